@@ -32,6 +32,8 @@
 #include "proto.h"
 #include "context.h"
 #include "mem.h"
+#include "scratch.h"
+#include "trace.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -307,6 +309,8 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
     /* Are we the auth for the master context? */
     int is_master = (auth->context->m_context == auth->context);
 
+    OTRL_TRACE2(auth_handle_commit_entry, auth->context, commitmsg);
+
     res = otrl_base64_otr_decode(commitmsg, &buf, &buflen);
     if (res == -1) goto memerr;
     if (res == -2) goto invval;
@@ -410,6 +414,7 @@ gcry_error_t otrl_auth_handle_commit(OtrlAuthInfo *auth,
 	    break;
     }
 
+    OTRL_TRACE2(auth_handle_commit_return, auth->context, err);
     return err;
 
 invval:
@@ -420,6 +425,7 @@ memerr:
 err:
     free(buf);
     free(encbuf);
+    OTRL_TRACE2(auth_handle_commit_return, auth->context, err);
     return err;
 }
 
@@ -450,7 +456,7 @@ static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
     /* How big is the total structure to be MAC'd? */
     totallen = 4 + ourpublen + 4 + theirpublen + 2 + privkey->pubkey_datalen
 	    + 4;
-    buf = malloc(totallen);
+    buf = otrl_scratch_buf(totallen);
     if (buf == NULL) goto memerr;
 
     bufp = buf;
@@ -475,7 +481,7 @@ static gcry_error_t calculate_pubkey_auth(unsigned char **authbufp,
     gcry_md_write(mackey, buf, totallen);
     memmove(macbuf, gcry_md_read(mackey, GCRY_MD_SHA256), 32);
 
-    free(buf);
+    otrl_scratch_release_buf(buf, totallen);
     buf = NULL;
 
     /* Sign the MAC */
@@ -589,7 +595,7 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     /* Now calculate the message to be MAC'd. */
     totallen = 4 + ourpublen + 4 + theirpublen + 2 +
 	(fingerprintend - fingerprintstart) + 4;
-    buf = malloc(totallen);
+    buf = otrl_scratch_buf(totallen);
     if (buf == NULL) goto memerr;
 
     bufp = buf;
@@ -614,7 +620,7 @@ static gcry_error_t check_pubkey_auth(unsigned char fingerprintbufp[20],
     gcry_md_write(mackey, buf, totallen);
     memmove(macbuf, gcry_md_read(mackey, GCRY_MD_SHA256), 32);
 
-    free(buf);
+    otrl_scratch_release_buf(buf, totallen);
     buf = NULL;
 
     /* Verify the signature on the MAC */
@@ -633,7 +639,6 @@ invval:
 memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
-    free(buf);
     gcry_sexp_release(pubs);
     return err;
 }
@@ -804,6 +809,8 @@ gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
     int res;
     unsigned int msg_version;
 
+    OTRL_TRACE2(auth_handle_key_entry, auth->context, keymsg);
+
     *havemsgp = 0;
 
     msg_version = otrl_proto_message_version(keymsg);
@@ -879,6 +886,7 @@ gcry_error_t otrl_auth_handle_key(OtrlAuthInfo *auth, const char *keymsg,
     }
 
     gcry_mpi_release(incoming_pub);
+    OTRL_TRACE2(auth_handle_key_return, auth->context, err);
     return err;
 
 invval:
@@ -889,6 +897,7 @@ memerr:
 err:
     free(buf);
     gcry_mpi_release(incoming_pub);
+    OTRL_TRACE2(auth_handle_key_return, auth->context, err);
     return err;
 }
 
@@ -914,6 +923,8 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
     int res;
     unsigned char version;
 
+    OTRL_TRACE2(auth_handle_revealsig_entry, auth->context, revealmsg);
+
     *havemsgp = 0;
 
     res = otrl_base64_otr_decode(revealmsg, &buf, &buflen);
@@ -1054,6 +1065,7 @@ gcry_error_t otrl_auth_handle_revealsig(OtrlAuthInfo *auth,
 	    break;
     }
 
+    OTRL_TRACE2(auth_handle_revealsig_return, auth->context, err);
     return err;
 
 decfail:
@@ -1069,6 +1081,7 @@ err:
     free(gxbuf);
     gcry_cipher_close(enc);
     gcry_mpi_release(incoming_pub);
+    OTRL_TRACE2(auth_handle_revealsig_return, auth->context, err);
     return err;
 }
 
@@ -1090,6 +1103,8 @@ gcry_error_t otrl_auth_handle_signature(OtrlAuthInfo *auth,
     int res;
     unsigned char version;
 
+    OTRL_TRACE2(auth_handle_signature_entry, auth->context, sigmsg);
+
     *havemsgp = 0;
 
     res = otrl_base64_otr_decode(sigmsg, &buf, &buflen);
@@ -1168,6 +1183,7 @@ gcry_error_t otrl_auth_handle_signature(OtrlAuthInfo *auth,
 	    break;
     }
 
+    OTRL_TRACE2(auth_handle_signature_return, auth->context, err);
     return err;
 
 invval:
@@ -1177,6 +1193,7 @@ memerr:
     err = gcry_error(GPG_ERR_ENOMEM);
 err:
     free(buf);
+    OTRL_TRACE2(auth_handle_signature_return, auth->context, err);
     return err;
 }
 
@@ -1320,6 +1337,8 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
     unsigned int received_keyid;
     int res;
 
+    OTRL_TRACE2(auth_handle_v1_key_exchange_entry, auth->context, keyexchmsg);
+
     *havemsgp = 0;
 
     res = otrl_base64_otr_decode(keyexchmsg, &buf, &buflen);
@@ -1424,6 +1443,7 @@ gcry_error_t otrl_auth_handle_v1_key_exchange(OtrlAuthInfo *auth,
     auth->our_keyid = 0;
     auth->authstate = OTRL_AUTHSTATE_NONE;
 
+    OTRL_TRACE2(auth_handle_v1_key_exchange_return, auth->context, err);
     return err;
 
 invval:
@@ -1435,6 +1455,7 @@ err:
     free(buf);
     gcry_sexp_release(pubs);
     gcry_mpi_release(received_pub);
+    OTRL_TRACE2(auth_handle_v1_key_exchange_return, auth->context, err);
     return err;
 }
 
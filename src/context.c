@@ -29,6 +29,7 @@
 /* libotr headers */
 #include "context.h"
 #include "instag.h"
+#include "hibernate.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -137,6 +138,8 @@ static ConnContext * new_context(const char * user, const char * accountname,
     context->msgstate = OTRL_MSGSTATE_PLAINTEXT;
     otrl_auth_new(context);
 
+    /* The SM state itself is always there, as applications look at it,
+     * but its MPIs are only allocated once SMP is used */
     smstate = malloc(sizeof(OtrlSMState));
     assert(smstate != NULL);
     otrl_sm_state_new(smstate);
@@ -304,6 +307,7 @@ ConnContext * otrl_context_find(OtrlUserState us, const char *user,
 
 	if (addedp) *addedp = 1;
 	newctx = new_context(user, accountname, protocol);
+	newctx->context_priv->us = us;
 	newctx->next = *curp;
 	if (*curp) {
 	    (*curp)->tous = &(newctx->next);
@@ -363,22 +367,46 @@ void otrl_context_update_recent_child(ConnContext *context,
 
 }
 
+/* The hash of a fingerprint in the fingerprint indexes: its first
+ * bytes, which, being those of a SHA-1 hash, are as good as any. */
+static size_t fingerprint_hash(const unsigned char fingerprint[20])
+{
+    size_t hash;
+
+    memmove(&hash, fingerprint, sizeof(hash));
+    return hash;
+}
+
 /* Find a fingerprint in a given context, perhaps adding it if not
  * present. */
 Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	unsigned char fingerprint[20], int add_if_missing, int *addedp)
 {
     Fingerprint *f;
+    OtrlHashTable *index;
+    OtrlUserState us;
+    size_t hash;
     if (addedp) *addedp = 0;
 
     if (!context || !context->m_context) return NULL;
 
     context = context->m_context;
+    index = &(context->context_priv->fingerprints);
+    hash = fingerprint_hash(fingerprint);
+
+    if (otrl_hashtab_usable(index)) {
+	OtrlHashCursor cursor;
 
-    f = context->fingerprint_root.next;
-    while(f) {
-	if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
-	f = f->next;
+	otrl_hashtab_lookup(index, hash, &cursor);
+	while ((f = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+	}
+    } else {
+	f = context->fingerprint_root.next;
+	while(f) {
+	    if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+	    f = f->next;
+	}
     }
 
     /* Didn't find it. */
@@ -397,11 +425,77 @@ Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	}
 	context->fingerprint_root.next = f;
 	f->tous = &(context->fingerprint_root.next);
+
+	otrl_hashtab_add(index, hash, f);
+	us = context->context_priv->us;
+	if (us) {
+	    otrl_hashtab_add(&(us->fingerprint_index), hash, f);
+	}
 	return f;
     }
     return NULL;
 }
 
+/* Find the next fingerprint after prev (or the first, if prev is NULL)
+ * that is equal to the given one, by walking every context */
+static Fingerprint *find_fingerprint_all_slowly(OtrlUserState us,
+	const unsigned char fingerprint[20], const Fingerprint *prev)
+{
+    ConnContext *context;
+    Fingerprint *f;
+    int found_prev = (prev == NULL);
+
+    for (context = us->context_root; context; context = context->next) {
+	for (f = context->fingerprint_root.next; f; f = f->next) {
+	    if (found_prev) {
+		if (!memcmp(f->fingerprint, fingerprint, 20)) return f;
+	    } else if (f == prev) {
+		found_prev = 1;
+	    }
+	}
+    }
+    return NULL;
+}
+
+/* Find a known fingerprint equal to the given one in any context of
+ * the given OtrlUserState. */
+Fingerprint *otrl_context_find_fingerprint_all(OtrlUserState us,
+	const unsigned char fingerprint[20], const Fingerprint *prev)
+{
+    OtrlHashCursor cursor;
+    Fingerprint *f;
+    int found_prev = (prev == NULL);
+
+    if (!otrl_hashtab_usable(&(us->fingerprint_index))) {
+	return find_fingerprint_all_slowly(us, fingerprint, prev);
+    }
+
+    otrl_hashtab_lookup(&(us->fingerprint_index),
+	    fingerprint_hash(fingerprint), &cursor);
+    while ((f = otrl_hashtab_next(&cursor)) != NULL) {
+	if (!found_prev) {
+	    found_prev = (f == prev);
+	} else if (!memcmp(f->fingerprint, fingerprint, 20)) {
+	    return f;
+	}
+    }
+    return NULL;
+}
+
+/* Find a known fingerprint equal to the given one, and trusted, in any
+ * context of the given OtrlUserState. */
+Fingerprint *otrl_context_find_trusted_fingerprint(OtrlUserState us,
+	const unsigned char fingerprint[20])
+{
+    Fingerprint *f = NULL;
+
+    while ((f = otrl_context_find_fingerprint_all(us, fingerprint, f))
+	    != NULL) {
+	if (otrl_context_is_fingerprint_trusted(f)) return f;
+    }
+    return NULL;
+}
+
 /* Set the trust level for a given fingerprint */
 void otrl_context_set_trust(Fingerprint *fprint, const char *trust)
 {
@@ -452,6 +546,14 @@ void otrl_context_forget_fingerprint(Fingerprint *fprint,
 	if (context->msgstate != OTRL_MSGSTATE_PLAINTEXT ||
 		context->active_fingerprint != fprint) {
 
+	    size_t hash = fingerprint_hash(fprint->fingerprint);
+	    OtrlUserState us = context->context_priv->us;
+
+	    otrl_hashtab_remove(&(context->context_priv->fingerprints),
+		    hash, fprint);
+	    if (us) {
+		otrl_hashtab_remove(&(us->fingerprint_index), hash, fprint);
+	    }
 	    free(fprint->fingerprint);
 	    free(fprint->trust);
 	    *(fprint->tous) = fprint->next;
@@ -511,10 +613,13 @@ int otrl_context_forget(ConnContext *context)
     free(context->accountname);
     free(context->protocol);
     free(context->smstate);
+    otrl_hashtab_free(&(context->context_priv->fingerprints));
+    free(context->context_priv);
     context->username = NULL;
     context->accountname = NULL;
     context->protocol = NULL;
     context->smstate = NULL;
+    context->context_priv = NULL;
 
     /* Free the application data, if it exists */
     if (context->app_data && context->app_data_free) {
@@ -522,6 +627,21 @@ int otrl_context_forget(ConnContext *context)
 	context->app_data = NULL;
     }
 
+    /* Don't leave the master's "recent context" pointers dangling */
+    if (context->m_context != context) {
+	ConnContext *m_context = context->m_context;
+
+	if (m_context->recent_child == context) {
+	    m_context->recent_child = m_context;
+	}
+	if (m_context->recent_rcvd_child == context) {
+	    m_context->recent_rcvd_child = m_context;
+	}
+	if (m_context->recent_sent_child == context) {
+	    m_context->recent_sent_child = m_context;
+	}
+    }
+
     /* Fix the list linkages */
     *(context->tous) = context->next;
     if (context->next) {
@@ -545,3 +665,108 @@ void otrl_context_forget_all(OtrlUserState us)
 	otrl_context_forget(us->context_root);
     }
 }
+
+/* Reclaim idle contexts from otrl_message_poll.  See context.h. */
+void otrl_context_set_idle_timeout(OtrlUserState us,
+	unsigned int idle_timeout, unsigned int sweep_size)
+{
+    if (us == NULL) return;
+
+    us->context_idle_timeout = idle_timeout;
+    us->context_sweep_size = sweep_size ? sweep_size :
+	    OTRL_CONTEXT_SWEEP_DEFAULT;
+    us->context_sweep_pos = 0;
+}
+
+/* Return the last time there was any activity on the given context. */
+static time_t context_last_active(const ConnContext *context)
+{
+    time_t last = context->context_priv->created;
+
+    if (context->context_priv->lastsent > last) {
+	last = context->context_priv->lastsent;
+    }
+    if (context->context_priv->lastrecv > last) {
+	last = context->context_priv->lastrecv;
+    }
+    return last;
+}
+
+/* Can the given idle context be forgotten altogether?  Children can,
+ * unless they are in an OTR session or in the middle of an AKE.  So can
+ * masters, unless they also hold fingerprints or children. */
+static int context_is_expendable(const ConnContext *context)
+{
+    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED ||
+	    context->auth.authstate != OTRL_AUTHSTATE_NONE) {
+	return 0;
+    }
+
+    if (context->m_context != context) return 1;
+
+    return context->fingerprint_root.next == NULL &&
+	    (context->next == NULL || context->next->m_context != context);
+}
+
+/* Examine the next us->context_sweep_size contexts, starting where the
+ * previous call left off, and reclaim what we can from those that have
+ * been idle for longer than us->context_idle_timeout seconds.  Returns
+ * the number of contexts forgotten. */
+unsigned int otrl_context_expire_idle(OtrlUserState us, time_t now)
+{
+    ConnContext *context, *next;
+    unsigned int pos = 0, visited = 0, forgotten = 0;
+    time_t idle_before;
+
+    if (us == NULL || us->context_idle_timeout == 0) return 0;
+
+    idle_before = now - us->context_idle_timeout;
+
+    /* Pick up where we left off, or start over if the list has shrunk
+     * since. */
+    for (context = us->context_root; context && pos < us->context_sweep_pos;
+	    context = context->next) {
+	pos++;
+    }
+    if (context == NULL) {
+	context = us->context_root;
+	pos = 0;
+    }
+
+    while (context && visited < us->context_sweep_size) {
+	next = context->next;
+	visited++;
+
+	if (context_last_active(context) < idle_before) {
+	    if (context_is_expendable(context)) {
+		otrl_context_force_plaintext(context);
+		if (!otrl_context_forget(context)) {
+		    forgotten++;
+		    context = next;
+		    continue;
+		}
+	    } else {
+		/* Drop any fragment that will never be completed */
+		if (context->context_priv->fragment) {
+		    free(context->context_priv->fragment);
+		    context->context_priv->fragment = NULL;
+		    context->context_priv->fragment_len = 0;
+		    context->context_priv->fragment_n = 0;
+		    context->context_priv->fragment_k = 0;
+		}
+		if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+			(us->hibernation == NULL ||
+			 otrl_hibernate_context(us, context))) {
+		    otrl_context_priv_release_sesskeys(context->context_priv);
+		}
+	    }
+	}
+
+	pos++;
+	context = next;
+    }
+
+    us->context_sweep_pos = context ? pos : 0;
+
+    return forgotten;
+}
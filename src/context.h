@@ -155,6 +155,20 @@ void otrl_context_update_recent_child(ConnContext *context,
 Fingerprint *otrl_context_find_fingerprint(ConnContext *context,
 	unsigned char fingerprint[20], int add_if_missing, int *addedp);
 
+/* Find a known fingerprint equal to the given one in any context of
+ * the given OtrlUserState, whatever the account, protocol or buddy,
+ * without looking through them all.  Returns the first one found if
+ * prev is NULL, and otherwise the next one after prev; NULL if there
+ * are no (more) such fingerprints.  The fingerprints must not be
+ * added or forgotten in between calls that pass prev. */
+Fingerprint *otrl_context_find_fingerprint_all(OtrlUserState us,
+	const unsigned char fingerprint[20], const Fingerprint *prev);
+
+/* Find a known fingerprint equal to the given one, and trusted, in any
+ * context of the given OtrlUserState.  Returns NULL if there is none. */
+Fingerprint *otrl_context_find_trusted_fingerprint(OtrlUserState us,
+	const unsigned char fingerprint[20]);
+
 /* Set the trust level for a given fingerprint */
 void otrl_context_set_trust(Fingerprint *fprint, const char *trust);
 
@@ -190,4 +204,39 @@ ConnContext * otrl_context_find_recent_instance(ConnContext * context,
  * in this case is limited to a one-second resolution. */
 ConnContext * otrl_context_find_recent_secure_instance(ConnContext * context);
 
+/* The default number of contexts examined by each sweep for idle
+ * contexts. */
+#define OTRL_CONTEXT_SWEEP_DEFAULT 64
+
+/* Have otrl_message_poll reclaim the memory held by contexts on which
+ * no message has been sent or received for more than idle_timeout
+ * seconds.  An idle_timeout of 0 (the default) turns this off.  Each
+ * call to otrl_message_poll examines at most sweep_size contexts (or
+ * OTRL_CONTEXT_SWEEP_DEFAULT, if sweep_size is 0), picking up where the
+ * previous call left off, so that a long context list is covered over
+ * several polls.
+ *
+ * Idle child contexts that are PLAINTEXT or FINISHED are forgotten, as
+ * are idle PLAINTEXT or FINISHED master contexts with no children and
+ * no known fingerprints.  Master contexts that hold fingerprints are
+ * always kept.  Idle ENCRYPTED contexts are kept as well, but the
+ * cipher and MAC handles of their session keys are released (or, if
+ * otrl_hibernate_enable has been called, all of their keys hibernate);
+ * they are rebuilt as needed the next time a message is sent or
+ * received.
+ *
+ * When contexts are forgotten in this way, their app_data is freed
+ * with app_data_free, and the update_context_list callback is invoked;
+ * the application must not keep ConnContext pointers past that point.
+ * Note that the sweep only runs when otrl_message_poll is called. */
+void otrl_context_set_idle_timeout(OtrlUserState us,
+	unsigned int idle_timeout, unsigned int sweep_size);
+
+/* Examine the next batch of contexts in the given OtrlUserState and
+ * reclaim what can be reclaimed from those that have been idle since
+ * before now minus the idle timeout.  Returns the number of contexts
+ * that were forgotten.  This is called by otrl_message_poll;
+ * applications need not call it. */
+unsigned int otrl_context_expire_idle(OtrlUserState us, time_t now);
+
 #endif
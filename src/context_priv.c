@@ -20,6 +20,8 @@
 
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <assert.h>
 
 /* libgcrypt headers */
@@ -27,6 +29,7 @@
 
 /* libotr headers */
 #include "context_priv.h"
+#include "hibernate.h"
 
 /* Create a new private connection context */
 ConnContextPriv *otrl_context_priv_new()
@@ -39,27 +42,16 @@ ConnContextPriv *otrl_context_priv_new()
 	context_priv->fragment_len = 0;
 	context_priv->fragment_n = 0;
 	context_priv->fragment_k = 0;
-	context_priv->numsavedkeys = 0;
-	context_priv->saved_mac_keys = NULL;
+	context_priv->keys = NULL;
+	context_priv->hibernated = NULL;
 	context_priv->generation = 0;
 	context_priv->lastsent = 0;
 	context_priv->lastmessage = NULL;
 	context_priv->lastrecv = 0;
 	context_priv->may_retransmit = 0;
-	context_priv->their_keyid = 0;
-	context_priv->their_y = NULL;
-	context_priv->their_old_y = NULL;
-	context_priv->our_keyid = 0;
-	context_priv->our_dh_key.groupid = 0;
-	context_priv->our_dh_key.priv = NULL;
-	context_priv->our_dh_key.pub = NULL;
-	context_priv->our_old_dh_key.groupid = 0;
-	context_priv->our_old_dh_key.priv = NULL;
-	context_priv->our_old_dh_key.pub = NULL;
-	otrl_dh_session_blank(&(context_priv->sesskeys[0][0]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[0][1]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[1][0]));
-	otrl_dh_session_blank(&(context_priv->sesskeys[1][1]));
+	context_priv->created = time(NULL);
+	context_priv->us = NULL;
+	otrl_hashtab_init(&(context_priv->fingerprints));
 
 	return context_priv;
 }
@@ -74,22 +66,149 @@ void otrl_context_priv_force_finished(ConnContextPriv *context_priv)
 	context_priv->fragment_len = 0;
 	context_priv->fragment_n = 0;
 	context_priv->fragment_k = 0;
-	context_priv->numsavedkeys = 0;
-	free(context_priv->saved_mac_keys);
-	context_priv->saved_mac_keys = NULL;
 	gcry_free(context_priv->lastmessage);
 	context_priv->lastmessage = NULL;
 	context_priv->may_retransmit = 0;
-	context_priv->their_keyid = 0;
-	gcry_mpi_release(context_priv->their_y);
-	context_priv->their_y = NULL;
-	gcry_mpi_release(context_priv->their_old_y);
-	context_priv->their_old_y = NULL;
-	context_priv->our_keyid = 0;
-	otrl_dh_keypair_free(&(context_priv->our_dh_key));
-	otrl_dh_keypair_free(&(context_priv->our_old_dh_key));
-	otrl_dh_session_free(&(context_priv->sesskeys[0][0]));
-	otrl_dh_session_free(&(context_priv->sesskeys[0][1]));
-	otrl_dh_session_free(&(context_priv->sesskeys[1][0]));
-	otrl_dh_session_free(&(context_priv->sesskeys[1][1]));
+	otrl_context_priv_free_keys(context_priv);
+	otrl_hibernate_discard(context_priv);
+}
+
+/* Allocate the keys of an OTR conversation, unless they already are */
+void otrl_context_priv_alloc_keys(ConnContextPriv *context_priv)
+{
+	ConnContextKeys *keys;
+
+	if (context_priv->keys != NULL) return;
+
+	keys = malloc(sizeof(*keys));
+	assert(keys != NULL);
+
+	keys->their_keyid = 0;
+	keys->their_y = NULL;
+	keys->their_old_y = NULL;
+	keys->our_keyid = 0;
+	keys->our_dh_key.groupid = 0;
+	keys->our_dh_key.priv = NULL;
+	keys->our_dh_key.pub = NULL;
+	keys->our_old_dh_key.groupid = 0;
+	keys->our_old_dh_key.priv = NULL;
+	keys->our_old_dh_key.pub = NULL;
+	otrl_dh_session_blank(&(keys->sesskeys[0][0]));
+	otrl_dh_session_blank(&(keys->sesskeys[0][1]));
+	otrl_dh_session_blank(&(keys->sesskeys[1][0]));
+	otrl_dh_session_blank(&(keys->sesskeys[1][1]));
+	keys->numsavedkeys = 0;
+	keys->saved_mac_keys = NULL;
+	keys->released_sesskeys = 0;
+
+	context_priv->keys = keys;
+}
+
+/* Free the keys of an OTR conversation */
+void otrl_context_priv_free_keys(ConnContextPriv *context_priv)
+{
+	ConnContextKeys *keys = context_priv->keys;
+
+	if (keys == NULL) return;
+
+	free(keys->saved_mac_keys);
+	gcry_mpi_release(keys->their_y);
+	gcry_mpi_release(keys->their_old_y);
+	otrl_dh_keypair_free(&(keys->our_dh_key));
+	otrl_dh_keypair_free(&(keys->our_old_dh_key));
+	otrl_dh_session_free(&(keys->sesskeys[0][0]));
+	otrl_dh_session_free(&(keys->sesskeys[0][1]));
+	otrl_dh_session_free(&(keys->sesskeys[1][0]));
+	otrl_dh_session_free(&(keys->sesskeys[1][1]));
+	free(keys);
+	context_priv->keys = NULL;
+}
+
+/* Release the cipher and MAC handles of the session keys of an idle
+ * context, keeping what is needed to rebuild them */
+void otrl_context_priv_release_sesskeys(ConnContextPriv *context_priv)
+{
+	ConnContextKeys *keys = context_priv->keys;
+	int i, j;
+
+	if (keys == NULL) return;
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			DH_sesskeys *sess = &(keys->sesskeys[i][j]);
+
+			if (sess->sendenc == NULL) continue;
+
+			gcry_cipher_close(sess->sendenc);
+			gcry_cipher_close(sess->rcvenc);
+			gcry_md_close(sess->sendmac);
+			gcry_md_close(sess->rcvmac);
+			sess->sendenc = NULL;
+			sess->rcvenc = NULL;
+			sess->sendmac = NULL;
+			sess->rcvmac = NULL;
+			keys->released_sesskeys |= 1 << (2*i+j);
+		}
+	}
+}
+
+/* Rebuild the session keys released by
+ * otrl_context_priv_release_sesskeys.  The keys themselves are derived
+ * again from our DH keys and their public values, after which the
+ * counters and the MAC key usage flags are put back. */
+gcry_error_t otrl_context_priv_restore_sesskeys(ConnContextPriv *context_priv)
+{
+	ConnContextKeys *keys = context_priv->keys;
+	int i, j;
+	gcry_error_t err;
+
+	if (keys == NULL || keys->released_sesskeys == 0) {
+		return gcry_error(GPG_ERR_NO_ERROR);
+	}
+
+	for (i = 0; i < 2; i++) {
+		for (j = 0; j < 2; j++) {
+			unsigned int bit = 1 << (2*i+j);
+			DH_sesskeys *sess = &(keys->sesskeys[i][j]);
+			DH_keypair *kp = i ? &(keys->our_old_dh_key) :
+				&(keys->our_dh_key);
+			gcry_mpi_t y = j ? keys->their_old_y :
+				keys->their_y;
+			DH_sesskeys fresh;
+
+			if (!(keys->released_sesskeys & bit)) continue;
+
+			/* The slot may have been recomputed in the meantime, or
+			 * its public value may be gone, in which case it can
+			 * no longer be used to send or receive anything. */
+			if (sess->sendenc == NULL && kp->priv != NULL &&
+				y != NULL) {
+				err = otrl_dh_session(&fresh, kp, y);
+				if (err) return err;
+				memmove(fresh.sendctr, sess->sendctr, 16);
+				memmove(fresh.rcvctr, sess->rcvctr, 16);
+				fresh.sendmacused = sess->sendmacused;
+				fresh.rcvmacused = sess->rcvmacused;
+				memmove(sess, &fresh, sizeof(DH_sesskeys));
+			}
+			keys->released_sesskeys &= ~bit;
+		}
+	}
+
+	return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Make the keys of the given private connection context ready for use */
+gcry_error_t otrl_context_priv_wake(ConnContextPriv *context_priv)
+{
+	gcry_error_t err;
+
+	err = otrl_hibernate_wake(context_priv);
+	if (err) return err;
+
+	if (context_priv->keys == NULL) {
+		return gcry_error(GPG_ERR_CONFLICT);
+	}
+
+	return otrl_context_priv_restore_sesskeys(context_priv);
 }
@@ -26,20 +26,12 @@
 #include "dh.h"
 #include "auth.h"
 #include "sm.h"
+#include "hashtab.h"
 
-typedef struct context_priv {
-	/* The part of the fragmented message we've seen so far */
-	char *fragment;
-
-	/* The length of fragment */
-	size_t fragment_len;
-
-	/* The total number of fragments in this message */
-	unsigned short fragment_n;
-
-	/* The highest fragment number we've seen so far for this message */
-	unsigned short fragment_k;
-
+/* The keys of an OTR conversation.  These are only allocated when the
+ * AKE completes, so that the many contexts that never go beyond
+ * plaintext don't carry them around. */
+typedef struct context_priv_keys {
 	/* current keyid used by other side; this is set to 0 if we get
 	 * a OTRL_TLV_DISCONNECTED message from them. */
 	unsigned int their_keyid;
@@ -67,6 +59,35 @@ typedef struct context_priv {
 	unsigned int numsavedkeys;
 	unsigned char *saved_mac_keys;
 
+	/* Bitmask of the sesskeys whose cipher and MAC handles were
+	 * released while the context was idle; bit (2*i+j) stands for
+	 * sesskeys[i][j] */
+	unsigned int released_sesskeys;
+
+} ConnContextKeys;
+
+typedef struct context_priv {
+	/* The part of the fragmented message we've seen so far */
+	char *fragment;
+
+	/* The length of fragment */
+	size_t fragment_len;
+
+	/* The total number of fragments in this message */
+	unsigned short fragment_n;
+
+	/* The highest fragment number we've seen so far for this message */
+	unsigned short fragment_k;
+
+	/* The keys of the OTR conversation; NULL until an AKE has
+	 * completed, and again once the context leaves the ENCRYPTED
+	 * state */
+	ConnContextKeys *keys;
+
+	/* The keys, sealed away while the context is hibernating (in
+	 * which case keys is NULL); see hibernate.h */
+	struct s_OtrlHibernatedKeys *hibernated;
+
 	/* generation number: increment every time we go private, and never
 	 * reset to 0 (unless we remove the context entirely) */
 	unsigned int generation;
@@ -83,6 +104,18 @@ typedef struct context_priv {
 	/* Is the last message eligible for retransmission? */
 	int may_retransmit;
 
+	/* The time this context was created */
+	time_t created;
+
+	/* The OtrlUserState this context belongs to, so that the
+	 * protocol code can find the userstate's statistics and
+	 * fingerprint index */
+	struct s_OtrlUserState *us;
+
+	/* The fingerprints of a master context, indexed by their first
+	 * bytes; see otrl_context_find_fingerprint */
+	OtrlHashTable fingerprints;
+
 } ConnContextPriv;
 
 /* Create a new private connection context. */
@@ -91,4 +124,26 @@ ConnContextPriv *otrl_context_priv_new();
 /* Frees up memory that was used in otrl_context_priv_new */
 void otrl_context_priv_force_finished(ConnContextPriv *context_priv);
 
+/* Make sure the given private connection context has room for the keys
+ * of an OTR conversation. */
+void otrl_context_priv_alloc_keys(ConnContextPriv *context_priv);
+
+/* Free the keys of an OTR conversation, if there are any. */
+void otrl_context_priv_free_keys(ConnContextPriv *context_priv);
+
+/* Make the keys of the given private connection context ready for use,
+ * waking them up if they are hibernating and rebuilding any released
+ * session keys.  Returns GPG_ERR_CONFLICT if there are no keys to use. */
+gcry_error_t otrl_context_priv_wake(ConnContextPriv *context_priv);
+
+/* Release the cipher and MAC handles of the session keys of an idle
+ * context.  The counters and MAC key state are kept, so that the keys
+ * can be rebuilt by otrl_context_priv_restore_sesskeys. */
+void otrl_context_priv_release_sesskeys(ConnContextPriv *context_priv);
+
+/* Rebuild any session keys released by
+ * otrl_context_priv_release_sesskeys.  This must be called before the
+ * session keys are used. */
+gcry_error_t otrl_context_priv_restore_sesskeys(ConnContextPriv *context_priv);
+
 #endif
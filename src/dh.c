@@ -27,6 +27,8 @@
 
 /* libotr headers */
 #include "dh.h"
+#include "scratch.h"
+#include "trace.h"
 
 
 static const char* DH1536_MODULUS_S = "0x"
@@ -97,23 +99,27 @@ void otrl_dh_keypair_free(DH_keypair *kp)
  */
 gcry_error_t otrl_dh_gen_keypair(unsigned int groupid, DH_keypair *kp)
 {
-    unsigned char *secbuf = NULL;
     gcry_mpi_t privkey = NULL;
 
+    OTRL_TRACE1(dh_gen_keypair_entry, groupid);
+
     if (groupid != DH1536_GROUP_ID) {
 	/* Invalid group id */
+	OTRL_TRACE1(dh_gen_keypair_return, gcry_error(GPG_ERR_INV_VALUE));
 	return gcry_error(GPG_ERR_INV_VALUE);
     }
 
-    /* Generate the secret key: a random 320-bit value */
-    secbuf = gcry_random_bytes_secure(40, GCRY_STRONG_RANDOM);
-    gcry_mpi_scan(&privkey, GCRYMPI_FMT_USG, secbuf, 40, NULL);
-    gcry_free(secbuf);
+    /* Generate the secret key: a random 320-bit value.  It has to be a
+     * secure MPI, so that libgcrypt exponentiates with it in constant
+     * time. */
+    privkey = gcry_mpi_snew(320);
+    gcry_mpi_randomize(privkey, 320, GCRY_STRONG_RANDOM);
 
     kp->groupid = groupid;
     kp->priv = privkey;
     kp->pub = gcry_mpi_new(DH1536_MOD_LEN_BITS);
     gcry_mpi_powm(kp->pub, DH1536_GENERATOR, privkey, DH1536_MODULUS);
+    OTRL_TRACE1(dh_gen_keypair_return, gcry_error(GPG_ERR_NO_ERROR));
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -131,35 +137,43 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
     unsigned char sendbyte, rcvbyte;
     gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
 
+    OTRL_TRACE1(dh_session_entry, kp->groupid);
+
     otrl_dh_session_blank(sess);
 
     if (kp->groupid != DH1536_GROUP_ID) {
 	/* Invalid group id */
-	return gcry_error(GPG_ERR_INV_VALUE);
+	err = gcry_error(GPG_ERR_INV_VALUE);
+	OTRL_TRACE1(dh_session_return, err);
+	return err;
     }
 
     /* Calculate the shared secret MPI */
-    gab = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
+    otrl_scratch_mpis(&gab, 1);
     gcry_mpi_powm(gab, y, kp->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &gablen, gab);
-    gabdata = gcry_malloc_secure(gablen + 5);
+    gabdata = otrl_scratch_buf(gablen + 5);
     if (!gabdata) {
-	gcry_mpi_release(gab);
-	return gcry_error(GPG_ERR_ENOMEM);
+	otrl_scratch_release_mpis(&gab, 1);
+	err = gcry_error(GPG_ERR_ENOMEM);
+	OTRL_TRACE1(dh_session_return, err);
+	return err;
     }
     gabdata[1] = (gablen >> 24) & 0xff;
     gabdata[2] = (gablen >> 16) & 0xff;
     gabdata[3] = (gablen >> 8) & 0xff;
     gabdata[4] = gablen & 0xff;
     gcry_mpi_print(GCRYMPI_FMT_USG, gabdata+5, gablen, NULL, gab);
-    gcry_mpi_release(gab);
+    otrl_scratch_release_mpis(&gab, 1);
 
-    hashdata = gcry_malloc_secure(20);
+    hashdata = otrl_scratch_buf(20);
     if (!hashdata) {
-	gcry_free(gabdata);
-	return gcry_error(GPG_ERR_ENOMEM);
+	otrl_scratch_release_buf(gabdata, gablen + 5);
+	err = gcry_error(GPG_ERR_ENOMEM);
+	OTRL_TRACE1(dh_session_return, err);
+	return err;
     }
 
     /* Are we the "high" or "low" end of the connection? */
@@ -209,13 +223,15 @@ gcry_error_t otrl_dh_session(DH_sesskeys *sess, const DH_keypair *kp,
     gabdata[0] = 0xff;
     gcry_md_hash_buffer(GCRY_MD_SHA256, sess->extrakey, gabdata, gablen+5);
 
-    gcry_free(gabdata);
-    gcry_free(hashdata);
+    otrl_scratch_release_buf(hashdata, 20);
+    otrl_scratch_release_buf(gabdata, gablen + 5);
+    OTRL_TRACE1(dh_session_return, err);
     return gcry_error(GPG_ERR_NO_ERROR);
 err:
     otrl_dh_session_free(sess);
-    gcry_free(gabdata);
-    gcry_free(hashdata);
+    otrl_scratch_release_buf(hashdata, 20);
+    otrl_scratch_release_buf(gabdata, gablen + 5);
+    OTRL_TRACE1(dh_session_return, err);
     return err;
 }
 
@@ -257,14 +273,14 @@ gcry_error_t otrl_dh_compute_v2_auth_keys(const DH_keypair *our_dh,
     }
 
     /* Calculate the shared secret MPI */
-    s = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
+    otrl_scratch_mpis(&s, 1);
     gcry_mpi_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &slen, s);
-    sdata = gcry_malloc_secure(slen + 5);
+    sdata = otrl_scratch_buf(slen + 5);
     if (!sdata) {
-	gcry_mpi_release(s);
+	otrl_scratch_release_mpis(&s, 1);
 	return gcry_error(GPG_ERR_ENOMEM);
     }
     sdata[1] = (slen >> 24) & 0xff;
@@ -272,12 +288,12 @@ gcry_error_t otrl_dh_compute_v2_auth_keys(const DH_keypair *our_dh,
     sdata[3] = (slen >> 8) & 0xff;
     sdata[4] = slen & 0xff;
     gcry_mpi_print(GCRYMPI_FMT_USG, sdata+5, slen, NULL, s);
-    gcry_mpi_release(s);
+    otrl_scratch_release_mpis(&s, 1);
 
     /* Calculate the session id */
-    hashdata = gcry_malloc_secure(32);
+    hashdata = otrl_scratch_buf(32);
     if (!hashdata) {
-	gcry_free(sdata);
+	otrl_scratch_release_buf(sdata, slen + 5);
 	return gcry_error(GPG_ERR_ENOMEM);
     }
     sdata[0] = 0x00;
@@ -334,8 +350,8 @@ gcry_error_t otrl_dh_compute_v2_auth_keys(const DH_keypair *our_dh,
     err = gcry_md_setkey(*mac_m2p, hashdata, 32);
     if (err) goto err;
 
-    gcry_free(sdata);
-    gcry_free(hashdata);
+    otrl_scratch_release_buf(hashdata, 32);
+    otrl_scratch_release_buf(sdata, slen + 5);
     return gcry_error(GPG_ERR_NO_ERROR);
 
 err:
@@ -351,8 +367,8 @@ err:
     *mac_m1p = NULL;
     *mac_m2 = NULL;
     *mac_m2p = NULL;
-    gcry_free(sdata);
-    gcry_free(hashdata);
+    otrl_scratch_release_buf(hashdata, 32);
+    otrl_scratch_release_buf(sdata, slen + 5);
     return err;
 }
 
@@ -382,14 +398,14 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
     }
 
     /* Calculate the shared secret MPI */
-    s = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
+    otrl_scratch_mpis(&s, 1);
     gcry_mpi_powm(s, their_pub, our_dh->priv, DH1536_MODULUS);
 
     /* Output it in the right format */
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &slen, s);
-    sdata = gcry_malloc_secure(slen + 5);
+    sdata = otrl_scratch_buf(slen + 5);
     if (!sdata) {
-	gcry_mpi_release(s);
+	otrl_scratch_release_mpis(&s, 1);
 	return gcry_error(GPG_ERR_ENOMEM);
     }
     sdata[1] = (slen >> 24) & 0xff;
@@ -397,12 +413,12 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
     sdata[3] = (slen >> 8) & 0xff;
     sdata[4] = slen & 0xff;
     gcry_mpi_print(GCRYMPI_FMT_USG, sdata+5, slen, NULL, s);
-    gcry_mpi_release(s);
+    otrl_scratch_release_mpis(&s, 1);
 
     /* Calculate the session id */
-    hashdata = gcry_malloc_secure(20);
+    hashdata = otrl_scratch_buf(20);
     if (!hashdata) {
-	gcry_free(sdata);
+	otrl_scratch_release_buf(sdata, slen + 5);
 	return gcry_error(GPG_ERR_ENOMEM);
     }
     sdata[0] = 0x00;
@@ -417,8 +433,8 @@ gcry_error_t otrl_dh_compute_v1_session_id(const DH_keypair *our_dh,
 	*halfp = OTRL_SESSIONID_FIRST_HALF_BOLD;
     }
 
-    gcry_free(hashdata);
-    gcry_free(sdata);
+    otrl_scratch_release_buf(hashdata, 20);
+    otrl_scratch_release_buf(sdata, slen + 5);
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -0,0 +1,521 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "context.h"
+#include "userstate.h"
+#include "event.h"
+#include "stats.h"
+
+/* Release the strings held by an event. */
+static void event_clear(OtrlEvent *ev)
+{
+    free(ev->accountname);
+    free(ev->protocol);
+    free(ev->username);
+    free(ev->message);
+    ev->accountname = NULL;
+    ev->protocol = NULL;
+    ev->username = NULL;
+    ev->message = NULL;
+}
+
+/* Reserve the next free slot in the queue of the given userstate, and
+ * return it, or NULL if the userstate is not in event queue mode or the
+ * queue is full.  In the latter case, the overflow counter is bumped,
+ * and the caller should deliver the event synchronously instead. */
+static OtrlEvent *event_reserve(OtrlUserState us, OtrlEventType type)
+{
+    OtrlEventQueue *q;
+    OtrlEvent *ev;
+
+    if (us == NULL || us->event_queue == NULL) return NULL;
+    q = us->event_queue;
+
+    if (q->count == q->capacity) {
+	q->overflows++;
+	return NULL;
+    }
+
+    ev = &(q->ring[(q->head + q->count) % q->capacity]);
+    memset(ev, 0, sizeof(OtrlEvent));
+    ev->type = type;
+    return ev;
+}
+
+/* Record the identity of the given context in an event reserved with
+ * event_reserve.  Returns 0 on success, or -1 if we ran out of memory,
+ * in which case the event has been cleared again. */
+static int event_set_context(OtrlEvent *ev, const ConnContext *context)
+{
+    if (context == NULL) return 0;
+
+    ev->has_context = 1;
+    ev->their_instance = context->their_instance;
+    ev->accountname = strdup(context->accountname);
+    ev->protocol = strdup(context->protocol);
+    ev->username = strdup(context->username);
+    if (!ev->accountname || !ev->protocol || !ev->username) {
+	event_clear(ev);
+	return -1;
+    }
+    return 0;
+}
+
+/* Make an event filled in after event_reserve visible to
+ * otrl_event_queue_drain. */
+static void event_commit(OtrlUserState us)
+{
+    us->event_queue->count++;
+}
+
+/* Switch the given OtrlUserState into event queue mode. */
+gcry_error_t otrl_event_queue_enable(OtrlUserState us, unsigned int capacity)
+{
+    OtrlEventQueue *q;
+
+    if (us == NULL) return gcry_error(GPG_ERR_INV_VALUE);
+    if (us->event_queue) return gcry_error(GPG_ERR_NO_ERROR);
+
+    if (capacity == 0) {
+	capacity = OTRL_EVENT_QUEUE_DEFAULT_CAPACITY;
+    }
+
+    q = malloc(sizeof(OtrlEventQueue));
+    if (!q) return gcry_error(GPG_ERR_ENOMEM);
+    q->ring = calloc(capacity, sizeof(OtrlEvent));
+    if (!q->ring) {
+	free(q);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    q->capacity = capacity;
+    q->head = 0;
+    q->count = 0;
+    q->pending_update_context_list = 0;
+    q->pending_write_fingerprints = 0;
+    q->overflows = 0;
+    q->dropped = 0;
+
+    us->event_queue = q;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Deliver any queued notifications, then switch the given OtrlUserState
+ * back to invoking the callbacks synchronously. */
+void otrl_event_queue_disable(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    if (us == NULL || us->event_queue == NULL) return;
+
+    /* Events raised by the callbacks during a drain are held for the
+     * next one, so keep going until the queue stays empty. */
+    while (us->event_queue->count > 0) {
+	otrl_event_queue_drain(us, ops, opdata);
+    }
+
+    otrl_event_queue_free(us->event_queue);
+    us->event_queue = NULL;
+}
+
+/* Deliver a single dequeued event. */
+static int event_deliver(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlEvent *ev)
+{
+    ConnContext *context = NULL;
+
+    if (ev->has_context) {
+	context = otrl_context_find(us, ev->username, ev->accountname,
+		ev->protocol, ev->their_instance, 0, NULL, NULL, NULL);
+	if (context == NULL) {
+	    /* The context went away before the application got to hear
+	     * about it. */
+	    us->event_queue->dropped++;
+	    return 0;
+	}
+    }
+
+    switch(ev->type) {
+	case OTRL_EVENT_MSG:
+	    if (!ops->handle_msg_event) return 0;
+	    ops->handle_msg_event(opdata, ev->msg_event, context,
+		    ev->message, ev->err);
+	    break;
+	case OTRL_EVENT_SMP:
+	    if (!ops->handle_smp_event) return 0;
+	    ops->handle_smp_event(opdata, ev->smp_event, context,
+		    ev->progress_percent, ev->message);
+	    break;
+	case OTRL_EVENT_UPDATE_CONTEXT_LIST:
+	    if (!ops->update_context_list) return 0;
+	    ops->update_context_list(opdata);
+	    break;
+	case OTRL_EVENT_NEW_FINGERPRINT:
+	    if (!ops->new_fingerprint) return 0;
+	    ops->new_fingerprint(opdata, us, ev->accountname, ev->protocol,
+		    ev->username, ev->fingerprint);
+	    break;
+	case OTRL_EVENT_WRITE_FINGERPRINTS:
+	    if (!ops->write_fingerprints) return 0;
+	    ops->write_fingerprints(opdata);
+	    break;
+	case OTRL_EVENT_GONE_SECURE:
+	    if (!ops->gone_secure) return 0;
+	    ops->gone_secure(opdata, context);
+	    break;
+	case OTRL_EVENT_STILL_SECURE:
+	    if (!ops->still_secure) return 0;
+	    ops->still_secure(opdata, context, ev->is_reply);
+	    break;
+    }
+    return 1;
+}
+
+/* Deliver the notifications queued on the given OtrlUserState, oldest
+ * first, by invoking the corresponding callbacks in ops.  Returns the
+ * number of callbacks invoked. */
+unsigned int otrl_event_queue_drain(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    OtrlEventQueue *q;
+    unsigned int todo, delivered = 0;
+
+    if (us == NULL || us->event_queue == NULL || ops == NULL) return 0;
+    q = us->event_queue;
+
+    /* Only deliver what was queued before we started; anything the
+     * callbacks queue waits for the next drain. */
+    todo = q->count;
+    while (todo > 0) {
+	OtrlEvent ev = q->ring[q->head];
+
+	memset(&(q->ring[q->head]), 0, sizeof(OtrlEvent));
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+	todo--;
+
+	/* Once a merged notification has been taken off the queue, a
+	 * new one must be queued again. */
+	if (ev.type == OTRL_EVENT_UPDATE_CONTEXT_LIST) {
+	    q->pending_update_context_list = 0;
+	} else if (ev.type == OTRL_EVENT_WRITE_FINGERPRINTS) {
+	    q->pending_write_fingerprints = 0;
+	}
+
+	delivered += event_deliver(us, ops, opdata, &ev);
+	event_clear(&ev);
+
+	/* A callback may have disabled the queue */
+	if (us->event_queue != q) break;
+    }
+
+    return delivered;
+}
+
+/* Return the number of notifications currently waiting in the given
+ * OtrlUserState's event queue. */
+unsigned int otrl_event_queue_pending(OtrlUserState us)
+{
+    if (us == NULL || us->event_queue == NULL) return 0;
+    return us->event_queue->count;
+}
+
+/* Free an event queue, discarding any notifications still in it. */
+void otrl_event_queue_free(OtrlEventQueue *queue)
+{
+    if (queue == NULL) return;
+
+    while (queue->count > 0) {
+	event_clear(&(queue->ring[queue->head]));
+	queue->head = (queue->head + 1) % queue->capacity;
+	queue->count--;
+    }
+    free(queue->ring);
+    free(queue);
+}
+
+void otrl_event_msg(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlMessageEvent msg_event, ConnContext *context,
+	const char *message, gcry_error_t err)
+{
+    OtrlEvent *ev;
+
+    otrl_stats_msg_event(us, msg_event);
+    if (!ops->handle_msg_event) return;
+
+    ev = event_reserve(us, OTRL_EVENT_MSG);
+    if (ev && event_set_context(ev, context) == 0) {
+	ev->msg_event = msg_event;
+	ev->err = err;
+	if (message) {
+	    ev->message = strdup(message);
+	}
+	if (!message || ev->message) {
+	    event_commit(us);
+	    return;
+	}
+	event_clear(ev);
+    }
+
+    ops->handle_msg_event(opdata, msg_event, context, message, err);
+}
+
+void otrl_event_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlSMPEvent smp_event, ConnContext *context,
+	unsigned short progress_percent, char *question)
+{
+    OtrlEvent *ev;
+
+    if (!ops->handle_smp_event) return;
+
+    ev = event_reserve(us, OTRL_EVENT_SMP);
+    if (ev && event_set_context(ev, context) == 0) {
+	ev->smp_event = smp_event;
+	ev->progress_percent = progress_percent;
+	if (question) {
+	    ev->message = strdup(question);
+	}
+	if (!question || ev->message) {
+	    event_commit(us);
+	    return;
+	}
+	event_clear(ev);
+    }
+
+    ops->handle_smp_event(opdata, smp_event, context, progress_percent,
+	    question);
+}
+
+/* Decide whether a coalesced notification (one of the OTRL_DIRTY_*
+ * bits) may be raised now, or must wait until the userstate's notify
+ * interval since the last one has elapsed.  In the latter case, mark it
+ * dirty, make sure otrl_message_poll will get called to raise it later,
+ * and return 1. */
+static int coalesce_defer(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, unsigned int dirtybit, time_t *lastp)
+{
+    time_t now;
+
+    if (us == NULL || us->notify_interval == 0) return 0;
+
+    now = time(NULL);
+    if ((us->notify_dirty & dirtybit) == 0 &&
+	    (*lastp == 0 || now - *lastp >= (time_t)us->notify_interval ||
+	     now < *lastp)) {
+	*lastp = now;
+	return 0;
+    }
+
+    us->notify_dirty |= dirtybit;
+    if (us->timer_running == 0 && ops->timer_control) {
+	ops->timer_control(opdata,
+		otrl_message_poll_get_default_interval(us));
+	us->timer_running = 1;
+    }
+    return 1;
+}
+
+static void raise_update_context_list(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    if (us && us->event_queue && us->event_queue->pending_update_context_list) {
+	/* Merge with the one already waiting */
+	return;
+    }
+
+    if (event_reserve(us, OTRL_EVENT_UPDATE_CONTEXT_LIST)) {
+	us->event_queue->pending_update_context_list = 1;
+	event_commit(us);
+	return;
+    }
+
+    ops->update_context_list(opdata);
+}
+
+void otrl_event_update_context_list(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    if (!ops->update_context_list) return;
+
+    if (coalesce_defer(us, ops, opdata, OTRL_DIRTY_CONTEXT_LIST,
+		&(us->last_context_list_notify))) {
+	return;
+    }
+
+    raise_update_context_list(us, ops, opdata);
+}
+
+void otrl_event_new_fingerprint(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *username,
+	unsigned char fingerprint[20])
+{
+    OtrlEvent *ev;
+
+    if (!ops->new_fingerprint) return;
+
+    ev = event_reserve(us, OTRL_EVENT_NEW_FINGERPRINT);
+    if (ev) {
+	ev->accountname = strdup(accountname);
+	ev->protocol = strdup(protocol);
+	ev->username = strdup(username);
+	memmove(ev->fingerprint, fingerprint, 20);
+	if (ev->accountname && ev->protocol && ev->username) {
+	    event_commit(us);
+	    return;
+	}
+	event_clear(ev);
+    }
+
+    ops->new_fingerprint(opdata, us, accountname, protocol, username,
+	    fingerprint);
+}
+
+static void raise_write_fingerprints(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    if (us && us->event_queue && us->event_queue->pending_write_fingerprints) {
+	/* Merge with the one already waiting */
+	return;
+    }
+
+    if (event_reserve(us, OTRL_EVENT_WRITE_FINGERPRINTS)) {
+	us->event_queue->pending_write_fingerprints = 1;
+	event_commit(us);
+	return;
+    }
+
+    ops->write_fingerprints(opdata);
+}
+
+void otrl_event_write_fingerprints(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata)
+{
+    if (!ops->write_fingerprints) return;
+
+    if (coalesce_defer(us, ops, opdata, OTRL_DIRTY_FINGERPRINTS,
+		&(us->last_fingerprints_notify))) {
+	return;
+    }
+
+    raise_write_fingerprints(us, ops, opdata);
+}
+
+/* Raise the deferred notifications of the given userstate.  If force
+ * is 0, only those whose notify interval has elapsed are raised. */
+static void raise_dirty(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, int force)
+{
+    time_t now = time(NULL);
+    time_t due = now - (time_t)us->notify_interval;
+
+    if ((us->notify_dirty & OTRL_DIRTY_CONTEXT_LIST) &&
+	    (force || us->last_context_list_notify <= due ||
+	     now < us->last_context_list_notify)) {
+	us->notify_dirty &= ~OTRL_DIRTY_CONTEXT_LIST;
+	us->last_context_list_notify = now;
+	if (ops->update_context_list) {
+	    raise_update_context_list(us, ops, opdata);
+	}
+    }
+    if ((us->notify_dirty & OTRL_DIRTY_FINGERPRINTS) &&
+	    (force || us->last_fingerprints_notify <= due ||
+	     now < us->last_fingerprints_notify)) {
+	us->notify_dirty &= ~OTRL_DIRTY_FINGERPRINTS;
+	us->last_fingerprints_notify = now;
+	if (ops->write_fingerprints) {
+	    raise_write_fingerprints(us, ops, opdata);
+	}
+    }
+}
+
+/* Set the minimum number of seconds between two update_context_list
+ * notifications, and between two write_fingerprints notifications. */
+void otrl_event_set_notify_interval(OtrlUserState us, unsigned int interval)
+{
+    if (us == NULL) return;
+    us->notify_interval = interval;
+}
+
+/* Raise any update_context_list or write_fingerprints notifications
+ * held back by the notify interval, and deliver everything waiting in
+ * the event queue, before returning. */
+void otrl_event_flush(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata)
+{
+    if (us == NULL || ops == NULL) return;
+
+    raise_dirty(us, ops, opdata, 1);
+    while (otrl_event_queue_pending(us) > 0) {
+	otrl_event_queue_drain(us, ops, opdata);
+    }
+}
+
+/* Called from otrl_message_poll: raise any deferred notifications that
+ * have become due.  Returns 1 if some are still being held back. */
+int otrl_event_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata)
+{
+    if (us == NULL || ops == NULL) return 0;
+
+    raise_dirty(us, ops, opdata, 0);
+    return us->notify_dirty != 0;
+}
+
+void otrl_event_gone_secure(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context)
+{
+    OtrlEvent *ev;
+
+    if (!ops->gone_secure) return;
+
+    ev = event_reserve(us, OTRL_EVENT_GONE_SECURE);
+    if (ev && event_set_context(ev, context) == 0) {
+	event_commit(us);
+	return;
+    }
+
+    ops->gone_secure(opdata, context);
+}
+
+void otrl_event_still_secure(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, int is_reply)
+{
+    OtrlEvent *ev;
+
+    if (!ops->still_secure) return;
+
+    ev = event_reserve(us, OTRL_EVENT_STILL_SECURE);
+    if (ev && event_set_context(ev, context) == 0) {
+	ev->is_reply = is_reply;
+	event_commit(us);
+	return;
+    }
+
+    ops->still_secure(opdata, context, is_reply);
+}
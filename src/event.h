@@ -0,0 +1,187 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __EVENT_H__
+#define __EVENT_H__
+
+#include "userstate.h"
+#include "proto.h"
+#include "message.h"
+
+/* The kinds of notification that can be held in an event queue.  Each
+ * corresponds to the OtrlMessageAppOps callback of the same name. */
+typedef enum {
+    OTRL_EVENT_MSG,                    /* handle_msg_event */
+    OTRL_EVENT_SMP,                    /* handle_smp_event */
+    OTRL_EVENT_UPDATE_CONTEXT_LIST,    /* update_context_list */
+    OTRL_EVENT_NEW_FINGERPRINT,        /* new_fingerprint */
+    OTRL_EVENT_WRITE_FINGERPRINTS,     /* write_fingerprints */
+    OTRL_EVENT_GONE_SECURE,            /* gone_secure */
+    OTRL_EVENT_STILL_SECURE            /* still_secure */
+} OtrlEventType;
+
+/* A queued notification.  The context it refers to is recorded by name
+ * and instance tag rather than by pointer, so that an event whose
+ * context has been forgotten in the meantime can be detected (and
+ * dropped) when the queue is drained. */
+typedef struct s_OtrlEvent {
+    OtrlEventType type;
+    char *accountname;
+    char *protocol;
+    char *username;
+    otrl_instag_t their_instance;
+    int has_context;                   /* Does this event refer to a
+					  ConnContext? */
+    OtrlMessageEvent msg_event;        /* OTRL_EVENT_MSG */
+    OtrlSMPEvent smp_event;            /* OTRL_EVENT_SMP */
+    unsigned short progress_percent;   /* OTRL_EVENT_SMP */
+    int is_reply;                      /* OTRL_EVENT_STILL_SECURE */
+    char *message;                     /* The message text for
+					  OTRL_EVENT_MSG, or the question
+					  for OTRL_EVENT_SMP; may be NULL */
+    gcry_error_t err;                  /* OTRL_EVENT_MSG */
+    unsigned char fingerprint[20];     /* OTRL_EVENT_NEW_FINGERPRINT */
+} OtrlEvent;
+
+/* A fixed-size ring of pending notifications for one OtrlUserState. */
+typedef struct s_OtrlEventQueue {
+    OtrlEvent *ring;
+    unsigned int capacity;             /* Number of slots in ring */
+    unsigned int head;                 /* Index of the oldest event */
+    unsigned int count;                /* Number of queued events */
+    int pending_update_context_list;   /* Is an update_context_list
+					  already queued? */
+    int pending_write_fingerprints;    /* Is a write_fingerprints
+					  already queued? */
+    unsigned int overflows;            /* Number of events that had to be
+					  delivered synchronously because
+					  the ring was full */
+    unsigned int dropped;              /* Number of events discarded at
+					  drain time because their context
+					  no longer existed */
+} OtrlEventQueue;
+
+/* Bits for the notify_dirty field of OtrlUserState */
+#define OTRL_DIRTY_CONTEXT_LIST 0x01
+#define OTRL_DIRTY_FINGERPRINTS 0x02
+
+/* The default number of slots in an event queue. */
+#define OTRL_EVENT_QUEUE_DEFAULT_CAPACITY 256
+
+/* Switch the given OtrlUserState into event queue mode.  From now on,
+ * the notification-only OtrlMessageAppOps callbacks (handle_msg_event,
+ * handle_smp_event, update_context_list, new_fingerprint,
+ * write_fingerprints, gone_secure and still_secure) are no longer
+ * invoked from inside otrl_message_sending, otrl_message_receiving and
+ * friends.  Instead, they are recorded in a ring of the given capacity
+ * (or OTRL_EVENT_QUEUE_DEFAULT_CAPACITY if capacity is 0), and are
+ * delivered when the application calls otrl_event_queue_drain.  Any
+ * number of update_context_list or write_fingerprints notifications
+ * raised between two drains are merged into a single one.
+ *
+ * Callbacks that return a value, or that pass key material
+ * (received_symkey), are always invoked synchronously.
+ *
+ * Calling this on a userstate that is already in event queue mode
+ * changes nothing and returns success. */
+gcry_error_t otrl_event_queue_enable(OtrlUserState us, unsigned int capacity);
+
+/* Deliver any queued notifications, then switch the given OtrlUserState
+ * back to invoking the callbacks synchronously. */
+void otrl_event_queue_disable(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata);
+
+/* Deliver the notifications queued on the given OtrlUserState, oldest
+ * first, by invoking the corresponding callbacks in ops.  Notifications
+ * queued by the callbacks themselves are left for the next drain.  This
+ * function must be called from the main libotr thread.  Returns the
+ * number of callbacks invoked. */
+unsigned int otrl_event_queue_drain(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata);
+
+/* Return the number of notifications currently waiting in the given
+ * OtrlUserState's event queue (0 if it is not in event queue mode). */
+unsigned int otrl_event_queue_pending(OtrlUserState us);
+
+/* Free an event queue, discarding any notifications still in it. */
+void otrl_event_queue_free(OtrlEventQueue *queue);
+
+/* Set the minimum number of seconds between two update_context_list
+ * notifications (and, separately, between two write_fingerprints
+ * notifications) raised for the given OtrlUserState.  A notification
+ * raised sooner than that after the previous one is held back, and
+ * raised by otrl_message_poll once the interval has elapsed; any
+ * number of notifications held back in this way are raised as a
+ * single one.  An interval of 0 (the default) raises every
+ * notification as it happens.
+ *
+ * If you do not implement the timer_control callback, note that the
+ * value returned by otrl_message_poll_get_default_interval takes the
+ * notify interval into account. */
+void otrl_event_set_notify_interval(OtrlUserState us, unsigned int interval);
+
+/* Raise right away any update_context_list or write_fingerprints
+ * notifications that are being held back by the notify interval, and,
+ * if the userstate is in event queue mode, deliver everything waiting
+ * in the queue.  When this returns, every pending notification has
+ * been delivered.  Call this before shutting down (in particular,
+ * before otrl_userstate_free), so that no fingerprint changes are lost.
+ * This function must be called from the main libotr thread. */
+void otrl_event_flush(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata);
+
+/* Raise any notifications held back by the notify interval whose time
+ * has come.  Returns 1 if there are others still being held back.  This
+ * is called by otrl_message_poll; applications need not call it. */
+int otrl_event_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata);
+
+/* The following are used by the rest of libotr to raise notifications.
+ * Each one invokes the corresponding callback in ops directly if us is
+ * not in event queue mode, or records it to be delivered later if it
+ * is.  Nothing happens if the application did not supply the callback.
+ */
+void otrl_event_msg(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlMessageEvent msg_event, ConnContext *context,
+	const char *message, gcry_error_t err);
+
+void otrl_event_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, OtrlSMPEvent smp_event, ConnContext *context,
+	unsigned short progress_percent, char *question);
+
+void otrl_event_update_context_list(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata);
+
+void otrl_event_new_fingerprint(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata, const char *accountname,
+	const char *protocol, const char *username,
+	unsigned char fingerprint[20]);
+
+void otrl_event_write_fingerprints(OtrlUserState us,
+	const OtrlMessageAppOps *ops, void *opdata);
+
+void otrl_event_gone_secure(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context);
+
+void otrl_event_still_secure(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, int is_reply);
+
+#endif
@@ -0,0 +1,195 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+
+/* libotr headers */
+#include "hashtab.h"
+
+/* The size of a table when the first item is added */
+#define HASHTAB_MIN_SIZE 8
+
+/* The FNV prime for the width of size_t */
+#if SIZE_MAX > 0xffffffffU
+#define HASHTAB_FNV_PRIME ((size_t)1099511628211ULL)
+#else
+#define HASHTAB_FNV_PRIME ((size_t)16777619U)
+#endif
+
+/* Initialize an empty table. */
+void otrl_hashtab_init(OtrlHashTable *table)
+{
+    table->slots = NULL;
+    table->size = 0;
+    table->count = 0;
+    table->failed = 0;
+}
+
+/* Free the memory used by a table (but not its items), leaving it
+ * empty. */
+void otrl_hashtab_free(OtrlHashTable *table)
+{
+    free(table->slots);
+    table->slots = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+/* Can the table be used? */
+int otrl_hashtab_usable(const OtrlHashTable *table)
+{
+    return !table->failed;
+}
+
+/* Put an item in the first free slot for its hash.  There must be
+ * one. */
+static void place(OtrlHashSlot *slots, size_t size, size_t hash, void *item)
+{
+    size_t mask = size - 1;
+    size_t pos = hash & mask;
+
+    while (slots[pos].item) {
+	pos = (pos + 1) & mask;
+    }
+    slots[pos].hash = hash;
+    slots[pos].item = item;
+}
+
+/* Make room for one more item */
+static int grow(OtrlHashTable *table)
+{
+    size_t newsize, i;
+    OtrlHashSlot *newslots;
+
+    if (table->count + 1 <= table->size / 2) return 0;
+
+    newsize = table->size ? table->size * 2 : HASHTAB_MIN_SIZE;
+    if (newsize < table->size ||
+	    newsize > (size_t)-1 / sizeof(OtrlHashSlot)) {
+	return -1;
+    }
+    newslots = calloc(newsize, sizeof(OtrlHashSlot));
+    if (newslots == NULL) return -1;
+
+    for (i = 0; i < table->size; ++i) {
+	if (table->slots[i].item) {
+	    place(newslots, newsize, table->slots[i].hash,
+		    table->slots[i].item);
+	}
+    }
+    free(table->slots);
+    table->slots = newslots;
+    table->size = newsize;
+    return 0;
+}
+
+/* Add an item with the given hash to the table. */
+void otrl_hashtab_add(OtrlHashTable *table, size_t hash, void *item)
+{
+    if (table->failed) return;
+
+    if (grow(table)) {
+	/* The table would be missing this item; stop using it */
+	otrl_hashtab_free(table);
+	table->failed = 1;
+	return;
+    }
+    place(table->slots, table->size, hash, item);
+    table->count++;
+}
+
+/* Remove an item, added with the given hash, from the table. */
+void otrl_hashtab_remove(OtrlHashTable *table, size_t hash,
+	const void *item)
+{
+    size_t mask = table->size - 1;
+    size_t hole, pos, home;
+
+    if (table->slots == NULL) return;
+
+    for (hole = hash & mask; table->slots[hole].item != item;
+	    hole = (hole + 1) & mask) {
+	if (table->slots[hole].item == NULL) return;
+    }
+
+    /* Shift back the items after it that would no longer be found
+     * past the hole */
+    pos = hole;
+    for (;;) {
+	pos = (pos + 1) & mask;
+	if (table->slots[pos].item == NULL) break;
+	home = table->slots[pos].hash & mask;
+
+	/* Leave it if its home slot is cyclically in (hole, pos] */
+	if (hole <= pos ? (home > hole && home <= pos) :
+		(home > hole || home <= pos)) {
+	    continue;
+	}
+	table->slots[hole] = table->slots[pos];
+	hole = pos;
+    }
+    table->slots[hole].item = NULL;
+    table->count--;
+}
+
+/* Start a lookup of the items with the given hash. */
+void otrl_hashtab_lookup(const OtrlHashTable *table, size_t hash,
+	OtrlHashCursor *cursor)
+{
+    cursor->table = table;
+    cursor->hash = hash;
+    cursor->pos = table->size ? hash & (table->size - 1) : 0;
+}
+
+/* Return the next item of a lookup, or NULL if there are no more. */
+void *otrl_hashtab_next(OtrlHashCursor *cursor)
+{
+    const OtrlHashTable *table = cursor->table;
+    size_t mask = table->size - 1;
+
+    if (table->slots == NULL) return NULL;
+
+    while (table->slots[cursor->pos].item) {
+	const OtrlHashSlot *slot = &(table->slots[cursor->pos]);
+	cursor->pos = (cursor->pos + 1) & mask;
+	if (slot->hash == cursor->hash) return slot->item;
+    }
+    return NULL;
+}
+
+/* Return the number of bytes the table takes up. */
+size_t otrl_hashtab_bytes(const OtrlHashTable *table)
+{
+    return table->size * sizeof(OtrlHashSlot);
+}
+
+/* Hash the string s, continuing from the hash h. */
+size_t otrl_hashtab_hash_string(size_t h, const char *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+
+    do {
+	h ^= *p;
+	h *= HASHTAB_FNV_PRIME;
+    } while (*p++);
+    return h;
+}
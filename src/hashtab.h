@@ -0,0 +1,104 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __HASHTAB_H__
+#define __HASHTAB_H__
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* A hash table of pointers to items that live in one of the linked
+ * lists of libotr, so that they can be found without walking the
+ * list.  The table doesn't know the keys of the items, only their
+ * hashes: a lookup yields every item with the given hash, and the
+ * caller compares the keys itself.  The same item may only be added
+ * once, but several items may have the same key.
+ *
+ * The table uses open addressing with linear probing, and is kept at
+ * most half full.  If it ever fails to grow for lack of memory, it
+ * empties itself and becomes unusable (see otrl_hashtab_usable), and
+ * the caller goes back to walking its list. */
+
+typedef struct s_OtrlHashSlot {
+    size_t hash;
+    void *item;                        /* NULL for an empty slot */
+} OtrlHashSlot;
+
+typedef struct s_OtrlHashTable {
+    OtrlHashSlot *slots;               /* NULL until an item is added */
+    size_t size;                       /* The number of slots: 0 or a
+					  power of 2 */
+    size_t count;                      /* The number of items */
+    int failed;                        /* Did we run out of memory? */
+} OtrlHashTable;
+
+/* The state of a lookup */
+typedef struct s_OtrlHashCursor {
+    const OtrlHashTable *table;
+    size_t hash;
+    size_t pos;
+} OtrlHashCursor;
+
+/* The hash to start from in otrl_hashtab_hash_string: the FNV offset
+ * basis for the width of size_t */
+#if SIZE_MAX > 0xffffffffU
+#define OTRL_HASHTAB_SEED ((size_t)14695981039346656037ULL)
+#else
+#define OTRL_HASHTAB_SEED ((size_t)2166136261U)
+#endif
+
+/* Initialize an empty table. */
+void otrl_hashtab_init(OtrlHashTable *table);
+
+/* Free the memory used by a table (but not its items), leaving it
+ * empty. */
+void otrl_hashtab_free(OtrlHashTable *table);
+
+/* Can the table be used?  If not, it has run out of memory, and the
+ * items must be found some other way. */
+int otrl_hashtab_usable(const OtrlHashTable *table);
+
+/* Add an item with the given hash to the table. */
+void otrl_hashtab_add(OtrlHashTable *table, size_t hash, void *item);
+
+/* Remove an item, added with the given hash, from the table.  Does
+ * nothing if it is not there. */
+void otrl_hashtab_remove(OtrlHashTable *table, size_t hash,
+	const void *item);
+
+/* Start a lookup of the items with the given hash.  The table must not
+ * be changed until the lookup is over. */
+void otrl_hashtab_lookup(const OtrlHashTable *table, size_t hash,
+	OtrlHashCursor *cursor);
+
+/* Return the next item of a lookup, or NULL if there are no more. */
+void *otrl_hashtab_next(OtrlHashCursor *cursor);
+
+/* Return the number of bytes the table takes up (not counting the
+ * OtrlHashTable itself). */
+size_t otrl_hashtab_bytes(const OtrlHashTable *table);
+
+/* Hash the string s, continuing from the hash h (start from
+ * OTRL_HASHTAB_SEED).  This is FNV-1a; hashing several strings in turn
+ * hashes them along with the NUL that ends each one. */
+size_t otrl_hashtab_hash_string(size_t h, const char *s);
+
+#endif
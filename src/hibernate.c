@@ -0,0 +1,579 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "hibernate.h"
+#include "userstate.h"
+#include "mem.h"
+#include "serial.h"
+
+/* The version byte at the start of a sealed blob */
+#define HIBERNATE_VERSION 0x01
+
+#define HIBERNATE_NONCE_BYTES 16
+#define HIBERNATE_MAC_BYTES 32
+
+/* Flags stored with each session key slot */
+#define SLOT_LIVE           0x01   /* The slot had (or can have) handles */
+#define SLOT_SENDMACUSED    0x02
+#define SLOT_RCVMACUSED     0x04
+
+/* flags, sendctr, rcvctr, sendmackey, rcvmackey, extrakey */
+#define SLOT_BYTES (4 + 16 + 16 + 20 + 20 + OTRL_EXTRAKEY_BYTES)
+
+/* The number of bytes needed to store an optional MPI */
+static size_t opt_mpi_len(gcry_mpi_t x)
+{
+    size_t n = 0;
+
+    if (x) {
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &n, x);
+	n += 4;
+    }
+    return 4 + n;
+}
+
+/* Serialize the given keys into a newly allocated buffer in secure
+ * memory. */
+static gcry_error_t serialize_keys(const ConnContextKeys *keys,
+	unsigned char **bufferp, size_t *lenpp)
+{
+    const gcry_mpi_t mpis[6] = { keys->their_y, keys->their_old_y,
+	keys->our_dh_key.priv, keys->our_dh_key.pub,
+	keys->our_old_dh_key.priv, keys->our_old_dh_key.pub };
+    enum gcry_mpi_format format = GCRYMPI_FMT_USG;
+    unsigned char *buf, *bufp;
+    size_t buflen, lenp;
+    int i, j;
+
+    buflen = 4 + 4 + 4 + 4 + 4 * SLOT_BYTES + 4 + 20 * keys->numsavedkeys;
+    for (i = 0; i < 6; i++) {
+	buflen += opt_mpi_len(mpis[i]);
+    }
+
+    buf = gcry_malloc_secure(buflen);
+    if (buf == NULL) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    bufp = buf;
+    lenp = buflen;
+
+    write_int(keys->their_keyid);
+    write_int(keys->our_keyid);
+    write_int(keys->our_dh_key.groupid);
+    write_int(keys->our_old_dh_key.groupid);
+    for (i = 0; i < 6; i++) {
+	if (mpis[i]) {
+	    size_t n;
+	    gcry_mpi_print(format, NULL, 0, &n, mpis[i]);
+	    write_int(1);
+	    write_mpi(mpis[i], n, "Hibernated MPI");
+	} else {
+	    write_int(0);
+	}
+    }
+
+    for (i = 0; i < 2; i++) {
+	for (j = 0; j < 2; j++) {
+	    const DH_sesskeys *sess = &(keys->sesskeys[i][j]);
+	    unsigned int flags = 0;
+
+	    if (sess->sendenc ||
+		    (keys->released_sesskeys & (1 << (2*i+j)))) {
+		flags |= SLOT_LIVE;
+	    }
+	    if (sess->sendmacused) flags |= SLOT_SENDMACUSED;
+	    if (sess->rcvmacused) flags |= SLOT_RCVMACUSED;
+	    write_int(flags);
+	    memmove(bufp, sess->sendctr, 16);
+	    memmove(bufp + 16, sess->rcvctr, 16);
+	    memmove(bufp + 32, sess->sendmackey, 20);
+	    memmove(bufp + 52, sess->rcvmackey, 20);
+	    memmove(bufp + 72, sess->extrakey, OTRL_EXTRAKEY_BYTES);
+	    bufp += SLOT_BYTES - 4; lenp -= SLOT_BYTES - 4;
+	}
+    }
+
+    write_int(keys->numsavedkeys);
+    if (keys->numsavedkeys > 0) {
+	memmove(bufp, keys->saved_mac_keys, 20 * keys->numsavedkeys);
+	bufp += 20 * keys->numsavedkeys; lenp -= 20 * keys->numsavedkeys;
+    }
+
+    *bufferp = buf;
+    *lenpp = buflen - lenp;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Rebuild keys from the output of serialize_keys.  The session keys of
+ * live slots are derived again from the DH keys. */
+static gcry_error_t deserialize_keys(const unsigned char *buf, size_t buflen,
+	ConnContextKeys *keys)
+{
+    gcry_mpi_t *mpis[6] = { &(keys->their_y), &(keys->their_old_y),
+	&(keys->our_dh_key.priv), &(keys->our_dh_key.pub),
+	&(keys->our_old_dh_key.priv), &(keys->our_old_dh_key.pub) };
+    const unsigned char *bufp = buf;
+    size_t lenp = buflen;
+    unsigned int numsavedkeys;
+    gcry_error_t err;
+    int i, j;
+
+    read_int(keys->their_keyid);
+    read_int(keys->our_keyid);
+    read_int(keys->our_dh_key.groupid);
+    read_int(keys->our_old_dh_key.groupid);
+    for (i = 0; i < 6; i++) {
+	unsigned int present;
+	read_int(present);
+	if (present) {
+	    read_mpi(*(mpis[i]));
+	}
+    }
+    /* The private keys belong in secure memory */
+    if (keys->our_dh_key.priv) {
+	gcry_mpi_set_flag(keys->our_dh_key.priv, GCRYMPI_FLAG_SECURE);
+    }
+    if (keys->our_old_dh_key.priv) {
+	gcry_mpi_set_flag(keys->our_old_dh_key.priv, GCRYMPI_FLAG_SECURE);
+    }
+
+    for (i = 0; i < 2; i++) {
+	for (j = 0; j < 2; j++) {
+	    DH_sesskeys *sess = &(keys->sesskeys[i][j]);
+	    const DH_keypair *kp = i ? &(keys->our_old_dh_key) :
+		    &(keys->our_dh_key);
+	    gcry_mpi_t y = j ? keys->their_old_y : keys->their_y;
+	    unsigned int flags;
+
+	    read_int(flags);
+	    require_len(SLOT_BYTES - 4);
+	    if ((flags & SLOT_LIVE) && kp->priv && y) {
+		err = otrl_dh_session(sess, kp, y);
+		if (err) return err;
+	    }
+	    memmove(sess->sendctr, bufp, 16);
+	    memmove(sess->rcvctr, bufp + 16, 16);
+	    memmove(sess->sendmackey, bufp + 32, 20);
+	    memmove(sess->rcvmackey, bufp + 52, 20);
+	    memmove(sess->extrakey, bufp + 72, OTRL_EXTRAKEY_BYTES);
+	    sess->sendmacused = (flags & SLOT_SENDMACUSED) ? 1 : 0;
+	    sess->rcvmacused = (flags & SLOT_RCVMACUSED) ? 1 : 0;
+	    bufp += SLOT_BYTES - 4; lenp -= SLOT_BYTES - 4;
+	}
+    }
+
+    read_int(numsavedkeys);
+    if (numsavedkeys > lenp / 20) goto invval;
+    if (numsavedkeys > 0) {
+	keys->saved_mac_keys = malloc(20 * numsavedkeys);
+	if (keys->saved_mac_keys == NULL) {
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	memmove(keys->saved_mac_keys, bufp, 20 * numsavedkeys);
+	keys->numsavedkeys = numsavedkeys;
+	bufp += 20 * numsavedkeys; lenp -= 20 * numsavedkeys;
+    }
+
+    if (lenp != 0) goto invval;
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+invval:
+    return gcry_error(GPG_ERR_INV_VALUE);
+}
+
+/* Encrypt and MAC the given plaintext into a newly allocated blob:
+ * version byte, nonce, AES-128-CTR ciphertext, HMAC-SHA256 over all of
+ * the preceding. */
+static gcry_error_t seal(const OtrlHibernation *hibernation,
+	const unsigned char *plain, size_t plainlen,
+	unsigned char **blobp, size_t *bloblenp)
+{
+    size_t bloblen = 1 + HIBERNATE_NONCE_BYTES + plainlen +
+	    HIBERNATE_MAC_BYTES;
+    unsigned char *blob, *nonce, *ciphertext;
+    gcry_cipher_hd_t enc = NULL;
+    gcry_md_hd_t mac = NULL;
+    gcry_error_t err;
+
+    blob = malloc(bloblen);
+    if (blob == NULL) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    blob[0] = HIBERNATE_VERSION;
+    nonce = blob + 1;
+    ciphertext = nonce + HIBERNATE_NONCE_BYTES;
+    gcry_create_nonce(nonce, HIBERNATE_NONCE_BYTES);
+
+    err = gcry_cipher_open(&enc, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
+	    GCRY_CIPHER_SECURE);
+    if (err) goto err;
+    err = gcry_cipher_setkey(enc, hibernation->key,
+	    OTRL_HIBERNATE_ENCKEY_BYTES);
+    if (err) goto err;
+    err = gcry_cipher_setctr(enc, nonce, HIBERNATE_NONCE_BYTES);
+    if (err) goto err;
+    err = gcry_cipher_encrypt(enc, ciphertext, plainlen, plain, plainlen);
+    if (err) goto err;
+
+    err = gcry_md_open(&mac, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+    if (err) goto err;
+    err = gcry_md_setkey(mac, hibernation->key + OTRL_HIBERNATE_ENCKEY_BYTES,
+	    OTRL_HIBERNATE_MACKEY_BYTES);
+    if (err) goto err;
+    gcry_md_write(mac, blob, ciphertext + plainlen - blob);
+    memmove(ciphertext + plainlen, gcry_md_read(mac, GCRY_MD_SHA256),
+	    HIBERNATE_MAC_BYTES);
+
+    gcry_cipher_close(enc);
+    gcry_md_close(mac);
+    *blobp = blob;
+    *bloblenp = bloblen;
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    gcry_cipher_close(enc);
+    gcry_md_close(mac);
+    free(blob);
+    return err;
+}
+
+/* Check and decrypt a blob made by seal into a newly allocated buffer
+ * in secure memory. */
+static gcry_error_t unseal(const OtrlHibernation *hibernation,
+	const unsigned char *blob, size_t bloblen,
+	unsigned char **plainp, size_t *plainlenp)
+{
+    const unsigned char *nonce, *ciphertext;
+    unsigned char *plain = NULL;
+    size_t plainlen;
+    gcry_cipher_hd_t enc = NULL;
+    gcry_md_hd_t mac = NULL;
+    gcry_error_t err;
+
+    if (bloblen < 1 + HIBERNATE_NONCE_BYTES + HIBERNATE_MAC_BYTES ||
+	    blob[0] != HIBERNATE_VERSION) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+    nonce = blob + 1;
+    ciphertext = nonce + HIBERNATE_NONCE_BYTES;
+    plainlen = bloblen - 1 - HIBERNATE_NONCE_BYTES - HIBERNATE_MAC_BYTES;
+
+    err = gcry_md_open(&mac, GCRY_MD_SHA256, GCRY_MD_FLAG_HMAC);
+    if (err) goto err;
+    err = gcry_md_setkey(mac, hibernation->key + OTRL_HIBERNATE_ENCKEY_BYTES,
+	    OTRL_HIBERNATE_MACKEY_BYTES);
+    if (err) goto err;
+    gcry_md_write(mac, blob, ciphertext + plainlen - blob);
+    if (otrl_mem_differ(gcry_md_read(mac, GCRY_MD_SHA256),
+	    ciphertext + plainlen, HIBERNATE_MAC_BYTES)) {
+	err = gcry_error(GPG_ERR_BAD_SIGNATURE);
+	goto err;
+    }
+
+    plain = gcry_malloc_secure(plainlen ? plainlen : 1);
+    if (plain == NULL) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto err;
+    }
+    err = gcry_cipher_open(&enc, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
+	    GCRY_CIPHER_SECURE);
+    if (err) goto err;
+    err = gcry_cipher_setkey(enc, hibernation->key,
+	    OTRL_HIBERNATE_ENCKEY_BYTES);
+    if (err) goto err;
+    err = gcry_cipher_setctr(enc, nonce, HIBERNATE_NONCE_BYTES);
+    if (err) goto err;
+    err = gcry_cipher_decrypt(enc, plain, plainlen, ciphertext, plainlen);
+    if (err) goto err;
+
+    gcry_cipher_close(enc);
+    gcry_md_close(mac);
+    *plainp = plain;
+    *plainlenp = plainlen;
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    gcry_cipher_close(enc);
+    gcry_md_close(mac);
+    gcry_free(plain);
+    return err;
+}
+
+#ifndef WIN32
+/* Write a blob to a new private file in the given directory. */
+static gcry_error_t spill(const char *dir, const unsigned char *blob,
+	size_t bloblen, char **pathp)
+{
+    static const char template[] = "/otr-hibernate-XXXXXX";
+    char *path;
+    FILE *f;
+    int fd;
+
+    path = malloc(strlen(dir) + sizeof(template));
+    if (path == NULL) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    strcpy(path, dir);
+    strcat(path, template);
+
+    /* mkstemp creates the file with mode 0600 */
+    fd = mkstemp(path);
+    if (fd < 0) {
+	gcry_error_t err = gcry_error_from_errno(errno);
+	free(path);
+	return err;
+    }
+    f = fdopen(fd, "wb");
+    if (f == NULL || fwrite(blob, bloblen, 1, f) != 1 || fclose(f) != 0) {
+	gcry_error_t err = gcry_error_from_errno(errno);
+	if (f == NULL) close(fd);
+	unlink(path);
+	free(path);
+	return err;
+    }
+
+    *pathp = path;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+#endif
+
+/* Read back a blob written by spill. */
+static gcry_error_t load(const char *path, unsigned char **blobp,
+	size_t *bloblenp)
+{
+    unsigned char *blob = NULL;
+    size_t bloblen = 0, bufsize = 0, n;
+    FILE *f;
+
+    f = fopen(path, "rb");
+    if (f == NULL) {
+	return gcry_error_from_errno(errno);
+    }
+    do {
+	if (bloblen == bufsize) {
+	    unsigned char *newblob;
+	    bufsize = bufsize ? 2 * bufsize : 1024;
+	    newblob = realloc(blob, bufsize);
+	    if (newblob == NULL) {
+		free(blob);
+		fclose(f);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    blob = newblob;
+	}
+	n = fread(blob + bloblen, 1, bufsize - bloblen, f);
+	bloblen += n;
+    } while (n > 0);
+    fclose(f);
+
+    *blobp = blob;
+    *bloblenp = bloblen;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Allow the keys of idle ENCRYPTED contexts to hibernate. */
+gcry_error_t otrl_hibernate_enable(OtrlUserState us, const char *spill_dir)
+{
+    OtrlHibernation *hibernation = us->hibernation;
+    char *newdir = NULL;
+
+#ifdef WIN32
+    if (spill_dir) return gcry_error(GPG_ERR_NOT_SUPPORTED);
+#endif
+
+    if (spill_dir) {
+	newdir = strdup(spill_dir);
+	if (newdir == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    if (hibernation == NULL) {
+	hibernation = malloc(sizeof(*hibernation));
+	if (hibernation == NULL) {
+	    free(newdir);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	hibernation->key = gcry_malloc_secure(OTRL_HIBERNATE_KEY_BYTES);
+	if (hibernation->key == NULL) {
+	    free(hibernation);
+	    free(newdir);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	gcry_randomize(hibernation->key, OTRL_HIBERNATE_KEY_BYTES,
+		GCRY_STRONG_RANDOM);
+	hibernation->spill_dir = NULL;
+	hibernation->num_hibernated = 0;
+	us->hibernation = hibernation;
+    }
+
+    free(hibernation->spill_dir);
+    hibernation->spill_dir = newdir;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Wake every hibernating context, and stop hibernating contexts. */
+void otrl_hibernate_disable(OtrlUserState us)
+{
+    ConnContext *context;
+
+    if (us->hibernation == NULL) return;
+
+    for (context = us->context_root; context; context = context->next) {
+	otrl_hibernate_wake(context->context_priv);
+    }
+
+    otrl_hibernate_free(us->hibernation);
+    us->hibernation = NULL;
+}
+
+/* Hibernate the keys of the given ENCRYPTED context. */
+gcry_error_t otrl_hibernate_context(OtrlUserState us, ConnContext *context)
+{
+    ConnContextPriv *context_priv = context->context_priv;
+    OtrlHibernation *hibernation = us->hibernation;
+    OtrlHibernatedKeys *hibernated;
+    unsigned char *plain = NULL;
+    size_t plainlen;
+    gcry_error_t err;
+
+    if (hibernation == NULL) return gcry_error(GPG_ERR_INV_VALUE);
+
+    /* Nothing to do, or already hibernating */
+    if (context_priv->keys == NULL) return gcry_error(GPG_ERR_NO_ERROR);
+
+    hibernated = malloc(sizeof(*hibernated));
+    if (hibernated == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    hibernated->hibernation = hibernation;
+    hibernated->blob = NULL;
+    hibernated->bloblen = 0;
+    hibernated->path = NULL;
+
+    err = serialize_keys(context_priv->keys, &plain, &plainlen);
+    if (err) goto err;
+    err = seal(hibernation, plain, plainlen, &(hibernated->blob),
+	    &(hibernated->bloblen));
+    gcry_free(plain);
+    if (err) goto err;
+
+#ifndef WIN32
+    if (hibernation->spill_dir) {
+	err = spill(hibernation->spill_dir, hibernated->blob,
+		hibernated->bloblen, &(hibernated->path));
+	if (err) goto err;
+	free(hibernated->blob);
+	hibernated->blob = NULL;
+    }
+#endif
+
+    /* Now let go of the live keys.  This releases every gcrypt object
+     * they held. */
+    otrl_context_priv_free_keys(context_priv);
+    context_priv->hibernated = hibernated;
+    hibernation->num_hibernated++;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    free(hibernated->blob);
+    free(hibernated);
+    return err;
+}
+
+/* Wake the hibernated keys of the given private connection context. */
+gcry_error_t otrl_hibernate_wake(ConnContextPriv *context_priv)
+{
+    OtrlHibernatedKeys *hibernated = context_priv->hibernated;
+    unsigned char *blob = NULL, *plain = NULL;
+    size_t bloblen = 0, plainlen;
+    gcry_error_t err;
+
+    if (hibernated == NULL) return gcry_error(GPG_ERR_NO_ERROR);
+
+    if (hibernated->path) {
+	err = load(hibernated->path, &blob, &bloblen);
+	if (err) goto err;
+    } else {
+	blob = hibernated->blob;
+	bloblen = hibernated->bloblen;
+    }
+
+    err = unseal(hibernated->hibernation, blob, bloblen, &plain, &plainlen);
+    if (blob != hibernated->blob) free(blob);
+    if (err) goto err;
+
+    otrl_context_priv_alloc_keys(context_priv);
+    err = deserialize_keys(plain, plainlen, context_priv->keys);
+    gcry_free(plain);
+    if (err) {
+	otrl_context_priv_free_keys(context_priv);
+	goto err;
+    }
+
+    otrl_hibernate_discard(context_priv);
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    /* There's no getting these keys back */
+    otrl_hibernate_discard(context_priv);
+    return err;
+}
+
+/* Discard the hibernated keys of the given private connection context. */
+void otrl_hibernate_discard(ConnContextPriv *context_priv)
+{
+    OtrlHibernatedKeys *hibernated = context_priv->hibernated;
+
+    if (hibernated == NULL) return;
+
+#ifndef WIN32
+    if (hibernated->path) {
+	unlink(hibernated->path);
+    }
+#endif
+    free(hibernated->path);
+    free(hibernated->blob);
+    hibernated->hibernation->num_hibernated--;
+    free(hibernated);
+    context_priv->hibernated = NULL;
+}
+
+/* Free the hibernation settings of a userstate. */
+void otrl_hibernate_free(OtrlHibernation *hibernation)
+{
+    if (hibernation == NULL) return;
+
+    gcry_free(hibernation->key);
+    free(hibernation->spill_dir);
+    free(hibernation);
+}
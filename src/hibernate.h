@@ -0,0 +1,98 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __HIBERNATE_H__
+#define __HIBERNATE_H__
+
+#include <gcrypt.h>
+
+#include "context.h"
+
+/* The key protecting hibernated conversation keys: an AES-128 key
+ * followed by an HMAC-SHA256 key. */
+#define OTRL_HIBERNATE_ENCKEY_BYTES 16
+#define OTRL_HIBERNATE_MACKEY_BYTES 32
+#define OTRL_HIBERNATE_KEY_BYTES \
+	(OTRL_HIBERNATE_ENCKEY_BYTES + OTRL_HIBERNATE_MACKEY_BYTES)
+
+/* The hibernation settings of an OtrlUserState. */
+typedef struct s_OtrlHibernation {
+    unsigned char *key;                /* OTRL_HIBERNATE_KEY_BYTES of
+					  random key material, in secure
+					  memory; it never leaves this
+					  process */
+    char *spill_dir;                   /* If non-NULL, hibernated keys are
+					  written to files in this
+					  directory rather than kept in
+					  memory */
+    unsigned int num_hibernated;       /* Contexts currently hibernating */
+} OtrlHibernation;
+
+/* The hibernated keys of one context, sealed with the userstate's
+ * hibernation key. */
+typedef struct s_OtrlHibernatedKeys {
+    OtrlHibernation *hibernation;
+    unsigned char *blob;               /* The sealed keys, if kept in
+					  memory */
+    size_t bloblen;
+    char *path;                        /* The file holding the sealed
+					  keys, if spilled to disk */
+} OtrlHibernatedKeys;
+
+/* Allow the keys of idle ENCRYPTED contexts in the given OtrlUserState
+ * to hibernate.  A hibernating context keeps no gcrypt objects at all:
+ * its DH keys, its correspondent's public keys and its session key
+ * state are serialized into a small blob, encrypted and MACed under a
+ * random key that only exists in this process's (secure) memory.  The
+ * blob is kept in memory, or, if spill_dir is non-NULL, written to a
+ * private file in that directory.  The keys are woken up transparently
+ * the next time the context sends or receives a message.
+ *
+ * Contexts hibernate when they are found idle by the sweep set up with
+ * otrl_context_set_idle_timeout (instead of merely releasing their
+ * session key handles), or when otrl_hibernate_context is called.
+ *
+ * Calling this again just changes the spill directory. */
+gcry_error_t otrl_hibernate_enable(OtrlUserState us, const char *spill_dir);
+
+/* Wake up every hibernating context in the given OtrlUserState, and
+ * stop hibernating contexts.  Contexts whose keys cannot be woken up
+ * (for instance, because their spill file is gone) are left without
+ * keys, and will fail to send or receive encrypted messages. */
+void otrl_hibernate_disable(OtrlUserState us);
+
+/* Hibernate the keys of the given ENCRYPTED context right away.  The
+ * userstate must have hibernation enabled. */
+gcry_error_t otrl_hibernate_context(OtrlUserState us, ConnContext *context);
+
+/* Wake up the hibernated keys of the given private connection context,
+ * if there are any.  On failure, the hibernated keys are discarded. */
+gcry_error_t otrl_hibernate_wake(ConnContextPriv *context_priv);
+
+/* Discard the hibernated keys of the given private connection context,
+ * if there are any, without waking them up. */
+void otrl_hibernate_discard(ConnContextPriv *context_priv);
+
+/* Free the hibernation settings of a userstate.  All its contexts must
+ * have been woken up or forgotten by then. */
+void otrl_hibernate_free(OtrlHibernation *hibernation);
+
+#endif
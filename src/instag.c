@@ -27,11 +27,90 @@
 
 /* libotr headers */
 #include "instag.h"
+#include "persist.h"
 #include "userstate.h"
 
-/* Forget the given instag. */
-void otrl_instag_forget(OtrlInsTag* instag) {
-    if (!instag) return;
+/* The hash of an account in us->instag_index */
+static size_t instag_hash(const char *accountname, const char *protocol)
+{
+    return otrl_hashtab_hash_string(otrl_hashtab_hash_string(
+		OTRL_HASHTAB_SEED, accountname), protocol);
+}
+
+/* Make sure us->instag_index holds every instag in us->instag_root.
+ * The functions in this file keep the two in step; if the list was
+ * changed some other way (which shows as its head not being the one
+ * the index knows about), the index is built over. */
+static void instag_index_sync(OtrlUserState us)
+{
+    OtrlInsTag *p;
+
+    if (us->instag_index_root == us->instag_root) return;
+
+    otrl_hashtab_free(&(us->instag_index));
+    otrl_hashtab_init(&(us->instag_index));
+    for (p = us->instag_root; p; p = p->next) {
+	p->us = us;
+	otrl_hashtab_add(&(us->instag_index),
+		instag_hash(p->accountname, p->protocol), p);
+    }
+    us->instag_index_root = us->instag_root;
+}
+
+/* Link a new instag at the head of our list in the given
+ * OtrlUserState, and index it. */
+static void instag_link(OtrlUserState us, OtrlInsTag *p)
+{
+    int in_sync = (us->instag_index_root == us->instag_root);
+
+    p->us = us;
+    p->next = us->instag_root;
+    if (p->next) {
+	p->next->tous = &(p->next);
+    }
+    p->tous = &(us->instag_root);
+    us->instag_root = p;
+
+    if (in_sync) {
+	otrl_hashtab_add(&(us->instag_index),
+		instag_hash(p->accountname, p->protocol), p);
+	us->instag_index_root = p;
+    }
+}
+
+/* Forget which file holds exactly our instags. */
+static void instag_file_forget(OtrlUserState us)
+{
+    free(us->instag_file);
+    us->instag_file = NULL;
+    us->instag_file_root = NULL;
+}
+
+/* Note that the given file holds exactly our instags, as they are now. */
+static void instag_file_set(OtrlUserState us, const char *filename)
+{
+    char *newfile = strdup(filename);
+
+    instag_file_forget(us);
+    if (!newfile) return;
+    us->instag_file = newfile;
+    us->instag_file_root = us->instag_root;
+}
+
+/* Forget the given instag, which is in the list of the given
+ * OtrlUserState (if us is not NULL). */
+static void instag_forget(OtrlUserState us, OtrlInsTag *instag)
+{
+    if (us) {
+	/* The instag file still has it */
+	instag_file_forget(us);
+
+	otrl_hashtab_remove(&(us->instag_index),
+		instag_hash(instag->accountname, instag->protocol), instag);
+	if (us->instag_index_root == instag) {
+	    us->instag_index_root = instag->next;
+	}
+    }
 
     if (instag->accountname) free(instag->accountname);
     if (instag->protocol) free(instag->protocol);
@@ -45,10 +124,17 @@ void otrl_instag_forget(OtrlInsTag* instag) {
     free(instag);
 }
 
+/* Forget the given instag. */
+void otrl_instag_forget(OtrlInsTag* instag) {
+    if (!instag) return;
+
+    instag_forget(instag->us, instag);
+}
+
 /* Forget all instags in a given OtrlUserState. */
 void otrl_instag_forget_all(OtrlUserState us) {
     while(us->instag_root) {
-	otrl_instag_forget(us->instag_root);
+	instag_forget(us, us->instag_root);
     }
 }
 
@@ -57,7 +143,25 @@ void otrl_instag_forget_all(OtrlUserState us) {
 OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 	const char *protocol)
 {
-    OtrlInsTag *p;
+    OtrlInsTag *p, *found = NULL;
+    OtrlHashCursor cursor;
+    int matches = 0;
+
+    instag_index_sync(us);
+    if (otrl_hashtab_usable(&(us->instag_index))) {
+	otrl_hashtab_lookup(&(us->instag_index),
+		instag_hash(accountname, protocol), &cursor);
+	while ((p = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		found = p;
+		matches++;
+	    }
+	}
+	/* If the account has several instags, the first one in the
+	 * list is the one in use */
+	if (matches <= 1) return found;
+    }
 
     for(p=us->instag_root; p; p=p->next) {
 	if (!strcmp(p->accountname, accountname) &&
@@ -68,12 +172,22 @@ OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
     return NULL;
 }
 
+/* Whether the given instag file is empty or ends in a whole line */
+static int instag_file_whole(FILE *instf)
+{
+    if (fseek(instf, 0, SEEK_END) != 0) return 0;
+    if (ftell(instf) == 0) return 1;
+    if (fseek(instf, -1, SEEK_END) != 0) return 0;
+    return fgetc(instf) == '\n';
+}
+
 /* Read our instance tag from a file on disk into the given
  * OtrlUserState. */
 gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename)
 {
     gcry_error_t err;
     FILE *instf;
+    int was_empty = (us->instag_root == NULL), whole;
 
     /* Open the instance tag file. */
     instf = fopen(filename, "rb");
@@ -82,7 +196,16 @@ gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename)
     }
 
     err = otrl_instag_read_FILEp(us, instf);
+    whole = !err && instag_file_whole(instf);
     fclose(instf);
+
+    /* If we had no instags before, the file now holds exactly ours,
+     * and otrl_instag_generate can append to it.  Not if it ends in a
+     * line torn by a crash, though: a new line would be glued onto it,
+     * so the next otrl_instag_generate rewrites the file instead. */
+    if (whole && was_empty) {
+	instag_file_set(us, filename);
+    }
     return err;
 }
 
@@ -96,106 +219,142 @@ gcry_error_t otrl_instag_read_FILEp(OtrlUserState us, FILE *instf)
     char storeline[1000];
     size_t maxsize = sizeof(storeline);
 
+    instag_file_forget(us);
+
     while(fgets(storeline, maxsize, instf)) {
-	char *prevpos;
-	char *pos;
+	char *accountname, *protocol, *hex, *pos;
 	unsigned int instag = 0;
 
-	p = malloc(sizeof(*p));
-	if (!p) {
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-
 	/* Parse the line, which should be of the form:
-	 * accountname\tprotocol\t40_hex_nybbles\n          */
-	prevpos = storeline;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p);
-	    continue;
-	}
+	 * accountname\tprotocol\t8_hex_nybbles\n
+	 * in place, before allocating anything */
+	accountname = storeline;
+	pos = strchr(accountname, '\t');
+	if (!pos) continue;
 	*pos = '\0';
-	pos++;
-	p->accountname = malloc(pos - prevpos);
-	if (!(p->accountname)) {
-	    free(p);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(p->accountname, prevpos, pos - prevpos);
-
-	prevpos = pos;
-	pos = strchr(prevpos, '\t');
-	if (!pos) {
-	    free(p->accountname);
-	    free(p);
-	    continue;
-	}
+	protocol = pos + 1;
+	pos = strchr(protocol, '\t');
+	if (!pos) continue;
 	*pos = '\0';
-	pos++;
-	p->protocol = malloc(pos - prevpos);
-	if (!(p->protocol)) {
-	    free(p->accountname);
-	    free(p);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(p->protocol, prevpos, pos - prevpos);
-
-	prevpos = pos;
-	pos = strchr(prevpos, '\r');
-	if (!pos) pos = strchr(prevpos, '\n');
-	if (!pos) {
-	    free(p->accountname);
-	    free(p->protocol);
-	    free(p);
-	    continue;
-	}
+	hex = pos + 1;
+	pos = strchr(hex, '\r');
+	if (!pos) pos = strchr(hex, '\n');
+	if (!pos) continue;
 	*pos = '\0';
-	pos++;
 	/* hex str of length 8 */
-	if (strlen(prevpos) != 8) {
-	    free(p->accountname);
-	    free(p->protocol);
-	    free(p);
+	if (strlen(hex) != 8) continue;
+
+	sscanf(hex, "%08x", &instag);
+
+	if (instag < OTRL_MIN_VALID_INSTAG) continue;
+
+	/* A later line for an account replaces the earlier ones, as
+	 * otrl_instag_generate appends to the file */
+	p = otrl_instag_find(us, accountname, protocol);
+	if (p) {
+	    p->instag = instag;
 	    continue;
 	}
 
-	sscanf(prevpos, "%08x", &instag);
-
-	if (instag < OTRL_MIN_VALID_INSTAG) {
+	p = malloc(sizeof(*p));
+	if (!p) {
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	p->accountname = strdup(accountname);
+	p->protocol = strdup(protocol);
+	if (!p->accountname || !p->protocol) {
 	    free(p->accountname);
 	    free(p->protocol);
 	    free(p);
-	    continue;
+	    return gcry_error(GPG_ERR_ENOMEM);
 	}
 	p->instag = instag;
 
 	/* Link it up */
-	p->next = us->instag_root;
-	if (p->next) {
-	    p->next->tous = &(p->next);
-	}
-	p->tous = &(us->instag_root);
-	us->instag_root = p;
+	instag_link(us, p);
     }
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Add a new instance tag for the given account to the file that holds
+ * exactly our instags, by appending a line to it. */
+static gcry_error_t instag_append(OtrlUserState us, const char *filename,
+	const char *accountname, const char *protocol)
+{
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+    OtrlInsTag *p;
+    FILE *instf;
+
+    p = (OtrlInsTag *)malloc(sizeof(OtrlInsTag));
+    if (!p) return gcry_error(GPG_ERR_ENOMEM);
+    p->accountname = strdup(accountname);
+    p->protocol = strdup(protocol);
+    if (!p->accountname || !p->protocol) {
+	free(p->accountname);
+	free(p->protocol);
+	free(p);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    p->instag = otrl_instag_get_new();
+
+    instf = fopen(filename, "ab");
+    if (!instf) {
+	err = gcry_error_from_errno(errno);
+    } else {
+	if (fprintf(instf, "%s\t%s\t%08x\n", accountname, protocol,
+		    p->instag) < 0) {
+	    err = gcry_error_from_errno(errno);
+	}
+	if (!err) err = otrl_persist_sync(instf);
+	if (fclose(instf) != 0 && !err) {
+	    err = gcry_error_from_errno(errno);
+	}
+    }
+
+    /* As with a rewrite, the instag is ours even if it could not be
+     * written; but the file may now end in a torn line, so the next
+     * call rewrites it */
+    instag_link(us, p);
+    if (err) {
+	instag_file_forget(us);
+    } else {
+	us->instag_file_root = us->instag_root;
+    }
+    return err;
+}
+
 /* Generate a new instance tag for the given account and write to file */
 gcry_error_t otrl_instag_generate(OtrlUserState us, const char *filename,
 	const char *accountname, const char *protocol)
 {
+    OtrlPersistFile pf;
     gcry_error_t err;
-    FILE *instf;
+
+    /* If the file holds exactly our instags, the new one is simply
+     * appended to it.  Inside a batch, the file may be about to be
+     * replaced, so it is rewritten like any other. */
+    if (accountname && protocol && us->instag_file &&
+	    us->instag_file_root == us->instag_root &&
+	    us->persist_depth == 0 && !strcmp(us->instag_file, filename)) {
+	return instag_append(us, filename, accountname, protocol);
+    }
 
     /* Open the instance tag file. */
-    instf = fopen(filename, "wb");
-    if (!instf) {
-	return gcry_error_from_errno(errno);
+    err = otrl_persist_open(&pf, filename, 0);
+    if (err) {
+	return err;
     }
 
-    err = otrl_instag_generate_FILEp(us, instf, accountname, protocol);
-    fclose(instf);
+    err = otrl_instag_generate_FILEp(us, pf.f, accountname, protocol);
+    if (err) {
+	otrl_persist_abort(&pf);
+	return err;
+    }
+    err = otrl_persist_commit(us, &pf);
+    if (!err && us->persist_depth == 0) {
+	instag_file_set(us, filename);
+    }
     return err;
 }
 
@@ -229,12 +388,7 @@ gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
     p->instag = otrl_instag_get_new();
 
     /* Add to our list in OtrlUserState */
-    p->next = us->instag_root;
-    if (p->next) {
-	p->next->tous = &(p->next);
-    }
-    p->tous = &(us->instag_root);
-    us->instag_root = p;
+    instag_link(us, p);
 
     otrl_instag_write_FILEp(us, instf);
 
@@ -244,17 +398,41 @@ gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
 /* Write our instance tags to a file on disk. */
 gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename)
 {
+    OtrlPersistFile pf;
     gcry_error_t err;
-    FILE *instf;
 
     /* Open the instance tag file. */
-    instf = fopen(filename, "wb");
-    if (!instf) {
-	return gcry_error_from_errno(errno);
+    err = otrl_persist_open(&pf, filename, 0);
+    if (err) {
+	return err;
     }
 
-    err = otrl_instag_write_FILEp(us, instf);
-    fclose(instf);
+    err = otrl_instag_write_FILEp(us, pf.f);
+    if (err) {
+	otrl_persist_abort(&pf);
+	return err;
+    }
+    err = otrl_persist_commit(us, &pf);
+    if (!err && us->persist_depth == 0) {
+	instag_file_set(us, filename);
+    }
+    return err;
+}
+
+/* Rewrite the given instance tag file with one line per account. */
+gcry_error_t otrl_instag_compact(const char *filename)
+{
+    OtrlUserState us = otrl_userstate_create();
+    gcry_error_t err;
+
+    if (!us) return gcry_error(GPG_ERR_ENOMEM);
+
+    /* Reading keeps only the last line of each account */
+    err = otrl_instag_read(us, filename);
+    if (!err) {
+	err = otrl_instag_write(us, filename);
+    }
+    otrl_userstate_free(us);
     return err;
 }
 
@@ -268,6 +446,10 @@ gcry_error_t otrl_instag_write_FILEp(OtrlUserState us, FILE *instf)
     fprintf(instf, "# WARNING! You shouldn't copy this file to another"
     " computer. It is unnecessary and can cause problems.\n");
     for(p=us->instag_root; p; p=p->next) {
+	/* Only the instag in use, if an account has several */
+	if (otrl_instag_find(us, p->accountname, p->protocol) != p) {
+	    continue;
+	}
 	fprintf(instf, "%s\t%s\t%08x\n", p->accountname, p->protocol,
 		p->instag);
     }
@@ -44,6 +44,9 @@ typedef struct s_OtrlInsTag {
     char *accountname;
     char *protocol;
     otrl_instag_t instag;
+    struct s_OtrlUserState *us;        /* The OtrlUserState whose list
+					  this is in, or NULL if it was
+					  not put there by libotr */
 } OtrlInsTag;
 
 #include "userstate.h"
@@ -60,7 +63,9 @@ OtrlInsTag * otrl_instag_find(OtrlUserState us, const char *accountname,
 	const char *protocol);
 
 /* Read our instance tag from a file on disk into the given
- * OtrlUserState. */
+ * OtrlUserState.  A later line for an account replaces an earlier one.
+ * If the OtrlUserState had no instags before, it remembers that the
+ * file holds exactly its instags; see otrl_instag_generate. */
 gcry_error_t otrl_instag_read(OtrlUserState us, const char *filename);
 
 /* Read our instance tag from a file on disk into the given
@@ -70,7 +75,14 @@ gcry_error_t otrl_instag_read_FILEp(OtrlUserState us, FILE *instf);
 /* Return a new valid instance tag */
 otrl_instag_t otrl_instag_get_new();
 
-/* Get a new instance tag for the given account and write to file*/
+/* Get a new instance tag for the given account and write to file.  If
+ * the file is the one this OtrlUserState last read its instags from
+ * (into an empty OtrlUserState) or wrote them all to, and the instags
+ * have not been changed some other way since, the new instag is
+ * appended to the file, which is then synced.  Otherwise the whole
+ * file is rewritten atomically (see persist.h), as is the case inside
+ * a batch of writes.  Appending leaves an older line for the account
+ * in the file if it had one; otrl_instag_compact drops those. */
 gcry_error_t otrl_instag_generate(OtrlUserState us, const char *filename,
 	const char *accountname, const char *protocol);
 
@@ -79,9 +91,15 @@ gcry_error_t otrl_instag_generate(OtrlUserState us, const char *filename,
 gcry_error_t otrl_instag_generate_FILEp(OtrlUserState us, FILE *instf,
 	const char *accountname, const char *protocol);
 
-/* Write our instance tags to a file on disk. */
+/* Write our instance tags to a file on disk.  The file is replaced
+ * atomically (see persist.h). */
 gcry_error_t otrl_instag_write(OtrlUserState us, const char *filename);
 
+/* Rewrite the given instance tag file, without the lines that later
+ * lines for the same account replace.  The file is replaced
+ * atomically. */
+gcry_error_t otrl_instag_compact(const char *filename);
+
 /* Write our instance tags to a file on disk.
  * The FILE* must be open for writing. */
 gcry_error_t otrl_instag_write_FILEp(OtrlUserState us, FILE *instf);
@@ -25,21 +25,47 @@
  * libgcrypt because you need to declare a fixed amount of it when you
  * start up.
  *
- * Because "secure" and "insecure" allocations from libgcrypt will get
- * handled the same way (since we're not going to be running as root,
- * and so won't actually have pinned memory), pretend all allocated
- * memory (but just from libgcrypt) is requested secure, and wipe it on
- * free(). */
+ * All allocated memory (but just from libgcrypt) is wiped on free(),
+ * whether libgcrypt asked for it to be secure or not.
+ *
+ * Small blocks (the MPIs, cipher and MAC handles that the crypto code
+ * makes and throws away by the thousand) come from a pool: chunks of a
+ * few size classes, carved out of slabs that are never given back to
+ * the system.  A freed chunk is wiped once and put on its size class's
+ * free list, to be handed out again by the next allocation of that
+ * size.  Larger blocks come from malloc() and are wiped before being
+ * free()d.
+ *
+ * Secure and insecure blocks never share a slab.  The slabs for secure
+ * blocks are the ones we try to mlock(), and if the application sets
+ * up a secure heap with otrl_mem_secure_heap, they are carved out of it
+ * until it runs out: regions that are mlock()ed (or we refuse to use
+ * them), fenced by inaccessible guard pages, and left out of core
+ * dumps.  We keep track of where every secure block is (secure blocks
+ * too big for the pool one by one), so that libgcrypt is told that the
+ * blocks it asked to be secure are, and that nothing else is. */
 
 /* Uncomment the following to add a check that our free() and realloc() only
  * get called on things returned from our malloc(). */
 /* #define OTRL_MEM_MAGIC 0x31415926 */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
 /* system headers */
 #ifdef OTRL_MEM_MAGIC
 #include <stdio.h>
 #endif
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -49,34 +75,350 @@
 
 static size_t header_size;
 
-static void *otrl_mem_malloc(size_t n)
+/* The header of a block holds its size (header included), with this
+ * bit set if libgcrypt asked for the block to be secure */
+#define MEM_SECURE_BIT ((size_t)1 << (sizeof(size_t) * 8 - 1))
+
+/* Everything currently allocated through the handlers below */
+static OtrlMemUsage gcrypt_usage;
+
+/* Everything ever allocated through them, freed or not */
+static OtrlMemUsage gcrypt_allocated;
+
+/* The handlers may be called from any thread, so the counters are
+ * updated atomically where the compiler lets us. */
+#if defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+#define MEM_ADD(p, n) __atomic_fetch_add((p), (n), __ATOMIC_RELAXED)
+#define MEM_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#else
+#define MEM_ADD(p, n) (*(p) += (n))
+#define MEM_LOAD(p) (*(p))
+#endif
+
+/* The pool has POOL_NUM_CLASSES size classes, of 2^POOL_MIN_SHIFT,
+ * 2^(POOL_MIN_SHIFT+1), ... bytes (headers included).  Anything bigger
+ * than the largest class goes to malloc(). */
+#define POOL_MIN_SHIFT 5
+#define POOL_NUM_CLASSES 8
+#define POOL_MAX_CHUNK (1 << (POOL_MIN_SHIFT + POOL_NUM_CLASSES - 1))
+#define POOL_SLAB_SIZE (64 * 1024)
+
+/* The pool is shared by all threads, and so is guarded by a spinlock
+ * (the critical sections are a handful of instructions).  Without
+ * GCC-style atomics, there is no pool, and everything is malloc()ed. */
+#if defined(__GNUC__) && defined(__ATOMIC_ACQUIRE)
+#define POOL_ENABLED 1
+static char pool_lock;
+#define POOL_LOCK() \
+    while (__atomic_test_and_set(&pool_lock, __ATOMIC_ACQUIRE)) { }
+#define POOL_UNLOCK() __atomic_clear(&pool_lock, __ATOMIC_RELEASE)
+#else
+#define POOL_ENABLED 0
+#define POOL_LOCK()
+#define POOL_UNLOCK()
+#endif
+
+/* A secure heap needs anonymous mappings that can be locked into
+ * memory and given guard pages, and the pool to hand them out. */
+#if POOL_ENABLED && defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS) \
+	&& defined(HAVE_MLOCK) && defined(HAVE_UNISTD_H)
+#define SECURE_HEAP_ENABLED 1
+#else
+#define SECURE_HEAP_ENABLED 0
+#endif
+
+/* The most regions otrl_mem_secure_heap can set up */
+#define SECURE_MAX_REGIONS 16
+
+typedef struct s_SecureRegion {
+    char *start;                       /* The usable part of the region, */
+    char *end;                         /* between the guard pages */
+    char *carved;                      /* Slabs have been taken up to here */
+} SecureRegion;
+
+/* Memory outside the secure heap that holds secure blocks */
+typedef struct s_SecureRange {
+    char *start;
+    char *end;
+} SecureRange;
+
+typedef struct s_PoolChunk {
+    struct s_PoolChunk *next;
+} PoolChunk;
+
+/* The chunks of either secure or insecure blocks */
+typedef struct s_PoolArena {
+    PoolChunk *free_list[POOL_NUM_CLASSES];
+    char *bump;                        /* The unused part of the newest */
+    char *bump_end;                    /* slab */
+} PoolArena;
+
+static struct {
+    PoolArena arenas[2];               /* Indexed by whether the blocks
+					  are secure */
+    OtrlMemUsage slabs;                /* The slabs we've got... */
+    size_t unlocked_slabs;             /* ...and how many of those for
+					  secure blocks mlock() refused */
+    SecureRegion secure[SECURE_MAX_REGIONS];
+    unsigned int num_secure;
+    OtrlMemUsage secure_size;          /* The size of the secure heap */
+    size_t secure_fallbacks;           /* Slabs we had to get elsewhere
+					  because it was used up */
+    SecureRange *ranges;               /* Those slabs, and the secure */
+    size_t num_ranges;                 /* blocks too big for the pool */
+    size_t ranges_size;
+} pool;
+
+/* Overwrite n bytes at p with zeros, in a way the compiler can't
+ * optimize away, even though the memory is about to be freed. */
+void otrl_mem_wipe(void *p, size_t n)
+{
+    static void *(*const volatile memset_v)(void *, int, size_t) = memset;
+    memset_v(p, 0, n);
+}
+
+/* The size class for a block of n bytes (header included), or
+ * POOL_NUM_CLASSES if it's too big for the pool */
+static unsigned int pool_class(size_t n)
+{
+    unsigned int class = 0;
+    size_t chunk = 1 << POOL_MIN_SHIFT;
+
+    if (!POOL_ENABLED || n > POOL_MAX_CHUNK) return POOL_NUM_CLASSES;
+    while (chunk < n) {
+	chunk <<= 1;
+	++class;
+    }
+    return class;
+}
+
+/* Take a slab from the secure heap, if it has any left.  Call with the
+ * pool locked. */
+static char *secure_slab(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool.num_secure; ++i) {
+	SecureRegion *region = &(pool.secure[i]);
+	if (region->end - region->carved >= POOL_SLAB_SIZE) {
+	    char *slab = region->carved;
+	    region->carved += POOL_SLAB_SIZE;
+	    return slab;
+	}
+    }
+    return NULL;
+}
+
+/* Remember that [start, end) holds secure blocks.  Call with the pool
+ * locked. */
+static int add_secure_range(char *start, char *end)
+{
+    if (pool.num_ranges == pool.ranges_size) {
+	size_t newsize = pool.ranges_size ? 2 * pool.ranges_size : 16;
+	SecureRange *newranges = realloc(pool.ranges,
+		newsize * sizeof(SecureRange));
+	if (newranges == NULL) return -1;
+	pool.ranges = newranges;
+	pool.ranges_size = newsize;
+    }
+    pool.ranges[pool.num_ranges].start = start;
+    pool.ranges[pool.num_ranges].end = end;
+    pool.num_ranges++;
+    return 0;
+}
+
+/* Forget the secure range starting at start.  Call with the pool
+ * locked. */
+static void remove_secure_range(const char *start)
+{
+    size_t i;
+
+    for (i = 0; i < pool.num_ranges; ++i) {
+	if (pool.ranges[i].start == start) {
+	    pool.ranges[i] = pool.ranges[--pool.num_ranges];
+	    return;
+	}
+    }
+}
+
+/* Get a fresh slab for the pool's secure or insecure chunks.  Call
+ * with the pool locked. */
+static int pool_grow(int secure)
+{
+    PoolArena *arena = &(pool.arenas[secure]);
+    char *slab;
+
+    if (secure && pool.num_secure > 0) {
+	slab = secure_slab();
+	if (slab) {
+	    /* Already locked */
+	    otrl_mem_account(&pool.slabs, 1, POOL_SLAB_SIZE);
+	    arena->bump = slab;
+	    arena->bump_end = slab + POOL_SLAB_SIZE;
+	    return 0;
+	}
+	pool.secure_fallbacks++;
+    }
+
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+    slab = mmap(NULL, POOL_SLAB_SIZE, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (slab == MAP_FAILED) return -1;
+#else
+    slab = malloc(POOL_SLAB_SIZE);
+    if (slab == NULL) return -1;
+#endif
+    if (secure) {
+	if (add_secure_range(slab, slab + POOL_SLAB_SIZE) != 0) {
+#if defined(HAVE_SYS_MMAN_H) && defined(MAP_ANONYMOUS)
+	    munmap(slab, POOL_SLAB_SIZE);
+#else
+	    free(slab);
+#endif
+	    return -1;
+	}
+#ifdef HAVE_MLOCK
+	if (mlock(slab, POOL_SLAB_SIZE) != 0) {
+	    pool.unlocked_slabs++;
+	}
+#else
+	pool.unlocked_slabs++;
+#endif
+    }
+    otrl_mem_account(&pool.slabs, 1, POOL_SLAB_SIZE);
+
+    /* Whatever is left of the old slab is wasted; it's never more than
+     * a largest-class chunk. */
+    arena->bump = slab;
+    arena->bump_end = slab + POOL_SLAB_SIZE;
+    return 0;
+}
+
+/* Take a chunk of the given size class from the pool */
+static void *pool_get(unsigned int class, int secure)
+{
+    PoolArena *arena = &(pool.arenas[secure]);
+    size_t chunk_size = (size_t)1 << (POOL_MIN_SHIFT + class);
+    PoolChunk *chunk;
+
+    POOL_LOCK();
+    chunk = arena->free_list[class];
+    if (chunk) {
+	arena->free_list[class] = chunk->next;
+    } else if ((size_t)(arena->bump_end - arena->bump) >= chunk_size ||
+	    pool_grow(secure) == 0) {
+	chunk = (PoolChunk *)arena->bump;
+	arena->bump += chunk_size;
+    }
+    POOL_UNLOCK();
+    return chunk;
+}
+
+/* Give a (wiped) chunk back to the pool */
+static void pool_put(void *p, unsigned int class, int secure)
+{
+    PoolArena *arena = &(pool.arenas[secure]);
+    PoolChunk *chunk = p;
+
+    POOL_LOCK();
+    chunk->next = arena->free_list[class];
+    arena->free_list[class] = chunk;
+    POOL_UNLOCK();
+}
+
+/* Allocate a block of n bytes, secure or not */
+static void *mem_alloc(size_t n, int secure)
 {
     void *p;
     size_t new_n = n;
+    unsigned int class;
     new_n += header_size;
 
     /* Check for overflow attack */
-    if (new_n < n) return NULL;
-    p = malloc(new_n);
+    if (new_n < n || (new_n & MEM_SECURE_BIT)) return NULL;
+    class = pool_class(new_n);
+    if (class < POOL_NUM_CLASSES) {
+	p = pool_get(class, secure);
+    } else {
+	p = malloc(new_n);
+	if (p && secure && POOL_ENABLED) {
+	    int err;
+
+	    POOL_LOCK();
+	    err = add_secure_range(p, (char *)p + new_n);
+	    POOL_UNLOCK();
+	    if (err) {
+		free(p);
+		p = NULL;
+	    }
+	}
+    }
     if (p == NULL) return NULL;
 
-    ((size_t *)p)[0] = new_n;  /* Includes header size */
+    /* Includes header size */
+    ((size_t *)p)[0] = new_n | (secure ? MEM_SECURE_BIT : 0);
 #ifdef OTRL_MEM_MAGIC
     ((size_t *)p)[1] = OTRL_MEM_MAGIC;
 #endif
+    otrl_mem_account(&gcrypt_usage, 1, new_n);
+    otrl_mem_account(&gcrypt_allocated, 1, new_n);
 
     return (void *)((char *)p + header_size);
 }
 
+static void *otrl_mem_malloc(size_t n)
+{
+    return mem_alloc(n, 0);
+}
+
+static void *otrl_mem_malloc_secure(size_t n)
+{
+    return mem_alloc(n, 1);
+}
+
+/* Is p in the secure heap?  Call with the pool locked. */
+static int in_secure_heap(const void *p)
+{
+    unsigned int i;
+
+    for (i = 0; i < pool.num_secure; ++i) {
+	if ((const char *)p >= pool.secure[i].start &&
+		(const char *)p < pool.secure[i].end) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* libgcrypt asks this about its own blocks, but also about buffers it
+ * is handed (gcry_mpi_scan makes a secure MPI out of a secure buffer),
+ * so it can't go by the header of the block. */
 static int otrl_mem_is_secure(const void *p)
 {
-    return 1;
+    int secure;
+    size_t i;
+
+    /* Without the pool, we don't keep track, so play it safe */
+    if (!POOL_ENABLED) return 1;
+
+    POOL_LOCK();
+    secure = in_secure_heap(p);
+    for (i = 0; !secure && i < pool.num_ranges; ++i) {
+	if ((const char *)p >= pool.ranges[i].start &&
+		(const char *)p < pool.ranges[i].end) {
+	    secure = 1;
+	}
+    }
+    POOL_UNLOCK();
+    return secure;
 }
 
 static void otrl_mem_free(void *p)
 {
     void *real_p = (void *)((char *)p - header_size);
-    size_t n = ((size_t *)real_p)[0];
+    size_t n = ((size_t *)real_p)[0] & ~MEM_SECURE_BIT;
+    int secure = (((size_t *)real_p)[0] & MEM_SECURE_BIT) != 0;
+    unsigned int class = pool_class(n);
 #ifdef OTRL_MEM_MAGIC
     if (((size_t *)real_p)[1] != OTRL_MEM_MAGIC) {
 	fprintf(stderr, "Illegal free!\n");
@@ -84,14 +426,20 @@ static void otrl_mem_free(void *p)
     }
 #endif
 
-    /* Wipe the memory (in the same way the built-in deallocator in
-     * libgcrypt would) */
-    memset(real_p, 0xff, n);
-    memset(real_p, 0xaa, n);
-    memset(real_p, 0x55, n);
-    memset(real_p, 0x00, n);
+    /* Wipe the memory */
+    otrl_mem_wipe(real_p, n);
 
-    free(real_p);
+    otrl_mem_account(&gcrypt_usage, -1, -(long)n);
+    if (class < POOL_NUM_CLASSES) {
+	pool_put(real_p, class, secure);
+    } else {
+	if (secure && POOL_ENABLED) {
+	    POOL_LOCK();
+	    remove_secure_range(real_p);
+	    POOL_UNLOCK();
+	}
+	free(real_p);
+    }
 }
 
 static void *otrl_mem_realloc(void *p, size_t n)
@@ -104,7 +452,9 @@ static void *otrl_mem_realloc(void *p, size_t n)
     } else {
 	void *real_p = (void *)((char *)p - header_size);
 	void *new_p;
-	size_t old_n = ((size_t *)real_p)[0];
+	size_t old_n = ((size_t *)real_p)[0] & ~MEM_SECURE_BIT;
+	size_t secure_bit = ((size_t *)real_p)[0] & MEM_SECURE_BIT;
+	unsigned int old_class = pool_class(old_n), new_class;
 #ifdef OTRL_MEM_MAGIC
 	size_t magic = ((size_t *)real_p)[1];
 #endif
@@ -112,7 +462,7 @@ static void *otrl_mem_realloc(void *p, size_t n)
 	new_n += header_size;
 
 	/* Check for overflow attack */
-	if (new_n < n) return NULL;
+	if (new_n < n || (new_n & MEM_SECURE_BIT)) return NULL;
 
 #ifdef OTRL_MEM_MAGIC
 	if (magic != OTRL_MEM_MAGIC) {
@@ -121,23 +471,37 @@ static void *otrl_mem_realloc(void *p, size_t n)
 	}
 #endif
 
+	new_class = pool_class(new_n);
+	if (new_class != old_class || (secure_bit && new_n > old_n &&
+		    old_class == POOL_NUM_CLASSES)) {
+	    /* Moving into, out of, or between size classes of the pool,
+	     * or growing a big secure block, whose place we keep track
+	     * of: copy the block, and wipe and free the old one */
+	    void *new_block = mem_alloc(n, secure_bit != 0);
+	    if (new_block == NULL) return NULL;
+	    memmove(new_block, p,
+		    (new_n < old_n ? new_n : old_n) - header_size);
+	    otrl_mem_free(p);
+	    return new_block;
+	}
+
 	if (new_n < old_n) {
 	    /* Overwrite the space we're about to stop using */
-	    void *p = (void *)((char *)real_p + new_n);
-	    size_t excess = old_n - new_n;
-	    memset(p, 0xff, excess);
-	    memset(p, 0xaa, excess);
-	    memset(p, 0x55, excess);
-	    memset(p, 0x00, excess);
+	    otrl_mem_wipe((char *)real_p + new_n, old_n - new_n);
 
 	    /* We don't actually need to realloc() */
 	    new_p = real_p;
+	} else if (old_class < POOL_NUM_CLASSES) {
+	    /* It still fits in its chunk */
+	    new_p = real_p;
 	} else {
 	    new_p = realloc(real_p, new_n);
 	    if (new_p == NULL) return NULL;
 	}
 
-	((size_t *)new_p)[0] = new_n;  /* Includes header size */
+	otrl_mem_account(&gcrypt_usage, 0, (long)new_n - (long)old_n);
+	/* Includes header size */
+	((size_t *)new_p)[0] = new_n | secure_bit;
 	return (void *)((char *)new_p + header_size);
     }
 }
@@ -157,13 +521,43 @@ void otrl_mem_init(void)
 
     gcry_set_allocation_handler(
 	    otrl_mem_malloc,
-	    otrl_mem_malloc,
+	    otrl_mem_malloc_secure,
 	    otrl_mem_is_secure,
 	    otrl_mem_realloc,
 	    otrl_mem_free
 	);
 }
 
+/* Record that count objects taking up bytes bytes were allocated (or,
+ * if the numbers are negative, freed). */
+void otrl_mem_account(OtrlMemUsage *usage, long count, long bytes)
+{
+    if (count) MEM_ADD(&(usage->count), (size_t)count);
+    if (bytes) MEM_ADD(&(usage->bytes), (size_t)bytes);
+}
+
+/* Copy a usage counter maintained by otrl_mem_account into *out. */
+void otrl_mem_usage_read(const OtrlMemUsage *usage, OtrlMemUsage *out)
+{
+    out->count = MEM_LOAD(&(usage->count));
+    out->bytes = MEM_LOAD(&(usage->bytes));
+}
+
+/* Put the number and total size of the blocks libgcrypt currently has
+ * allocated into *usage. */
+void otrl_mem_gcrypt_usage(OtrlMemUsage *usage)
+{
+    otrl_mem_usage_read(&gcrypt_usage, usage);
+}
+
+/* Put the number and total size of the blocks libgcrypt has allocated
+ * since otrl_mem_init, whether or not it has freed them since, into
+ * *usage. */
+void otrl_mem_gcrypt_allocated(OtrlMemUsage *usage)
+{
+    otrl_mem_usage_read(&gcrypt_allocated, usage);
+}
+
 /* Compare two memory blocks in time dependent on the length of the
  * blocks, but not their contents.  Returns 1 if they differ, 0 if they
  * are the same. */
@@ -178,3 +572,86 @@ int otrl_mem_differ(const unsigned char *buf1, const unsigned char *buf2,
     }
     return (diff != 0);
 }
+
+/* Put the number and total size of the slabs of the allocation pool
+ * into *usage, and the number of them that could not be locked into
+ * memory into *unlocked (if non-NULL). */
+void otrl_mem_pool_usage(OtrlMemUsage *usage, size_t *unlocked)
+{
+    otrl_mem_usage_read(&pool.slabs, usage);
+    if (unlocked) {
+	POOL_LOCK();
+	*unlocked = pool.unlocked_slabs;
+	POOL_UNLOCK();
+    }
+}
+
+/* Add a secure region of (at least) size bytes to the heap that
+ * libgcrypt's small secure blocks come from. */
+gcry_error_t otrl_mem_secure_heap(size_t size)
+{
+#if SECURE_HEAP_ENABLED
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    char *map, *start;
+    int err;
+
+    if (size == 0) return gcry_error(GPG_ERR_INV_VALUE);
+
+    /* Whole slabs, plus a guard page on each side */
+    size = (size + POOL_SLAB_SIZE - 1) / POOL_SLAB_SIZE * POOL_SLAB_SIZE;
+    if (size == 0 || size > (size_t)-1 - 2 * page) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+    map = mmap(NULL, size + 2 * page, PROT_NONE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return gcry_error_from_errno(errno);
+    start = map + page;
+
+    if (mprotect(start, size, PROT_READ | PROT_WRITE) != 0 ||
+	    mlock(start, size) != 0) {
+	err = errno;
+	munmap(map, size + 2 * page);
+	return gcry_error_from_errno(err);
+    }
+#ifdef MADV_DONTDUMP
+    madvise(start, size, MADV_DONTDUMP);
+#endif
+
+    POOL_LOCK();
+    if (pool.num_secure == SECURE_MAX_REGIONS) {
+	POOL_UNLOCK();
+	munlock(start, size);
+	munmap(map, size + 2 * page);
+	return gcry_error(GPG_ERR_TOO_LARGE);
+    }
+    pool.secure[pool.num_secure].start = start;
+    pool.secure[pool.num_secure].end = start + size;
+    pool.secure[pool.num_secure].carved = start;
+    pool.num_secure++;
+    otrl_mem_account(&pool.secure_size, 1, (long)size);
+
+    /* Carve the next secure chunks out of the new region, rather than
+     * what's left of an ordinary slab */
+    if (pool.arenas[1].bump && !in_secure_heap(pool.arenas[1].bump)) {
+	pool.arenas[1].bump = pool.arenas[1].bump_end = NULL;
+    }
+    POOL_UNLOCK();
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+#else
+    return gcry_error(GPG_ERR_NOT_SUPPORTED);
+#endif
+}
+
+/* Put the number and total size of the regions of the secure heap into
+ * *usage, and the number of slabs that had to be found elsewhere
+ * because it was used up into *fallbacks (if non-NULL). */
+void otrl_mem_secure_heap_usage(OtrlMemUsage *usage, size_t *fallbacks)
+{
+    otrl_mem_usage_read(&pool.secure_size, usage);
+    if (fallbacks) {
+	POOL_LOCK();
+	*fallbacks = pool.secure_fallbacks;
+	POOL_UNLOCK();
+    }
+}
@@ -24,8 +24,74 @@
 
 #include <stdlib.h>
 
+#include <gcrypt.h>
+
+/* How many objects are in use, and how many bytes they take up */
+typedef struct s_OtrlMemUsage {
+    size_t count;
+    size_t bytes;
+} OtrlMemUsage;
+
 void otrl_mem_init(void);
 
+/* Record that count objects taking up bytes bytes were allocated (or,
+ * if the numbers are negative, freed).  This may be called from any
+ * thread. */
+void otrl_mem_account(OtrlMemUsage *usage, long count, long bytes);
+
+/* Copy a usage counter maintained by otrl_mem_account into *out. */
+void otrl_mem_usage_read(const OtrlMemUsage *usage, OtrlMemUsage *out);
+
+/* Overwrite n bytes at p with zeros, in a way the compiler can't
+ * optimize away, even though the memory is about to be freed. */
+void otrl_mem_wipe(void *p, size_t n);
+
+/* Put the number and total size of the blocks libgcrypt currently has
+ * allocated into *usage.  This covers every MPI, cipher and MAC handle
+ * in the process, not just those of one OtrlUserState. */
+void otrl_mem_gcrypt_usage(OtrlMemUsage *usage);
+
+/* Put the number and total size of the blocks libgcrypt has allocated
+ * since otrl_mem_init, whether or not it has freed them since, into
+ * *usage.  Unlike otrl_mem_gcrypt_usage, this only ever grows, so the
+ * difference between two readings is how much allocating was done in
+ * between; blocks that are grown in place don't count again. */
+void otrl_mem_gcrypt_allocated(OtrlMemUsage *usage);
+
+/* Put the number and total size of the slabs of the allocation pool
+ * that libgcrypt's small blocks come from into *usage, and the number
+ * of slabs for secure blocks that could not be locked into memory into
+ * *unlocked (if non-NULL).  The pool only ever grows, to the peak of
+ * what libgcrypt has needed at once. */
+void otrl_mem_pool_usage(OtrlMemUsage *usage, size_t *unlocked);
+
+/* Add a secure region of (at least) size bytes, rounded up to whole
+ * 64 KiB slabs, to the heap that libgcrypt's small secure blocks (the
+ * MPIs holding private exponents, the session keys and so on) come
+ * from.  Blocks libgcrypt doesn't ask to be secure never do.  The
+ * region is locked into memory, so it never gets swapped out; it is
+ * fenced by an inaccessible guard page on each side, and left out of
+ * core dumps where the system allows.
+ *
+ * This may be called more than once, to grow the heap.  Call it before
+ * OTRL_INIT if all secure blocks are to come from it: chunks freed
+ * before then are still reused.  Once the secure heap is used up, the
+ * pool falls back to slabs of ordinary memory that it tries to lock,
+ * which otrl_mem_secure_heap_usage counts.  Blocks too big for the
+ * pool never come from the secure heap.  Either way, libgcrypt is told
+ * that the blocks it asked to be secure are.
+ *
+ * Returns an error from mlock() (typically GPG_ERR_ENOMEM or
+ * GPG_ERR_EPERM when RLIMIT_MEMLOCK is too low) if the region cannot be
+ * locked, and GPG_ERR_NOT_SUPPORTED on systems without mmap() and
+ * mlock(). */
+gcry_error_t otrl_mem_secure_heap(size_t size);
+
+/* Put the number and total size of the regions of the secure heap into
+ * *usage, and the number of slabs that had to be found elsewhere
+ * because it was used up into *fallbacks (if non-NULL). */
+void otrl_mem_secure_heap_usage(OtrlMemUsage *usage, size_t *fallbacks);
+
 /* Compare two memory blocks in time dependent on the length of the
  * blocks, but not their contents.  Returns 1 if they differ, 0 if they
  * are the same. */
@@ -35,6 +35,9 @@
 #include "message.h"
 #include "sm.h"
 #include "instag.h"
+#include "event.h"
+#include "stats.h"
+#include "trace.h"
 
 #if OTRL_DEBUGGING
 #include <stdio.h>
@@ -138,6 +141,18 @@ static gcry_error_t fragment_and_send(const OtrlMessageAppOps *ops,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* If there's not already a timer running to call otrl_message_poll,
+ * try to start one. */
+static void start_poll_timer(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata)
+{
+    if (us->timer_running == 0 && ops && ops->timer_control) {
+	ops->timer_control(opdata,
+		otrl_message_poll_get_default_interval(us));
+	us->timer_running = 1;
+    }
+}
+
 static void populate_context_instag(OtrlUserState us, const OtrlMessageAppOps
 	*ops, void *opdata, const char *accountname, const char *protocol,
 	ConnContext *context) {
@@ -162,42 +177,8 @@ void otrl_message_free(char *message)
     free(message);
 }
 
-/* Handle a message about to be sent to the network.  It is safe to pass
- * all messages about to be sent to this routine.  add_appdata is a
- * function that will be called in the event that a new ConnContext is
- * created.  It will be passed the data that you supplied, as well as a
- * pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_sending.
- *
- * tlvs is a chain of OtrlTLVs to append to the private message.  It is
- * usually correct to just pass NULL here.
- *
- * If non-NULL, ops->convert_msg will be called just before encrypting a
- * message.
- *
- * "instag" specifies the instance tag of the buddy (protocol version 3 only).
- * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * sending the message.
- *
- * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
- * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
- * with the encrypted msg. If the routine returns non-zero, then the library
- * tried to encrypt the message, but for some reason failed. DO NOT send the
- * message in the clear in that case. If *messagep gets set by the call to
- * something non-NULL, then you should replace your message with the contents
- * of *messagep, and send that instead.
- *
- * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
- * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
- * these cases, the appropriate fragments will be automatically sent. For the
- * last two policies, the remaining fragment will be passed in *original_msg.
- *
- * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
- * done with it. */
-gcry_error_t otrl_message_sending(OtrlUserState us,
+/* The work of otrl_message_sending */
+static gcry_error_t message_sending(OtrlUserState us,
 	const OtrlMessageAppOps *ops,
 	void *opdata, const char *accountname, const char *protocol,
 	const char *recipient, otrl_instag_t their_instag,
@@ -235,9 +216,13 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
     context = otrl_context_find(us, recipient, accountname, protocol,
 	    their_instag, 1, &context_added, add_appdata, data);
 
-    /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
+    /* Update the context list if we added one, and make sure it will
+     * be reclaimed once idle, if the application asked for that. */
+    if (context_added) {
+	otrl_event_update_context_list(us, ops, opdata);
+	if (us->context_idle_timeout > 0) {
+	    start_poll_timer(us, ops, opdata);
+	}
     }
 
     /* Find or generate the instance tag if needed */
@@ -306,11 +291,9 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 		/* We're trying to send an unencrypted message with a policy
 		 * that disallows that.  Don't do that, but try to start
 		 * up OTR instead. */
-		if (ops->handle_msg_event) {
-		    ops->handle_msg_event(opdata,
-			    OTRL_MSGEVENT_ENCRYPTION_REQUIRED,
-			    context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-		}
+		otrl_event_msg(us, ops, opdata,
+			OTRL_MSGEVENT_ENCRYPTION_REQUIRED, context, NULL,
+			gcry_error(GPG_ERR_NO_ERROR));
 
 		context->context_priv->lastmessage =
 			gcry_malloc_secure(strlen(original_msg) + 1);
@@ -397,11 +380,8 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 	    } else {
 		/* Uh, oh.  Whatever we do, *don't* send the message in the
 		 * clear. */
-		if (ops->handle_msg_event) {
-		    ops->handle_msg_event(opdata,
-			    OTRL_MSGEVENT_ENCRYPTION_ERROR,
-			    context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-		}
+		otrl_event_msg(us, ops, opdata, OTRL_MSGEVENT_ENCRYPTION_ERROR,
+			context, NULL, gcry_error(GPG_ERR_NO_ERROR));
 		if (ops->otr_error_message) {
 		    err_msg = ops->otr_error_message(opdata, context,
 			OTRL_ERRCODE_ENCRYPTION_ERROR);
@@ -422,10 +402,8 @@ gcry_error_t otrl_message_sending(OtrlUserState us,
 	    }
 	    break;
 	case OTRL_MSGSTATE_FINISHED:
-	    if (ops->handle_msg_event) {
-		ops->handle_msg_event(opdata, OTRL_MSGEVENT_CONNECTION_ENDED,
+	    otrl_event_msg(us, ops, opdata, OTRL_MSGEVENT_CONNECTION_ENDED,
 		    context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-	    }
 	    *messagep = strdup("");
 	    if (!(*messagep)) {
 		err = gcry_error(GPG_ERR_ENOMEM);
@@ -457,6 +435,63 @@ fragment:
     }
 }
 
+/* Handle a message about to be sent to the network.  It is safe to pass
+ * all messages about to be sent to this routine.  add_appdata is a
+ * function that will be called in the event that a new ConnContext is
+ * created.  It will be passed the data that you supplied, as well as a
+ * pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_sending.
+ *
+ * tlvs is a chain of OtrlTLVs to append to the private message.  It is
+ * usually correct to just pass NULL here.
+ *
+ * If non-NULL, ops->convert_msg will be called just before encrypting a
+ * message.
+ *
+ * "instag" specifies the instance tag of the buddy (protocol version 3 only).
+ * Meta-instances may also be specified (e.g., OTRL_INSTAG_MOST_SECURE).
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * sending the message.
+ *
+ * If no fragmentation or msg injection is wanted, use OTRL_FRAGMENT_SEND_SKIP
+ * as the OtrlFragmentPolicy. In this case, this function will assign *messagep
+ * with the encrypted msg. If the routine returns non-zero, then the library
+ * tried to encrypt the message, but for some reason failed. DO NOT send the
+ * message in the clear in that case. If *messagep gets set by the call to
+ * something non-NULL, then you should replace your message with the contents
+ * of *messagep, and send that instead.
+ *
+ * Other fragmentation policies are OTRL_FRAGMENT_SEND_ALL,
+ * OTRL_FRAGMENT_SEND_ALL_BUT_LAST, or OTRL_FRAGMENT_SEND_ALL_BUT_FIRST. In
+ * these cases, the appropriate fragments will be automatically sent. For the
+ * last two policies, the remaining fragment will be passed in *original_msg.
+ *
+ * Call otrl_message_free(*messagep) if you don't need *messagep or when you're
+ * done with it. */
+gcry_error_t otrl_message_sending(OtrlUserState us,
+	const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *recipient, otrl_instag_t their_instag,
+	const char *original_msg, OtrlTLV *tlvs, char **messagep,
+	OtrlFragmentPolicy fragPolicy, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext *context = NULL;
+    gcry_error_t err;
+
+    OTRL_TRACE3(message_sending_entry, us, their_instag, original_msg);
+    err = message_sending(us, ops, opdata, accountname, protocol,
+	    recipient, their_instag, original_msg, tlvs, messagep,
+	    fragPolicy, &context, add_appdata, data);
+    OTRL_TRACE3(message_sending_return, context,
+	    context ? context->protocol_version : 0, err);
+    if (contextp) *contextp = context;
+    return err;
+}
+
 /* If err == 0, send the last auth message for the given context to the
  * appropriate user.  Otherwise, display an appripriate error dialog.
  * Return the value of err that was passed. */
@@ -488,17 +523,12 @@ static gcry_error_t send_or_error_auth(const OtrlMessageAppOps *ops,
 		context->auth.commit_sent_time = now;
 		/* If there's not already a timer running to clean up
 		 * this private key, try to start one. */
-		if (us->timer_running == 0 && ops && ops->timer_control) {
-		    ops->timer_control(opdata, POLL_DEFAULT_INTERVAL);
-		    us->timer_running = 1;
-		}
+		start_poll_timer(us, ops, opdata);
 	    }
 	}
     } else {
-	if (ops->handle_msg_event) {
-	    ops->handle_msg_event(opdata, OTRL_MSGEVENT_SETUP_ERROR,
-		    context, NULL, err);
-	}
+	otrl_event_msg(us, ops, opdata, OTRL_MSGEVENT_SETUP_ERROR, context,
+		NULL, err);
     }
     return err;
 }
@@ -521,15 +551,14 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
     int fprint_added = 0;
     OtrlMessageState oldstate = edata->context->msgstate;
     Fingerprint *oldprint = edata->context->active_fingerprint;
+    ConnContextKeys *keys;
 
     /* See if we're talking to ourselves */
     if (!gcry_mpi_cmp(auth->their_pub, auth->our_dh.pub)) {
 	/* Yes, we are. */
-	if (edata->ops->handle_msg_event) {
-	    edata->ops->handle_msg_event(edata->opdata,
-		    OTRL_MSGEVENT_MSG_REFLECTED, edata->context,
-		    NULL, gcry_error(GPG_ERR_NO_ERROR));
-	}
+	otrl_event_msg(edata->us, edata->ops, edata->opdata,
+		OTRL_MSGEVENT_MSG_REFLECTED, edata->context, NULL,
+		gcry_error(GPG_ERR_NO_ERROR));
 	edata->ignore_message = 1;
 	return gcry_error(GPG_ERR_NO_ERROR);
     }
@@ -539,41 +568,35 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
 
     if (fprint_added) {
 	/* Inform the user of the new fingerprint */
-	if (edata->ops->new_fingerprint) {
-	    edata->ops->new_fingerprint(edata->opdata, edata->us,
-		    edata->context->accountname, edata->context->protocol,
-		    edata->context->username,
-		    edata->context->auth.their_fingerprint);
-	}
+	otrl_event_new_fingerprint(edata->us, edata->ops, edata->opdata,
+		edata->context->accountname, edata->context->protocol,
+		edata->context->username,
+		edata->context->auth.their_fingerprint);
 	/* Arrange that the new fingerprint be written to disk */
-	if (edata->ops->write_fingerprints) {
-	    edata->ops->write_fingerprints(edata->opdata);
-	}
+	otrl_event_write_fingerprints(edata->us, edata->ops, edata->opdata);
     }
 
     /* Is this a new session or just a refresh of an existing one? */
+    if (edata->context->msgstate == OTRL_MSGSTATE_ENCRYPTED) {
+	otrl_context_priv_wake(edata->context->context_priv);
+    }
+    keys = edata->context->context_priv->keys;
     if (edata->context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
-	    oldprint == found_print &&
-	    edata->context->context_priv->our_keyid - 1 ==
-	    edata->context->auth.our_keyid &&
-	    !gcry_mpi_cmp(edata->context->context_priv->our_old_dh_key.pub,
+	    keys != NULL && oldprint == found_print &&
+	    keys->our_keyid - 1 == edata->context->auth.our_keyid &&
+	    !gcry_mpi_cmp(keys->our_old_dh_key.pub,
 		edata->context->auth.our_dh.pub) &&
-	    ((edata->context->context_priv->their_keyid > 0 &&
-	      edata->context->context_priv->their_keyid ==
-		    edata->context->auth.their_keyid &&
-	      !gcry_mpi_cmp(edata->context->context_priv->their_y,
-		  edata->context->auth.their_pub)) ||
-	    (edata->context->context_priv->their_keyid > 1 &&
-	     edata->context->context_priv->their_keyid - 1 ==
-		    edata->context->auth.their_keyid &&
-	     edata->context->context_priv->their_old_y != NULL &&
-	     !gcry_mpi_cmp(edata->context->context_priv->their_old_y,
+	    ((keys->their_keyid > 0 &&
+	      keys->their_keyid == edata->context->auth.their_keyid &&
+	      !gcry_mpi_cmp(keys->their_y, edata->context->auth.their_pub)) ||
+	    (keys->their_keyid > 1 &&
+	     keys->their_keyid - 1 == edata->context->auth.their_keyid &&
+	     keys->their_old_y != NULL &&
+	     !gcry_mpi_cmp(keys->their_old_y,
 		 edata->context->auth.their_pub)))) {
 	/* This is just a refresh of the existing session. */
-	if (edata->ops->still_secure) {
-	    edata->ops->still_secure(edata->opdata, edata->context,
-		    edata->context->auth.initiated);
-	}
+	otrl_event_still_secure(edata->us, edata->ops, edata->opdata,
+		edata->context, edata->context->auth.initiated);
 	edata->ignore_message = 1;
 	return gcry_error(GPG_ERR_NO_ERROR);
     }
@@ -588,57 +611,49 @@ static gcry_error_t go_encrypted(const OtrlAuthInfo *auth, void *asdata)
     edata->context->protocol_version =
 	    edata->context->auth.protocol_version;
 
-    edata->context->context_priv->their_keyid =
-	    edata->context->auth.their_keyid;
-    gcry_mpi_release(edata->context->context_priv->their_y);
-    gcry_mpi_release(edata->context->context_priv->their_old_y);
-    edata->context->context_priv->their_y =
-	    gcry_mpi_copy(edata->context->auth.their_pub);
-    edata->context->context_priv->their_old_y = NULL;
-
-    if (edata->context->context_priv->our_keyid - 1 !=
-	edata->context->auth.our_keyid ||
-	gcry_mpi_cmp(edata->context->context_priv->our_old_dh_key.pub,
+    /* This is the first time we need room for the conversation keys */
+    otrl_context_priv_alloc_keys(edata->context->context_priv);
+    keys = edata->context->context_priv->keys;
+
+    keys->their_keyid = edata->context->auth.their_keyid;
+    gcry_mpi_release(keys->their_y);
+    gcry_mpi_release(keys->their_old_y);
+    keys->their_y = gcry_mpi_copy(edata->context->auth.their_pub);
+    keys->their_old_y = NULL;
+
+    if (keys->our_keyid - 1 != edata->context->auth.our_keyid ||
+	gcry_mpi_cmp(keys->our_old_dh_key.pub,
 		edata->context->auth.our_dh.pub)) {
-	otrl_dh_keypair_free(&(edata->context->context_priv->our_dh_key));
-	otrl_dh_keypair_free(&(edata->context->context_priv->our_old_dh_key));
-	otrl_dh_keypair_copy(&(edata->context->context_priv->our_old_dh_key),
+	otrl_dh_keypair_free(&(keys->our_dh_key));
+	otrl_dh_keypair_free(&(keys->our_old_dh_key));
+	otrl_dh_keypair_copy(&(keys->our_old_dh_key),
 		&(edata->context->auth.our_dh));
-	otrl_dh_gen_keypair(
-		edata->context->context_priv->our_old_dh_key.groupid,
-		&(edata->context->context_priv->our_dh_key));
-	edata->context->context_priv->our_keyid = edata->context->auth.our_keyid
-		+ 1;
+	otrl_dh_gen_keypair(keys->our_old_dh_key.groupid,
+		&(keys->our_dh_key));
+	keys->our_keyid = edata->context->auth.our_keyid + 1;
     }
 
     /* Create the session keys from the DH keys */
-    otrl_dh_session_free(&(edata->context->context_priv->sesskeys[0][0]));
-    err = otrl_dh_session(&(edata->context->context_priv->sesskeys[0][0]),
-	    &(edata->context->context_priv->our_dh_key),
-	    edata->context->context_priv->their_y);
+    otrl_dh_session_free(&(keys->sesskeys[0][0]));
+    err = otrl_dh_session(&(keys->sesskeys[0][0]),
+	    &(keys->our_dh_key), keys->their_y);
     if (err) return err;
-    otrl_dh_session_free(&(edata->context->context_priv->sesskeys[1][0]));
-    err = otrl_dh_session(&(edata->context->context_priv->sesskeys[1][0]),
-	    &(edata->context->context_priv->our_old_dh_key),
-	    edata->context->context_priv->their_y);
+    otrl_dh_session_free(&(keys->sesskeys[1][0]));
+    err = otrl_dh_session(&(keys->sesskeys[1][0]),
+	    &(keys->our_old_dh_key), keys->their_y);
     if (err) return err;
 
     edata->context->context_priv->generation++;
     edata->context->active_fingerprint = found_print;
     edata->context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
 
-    if (edata->ops->update_context_list) {
-	edata->ops->update_context_list(edata->opdata);
-    }
+    otrl_event_update_context_list(edata->us, edata->ops, edata->opdata);
     if (oldstate == OTRL_MSGSTATE_ENCRYPTED && oldprint == found_print) {
-	if (edata->ops->still_secure) {
-	    edata->ops->still_secure(edata->opdata, edata->context,
-		    edata->context->auth.initiated);
-	}
+	otrl_event_still_secure(edata->us, edata->ops, edata->opdata,
+		edata->context, edata->context->auth.initiated);
     } else {
-	if (edata->ops->gone_secure) {
-	    edata->ops->gone_secure(edata->opdata, edata->context);
-	}
+	otrl_event_gone_secure(edata->us, edata->ops, edata->opdata,
+		edata->context);
     }
 
     edata->gone_encrypted = 1;
@@ -650,6 +665,7 @@ static void maybe_resend(EncrData *edata)
 {
     gcry_error_t err;
     time_t now;
+    unsigned long long stats_start;
 
     if (!edata->gone_encrypted) return;
 
@@ -692,6 +708,7 @@ static void maybe_resend(EncrData *edata)
 	}
 
 	/* Re-encrypt the message with the new keys */
+	stats_start = otrl_stats_start(edata->us);
 	err = otrl_proto_create_data(&resendmsg,
 		edata->context, msg_to_send, NULL, 0, NULL);
 	if (resending) {
@@ -699,36 +716,33 @@ static void maybe_resend(EncrData *edata)
 	}
 	if (!err) {
 	    /* Resend the message */
-	    fragment_and_send(edata->ops, edata->opdata, edata->context,
-		    resendmsg, OTRL_FRAGMENT_SEND_ALL, NULL);
+	    err = fragment_and_send(edata->ops, edata->opdata,
+		    edata->context, resendmsg, OTRL_FRAGMENT_SEND_ALL, NULL);
 	    free(resendmsg);
 	    edata->context->context_priv->lastsent = now;
 	    otrl_context_update_recent_child(edata->context, 1);
 	    if (resending) {
 		/* We're not sending it for the first time; let the user
 		 * know we resent it */
-		if (edata->ops->handle_msg_event) {
-		    edata->ops->handle_msg_event(edata->opdata,
-			    OTRL_MSGEVENT_MSG_RESENT, edata->context,
-			    NULL, gcry_error(GPG_ERR_NO_ERROR));
-		}
+		otrl_event_msg(edata->us, edata->ops, edata->opdata,
+			OTRL_MSGEVENT_MSG_RESENT, edata->context, NULL,
+			gcry_error(GPG_ERR_NO_ERROR));
 	    }
 	    edata->ignore_message = 1;
 	}
+	otrl_stats_end(edata->us, OTRL_STATS_RESEND, stats_start, err);
     }
 }
 
 /* Set the trust level based on the result of the SMP */
-static void set_smp_trust(const OtrlMessageAppOps *ops, void *opdata,
-	ConnContext *context, int trusted)
+static void set_smp_trust(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, ConnContext *context, int trusted)
 {
     otrl_context_set_trust(context->active_fingerprint, trusted ? "smp" : "");
 
     /* Write the new info to disk, redraw the ui, and redraw the
      * OTR buttons. */
-    if (ops->write_fingerprints) {
-	ops->write_fingerprints(opdata);
-    }
+    otrl_event_write_fingerprints(us, ops, opdata);
 }
 
 static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
@@ -744,6 +758,7 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
     size_t combined_buf_len;
     OtrlTLV *sendtlv;
     char *sendsmp = NULL;
+    unsigned long long stats_start;
 
     if (!context || context->msgstate != OTRL_MSGSTATE_ENCRYPTED) return;
 
@@ -775,12 +790,19 @@ static void init_respond_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    combined_buf_len);
     free(combined_buf);
 
+    stats_start = otrl_stats_start(us);
     if (initiating) {
-	otrl_sm_step1(context->smstate, combined_secret, SM_DIGEST_SIZE,
-		&smpmsg, &smpmsglen);
+	OTRL_TRACE2(sm_step1_entry, context, SM_DIGEST_SIZE);
+	err = otrl_sm_step1(context->smstate, combined_secret,
+		SM_DIGEST_SIZE, &smpmsg, &smpmsglen);
+	otrl_stats_end(us, OTRL_STATS_SMP_STEP1, stats_start, err);
+	OTRL_TRACE2(sm_step1_return, context, err);
     } else {
-	otrl_sm_step2b(context->smstate, combined_secret, SM_DIGEST_SIZE,
-		&smpmsg, &smpmsglen);
+	OTRL_TRACE2(sm_step2b_entry, context, SM_DIGEST_SIZE);
+	err = otrl_sm_step2b(context->smstate, combined_secret,
+		SM_DIGEST_SIZE, &smpmsg, &smpmsglen);
+	otrl_stats_end(us, OTRL_STATS_SMP_STEP2B, stats_start, err);
+	OTRL_TRACE2(sm_step2b_return, context, err);
     }
 
     /* If we've got a question, attach it to the smpmsg */
@@ -867,12 +889,10 @@ void otrl_message_abort_smp(OtrlUserState us, const OtrlMessageAppOps *ops,
     otrl_tlv_free(sendtlv);
 }
 
-static void message_malformed(const OtrlMessageAppOps *ops,
+static void message_malformed(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, ConnContext *context) {
-    if (ops->handle_msg_event) {
-	ops->handle_msg_event(opdata, OTRL_MSGEVENT_RCVDMSG_MALFORMED, context,
+    otrl_event_msg(us, ops, opdata, OTRL_MSGEVENT_RCVDMSG_MALFORMED, context,
 	    NULL, gcry_error(GPG_ERR_NO_ERROR));
-    }
 
     if (ops->inject_message && ops->otr_error_message) {
 	const char *err_msg = ops->otr_error_message(opdata, context,
@@ -897,37 +917,8 @@ static void message_malformed(const OtrlMessageAppOps *ops,
 }
 
 
-/* Handle a message just received from the network.  It is safe to pass
- * all received messages to this routine.  add_appdata is a function
- * that will be called in the event that a new ConnContext is created.
- * It will be passed the data that you supplied, as well as
- * a pointer to the new ConnContext.  You can use this to add
- * application-specific information to the ConnContext using the
- * "context->app" field, for example.  If you don't need to do this, you
- * can pass NULL for the last two arguments of otrl_message_receiving.
- *
- * If non-NULL, ops->convert_msg will be called after a data message is
- * decrypted.
- *
- * If "contextp" is not NULL, it will be set to the ConnContext used for
- * receiving the message.
- *
- * If otrl_message_receiving returns 1, then the message you received
- * was an internal protocol message, and no message should be delivered
- * to the user.
- *
- * If it returns 0, then check if *messagep was set to non-NULL.  If
- * so, replace the received message with the contents of *messagep, and
- * deliver that to the user instead.  You must call
- * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
- * non-NULL, *tlvsp will be set to a chain of any TLVs that were
- * transmitted along with this message.  You must call
- * otrl_tlv_free(*tlvsp) when you're done with those.
- *
- * If otrl_message_receiving returns 0 and *messagep is NULL, then this
- * was an ordinary, non-OTR message, which should just be delivered to
- * the user without modification. */
-int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
+/* The work of otrl_message_receiving */
+static int message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	void *opdata, const char *accountname, const char *protocol,
 	const char *sender, const char *message, char **newmessagep,
 	OtrlTLV **tlvsp, ConnContext **contextp,
@@ -943,9 +934,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
     otrl_instag_t our_instance = 0, their_instance = 0;
     int version;
     gcry_error_t err;
-
-    if (!accountname || !protocol || !sender || !message || !newmessagep)
-	return 0;
+    unsigned long long stats_start;
 
     *newmessagep = NULL;
     if (tlvsp) *tlvsp = NULL;
@@ -959,9 +948,13 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    protocol, OTRL_INSTAG_MASTER, 1, &context_added, add_appdata, data);
     context = m_context;
 
-    /* Update the context list if we added one */
-    if (context_added && ops->update_context_list) {
-	ops->update_context_list(opdata);
+    /* Update the context list if we added one, and make sure it will
+     * be reclaimed once idle, if the application asked for that. */
+    if (context_added) {
+	otrl_event_update_context_list(us, ops, opdata);
+	if (us->context_idle_timeout > 0) {
+	    start_poll_timer(us, ops, opdata);
+	}
     }
 
     best_context = otrl_context_find(us, sender, accountname,
@@ -996,11 +989,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    /* Ignore message if it is intended for a different instance */
 	    if (our_instance && context->our_instance != our_instance) {
 
-		    if (ops->handle_msg_event) {
-			ops->handle_msg_event(opdata,
-				OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
-				m_context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-		    }
+		    otrl_event_msg(us, ops, opdata,
+			    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
+			    m_context, NULL, gcry_error(GPG_ERR_NO_ERROR));
 		    return 1;
 	    }
 	    /* Get the context for this instance */
@@ -1009,7 +1000,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			protocol, their_instance, 1, &context_added,
 			add_appdata, data);
 	    } else {
-		message_malformed(ops, opdata, context);
+		message_malformed(us, ops, opdata, context);
 		return 1;
 	    }
 	}
@@ -1062,11 +1053,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    context->our_instance != our_instance) ||
 		    (msgtype != OTRL_MSGTYPE_DH_COMMIT &&
 		    context->our_instance != our_instance)) {
-		if (ops->handle_msg_event) {
-		    ops->handle_msg_event(opdata,
-			    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
-			    m_context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-		}
+		otrl_event_msg(us, ops, opdata,
+			OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE, m_context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
 		/* ignore message intended for a different instance */
 		edata.ignore_message = 1;
 		goto end;
@@ -1080,7 +1069,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	}
 
 	if (err || their_instance < OTRL_MIN_VALID_INSTAG) {
-	    message_malformed(ops, opdata, context);
+	    message_malformed(us, ops, opdata, context);
 	    edata.ignore_message = 1;
 	    goto end;
 	}
@@ -1109,9 +1098,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    }
 
 	    /* Update the context list */
-	    if (ops->update_context_list) {
-		ops->update_context_list(opdata);
-	    }
+	    otrl_event_update_context_list(us, ops, opdata);
 	} else if (m_context != context) {
 	    /* Switching from m_context to existing instance context */
 	    if (msgtype == OTRL_MSGTYPE_DH_KEY && m_context->auth.authstate
@@ -1153,9 +1140,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	case OTRL_MSGTYPE_QUERY:
 	    /* See if we should use an existing DH keypair, or generate
 	     * a fresh one. */
-	    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED) {
-		our_dh = &(context->context_priv->our_old_dh_key);
-		our_keyid = context->context_priv->our_keyid - 1;
+	    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+		    !otrl_context_priv_wake(context->context_priv)) {
+		our_dh = &(context->context_priv->keys->our_old_dh_key);
+		our_keyid = context->context_priv->keys->our_keyid - 1;
 	    } else {
 		our_dh = NULL;
 		our_keyid = 0;
@@ -1199,7 +1187,9 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    break;
 
 	case OTRL_MSGTYPE_DH_COMMIT:
+	    stats_start = otrl_stats_start(us);
 	    err = otrl_auth_handle_commit(&(context->auth), otrtag, version);
+	    otrl_stats_end(us, OTRL_STATS_AKE_COMMIT, stats_start, err);
 	    send_or_error_auth(ops, opdata, err, context, us);
 
 	    if (edata.ignore_message == -1) edata.ignore_message = 1;
@@ -1219,8 +1209,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		}
 	    }
 	    if (privkey) {
+		stats_start = otrl_stats_start(us);
 		err = otrl_auth_handle_key(&(context->auth), otrtag,
 			&haveauthmsg, privkey);
+		otrl_stats_end(us, OTRL_STATS_AKE_KEY, stats_start, err);
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		}
@@ -1243,9 +1235,11 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		}
 	    }
 	    if (privkey) {
+		stats_start = otrl_stats_start(us);
 		err = otrl_auth_handle_revealsig(&(context->auth),
 			otrtag, &haveauthmsg, privkey, go_encrypted,
 			&edata);
+		otrl_stats_end(us, OTRL_STATS_AKE_REVEALSIG, stats_start, err);
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    maybe_resend(&edata);
@@ -1256,8 +1250,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	    break;
 
 	case OTRL_MSGTYPE_SIGNATURE:
+	    stats_start = otrl_stats_start(us);
 	    err = otrl_auth_handle_signature(&(context->auth),
 		    otrtag, &haveauthmsg, go_encrypted, &edata);
+	    otrl_stats_end(us, OTRL_STATS_AKE_SIGNATURE, stats_start, err);
 	    if (err || haveauthmsg) {
 		send_or_error_auth(ops, opdata, err, context, us);
 		maybe_resend(&edata);
@@ -1269,9 +1265,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	case OTRL_MSGTYPE_V1_KEYEXCH:
 	    /* See if we should use an existing DH keypair, or generate
 	     * a fresh one. */
-	    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED) {
-		our_dh = &(context->context_priv->our_old_dh_key);
-		our_keyid = context->context_priv->our_keyid - 1;
+	    if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+		    !otrl_context_priv_wake(context->context_priv)) {
+		our_dh = &(context->context_priv->keys->our_old_dh_key);
+		our_keyid = context->context_priv->keys->our_keyid - 1;
 	    } else {
 		our_dh = NULL;
 		our_keyid = 0;
@@ -1290,9 +1287,12 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		}
 	    }
 	    if (privkey) {
+		stats_start = otrl_stats_start(us);
 		err = otrl_auth_handle_v1_key_exchange(&(context->auth),
 			message, &haveauthmsg, privkey, our_dh, our_keyid,
 			go_encrypted, &edata);
+		otrl_stats_end(us, OTRL_STATS_AKE_V1_KEYEXCH, stats_start,
+			err);
 		if (err || haveauthmsg) {
 		    send_or_error_auth(ops, opdata, err, context, us);
 		    maybe_resend(&edata);
@@ -1326,17 +1326,13 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		    if(best_context && best_context != context &&
 			best_context->msgstate == OTRL_MSGSTATE_ENCRYPTED) {
 
-			if (ops->handle_msg_event) {
-			    ops->handle_msg_event(opdata,
-				    OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
-				    m_context, NULL,
-				    gcry_error(GPG_ERR_NO_ERROR));
-			}
-		    } else if (ops->handle_msg_event) {
-			ops->handle_msg_event(opdata,
-				    OTRL_MSGEVENT_RCVDMSG_NOT_IN_PRIVATE,
-				    context, NULL,
-				    gcry_error(GPG_ERR_NO_ERROR));
+			otrl_event_msg(us, ops, opdata,
+				OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE,
+				m_context, NULL, gcry_error(GPG_ERR_NO_ERROR));
+		    } else {
+			otrl_event_msg(us, ops, opdata,
+				OTRL_MSGEVENT_RCVDMSG_NOT_IN_PRIVATE,
+				context, NULL, gcry_error(GPG_ERR_NO_ERROR));
 		    }
 		    edata.ignore_message = 1;
 
@@ -1357,19 +1353,13 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    break;
 			}
 			if (is_conflict) {
-			    if (ops->handle_msg_event) {
-				ops->handle_msg_event(opdata,
-					OTRL_MSGEVENT_RCVDMSG_UNREADABLE,
-					context, NULL,
-					gcry_error(GPG_ERR_NO_ERROR));
-			    }
+			    otrl_event_msg(us, ops, opdata,
+				    OTRL_MSGEVENT_RCVDMSG_UNREADABLE, context,
+				    NULL, gcry_error(GPG_ERR_NO_ERROR));
 			} else {
-			    if (ops->handle_msg_event) {
-				ops->handle_msg_event(opdata,
-					OTRL_MSGEVENT_RCVDMSG_MALFORMED,
-					context, NULL,
-					gcry_error(GPG_ERR_NO_ERROR));
-			    }
+			    otrl_event_msg(us, ops, opdata,
+				    OTRL_MSGEVENT_RCVDMSG_MALFORMED, context,
+				    NULL, gcry_error(GPG_ERR_NO_ERROR));
 			}
 			if (ops->inject_message && ops->otr_error_message) {
 			    err_msg = ops->otr_error_message(opdata,
@@ -1434,33 +1424,31 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    char *qend = memchr(question, '\0', tlv->len - 1);
 			    size_t qlen = qend ? (qend - question + 1) :
 				    tlv->len;
-			    otrl_sm_step2a(context->smstate, tlv->data + qlen,
-				    tlv->len - qlen, 1);
+			    stats_start = otrl_stats_start(us);
+			    OTRL_TRACE2(sm_step2a_entry, context, tlv->len - qlen);
+			    err = otrl_sm_step2a(context->smstate,
+				    tlv->data + qlen, tlv->len - qlen, 1);
+			    otrl_stats_end(us, OTRL_STATS_SMP_STEP2A,
+				    stats_start, err);
+			    OTRL_TRACE2(sm_step2a_return, context, err);
 
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_ASK_FOR_ANSWER,
-					    context, 25, question);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_ASK_FOR_ANSWER, context,
+					25, question);
 			    } else {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_CHEATED, context,
-					    0, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_CHEATED, context, 0,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 				context->smstate->sm_prog_state =
 					OTRL_SMP_PROG_OK;
 			    }
 			} else {
-			    if (ops->handle_smp_event) {
-				ops->handle_smp_event(opdata,
-					OTRL_SMPEVENT_ERROR, context,
-					0, NULL);
-			    }
+			    otrl_event_smp(us, ops, opdata,
+				    OTRL_SMPEVENT_ERROR, context, 0, NULL);
 			}
 		    }
 
@@ -1470,32 +1458,30 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    /* We can only do the verification half now.
 			     * We must wait for the secret to be entered
 			     * to continue. */
-			    otrl_sm_step2a(context->smstate, tlv->data,
-				    tlv->len, 0);
+			    stats_start = otrl_stats_start(us);
+			    OTRL_TRACE2(sm_step2a_entry, context, tlv->len);
+			    err = otrl_sm_step2a(context->smstate,
+				    tlv->data, tlv->len, 0);
+			    otrl_stats_end(us, OTRL_STATS_SMP_STEP2A,
+				    stats_start, err);
+			    OTRL_TRACE2(sm_step2a_return, context, err);
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_ASK_FOR_SECRET,
-					    context, 25, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_ASK_FOR_SECRET, context,
+					25, NULL);
 			    } else {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_CHEATED,
-					    context, 0, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_CHEATED, context, 0,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 				context->smstate->sm_prog_state =
 					OTRL_SMP_PROG_OK;
 			    }
 			} else {
-			    if (ops->handle_smp_event) {
-				ops->handle_smp_event(opdata,
-					OTRL_SMPEVENT_ERROR, context,
-					0, NULL);
-			    }
+			    otrl_event_smp(us, ops, opdata,
+				    OTRL_SMPEVENT_ERROR, context, 0, NULL);
 			}
 		    }
 
@@ -1506,8 +1492,13 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    int nextmsglen;
 			    OtrlTLV *sendtlv;
 			    char *sendsmp = NULL;
-			    otrl_sm_step3(context->smstate, tlv->data,
+			    stats_start = otrl_stats_start(us);
+			    OTRL_TRACE2(sm_step3_entry, context, tlv->len);
+			    err = otrl_sm_step3(context->smstate, tlv->data,
 				    tlv->len, &nextmsg, &nextmsglen);
+			    otrl_stats_end(us, OTRL_STATS_SMP_STEP3,
+				    stats_start, err);
+			    OTRL_TRACE2(sm_step3_return, context, err);
 
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
@@ -1526,19 +1517,15 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 				free(sendsmp);
 				otrl_tlv_free(sendtlv);
 
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_IN_PROGRESS,
-					    context, 60, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_IN_PROGRESS, context, 60,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT4;
 			    } else {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_CHEATED,
-					    context, 0, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_CHEATED, context, 0,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 				context->smstate->sm_prog_state =
@@ -1546,11 +1533,8 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    }
 			    free(nextmsg);
 			} else {
-			    if (ops->handle_smp_event) {
-				ops->handle_smp_event(opdata,
-					OTRL_SMPEVENT_ERROR, context,
-					0, NULL);
-			    }
+			    otrl_event_smp(us, ops, opdata,
+				    OTRL_SMPEVENT_ERROR, context, 0, NULL);
 			}
 		    }
 
@@ -1561,11 +1545,16 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    int nextmsglen;
 			    OtrlTLV *sendtlv;
 			    char *sendsmp = NULL;
+			    stats_start = otrl_stats_start(us);
+			    OTRL_TRACE2(sm_step4_entry, context, tlv->len);
 			    err = otrl_sm_step4(context->smstate, tlv->data,
 				    tlv->len, &nextmsg, &nextmsglen);
+			    otrl_stats_end(us, OTRL_STATS_SMP_STEP4,
+				    stats_start, err);
+			    OTRL_TRACE2(sm_step4_return, context, err);
 			    /* Set trust level based on result */
 			    if (context->smstate->received_question == 0) {
-				set_smp_trust(ops, opdata, context,
+				set_smp_trust(us, ops, opdata, context,
 					(err == gcry_error(GPG_ERR_NO_ERROR)));
 			    }
 
@@ -1586,23 +1575,18 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 				free(sendsmp);
 				otrl_tlv_free(sendtlv);
 
-				if (ops->handle_smp_event) {
-				    OtrlSMPEvent succorfail =
+				otrl_event_smp(us, ops, opdata,
 					context->smstate->sm_prog_state ==
 						OTRL_SMP_PROG_SUCCEEDED ?
 					    OTRL_SMPEVENT_SUCCESS :
-					    OTRL_SMPEVENT_FAILURE;
-				    ops->handle_smp_event(opdata, succorfail,
-					    context, 100, NULL);
-				}
+					    OTRL_SMPEVENT_FAILURE,
+					context, 100, NULL);
 				context->smstate->nextExpected =
 				    OTRL_SMP_EXPECT1;
 			    } else {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_CHEATED,
-					    context, 0, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_CHEATED, context, 0,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 				context->smstate->sm_prog_state =
@@ -1610,77 +1594,67 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			    }
 			    free(nextmsg);
 			} else {
-			    if (ops->handle_smp_event) {
-				ops->handle_smp_event(opdata,
-					OTRL_SMPEVENT_ERROR, context,
-					0, NULL);
-			    }
+			    otrl_event_smp(us, ops, opdata,
+				    OTRL_SMPEVENT_ERROR, context, 0, NULL);
 			}
 		    }
 
 		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP4);
 		    if (tlv) {
 			if (nextMsg == OTRL_SMP_EXPECT4) {
+			    stats_start = otrl_stats_start(us);
+			    OTRL_TRACE2(sm_step5_entry, context, tlv->len);
 			    err = otrl_sm_step5(context->smstate, tlv->data,
 				    tlv->len);
+			    otrl_stats_end(us, OTRL_STATS_SMP_STEP5,
+				    stats_start, err);
+			    OTRL_TRACE2(sm_step5_return, context, err);
 			    /* Set trust level based on result */
-			    set_smp_trust(ops, opdata, context,
+			    set_smp_trust(us, ops, opdata, context,
 				    (err == gcry_error(GPG_ERR_NO_ERROR)));
 
 			    if (context->smstate->sm_prog_state !=
 				    OTRL_SMP_PROG_CHEATED) {
-				if (ops->handle_smp_event) {
-				    OtrlSMPEvent succorfail =
+				otrl_event_smp(us, ops, opdata,
 					context->smstate->sm_prog_state ==
 						OTRL_SMP_PROG_SUCCEEDED ?
 					    OTRL_SMPEVENT_SUCCESS :
-					    OTRL_SMPEVENT_FAILURE;
-				    ops->handle_smp_event(opdata, succorfail,
-					    context, 100, NULL);
-				}
+					    OTRL_SMPEVENT_FAILURE,
+					context, 100, NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 			    } else {
-				if (ops->handle_smp_event) {
-				    ops->handle_smp_event(opdata,
-					    OTRL_SMPEVENT_CHEATED,
-					    context, 0, NULL);
-				}
+				otrl_event_smp(us, ops, opdata,
+					OTRL_SMPEVENT_CHEATED, context, 0,
+					NULL);
 				context->smstate->nextExpected =
 					OTRL_SMP_EXPECT1;
 				context->smstate->sm_prog_state =
 					OTRL_SMP_PROG_OK;
 			    }
 			} else {
-			    if (ops->handle_smp_event) {
-				ops->handle_smp_event(opdata,
-					OTRL_SMPEVENT_ERROR, context,
-					0, NULL);
-			    }
+			    otrl_event_smp(us, ops, opdata,
+				    OTRL_SMPEVENT_ERROR, context, 0, NULL);
 			}
 		    }
 
 		    tlv = otrl_tlv_find(tlvs, OTRL_TLV_SMP_ABORT);
 		    if (tlv) {
 			context->smstate->nextExpected = OTRL_SMP_EXPECT1;
-			if (ops->handle_smp_event) {
-			    ops->handle_smp_event(opdata, OTRL_SMPEVENT_ABORT,
-				    context, 0, NULL);
-			}
+			otrl_event_smp(us, ops, opdata, OTRL_SMPEVENT_ABORT,
+				context, 0, NULL);
 		    }
 
 		    if (plaintext[0] == '\0') {
 			/* If it's a heartbeat (an empty message), don't
 			 * display it to the user, but signal an event. */
-			if (ops->handle_msg_event) {
-			    ops->handle_msg_event(opdata,
-				    OTRL_MSGEVENT_LOG_HEARTBEAT_RCVD,
-				    context, NULL,
-				    gcry_error(GPG_ERR_NO_ERROR));
-			}
+			otrl_event_msg(us, ops, opdata,
+				OTRL_MSGEVENT_LOG_HEARTBEAT_RCVD, context,
+				NULL, gcry_error(GPG_ERR_NO_ERROR));
 			edata.ignore_message = 1;
 		    } else if (edata.ignore_message != 1 &&
-			    context->context_priv->their_keyid > 0) {
+			    context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
+			    context->context_priv->keys->their_keyid > 0) {
 			/* If it's *not* a heartbeat, and we haven't
 			 * sent anything in a while, also send a
 			 * heartbeat. */
@@ -1706,12 +1680,10 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 				otrl_context_update_recent_child(context, 1);
 
 				/* Signal an event for the heartbeat message */
-				if (ops->handle_msg_event) {
-				    ops->handle_msg_event(opdata,
-					    OTRL_MSGEVENT_LOG_HEARTBEAT_SENT,
-					    context, NULL,
-					    gcry_error(GPG_ERR_NO_ERROR));
-				}
+				otrl_event_msg(us, ops, opdata,
+					OTRL_MSGEVENT_LOG_HEARTBEAT_SENT,
+					context, NULL,
+					gcry_error(GPG_ERR_NO_ERROR));
 			    }
 			}
 		    }
@@ -1785,7 +1757,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 			/* Advance pointer to skip the space character */
 			just_err_msg++;
 		    }
-		    ops->handle_msg_event(opdata,
+		    otrl_event_msg(us, ops, opdata,
 			    OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR,
 			    context, just_err_msg,
 			    gcry_error(GPG_ERR_NO_ERROR));
@@ -1854,7 +1826,7 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 		/* Not fine.  Let the user know. */
 		const char *plainmsg = (*newmessagep) ? *newmessagep : message;
 		if (ops->handle_msg_event) {
-		    ops->handle_msg_event(opdata,
+		    otrl_event_msg(us, ops, opdata,
 			    OTRL_MSGEVENT_RCVDMSG_UNENCRYPTED,
 			    context, plainmsg, gcry_error(GPG_ERR_NO_ERROR));
 		    free(*newmessagep);
@@ -1867,11 +1839,8 @@ int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
 	case OTRL_MSGTYPE_UNKNOWN:
 	    /* We received an OTR message we didn't recognize.  Ignore
 	     * it, and signal an event. */
-	    if (ops->handle_msg_event) {
-		ops->handle_msg_event(opdata,
-			OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED,
-			context, NULL, gcry_error(GPG_ERR_NO_ERROR));
-	    }
+	    otrl_event_msg(us, ops, opdata, OTRL_MSGEVENT_RCVDMSG_UNRECOGNIZED,
+		    context, NULL, gcry_error(GPG_ERR_NO_ERROR));
 	    if (edata.ignore_message == -1) edata.ignore_message = 1;
 	    break;
     }
@@ -1885,6 +1854,60 @@ end:
     return edata.ignore_message;
 }
 
+/* Handle a message just received from the network.  It is safe to pass
+ * all received messages to this routine.  add_appdata is a function
+ * that will be called in the event that a new ConnContext is created.
+ * It will be passed the data that you supplied, as well as
+ * a pointer to the new ConnContext.  You can use this to add
+ * application-specific information to the ConnContext using the
+ * "context->app" field, for example.  If you don't need to do this, you
+ * can pass NULL for the last two arguments of otrl_message_receiving.
+ *
+ * If non-NULL, ops->convert_msg will be called after a data message is
+ * decrypted.
+ *
+ * If "contextp" is not NULL, it will be set to the ConnContext used for
+ * receiving the message.
+ *
+ * If otrl_message_receiving returns 1, then the message you received
+ * was an internal protocol message, and no message should be delivered
+ * to the user.
+ *
+ * If it returns 0, then check if *messagep was set to non-NULL.  If
+ * so, replace the received message with the contents of *messagep, and
+ * deliver that to the user instead.  You must call
+ * otrl_message_free(*messagep) when you're done with it.  If tlvsp is
+ * non-NULL, *tlvsp will be set to a chain of any TLVs that were
+ * transmitted along with this message.  You must call
+ * otrl_tlv_free(*tlvsp) when you're done with those.
+ *
+ * If otrl_message_receiving returns 0 and *messagep is NULL, then this
+ * was an ordinary, non-OTR message, which should just be delivered to
+ * the user without modification. */
+int otrl_message_receiving(OtrlUserState us, const OtrlMessageAppOps *ops,
+	void *opdata, const char *accountname, const char *protocol,
+	const char *sender, const char *message, char **newmessagep,
+	OtrlTLV **tlvsp, ConnContext **contextp,
+	void (*add_appdata)(void *data, ConnContext *context),
+	void *data)
+{
+    ConnContext *context = NULL;
+    int ignore_message;
+
+    /* Bad arguments leave everything, *contextp included, untouched */
+    if (!accountname || !protocol || !sender || !message || !newmessagep)
+	return 0;
+
+    OTRL_TRACE2(message_receiving_entry, us, message);
+    ignore_message = message_receiving(us, ops, opdata, accountname,
+	    protocol, sender, message, newmessagep, tlvsp, &context,
+	    add_appdata, data);
+    OTRL_TRACE3(message_receiving_return, context,
+	    context ? context->protocol_version : 0, ignore_message);
+    if (contextp) *contextp = context;
+    return ignore_message;
+}
+
 /* Put a connection into the PLAINTEXT state, first sending the
  * other side a notice that we're doing so if we're currently ENCRYPTED,
  * and we think he's logged in. Affects only the specified context. */
@@ -1894,7 +1917,8 @@ static void disconnect_context(OtrlUserState us, const OtrlMessageAppOps *ops,
     if (!context) return;
 
     if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
-	    context->context_priv->their_keyid > 0 &&
+	    !otrl_context_priv_wake(context->context_priv) &&
+	    context->context_priv->keys->their_keyid > 0 &&
 	    ops->is_logged_in &&
 	    ops->is_logged_in(opdata, context->accountname, context->protocol,
 		    context->username) == 1) {
@@ -1915,9 +1939,7 @@ static void disconnect_context(OtrlUserState us, const OtrlMessageAppOps *ops,
     }
 
     otrl_context_force_plaintext(context);
-    if (ops->update_context_list) {
-	ops->update_context_list(opdata);
-    }
+    otrl_event_update_context_list(us, ops, opdata);
 }
 
 
@@ -1973,7 +1995,8 @@ gcry_error_t otrl_message_symkey(OtrlUserState us,
     }
 
     if (context->msgstate == OTRL_MSGSTATE_ENCRYPTED &&
-	    context->context_priv->their_keyid > 0) {
+	    !otrl_context_priv_wake(context->context_priv) &&
+	    context->context_priv->keys->their_keyid > 0) {
 	unsigned char *tlvdata = malloc(usedatalen+4);
 	char *encmsg = NULL;
 	gcry_error_t err;
@@ -2012,6 +2035,11 @@ gcry_error_t otrl_message_symkey(OtrlUserState us,
  * otrl_message_poll every time the timer goes off. */
 unsigned int otrl_message_poll_get_default_interval(OtrlUserState us)
 {
+    /* Poll often enough to raise held-back notifications on time */
+    if (us && us->notify_interval > 0 &&
+	    us->notify_interval < POLL_DEFAULT_INTERVAL) {
+	return us->notify_interval;
+    }
     return POLL_DEFAULT_INTERVAL;
 }
 
@@ -2050,6 +2078,23 @@ void otrl_message_poll(OtrlUserState us, const OtrlMessageAppOps *ops,
 	}
     }
 
+    /* Reclaim the next batch of idle contexts.  As long as there are
+     * contexts left, keep the timer running so they get looked at. */
+    if (us->context_idle_timeout > 0) {
+	if (otrl_context_expire_idle(us, time(NULL)) > 0 && ops) {
+	    otrl_event_update_context_list(us, ops, opdata);
+	}
+	if (us->context_root) {
+	    still_waiting = 1;
+	}
+    }
+
+    /* Raise any update_context_list or write_fingerprints notifications
+     * that were held back and are now due. */
+    if (ops && otrl_event_poll(us, ops, opdata)) {
+	still_waiting = 1;
+    }
+
     /* If there's nothing more to wait for, stop the timer, if possible. */
     if (still_waiting == 0 && ops && ops->timer_control) {
 	ops->timer_control(opdata, 0);
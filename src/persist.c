@@ -0,0 +1,419 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "persist.h"
+#include "userstate.h"
+
+#ifndef WIN32
+/* The most symlinks persist_target follows, as the kernel would */
+#define PERSIST_MAX_LINKS 40
+
+/* Return a newly-allocated copy of the name of the file the given
+ * store really lives in.  If the store is a symlink, a rename() over it
+ * would replace the link rather than write through it, as fopen()
+ * does, so follow the link, even if what it points to doesn't exist
+ * yet.  Returns NULL and sets errno on error. */
+static char *persist_target(const char *filename)
+{
+    char *name = strdup(filename);
+    int links;
+
+    for (links = 0; name; ++links) {
+	struct stat st;
+	char *target, *joined;
+	const char *slash;
+	size_t bufsize, dirlen;
+	ssize_t len;
+
+	if (lstat(name, &st) != 0 || !S_ISLNK(st.st_mode)) return name;
+	if (links == PERSIST_MAX_LINKS) {
+	    free(name);
+	    errno = ELOOP;
+	    return NULL;
+	}
+
+	/* Some filesystems report a size of 0 for their symlinks */
+	bufsize = st.st_size > 0 ? (size_t)st.st_size + 1 : 4096;
+	target = malloc(bufsize);
+	len = target ? readlink(name, target, bufsize) : -1;
+	if (len < 0 || (size_t)len >= bufsize) {
+	    /* Out of memory, or the link changed under our feet */
+	    if (!target) errno = ENOMEM;
+	    else if (len >= 0) errno = ENAMETOOLONG;
+	    free(target);
+	    free(name);
+	    return NULL;
+	}
+	target[len] = '\0';
+
+	/* A relative link is relative to the directory it is in */
+	slash = strrchr(name, '/');
+	if (target[0] == '/' || !slash) {
+	    free(name);
+	    name = target;
+	    continue;
+	}
+	dirlen = slash - name + 1;
+	joined = malloc(dirlen + len + 1);
+	if (joined) {
+	    memmove(joined, name, dirlen);
+	    memmove(joined + dirlen, target, len + 1);
+	}
+	free(target);
+	free(name);
+	name = joined;
+    }
+    errno = ENOMEM;
+    return NULL;
+}
+
+/* Give the temporary file the permissions the store would have had if
+ * it had been rewritten in place. */
+static void persist_chmod(int fd, const char *filename, int secret)
+{
+    struct stat st;
+    mode_t mode;
+
+    if (stat(filename, &st) == 0) {
+	mode = st.st_mode & 07777;
+    } else if (secret) {
+	mode = 0600;
+    } else {
+	mode = umask(0);
+	umask(mode);
+	mode = 0666 & ~mode;
+    }
+
+    /* mkstemp created the file with mode 0600 */
+    if (mode != 0600) {
+	fchmod(fd, mode);
+    }
+}
+#endif
+
+/* Start rewriting the given store. */
+gcry_error_t otrl_persist_open(OtrlPersistFile *pf, const char *filename,
+	int secret)
+{
+    static const char suffix[] = ".XXXXXX";
+    gcry_error_t err;
+#ifndef WIN32
+    int fd;
+#endif
+
+    pf->f = NULL;
+    pf->tmpname = NULL;
+#ifndef WIN32
+    pf->filename = persist_target(filename);
+    if (!pf->filename) {
+	err = gcry_error_from_errno(errno);
+	goto err;
+    }
+#else
+    pf->filename = strdup(filename);
+    if (!pf->filename) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto err;
+    }
+#endif
+    filename = pf->filename;
+    pf->tmpname = malloc(strlen(filename) + sizeof(suffix));
+    if (!pf->tmpname) {
+	err = gcry_error(GPG_ERR_ENOMEM);
+	goto err;
+    }
+    strcpy(pf->tmpname, filename);
+    strcat(pf->tmpname, suffix);
+
+#ifndef WIN32
+    fd = mkstemp(pf->tmpname);
+    if (fd < 0) {
+	err = gcry_error_from_errno(errno);
+	goto err;
+    }
+    persist_chmod(fd, filename, secret);
+    pf->f = fdopen(fd, "w+b");
+    if (!pf->f) {
+	err = gcry_error_from_errno(errno);
+	close(fd);
+	unlink(pf->tmpname);
+	goto err;
+    }
+#else
+    /* No mkstemp here; a fixed name will do, as only one writer of a
+     * given store is expected. */
+    strcpy(pf->tmpname + strlen(filename), ".new");
+    pf->f = fopen(pf->tmpname, "w+b");
+    if (!pf->f) {
+	err = gcry_error_from_errno(errno);
+	goto err;
+    }
+#endif
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+
+err:
+    free(pf->filename);
+    free(pf->tmpname);
+    pf->filename = NULL;
+    pf->tmpname = NULL;
+    return err;
+}
+
+/* Flush f and make sure its contents are on disk. */
+gcry_error_t otrl_persist_sync(FILE *f)
+{
+    if (fflush(f) != 0 || ferror(f)) {
+	return gcry_error_from_errno(errno ? errno : EIO);
+    }
+#ifndef WIN32
+    if (fsync(fileno(f)) != 0) {
+	return gcry_error_from_errno(errno);
+    }
+#endif
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Sync the directory holding the given file, so that a rename() into
+ * it survives a crash. */
+static void persist_sync_dir(const char *filename)
+{
+#ifndef WIN32
+    const char *slash = strrchr(filename, '/');
+    char *dir;
+    int fd;
+
+    if (!slash) {
+	dir = strdup(".");
+    } else {
+	size_t len = slash == filename ? 1 : (size_t)(slash - filename);
+	dir = malloc(len + 1);
+	if (dir) {
+	    memmove(dir, filename, len);
+	    dir[len] = '\0';
+	}
+    }
+    if (!dir) return;
+
+    /* Some filesystems refuse to sync directories; the rename has
+     * happened regardless, so there is nothing to report. */
+    fd = open(dir, O_RDONLY);
+    if (fd >= 0) {
+	fsync(fd);
+	close(fd);
+    }
+    free(dir);
+#endif
+}
+
+/* Whether the two files are in the same directory */
+static int persist_same_dir(const char *a, const char *b)
+{
+    const char *sa = strrchr(a, '/');
+    const char *sb = strrchr(b, '/');
+    size_t la = sa ? (size_t)(sa - a) : 0;
+    size_t lb = sb ? (size_t)(sb - b) : 0;
+
+    if (!sa || !sb) return !sa && !sb;
+    return la == lb && !memcmp(a, b, la);
+}
+
+/* Move the synced temporary file over the store. */
+static gcry_error_t persist_rename(const char *tmpname, const char *filename)
+{
+#ifdef WIN32
+    /* rename() does not replace an existing file here */
+    remove(filename);
+#endif
+    if (rename(tmpname, filename) != 0) {
+	gcry_error_t err = gcry_error_from_errno(errno);
+	remove(tmpname);
+	return err;
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Replace the store with what has been written to pf->f. */
+gcry_error_t otrl_persist_commit(OtrlUserState us, OtrlPersistFile *pf)
+{
+    OtrlPersistPending *pending;
+    gcry_error_t err;
+
+    if (us && us->persist_depth > 0) {
+	if (fflush(pf->f) != 0 || ferror(pf->f)) {
+	    err = gcry_error_from_errno(errno ? errno : EIO);
+	    otrl_persist_abort(pf);
+	    return err;
+	}
+
+	/* A later version of a store replaces the one already pending */
+	for (pending = us->persist_pending; pending;
+		pending = pending->next) {
+	    if (!strcmp(pending->filename, pf->filename)) break;
+	}
+	if (pending) {
+	    fclose(pending->f);
+	    remove(pending->tmpname);
+	    free(pending->tmpname);
+	    free(pf->filename);
+	} else {
+	    pending = malloc(sizeof(OtrlPersistPending));
+	    if (!pending) {
+		otrl_persist_abort(pf);
+		return gcry_error(GPG_ERR_ENOMEM);
+	    }
+	    pending->filename = pf->filename;
+	    pending->next = us->persist_pending;
+	    us->persist_pending = pending;
+	}
+	pending->f = pf->f;
+	pending->tmpname = pf->tmpname;
+	return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    err = otrl_persist_sync(pf->f);
+    if (fclose(pf->f) != 0 && !err) {
+	err = gcry_error_from_errno(errno);
+    }
+    if (err) {
+	remove(pf->tmpname);
+    } else {
+	err = persist_rename(pf->tmpname, pf->filename);
+	if (!err) persist_sync_dir(pf->filename);
+    }
+    free(pf->filename);
+    free(pf->tmpname);
+    return err;
+}
+
+/* Throw away what has been written to pf->f. */
+void otrl_persist_abort(OtrlPersistFile *pf)
+{
+    fclose(pf->f);
+    remove(pf->tmpname);
+    free(pf->filename);
+    free(pf->tmpname);
+}
+
+/* Start a batch of writes for the given OtrlUserState. */
+void otrl_persist_batch_begin(OtrlUserState us)
+{
+    us->persist_depth++;
+}
+
+/* Free a pending replacement */
+static void persist_pending_free(OtrlPersistPending *pending)
+{
+    free(pending->filename);
+    free(pending->tmpname);
+    free(pending);
+}
+
+/* Sync and rename every store held back for the given OtrlUserState. */
+static gcry_error_t persist_flush(OtrlUserState us)
+{
+    OtrlPersistPending *pending, *synced = NULL, *renamed = NULL, *next;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    /* Sync every temporary file before renaming any of them, so that
+     * the stores are replaced as close together as possible. */
+    for (pending = us->persist_pending; pending; pending = next) {
+	gcry_error_t ferr = otrl_persist_sync(pending->f);
+
+	next = pending->next;
+	if (fclose(pending->f) != 0 && !ferr) {
+	    ferr = gcry_error_from_errno(errno);
+	}
+	pending->f = NULL;
+	if (ferr) {
+	    if (!err) err = ferr;
+	    remove(pending->tmpname);
+	    persist_pending_free(pending);
+	} else {
+	    pending->next = synced;
+	    synced = pending;
+	}
+    }
+    us->persist_pending = NULL;
+
+    for (pending = synced; pending; pending = next) {
+	gcry_error_t ferr = persist_rename(pending->tmpname,
+		pending->filename);
+
+	next = pending->next;
+	if (ferr) {
+	    if (!err) err = ferr;
+	    persist_pending_free(pending);
+	} else {
+	    pending->next = renamed;
+	    renamed = pending;
+	}
+    }
+
+    /* Then sync each directory once */
+    for (pending = renamed; pending; pending = next) {
+	OtrlPersistPending *p;
+	int seen = 0;
+
+	next = pending->next;
+	for (p = next; p; p = p->next) {
+	    if (persist_same_dir(p->filename, pending->filename)) {
+		seen = 1;
+		break;
+	    }
+	}
+	if (!seen) persist_sync_dir(pending->filename);
+	persist_pending_free(pending);
+    }
+
+    return err;
+}
+
+/* End a batch of writes. */
+gcry_error_t otrl_persist_batch_end(OtrlUserState us)
+{
+    if (us->persist_depth == 0) return gcry_error(GPG_ERR_INV_VALUE);
+    if (--us->persist_depth > 0) return gcry_error(GPG_ERR_NO_ERROR);
+    return persist_flush(us);
+}
+
+/* Commit the writes still held back by a batch. */
+void otrl_persist_flush_all(OtrlUserState us)
+{
+    us->persist_depth = 0;
+    persist_flush(us);
+}
@@ -0,0 +1,98 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __PERSIST_H__
+#define __PERSIST_H__
+
+#include <stdio.h>
+#include <gcrypt.h>
+
+#include "userstate.h"
+
+/* A store file (the privkey store, the instance tag store or the
+ * fingerprint store) being rewritten.  The new contents are written to
+ * a temporary file next to the store, which replaces it with a single
+ * rename() only once it has been completely written and synced to disk.
+ * A crash at any point therefore leaves either the old store or the new
+ * one, never a truncated one. */
+typedef struct s_OtrlPersistFile {
+    FILE *f;                /* Write the new contents here */
+    char *filename;         /* The store being replaced */
+    char *tmpname;          /* The temporary file */
+} OtrlPersistFile;
+
+/* A replacement held back until the end of a batch; see
+ * otrl_persist_batch_begin. */
+typedef struct s_OtrlPersistPending {
+    struct s_OtrlPersistPending *next;
+    FILE *f;                /* Still open, so that it can be synced */
+    char *filename;
+    char *tmpname;
+} OtrlPersistPending;
+
+/* Start rewriting the given store.  On success, pf->f is open for
+ * reading and writing on a new, empty temporary file, and the caller
+ * must finish with exactly one of otrl_persist_commit or
+ * otrl_persist_abort.  If secret is non-zero, a new store is only
+ * readable by its owner; an existing store keeps its permissions
+ * either way.  If the store is a symlink, the file it points to is
+ * replaced, and the link is left alone. */
+gcry_error_t otrl_persist_open(OtrlPersistFile *pf, const char *filename,
+	int secret);
+
+/* Replace the store with what has been written to pf->f.  Outside a
+ * batch, the temporary file is synced, renamed over the store, and the
+ * directory holding it synced, before this returns.  Inside a batch,
+ * only write errors are reported here, and the replacement happens at
+ * the end of the batch.  pf must not be used afterwards. */
+gcry_error_t otrl_persist_commit(OtrlUserState us, OtrlPersistFile *pf);
+
+/* Throw away what has been written to pf->f, leaving the store as it
+ * was.  pf must not be used afterwards. */
+void otrl_persist_abort(OtrlPersistFile *pf);
+
+/* Flush f and make sure its contents are on disk.  This is used
+ * internally. */
+gcry_error_t otrl_persist_sync(FILE *f);
+
+/* Start a batch of writes for the given OtrlUserState.  Until the
+ * matching otrl_persist_batch_end, otrl_privkey_write_fingerprints,
+ * otrl_instag_write, otrl_privkey_generate and the like write their
+ * stores to temporary files, but hold back syncing and renaming them.
+ * Writing the same store more than once in a batch only keeps the last
+ * version, so a burst of N writes to a store costs one fsync() rather
+ * than N.  Batches may be nested; only the end of the outermost one
+ * commits anything. */
+void otrl_persist_batch_begin(OtrlUserState us);
+
+/* End a batch of writes, and if it is the outermost one, sync and
+ * rename every store written during it.  Each directory involved is
+ * synced once, after all of its stores have been renamed.  A store
+ * that could not be synced is left as it was.  Returns the first error
+ * encountered, or GPG_ERR_INV_VALUE if no batch was started. */
+gcry_error_t otrl_persist_batch_end(OtrlUserState us);
+
+/* Commit the writes still held back by a batch for the given
+ * OtrlUserState, whatever the nesting depth.  This is called by
+ * otrl_userstate_free. */
+void otrl_persist_flush_all(OtrlUserState us);
+
+#endif
@@ -23,6 +23,10 @@
 
 #include <gcrypt.h>
 
+/* The length of a string representing a human-readable version of a
+ * fingerprint (including the trailing NUL) */
+#define OTRL_PRIVKEY_FPRINT_HUMAN_LEN 45
+
 typedef struct s_OtrlPrivKey {
     struct s_OtrlPrivKey *next;
     struct s_OtrlPrivKey **tous;
@@ -33,6 +37,22 @@ typedef struct s_OtrlPrivKey {
     gcry_sexp_t privkey;
     unsigned char *pubkey_data;
     size_t pubkey_datalen;
+    struct s_OtrlUserState *us;        /* The OtrlUserState whose list
+					  this is in, or NULL if it was
+					  not put there by libotr */
+    unsigned char *fingerprint_of;     /* A copy of the pubkey_data the
+					  next two were worked out from,
+					  or NULL */
+    size_t fingerprint_oflen;
+    unsigned char fingerprint[20];     /* The SHA-1 hash of pubkey_data */
+    char fingerprint_human[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+					/* The same, as from
+					   otrl_privkey_hash_to_human */
+    int on_demand;                     /* Loaded by otrl_privkey_find;
+					  see otrl_privkey_read_lazy */
+    struct s_OtrlPrivKey *lru_prev;    /* If on_demand, the keys found */
+    struct s_OtrlPrivKey *lru_next;    /* next more and next less
+					  recently than this one */
 } OtrlPrivKey;
 
 #define OTRL_PUBKEY_TYPE_DSA 0x0000
@@ -29,6 +29,8 @@
 
 /* libotr headers */
 #include "privkey.h"
+#include "persist.h"
+#include "privstore.h"
 #include "serial.h"
 
 /* Convert a 20-byte hash value to a 45-byte human-readable value */
@@ -51,6 +53,29 @@ void otrl_privkey_hash_to_human(
     *p = '\0';
 }
 
+/* Work out the fingerprints of a key, unless that was done already.
+ * They are worked out again if pubkey_data was replaced or changed in
+ * place: comparing it with our copy is much cheaper than hashing it. */
+static void privkey_fingerprint_memo(OtrlPrivKey *p)
+{
+    if (p->fingerprint_of && p->fingerprint_oflen == p->pubkey_datalen &&
+	    !memcmp(p->fingerprint_of, p->pubkey_data, p->pubkey_datalen)) {
+	return;
+    }
+
+    gcry_md_hash_buffer(GCRY_MD_SHA1, p->fingerprint, p->pubkey_data,
+	    p->pubkey_datalen);
+    otrl_privkey_hash_to_human(p->fingerprint_human, p->fingerprint);
+
+    /* Without a copy, they'll just be worked out every time */
+    free(p->fingerprint_of);
+    p->fingerprint_of = malloc(p->pubkey_datalen ? p->pubkey_datalen : 1);
+    p->fingerprint_oflen = p->pubkey_datalen;
+    if (p->fingerprint_of) {
+	memmove(p->fingerprint_of, p->pubkey_data, p->pubkey_datalen);
+    }
+}
+
 /* Calculate a human-readable hash of our DSA public key.  Return it in
  * the passed fingerprint buffer.  Return NULL on error, or a pointer to
  * the given buffer on success. */
@@ -58,16 +83,13 @@ char *otrl_privkey_fingerprint(OtrlUserState us,
 	char fingerprint[OTRL_PRIVKEY_FPRINT_HUMAN_LEN],
 	const char *accountname, const char *protocol)
 {
-    unsigned char hash[20];
     OtrlPrivKey *p = otrl_privkey_find(us, accountname, protocol);
 
     if (p) {
-	/* Calculate the hash */
-	gcry_md_hash_buffer(GCRY_MD_SHA1, hash, p->pubkey_data,
-		p->pubkey_datalen);
-
-	/* Now convert it to a human-readable format */
-	otrl_privkey_hash_to_human(fingerprint, hash);
+	/* The hash is worked out when the key is loaded */
+	privkey_fingerprint_memo(p);
+	memmove(fingerprint, p->fingerprint_human,
+		OTRL_PRIVKEY_FPRINT_HUMAN_LEN);
     } else {
 	return NULL;
     }
@@ -84,9 +106,8 @@ unsigned char *otrl_privkey_fingerprint_raw(OtrlUserState us,
     OtrlPrivKey *p = otrl_privkey_find(us, accountname, protocol);
 
     if (p) {
-	/* Calculate the hash */
-	gcry_md_hash_buffer(GCRY_MD_SHA1, hash, p->pubkey_data,
-		p->pubkey_datalen);
+	privkey_fingerprint_memo(p);
+	memmove(hash, p->fingerprint, 20);
     } else {
 	return NULL;
     }
@@ -175,6 +196,54 @@ static gcry_error_t make_pubkey(unsigned char **pubbufp, size_t *publenp,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* The hash of an account in us->privkey_index */
+static size_t privkey_hash(const char *accountname, const char *protocol)
+{
+    return otrl_hashtab_hash_string(otrl_hashtab_hash_string(
+		OTRL_HASHTAB_SEED, accountname), protocol);
+}
+
+/* Make sure us->privkey_index holds every key in us->privkey_root.
+ * The functions in this file keep the two in step; if the list was
+ * changed some other way (which shows as its head not being the one
+ * the index knows about), the index is built over. */
+static void privkey_index_sync(OtrlUserState us)
+{
+    OtrlPrivKey *p;
+
+    if (us->privkey_index_root == us->privkey_root) return;
+
+    otrl_hashtab_free(&(us->privkey_index));
+    otrl_hashtab_init(&(us->privkey_index));
+    for (p = us->privkey_root; p; p = p->next) {
+	p->us = us;
+	otrl_hashtab_add(&(us->privkey_index),
+		privkey_hash(p->accountname, p->protocol), p);
+    }
+    us->privkey_index_root = us->privkey_root;
+}
+
+/* Link a new key at the head of the list of private keys in the given
+ * OtrlUserState, and index it. */
+static void privkey_link(OtrlUserState us, OtrlPrivKey *p)
+{
+    int in_sync = (us->privkey_index_root == us->privkey_root);
+
+    p->us = us;
+    p->next = us->privkey_root;
+    if (p->next) {
+	p->next->tous = &(p->next);
+    }
+    p->tous = &(us->privkey_root);
+    us->privkey_root = p;
+
+    if (in_sync) {
+	otrl_hashtab_add(&(us->privkey_index),
+		privkey_hash(p->accountname, p->protocol), p);
+	us->privkey_index_root = p;
+    }
+}
+
 /* Read a sets of private DSA keys from a file on disk into the given
  * OtrlUserState. */
 gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename)
@@ -197,6 +266,39 @@ gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename)
     return err;
 }
 
+/* Open the indexed private key store in the given file for the given
+ * OtrlUserState, and load each of its keys only when otrl_privkey_find
+ * is first asked for it.  Until otrl_privkey_close_lazy, keys are
+ * generated into the store, whatever file or FILE* they are given. */
+gcry_error_t otrl_privkey_read_lazy(OtrlUserState us, const char *filename,
+	unsigned int max_loaded)
+{
+    OtrlPrivKeyStore *store;
+    gcry_error_t err;
+
+    err = otrl_privkey_store_open(&store, filename);
+    if (err) {
+	return err;
+    }
+
+    otrl_privkey_close_lazy(us);
+    us->privkey_store = store;
+    us->privkey_lazy_max = max_loaded;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Forget the keys loaded on demand, and close the store given to
+ * otrl_privkey_read_lazy. */
+void otrl_privkey_close_lazy(OtrlUserState us)
+{
+    while (us->privkey_lru_head) {
+	otrl_privkey_forget(us->privkey_lru_head);
+    }
+    otrl_privkey_store_close(us->privkey_store);
+    us->privkey_store = NULL;
+    us->privkey_lazy_max = 0;
+}
+
 /* Read a sets of private DSA keys from a FILE* into the given
  * OtrlUserState.  The FILE* must be open for reading. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
@@ -245,103 +347,113 @@ gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf)
 
     /* Get each account */
     for(i=1; i<gcry_sexp_length(allkeys); ++i) {
-	gcry_sexp_t names, protos, privs;
-	char *name, *proto;
-	gcry_sexp_t accounts;
-	OtrlPrivKey *p;
-
 	/* Get the ith "account" S-exp */
-	accounts = gcry_sexp_nth(allkeys, i);
+	gcry_sexp_t accounts = gcry_sexp_nth(allkeys, i);
 
-	/* It's really an "account" S-exp? */
-	token = gcry_sexp_nth_data(accounts, 0, &tokenlen);
-	if (tokenlen != 7 || strncmp(token, "account", 7)) {
-	    gcry_sexp_release(accounts);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	/* Extract the name, protocol, and privkey S-exps */
-	names = gcry_sexp_find_token(accounts, "name", 0);
-	protos = gcry_sexp_find_token(accounts, "protocol", 0);
-	privs = gcry_sexp_find_token(accounts, "private-key", 0);
+	err = otrl_privkey_read_account(us, accounts);
 	gcry_sexp_release(accounts);
-	if (!names || !protos || !privs) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	/* Extract the actual name and protocol */
-	token = gcry_sexp_nth_data(names, 1, &tokenlen);
-	if (!token) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	name = malloc(tokenlen + 1);
-	if (!name) {
-	    gcry_sexp_release(names);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
+	if (err) {
 	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
+	    return err;
 	}
-	memmove(name, token, tokenlen);
-	name[tokenlen] = '\0';
-	gcry_sexp_release(names);
+    }
+    gcry_sexp_release(allkeys);
 
-	token = gcry_sexp_nth_data(protos, 1, &tokenlen);
-	if (!token) {
-	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
-	proto = malloc(tokenlen + 1);
-	if (!proto) {
-	    free(name);
-	    gcry_sexp_release(protos);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
-	memmove(proto, token, tokenlen);
-	proto[tokenlen] = '\0';
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Read one "account" S-exp of a private key file, and add its key to
+ * the given OtrlUserState. */
+gcry_error_t otrl_privkey_read_account(OtrlUserState us,
+	gcry_sexp_t accounts)
+{
+    gcry_sexp_t names, protos, privs;
+    char *name, *proto;
+    const char *token;
+    size_t tokenlen;
+    OtrlPrivKey *p;
+    gcry_error_t err;
+
+    /* It's really an "account" S-exp? */
+    token = gcry_sexp_nth_data(accounts, 0, &tokenlen);
+    if (tokenlen != 7 || strncmp(token, "account", 7)) {
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    /* Extract the name, protocol, and privkey S-exps */
+    names = gcry_sexp_find_token(accounts, "name", 0);
+    protos = gcry_sexp_find_token(accounts, "protocol", 0);
+    privs = gcry_sexp_find_token(accounts, "private-key", 0);
+    if (!names || !protos || !privs) {
+	gcry_sexp_release(names);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    /* Extract the actual name and protocol */
+    token = gcry_sexp_nth_data(names, 1, &tokenlen);
+    if (!token) {
+	gcry_sexp_release(names);
 	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    name = malloc(tokenlen + 1);
+    if (!name) {
+	gcry_sexp_release(names);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    memmove(name, token, tokenlen);
+    name[tokenlen] = '\0';
+    gcry_sexp_release(names);
 
-	/* Make a new OtrlPrivKey entry */
-	p = malloc(sizeof(*p));
-	if (!p) {
-	    free(name);
-	    free(proto);
-	    gcry_sexp_release(privs);
-	    gcry_sexp_release(allkeys);
-	    return gcry_error(GPG_ERR_ENOMEM);
-	}
+    token = gcry_sexp_nth_data(protos, 1, &tokenlen);
+    if (!token) {
+	free(name);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    proto = malloc(tokenlen + 1);
+    if (!proto) {
+	free(name);
+	gcry_sexp_release(protos);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    memmove(proto, token, tokenlen);
+    proto[tokenlen] = '\0';
+    gcry_sexp_release(protos);
+
+    /* Make a new OtrlPrivKey entry */
+    p = malloc(sizeof(*p));
+    if (!p) {
+	free(name);
+	free(proto);
+	gcry_sexp_release(privs);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
 
-	/* Fill it in and link it up */
-	p->accountname = name;
-	p->protocol = proto;
-	p->pubkey_type = OTRL_PUBKEY_TYPE_DSA;
-	p->privkey = privs;
-	p->next = us->privkey_root;
-	if (p->next) {
-	    p->next->tous = &(p->next);
-	}
-	p->tous = &(us->privkey_root);
-	us->privkey_root = p;
-	err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
-	if (err) {
-	    gcry_sexp_release(allkeys);
-	    otrl_privkey_forget(p);
-	    return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
-	}
+    /* Fill it in and link it up */
+    p->accountname = name;
+    p->protocol = proto;
+    p->pubkey_type = OTRL_PUBKEY_TYPE_DSA;
+    p->privkey = privs;
+    p->pubkey_data = NULL;
+    p->pubkey_datalen = 0;
+    p->fingerprint_of = NULL;
+    p->fingerprint_oflen = 0;
+    p->on_demand = 0;
+    p->lru_prev = NULL;
+    p->lru_next = NULL;
+    privkey_link(us, p);
+    err = make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
+    if (err) {
+	otrl_privkey_forget(p);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
     }
-    gcry_sexp_release(allkeys);
+    privkey_fingerprint_memo(p);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -416,45 +528,91 @@ void otrl_privkey_pending_forget_all(OtrlUserState us)
     }
 }
 
-static gcry_error_t sexp_write(FILE *privf, gcry_sexp_t sexp)
+/* Append the advanced rendering of an S-exp to a growing buffer */
+static gcry_error_t sexp_append(char **bufp, size_t *lenp, gcry_sexp_t sexp)
 {
-    size_t buflen;
-    char *buf;
+    size_t sexplen;
+    char *newbuf;
 
-    buflen = gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, NULL, 0);
-    buf = malloc(buflen);
-    if (buf == NULL && buflen > 0) {
+    /* The length includes the terminating NUL */
+    sexplen = gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+    newbuf = realloc(*bufp, *lenp + sexplen);
+    if (newbuf == NULL) {
 	return gcry_error(GPG_ERR_ENOMEM);
     }
-    gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, buf, buflen);
-
-    fprintf(privf, "%s", buf);
-    free(buf);
+    *bufp = newbuf;
+    gcry_sexp_sprint(sexp, GCRYSEXP_FMT_ADVANCED, newbuf + *lenp, sexplen);
+    *lenp += strlen(newbuf + *lenp);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
-static gcry_error_t account_write(FILE *privf, const char *accountname,
-	const char *protocol, gcry_sexp_t privkey)
+/* Render the "account" S-exp of a private key file for the given
+ * account into a newly-allocated, NUL-terminated buffer. */
+gcry_error_t otrl_privkey_account_sprint(char **bufp, size_t *lenp,
+	const char *accountname, const char *protocol, gcry_sexp_t privkey)
 {
+    static const char head[] = " (account\n";
+    static const char tail[] = " )\n";
     gcry_error_t err;
     gcry_sexp_t names, protos;
+    char *buf, *newbuf;
+    size_t len;
 
-    fprintf(privf, " (account\n");
+    *bufp = NULL;
+    *lenp = 0;
+
+    buf = malloc(sizeof(head));
+    if (buf == NULL) {
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+    strcpy(buf, head);
+    len = sizeof(head) - 1;
 
     err = gcry_sexp_build(&names, NULL, "(name %s)", accountname);
     if (!err) {
-	err = sexp_write(privf, names);
+	err = sexp_append(&buf, &len, names);
 	gcry_sexp_release(names);
     }
     if (!err) err = gcry_sexp_build(&protos, NULL, "(protocol %s)", protocol);
     if (!err) {
-	err = sexp_write(privf, protos);
+	err = sexp_append(&buf, &len, protos);
 	gcry_sexp_release(protos);
     }
-    if (!err) err = sexp_write(privf, privkey);
+    if (!err) err = sexp_append(&buf, &len, privkey);
+    if (!err) {
+	newbuf = realloc(buf, len + sizeof(tail));
+	if (newbuf == NULL) {
+	    err = gcry_error(GPG_ERR_ENOMEM);
+	} else {
+	    buf = newbuf;
+	    strcpy(buf + len, tail);
+	    len += sizeof(tail) - 1;
+	}
+    }
+    if (err) {
+	free(buf);
+	return err;
+    }
+
+    *bufp = buf;
+    *lenp = len;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
 
-    fprintf(privf, " )\n");
+static gcry_error_t account_write(FILE *privf, const char *accountname,
+	const char *protocol, gcry_sexp_t privkey)
+{
+    gcry_error_t err;
+    char *buf;
+    size_t len;
+
+    err = otrl_privkey_account_sprint(&buf, &len, accountname, protocol,
+	    privkey);
+    if (!err) {
+	fwrite(buf, len, 1, privf);
+	free(buf);
+    }
 
     return err;
 }
@@ -526,26 +684,6 @@ gcry_error_t otrl_privkey_generate_calculate(void *newkey)
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
-static FILE* privkey_fopen(const char *filename, gcry_error_t *errp)
-{
-    FILE *privf;
-#ifndef WIN32
-    mode_t oldmask;
-#endif
-
-#ifndef WIN32
-    oldmask = umask(077);
-#endif
-    privf = fopen(filename, "w+b");
-    if (!privf && errp) {
-	*errp = gcry_error_from_errno(errno);
-    }
-#ifndef WIN32
-    umask(oldmask);
-#endif
-    return privf;
-}
-
 /* Call this from the main thread only, in the event that the background
  * thread generating the key is cancelled.  The newkey is deallocated,
  * and must not be used further. */
@@ -566,25 +704,41 @@ void otrl_privkey_generate_cancelled(OtrlUserState us, void *newkey)
 }
 
 /* Call this from the main thread only.  It will write the newly created
- * private key into the given file and store it in the OtrlUserState. */
+ * private key into the given file and store it in the OtrlUserState.
+ * If otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate_finish(OtrlUserState us,
 	void *newkey, const char *filename)
 {
+    OtrlPersistFile pf;
     gcry_error_t err;
-    FILE *privf = privkey_fopen(filename, &err);
-    if (!privf) {
-	return err;
+
+    /* Rewriting the file from the keys we happen to have loaded would
+     * lose the others */
+    if (us && us->privkey_store) {
+	return otrl_privkey_generate_finish_store(us, newkey,
+		us->privkey_store);
     }
 
-    err = otrl_privkey_generate_finish_FILEp(us, newkey, privf);
+    err = otrl_persist_open(&pf, filename, 1);
+    if (err) {
+	return err;
+    }
 
-    fclose(privf);
-    return err;
+    /* Keep the old store unless the new one reads back correctly */
+    err = otrl_privkey_generate_finish_FILEp(us, newkey, pf.f);
+    if (err) {
+	otrl_persist_abort(&pf);
+	return err;
+    }
+    return otrl_persist_commit(us, &pf);
 }
 
 /* Call this from the main thread only.  It will write the newly created
  * private key into the given FILE* (which must be open for reading and
- * writing) and store it in the OtrlUserState. */
+ * writing) and store it in the OtrlUserState.  If
+ * otrl_privkey_read_lazy was called, the key goes into its store
+ * instead, and the FILE* is left alone. */
 gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 	void *newkey, FILE *privf)
 {
@@ -592,6 +746,11 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 	    (struct s_pending_privkey_calc *)newkey;
     gcry_error_t ret = gcry_error(GPG_ERR_INV_VALUE);
 
+    if (us && us->privkey_store) {
+	return otrl_privkey_generate_finish_store(us, newkey,
+		us->privkey_store);
+    }
+
     if (ppc && us && privf) {
 	OtrlPrivKey *p;
 
@@ -620,28 +779,67 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
     return ret;
 }
 
+/* Call this from the main thread only.  It will append the newly
+ * created private key to the given indexed store and store it in the
+ * OtrlUserState. */
+gcry_error_t otrl_privkey_generate_finish_store(OtrlUserState us,
+	void *newkey, OtrlPrivKeyStore *store)
+{
+    struct s_pending_privkey_calc *ppc =
+	    (struct s_pending_privkey_calc *)newkey;
+    gcry_error_t ret = gcry_error(GPG_ERR_INV_VALUE);
+
+    if (ppc && us && store) {
+	ret = otrl_privkey_store_add(store, ppc->accountname,
+		ppc->protocol, ppc->privkey);
+
+	/* Read the new key back, as otrl_privkey_generate_finish does */
+	if (!ret) {
+	    ret = otrl_privkey_store_load(us, store, ppc->accountname,
+		    ppc->protocol);
+	}
+    }
+
+    otrl_privkey_generate_cancelled(us, newkey);
+
+    return ret;
+}
+
 /* Generate a private DSA key for a given account, storing it into a
  * file on disk, and loading it into the given OtrlUserState.  Overwrite any
- * previously generated keys for that account in that OtrlUserState. */
+ * previously generated keys for that account in that OtrlUserState.
+ * If otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate(OtrlUserState us, const char *filename,
 	const char *accountname, const char *protocol)
 {
+    OtrlPersistFile pf;
     gcry_error_t err;
-    FILE *privf = privkey_fopen(filename, &err);
-    if (!privf) {
-	return err;
+
+    /* Don't replace the file; the key isn't written to it anyway */
+    if (us && us->privkey_store) {
+	return otrl_privkey_generate_FILEp(us, NULL, accountname, protocol);
     }
 
-    err = otrl_privkey_generate_FILEp(us, privf, accountname, protocol);
+    err = otrl_persist_open(&pf, filename, 1);
+    if (err) {
+	return err;
+    }
 
-    fclose(privf);
-    return err;
+    err = otrl_privkey_generate_FILEp(us, pf.f, accountname, protocol);
+    if (err) {
+	otrl_persist_abort(&pf);
+	return err;
+    }
+    return otrl_persist_commit(us, &pf);
 }
 
 /* Generate a private DSA key for a given account, storing it into a
  * FILE*, and loading it into the given OtrlUserState.  Overwrite any
  * previously generated keys for that account in that OtrlUserState.
- * The FILE* must be open for reading and writing. */
+ * The FILE* must be open for reading and writing.  If
+ * otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate_FILEp(OtrlUserState us, FILE *privf,
 	const char *accountname, const char *protocol)
 {
@@ -767,19 +965,20 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 gcry_error_t otrl_privkey_write_fingerprints(OtrlUserState us,
 	const char *filename)
 {
+    OtrlPersistFile pf;
     gcry_error_t err;
-    FILE *storef;
 
-    storef = fopen(filename, "wb");
-    if (!storef) {
-	err = gcry_error_from_errno(errno);
+    err = otrl_persist_open(&pf, filename, 0);
+    if (err) {
 	return err;
     }
 
-    err = otrl_privkey_write_fingerprints_FILEp(us, storef);
-
-    fclose(storef);
-    return err;
+    err = otrl_privkey_write_fingerprints_FILEp(us, pf.f);
+    if (err) {
+	otrl_persist_abort(&pf);
+	return err;
+    }
+    return otrl_persist_commit(us, &pf);
 }
 
 /* Write the fingerprint store from a given OtrlUserState to a FILE*.
@@ -812,14 +1011,103 @@ gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
+/* Put a key loaded on demand at the head of the LRU list. */
+static void lru_push(OtrlUserState us, OtrlPrivKey *p)
+{
+    p->lru_prev = NULL;
+    p->lru_next = us->privkey_lru_head;
+    if (p->lru_next) {
+	p->lru_next->lru_prev = p;
+    } else {
+	us->privkey_lru_tail = p;
+    }
+    us->privkey_lru_head = p;
+}
+
+/* Take a key loaded on demand off the LRU list. */
+static void lru_unlink(OtrlUserState us, OtrlPrivKey *p)
+{
+    if (p->lru_prev) {
+	p->lru_prev->lru_next = p->lru_next;
+    } else {
+	us->privkey_lru_head = p->lru_next;
+    }
+    if (p->lru_next) {
+	p->lru_next->lru_prev = p->lru_prev;
+    } else {
+	us->privkey_lru_tail = p->lru_prev;
+    }
+    p->lru_prev = p->lru_next = NULL;
+}
+
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account, loading it from the store given to
+ * otrl_privkey_read_lazy if need be */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol)
 {
-    OtrlPrivKey *p;
+    OtrlPrivKey *p = otrl_privkey_find_loaded(us, accountname, protocol);
+
+    if (p) {
+	if (p->on_demand && us->privkey_lru_head != p) {
+	    lru_unlink(us, p);
+	    lru_push(us, p);
+	}
+	return p;
+    }
+
+    if (!us->privkey_store || !accountname || !protocol ||
+	    !otrl_privkey_store_find(us->privkey_store, accountname,
+		protocol)) {
+	return NULL;
+    }
+    if (otrl_privkey_store_load(us, us->privkey_store, accountname,
+		protocol)) {
+	return NULL;
+    }
+
+    /* The new key is at the head of the list */
+    p = us->privkey_root;
+    p->on_demand = 1;
+    lru_push(us, p);
+    us->privkey_lazy_count++;
+
+    /* Make room, dropping the keys found the longest ago */
+    while (us->privkey_lazy_max &&
+	    us->privkey_lazy_count > us->privkey_lazy_max) {
+	otrl_privkey_forget(us->privkey_lru_tail);
+    }
+
+    return p;
+}
+
+/* Fetch the private key from the given OtrlUserState associated with
+ * the given account, if it is loaded */
+OtrlPrivKey *otrl_privkey_find_loaded(OtrlUserState us,
+	const char *accountname, const char *protocol)
+{
+    OtrlPrivKey *p, *found = NULL;
+    OtrlHashCursor cursor;
+    int matches = 0;
+
     if (!accountname || !protocol) return NULL;
 
+    privkey_index_sync(us);
+    if (otrl_hashtab_usable(&(us->privkey_index))) {
+	otrl_hashtab_lookup(&(us->privkey_index),
+		privkey_hash(accountname, protocol), &cursor);
+	while ((p = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!strcmp(p->accountname, accountname) &&
+		    !strcmp(p->protocol, protocol)) {
+		found = p;
+		matches++;
+	    }
+	}
+	/* If the account has several keys, the first one in the list is
+	 * the one in use */
+	if (matches <= 1) return found;
+    }
+
     for(p=us->privkey_root; p; p=p->next) {
 	if (!strcmp(p->accountname, accountname) &&
 		!strcmp(p->protocol, protocol)) {
@@ -829,13 +1117,28 @@ OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
     return NULL;
 }
 
-/* Forget a private key */
-void otrl_privkey_forget(OtrlPrivKey *privkey)
+/* Forget a private key, which is in the list of the given OtrlUserState
+ * (if us is not NULL) */
+static void privkey_forget(OtrlUserState us, OtrlPrivKey *privkey)
 {
+    if (us && privkey->on_demand) {
+	lru_unlink(us, privkey);
+	us->privkey_lazy_count--;
+    }
+    if (us) {
+	otrl_hashtab_remove(&(us->privkey_index),
+		privkey_hash(privkey->accountname, privkey->protocol),
+		privkey);
+	if (us->privkey_index_root == privkey) {
+	    us->privkey_index_root = privkey->next;
+	}
+    }
+
     free(privkey->accountname);
     free(privkey->protocol);
     gcry_sexp_release(privkey->privkey);
     free(privkey->pubkey_data);
+    free(privkey->fingerprint_of);
 
     /* Re-link the list */
     *(privkey->tous) = privkey->next;
@@ -847,11 +1150,17 @@ void otrl_privkey_forget(OtrlPrivKey *privkey)
     free(privkey);
 }
 
+/* Forget a private key */
+void otrl_privkey_forget(OtrlPrivKey *privkey)
+{
+    privkey_forget(privkey->us, privkey);
+}
+
 /* Forget all private keys in a given OtrlUserState. */
 void otrl_privkey_forget_all(OtrlUserState us)
 {
     while (us->privkey_root) {
-	otrl_privkey_forget(us->privkey_root);
+	privkey_forget(us, us->privkey_root);
     }
 }
 
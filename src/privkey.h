@@ -25,9 +25,7 @@
 #include "privkey-t.h"
 #include "userstate.h"
 
-/* The length of a string representing a human-readable version of a
- * fingerprint (including the trailing NUL) */
-#define OTRL_PRIVKEY_FPRINT_HUMAN_LEN 45
+struct s_OtrlPrivKeyStore;  /* See privstore.h */
 
 /* Convert a 20-byte hash value to a 45-byte human-readable value */
 void otrl_privkey_hash_to_human(
@@ -43,7 +41,9 @@ char *otrl_privkey_fingerprint(OtrlUserState us,
 
 /* Calculate a raw hash of our DSA public key.  Return it in the passed
  * fingerprint buffer.  Return NULL on error, or a pointer to the given
- * buffer on success. */
+ * buffer on success.  Both this and otrl_privkey_fingerprint copy out
+ * the hashes kept in the OtrlPrivKey, which are worked out once, when
+ * the key is loaded or generated. */
 unsigned char *otrl_privkey_fingerprint_raw(OtrlUserState us,
 	unsigned char hash[20], const char *accountname, const char *protocol);
 
@@ -55,6 +55,45 @@ gcry_error_t otrl_privkey_read(OtrlUserState us, const char *filename);
  * OtrlUserState.  The FILE* must be open for reading. */
 gcry_error_t otrl_privkey_read_FILEp(OtrlUserState us, FILE *privf);
 
+/* Open the indexed private key store (see privstore.h) in the given
+ * file for the given OtrlUserState, without loading any key: only the
+ * position of each account's record is read.  otrl_privkey_find then
+ * loads an account's key the first time it is asked for it.  If
+ * max_loaded is not 0, at most that many keys loaded this way are kept
+ * in memory, and the one found the longest ago is forgotten to make
+ * room for another; a pointer returned by otrl_privkey_find should
+ * then not be kept across calls that may find a different account's
+ * key.  Keys that were already in the OtrlUserState, or that are added
+ * by otrl_privkey_generate_finish_store, are kept.  An old private key
+ * file has to be converted first (see otrl_privkey_store_import).
+ *
+ * Until otrl_privkey_close_lazy, otrl_privkey_generate,
+ * otrl_privkey_generate_FILEp, otrl_privkey_generate_finish and
+ * otrl_privkey_generate_finish_FILEp add their key to this store, as
+ * otrl_privkey_generate_finish_store does, whatever file or FILE* they
+ * are given: writing out only the keys that happen to be loaded would
+ * lose the others. */
+gcry_error_t otrl_privkey_read_lazy(OtrlUserState us, const char *filename,
+	unsigned int max_loaded);
+
+/* Forget the keys loaded on demand, and close the store opened by
+ * otrl_privkey_read_lazy.  This is called by otrl_userstate_free. */
+void otrl_privkey_close_lazy(OtrlUserState us);
+
+/* Read one "account" S-exp of a private key file, and add its key to
+ * the given OtrlUserState, ahead of any key the account already has.
+ * This is used internally. */
+gcry_error_t otrl_privkey_read_account(OtrlUserState us,
+	gcry_sexp_t accounts);
+
+/* Render the "account" S-exp of a private key file for the given
+ * account, exactly as it is written to the file, into a
+ * newly-allocated, NUL-terminated buffer.  *lenp is set to its length,
+ * without the NUL.  The caller should free() the buffer.  This is used
+ * internally. */
+gcry_error_t otrl_privkey_account_sprint(char **bufp, size_t *lenp,
+	const char *accountname, const char *protocol, gcry_sexp_t privkey);
+
 /* Free the memory associated with the pending privkey list */
 void otrl_privkey_pending_forget_all(OtrlUserState us);
 
@@ -74,13 +113,19 @@ gcry_error_t otrl_privkey_generate_start(OtrlUserState us,
 gcry_error_t otrl_privkey_generate_calculate(void *newkey);
 
 /* Call this from the main thread only.  It will write the newly created
- * private key into the given file and store it in the OtrlUserState. */
+ * private key into the given file and store it in the OtrlUserState.
+ * The file is replaced atomically (see persist.h), and is left as it
+ * was if the new key cannot be read back from it.  If
+ * otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate_finish(OtrlUserState us,
 	void *newkey, const char *filename);
 
 /* Call this from the main thread only.  It will write the newly created
  * private key into the given FILE* (which must be open for reading and
- * writing) and store it in the OtrlUserState. */
+ * writing) and store it in the OtrlUserState.  If
+ * otrl_privkey_read_lazy was called, the key goes into its store
+ * instead, and the FILE* is left alone. */
 gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
 	void *newkey, FILE *privf);
 
@@ -89,16 +134,27 @@ gcry_error_t otrl_privkey_generate_finish_FILEp(OtrlUserState us,
  * and must not be used further. */
 void otrl_privkey_generate_cancelled(OtrlUserState us, void *newkey);
 
+/* Call this from the main thread only.  It will append the newly
+ * created private key to the given indexed store (see privstore.h) and
+ * store it in the OtrlUserState, without writing or reading back the
+ * keys of any other account. */
+gcry_error_t otrl_privkey_generate_finish_store(OtrlUserState us,
+	void *newkey, struct s_OtrlPrivKeyStore *store);
+
 /* Generate a private DSA key for a given account, storing it into a
  * file on disk, and loading it into the given OtrlUserState.  Overwrite any
- * previously generated keys for that account in that OtrlUserState. */
+ * previously generated keys for that account in that OtrlUserState.
+ * If otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate(OtrlUserState us, const char *filename,
 	const char *accountname, const char *protocol);
 
 /* Generate a private DSA key for a given account, storing it into a
  * FILE*, and loading it into the given OtrlUserState.  Overwrite any
  * previously generated keys for that account in that OtrlUserState.
- * The FILE* must be open for reading and writing. */
+ * The FILE* must be open for reading and writing.  If
+ * otrl_privkey_read_lazy was called, the key goes into its store
+ * instead. */
 gcry_error_t otrl_privkey_generate_FILEp(OtrlUserState us, FILE *privf,
 	const char *accountname, const char *protocol);
 
@@ -118,7 +174,9 @@ gcry_error_t otrl_privkey_read_fingerprints_FILEp(OtrlUserState us,
 	void (*add_app_data)(void *data, ConnContext *context),
 	void  *data);
 
-/* Write the fingerprint store from a given OtrlUserState to a file on disk. */
+/* Write the fingerprint store from a given OtrlUserState to a file on disk.
+ * The file is replaced atomically (see persist.h), so a crash while
+ * writing leaves the previous store intact. */
 gcry_error_t otrl_privkey_write_fingerprints(OtrlUserState us,
 	const char *filename);
 
@@ -128,10 +186,16 @@ gcry_error_t otrl_privkey_write_fingerprints_FILEp(OtrlUserState us,
 	FILE *storef);
 
 /* Fetch the private key from the given OtrlUserState associated with
- * the given account */
+ * the given account.  If otrl_privkey_read_lazy was called, a key that
+ * is not loaded yet is loaded from the store. */
 OtrlPrivKey *otrl_privkey_find(OtrlUserState us, const char *accountname,
 	const char *protocol);
 
+/* Fetch the private key from the given OtrlUserState associated with
+ * the given account, only if it is loaded already */
+OtrlPrivKey *otrl_privkey_find_loaded(OtrlUserState us,
+	const char *accountname, const char *protocol);
+
 /* Forget a private key */
 void otrl_privkey_forget(OtrlPrivKey *privkey);
 
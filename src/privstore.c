@@ -0,0 +1,563 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <io.h>
+#endif
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "privstore.h"
+#include "privkey.h"
+#include "persist.h"
+
+#define STORE_MAGIC "# OTR private key store 1\n"
+
+/* The longest record header, not counting the names */
+#define STORE_HEADER_EXTRA 13
+
+/* The hash of an account in store->index */
+static size_t entry_hash(const char *accountname, const char *protocol)
+{
+    return otrl_hashtab_hash_string(otrl_hashtab_hash_string(
+		OTRL_HASHTAB_SEED, accountname), protocol);
+}
+
+/* Cut the file short at the given length. */
+static int store_truncate(FILE *f, long len)
+{
+    fflush(f);
+#ifndef WIN32
+    return ftruncate(fileno(f), len);
+#else
+    return _chsize(_fileno(f), len);
+#endif
+}
+
+/* Read a line, growing *linep as needed.  Returns its length
+ * (including the newline, if there is one), or -1 at the end of the
+ * file. */
+static long read_line(FILE *f, char **linep, size_t *sizep)
+{
+    size_t len = 0;
+
+    for (;;) {
+	if (*sizep - len < 2) {
+	    size_t newsize = *sizep ? *sizep * 2 : 256;
+	    char *newline = realloc(*linep, newsize);
+	    if (!newline) return -1;
+	    *linep = newline;
+	    *sizep = newsize;
+	}
+	if (!fgets(*linep + len, *sizep - len, f)) break;
+	len += strlen(*linep + len);
+	if ((*linep)[len - 1] == '\n') break;
+    }
+    return len ? (long)len : -1;
+}
+
+/* Free an entry, which is in the list of the given store. */
+static void entry_forget(OtrlPrivKeyStore *store,
+	OtrlPrivKeyStoreEntry *entry)
+{
+    otrl_hashtab_remove(&(store->index),
+	    entry_hash(entry->accountname, entry->protocol), entry);
+
+    free(entry->accountname);
+    free(entry->protocol);
+
+    /* Re-link the list */
+    *(entry->tous) = entry->next;
+    if (entry->next) {
+	entry->next->tous = entry->tous;
+    }
+
+    free(entry);
+}
+
+/* Find the newest record of the given account. */
+OtrlPrivKeyStoreEntry *otrl_privkey_store_find(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol)
+{
+    OtrlPrivKeyStoreEntry *entry;
+
+    if (otrl_hashtab_usable(&(store->index))) {
+	OtrlHashCursor cursor;
+
+	otrl_hashtab_lookup(&(store->index),
+		entry_hash(accountname, protocol), &cursor);
+	while ((entry = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!strcmp(entry->accountname, accountname) &&
+		    !strcmp(entry->protocol, protocol)) {
+		return entry;
+	    }
+	}
+	return NULL;
+    }
+
+    for (entry = store->entry_root; entry; entry = entry->next) {
+	if (!strcmp(entry->accountname, accountname) &&
+		!strcmp(entry->protocol, protocol)) {
+	    return entry;
+	}
+    }
+    return NULL;
+}
+
+/* Note that the newest record of the given account is at the given
+ * offset, with the given length (0 if the account has no key). */
+static gcry_error_t store_set(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol, long offset,
+	size_t len)
+{
+    OtrlPrivKeyStoreEntry *entry =
+	    otrl_privkey_store_find(store, accountname, protocol);
+
+    if (len == 0) {
+	if (entry) entry_forget(store, entry);
+	return gcry_error(GPG_ERR_NO_ERROR);
+    }
+
+    if (!entry) {
+	entry = malloc(sizeof(OtrlPrivKeyStoreEntry));
+	if (!entry) return gcry_error(GPG_ERR_ENOMEM);
+	entry->accountname = strdup(accountname);
+	entry->protocol = strdup(protocol);
+	if (!entry->accountname || !entry->protocol) {
+	    free(entry->accountname);
+	    free(entry->protocol);
+	    free(entry);
+	    return gcry_error(GPG_ERR_ENOMEM);
+	}
+	entry->next = store->entry_root;
+	if (entry->next) {
+	    entry->next->tous = &(entry->next);
+	}
+	entry->tous = &(store->entry_root);
+	store->entry_root = entry;
+	otrl_hashtab_add(&(store->index),
+		entry_hash(accountname, protocol), entry);
+    }
+    entry->offset = offset;
+    entry->len = len;
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Read the record headers of the store, and drop a record cut short at
+ * the end of the file. */
+static gcry_error_t store_scan(OtrlPrivKeyStore *store)
+{
+    FILE *f = store->f;
+    struct stat st;
+    char *line = NULL;
+    size_t linesize = 0;
+    long linelen, pos, filesize;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    if (fstat(fileno(f), &st)) {
+	return gcry_error_from_errno(errno);
+    }
+    filesize = st.st_size;
+
+    /* A new store */
+    if (filesize == 0) {
+	if (fputs(STORE_MAGIC, f) == EOF) {
+	    return gcry_error_from_errno(errno);
+	}
+	err = otrl_persist_sync(f);
+	store->end = ftell(f);
+	return err;
+    }
+
+    linelen = read_line(f, &line, &linesize);
+    if (linelen < 0 || strcmp(line, STORE_MAGIC)) {
+	free(line);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    pos = ftell(f);
+
+    while ((linelen = read_line(f, &line, &linesize)) >= 0) {
+	char *protocol, *lenstr, *end;
+	unsigned long len;
+
+	/* The last record was being appended when we crashed */
+	if (line[linelen - 1] != '\n') break;
+
+	protocol = strchr(line, '\t');
+	lenstr = protocol ? strchr(protocol + 1, '\t') : NULL;
+	if (!lenstr || linelen - (lenstr + 1 - line) != 11) {
+	    err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	    break;
+	}
+	*protocol++ = '\0';
+	*lenstr++ = '\0';
+	len = strtoul(lenstr, &end, 10);
+	if (end != lenstr + 10) {
+	    err = gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+	    break;
+	}
+
+	/* Likewise */
+	if ((unsigned long)(filesize - ftell(f)) < len) break;
+
+	err = store_set(store, line, protocol, ftell(f), len);
+	if (err) break;
+	store->numrecords++;
+	fseek(f, len, SEEK_CUR);
+	pos = ftell(f);
+    }
+    free(line);
+    if (err) return err;
+
+    if (pos < filesize) {
+	store_truncate(f, pos);
+    }
+    store->end = pos;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Open the indexed private key store in the given file. */
+gcry_error_t otrl_privkey_store_open(OtrlPrivKeyStore **storep,
+	const char *filename)
+{
+    OtrlPrivKeyStore *store;
+    gcry_error_t err;
+#ifndef WIN32
+    int fd;
+#endif
+
+    *storep = NULL;
+    store = calloc(1, sizeof(OtrlPrivKeyStore));
+    if (!store) return gcry_error(GPG_ERR_ENOMEM);
+    otrl_hashtab_init(&(store->index));
+    store->filename = strdup(filename);
+    if (!store->filename) {
+	otrl_privkey_store_close(store);
+	return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+#ifndef WIN32
+    fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0) {
+	store->f = fdopen(fd, "r+b");
+	if (!store->f) close(fd);
+    }
+#else
+    store->f = fopen(filename, "r+b");
+    if (!store->f && errno == ENOENT) {
+	store->f = fopen(filename, "w+b");
+    }
+#endif
+    if (!store->f) {
+	err = gcry_error_from_errno(errno);
+	otrl_privkey_store_close(store);
+	return err;
+    }
+
+    err = store_scan(store);
+    if (err) {
+	otrl_privkey_store_close(store);
+	return err;
+    }
+
+    *storep = store;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Close a store. */
+void otrl_privkey_store_close(OtrlPrivKeyStore *store)
+{
+    if (!store) return;
+
+    while (store->entry_root) {
+	entry_forget(store, store->entry_root);
+    }
+    otrl_hashtab_free(&(store->index));
+    if (store->f) fclose(store->f);
+    free(store->filename);
+    free(store);
+}
+
+/* Load the key of the given account from the store into the given
+ * OtrlUserState. */
+gcry_error_t otrl_privkey_store_load(OtrlUserState us,
+	OtrlPrivKeyStore *store, const char *accountname,
+	const char *protocol)
+{
+    OtrlPrivKeyStoreEntry *entry;
+    OtrlPrivKey *old, *p;
+    gcry_sexp_t accounts;
+    gcry_error_t err;
+    char *buf;
+
+    entry = otrl_privkey_store_find(store, accountname, protocol);
+    if (!entry) return gcry_error(GPG_ERR_NOT_FOUND);
+
+    buf = malloc(entry->len);
+    if (!buf) return gcry_error(GPG_ERR_ENOMEM);
+    if (fseek(store->f, entry->offset, SEEK_SET) ||
+	    fread(buf, entry->len, 1, store->f) != 1) {
+	err = gcry_error_from_errno(errno ? errno : EIO);
+	free(buf);
+	return err;
+    }
+    err = gcry_sexp_new(&accounts, buf, entry->len, 0);
+    free(buf);
+    if (err) return err;
+
+    old = otrl_privkey_find_loaded(us, accountname, protocol);
+    err = otrl_privkey_read_account(us, accounts);
+    gcry_sexp_release(accounts);
+    if (err) return err;
+
+    /* The new key is now at the head of the list */
+    p = us->privkey_root;
+    if (strcmp(p->accountname, accountname) ||
+	    strcmp(p->protocol, protocol)) {
+	otrl_privkey_forget(p);
+	return gcry_error(GPG_ERR_UNUSABLE_SECKEY);
+    }
+    if (old) otrl_privkey_forget(old);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Load the key of every account in the store. */
+gcry_error_t otrl_privkey_store_load_all(OtrlUserState us,
+	OtrlPrivKeyStore *store)
+{
+    OtrlPrivKeyStoreEntry *entry;
+
+    for (entry = store->entry_root; entry; entry = entry->next) {
+	gcry_error_t err = otrl_privkey_store_load(us, store,
+		entry->accountname, entry->protocol);
+	if (err) return err;
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Append a record to the store, and sync it to disk if sync is set.
+ * On failure, the file is cut back to what it was. */
+static gcry_error_t store_append(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol, const char *body,
+	size_t len, int sync)
+{
+    char *header;
+    size_t headerlen;
+    gcry_error_t err = gcry_error(GPG_ERR_NO_ERROR);
+
+    /* The names can't hold the characters that end them */
+    if (strpbrk(accountname, "\t\n") || strpbrk(protocol, "\t\n")) {
+	return gcry_error(GPG_ERR_INV_VALUE);
+    }
+
+    headerlen = strlen(accountname) + strlen(protocol) + STORE_HEADER_EXTRA;
+    header = malloc(headerlen + 1);
+    if (!header) return gcry_error(GPG_ERR_ENOMEM);
+    snprintf(header, headerlen + 1, "%s\t%s\t%010lu\n", accountname,
+	    protocol, (unsigned long)len);
+
+    if (fseek(store->f, store->end, SEEK_SET) ||
+	    fwrite(header, headerlen, 1, store->f) != 1 ||
+	    (len > 0 && fwrite(body, len, 1, store->f) != 1) ||
+	    fflush(store->f)) {
+	err = gcry_error_from_errno(errno ? errno : EIO);
+    }
+    free(header);
+    if (!err && sync) err = otrl_persist_sync(store->f);
+    if (!err) {
+	err = store_set(store, accountname, protocol,
+		store->end + (long)headerlen, len);
+    }
+    if (err) {
+	store_truncate(store->f, store->end);
+	return err;
+    }
+
+    store->end += headerlen + len;
+    store->numrecords++;
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Append a key to the store. */
+static gcry_error_t store_add(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol, gcry_sexp_t privkey,
+	int sync)
+{
+    gcry_error_t err;
+    char *body;
+    size_t len;
+
+    err = otrl_privkey_account_sprint(&body, &len, accountname, protocol,
+	    privkey);
+    if (err) return err;
+    err = store_append(store, accountname, protocol, body, len, sync);
+    free(body);
+    return err;
+}
+
+/* Append the given key for the given account to the store. */
+gcry_error_t otrl_privkey_store_add(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol, gcry_sexp_t privkey)
+{
+    return store_add(store, accountname, protocol, privkey, 1);
+}
+
+/* Remove the key of the given account from the store. */
+gcry_error_t otrl_privkey_store_remove(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol)
+{
+    if (!otrl_privkey_store_find(store, accountname, protocol)) {
+	return gcry_error(GPG_ERR_NOT_FOUND);
+    }
+    return store_append(store, accountname, protocol, NULL, 0, 1);
+}
+
+/* Add every key in the given OtrlUserState to the store. */
+gcry_error_t otrl_privkey_store_import(OtrlPrivKeyStore *store,
+	OtrlUserState us)
+{
+    OtrlPrivKey *p;
+    gcry_error_t err;
+
+    /* Sync once, at the end */
+    for (p = us->privkey_root; p; p = p->next) {
+	/* Only the key in use, if an account has several */
+	if (otrl_privkey_find_loaded(us, p->accountname, p->protocol) != p) {
+	    continue;
+	}
+	err = store_add(store, p->accountname, p->protocol, p->privkey, 0);
+	if (err) return err;
+    }
+    return otrl_persist_sync(store->f);
+}
+
+/* Rewrite the store with the newest record of each account only. */
+gcry_error_t otrl_privkey_store_compact(OtrlPrivKeyStore *store)
+{
+    OtrlPrivKeyStoreEntry *entry;
+    OtrlPersistFile pf;
+    FILE *newf = NULL;
+    long *offsets = NULL;
+    char *buf = NULL;
+    size_t bufsize = 0, numentries = 0, i;
+    gcry_error_t err;
+
+    for (entry = store->entry_root; entry; entry = entry->next) {
+	numentries++;
+    }
+    if (numentries > 0) {
+	offsets = malloc(numentries * sizeof(long));
+	if (!offsets) return gcry_error(GPG_ERR_ENOMEM);
+    }
+
+    err = otrl_persist_open(&pf, store->filename, 1);
+    if (err) {
+	free(offsets);
+	return err;
+    }
+    if (fputs(STORE_MAGIC, pf.f) == EOF) {
+	err = gcry_error_from_errno(errno);
+    }
+
+    /* Copy the records over as they are; no key needs parsing */
+    for (entry = store->entry_root, i = 0; entry && !err;
+	    entry = entry->next, ++i) {
+	if (entry->len > bufsize) {
+	    char *newbuf = realloc(buf, entry->len);
+	    if (!newbuf) {
+		err = gcry_error(GPG_ERR_ENOMEM);
+		break;
+	    }
+	    buf = newbuf;
+	    bufsize = entry->len;
+	}
+	if (fseek(store->f, entry->offset, SEEK_SET) ||
+		fread(buf, entry->len, 1, store->f) != 1 ||
+		fprintf(pf.f, "%s\t%s\t%010lu\n", entry->accountname,
+		    entry->protocol, (unsigned long)entry->len) < 0) {
+	    err = gcry_error_from_errno(errno ? errno : EIO);
+	    break;
+	}
+	offsets[i] = ftell(pf.f);
+	if (fwrite(buf, entry->len, 1, pf.f) != 1) {
+	    err = gcry_error_from_errno(errno);
+	}
+    }
+    free(buf);
+
+#ifndef WIN32
+    /* Keep a handle on the new file, which becomes the store once it
+     * is renamed */
+    if (!err) {
+	newf = fopen(pf.tmpname, "r+b");
+	if (!newf) err = gcry_error_from_errno(errno);
+    }
+#endif
+    if (err) {
+	otrl_persist_abort(&pf);
+	free(offsets);
+	return err;
+    }
+
+#ifdef WIN32
+    /* An open file can't be replaced here */
+    fclose(store->f);
+    store->f = NULL;
+#endif
+    err = otrl_persist_commit(NULL, &pf);
+#ifdef WIN32
+    store->f = fopen(store->filename, "r+b");
+    if (!store->f && !err) err = gcry_error_from_errno(errno);
+#endif
+    if (err) {
+	if (newf) fclose(newf);
+	free(offsets);
+	return err;
+    }
+
+#ifndef WIN32
+    fclose(store->f);
+    store->f = newf;
+#endif
+    fseek(store->f, 0, SEEK_END);
+    store->end = ftell(store->f);
+    store->numrecords = numentries;
+    for (entry = store->entry_root, i = 0; entry; entry = entry->next, ++i) {
+	entry->offset = offsets[i];
+    }
+    free(offsets);
+
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
@@ -0,0 +1,121 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __PRIVSTORE_H__
+#define __PRIVSTORE_H__
+
+#include <stdio.h>
+#include <gcrypt.h>
+
+#include "userstate.h"
+#include "hashtab.h"
+
+/* An indexed private key store: a private key file made of one record
+ * per account, rather than of a single S-expression holding every key.
+ * Adding a key for an account appends a record, and loading a key
+ * parses its record only, so neither costs more with many accounts
+ * than with few.  The file is
+ *
+ *   # OTR private key store 1
+ *   accountname<TAB>protocol<TAB>length<NEWLINE>
+ *   the account's S-expression, exactly as in a private key file
+ *   ...
+ *
+ * with the length (in decimal, of the S-expression) always written
+ * with ten digits.  A later record for an account replaces the earlier
+ * ones, and a record of length 0 removes the account's key.  Records
+ * left behind that way are only dropped when the store is compacted.
+ * A record cut short by a crash while it was being appended is dropped
+ * when the store is opened. */
+
+/* Where the newest record of an account is */
+typedef struct s_OtrlPrivKeyStoreEntry {
+    struct s_OtrlPrivKeyStoreEntry *next;
+    struct s_OtrlPrivKeyStoreEntry **tous;
+
+    char *accountname;
+    char *protocol;
+    long offset;                /* Of the S-expression in the file */
+    size_t len;                 /* Its length */
+} OtrlPrivKeyStoreEntry;
+
+typedef struct s_OtrlPrivKeyStore {
+    FILE *f;                    /* Open for reading and writing */
+    char *filename;
+    long end;                   /* Where the next record goes */
+    OtrlPrivKeyStoreEntry *entry_root;  /* The accounts with a key */
+    OtrlHashTable index;        /* entry_root, by accountname and
+				   protocol */
+    unsigned int numrecords;    /* The records in the file, including
+				   the replaced and removed ones */
+} OtrlPrivKeyStore;
+
+/* Open the indexed private key store in the given file, creating it
+ * (readable by its owner only) if it does not exist.  Only the record
+ * headers are read; no key is parsed until it is loaded.  Returns
+ * GPG_ERR_UNUSABLE_SECKEY if the file is not an indexed store (an old
+ * private key file can be converted with otrl_privkey_store_import). */
+gcry_error_t otrl_privkey_store_open(OtrlPrivKeyStore **storep,
+	const char *filename);
+
+/* Close a store. */
+void otrl_privkey_store_close(OtrlPrivKeyStore *store);
+
+/* Find the newest record of the given account, or return NULL if the
+ * store has no key for it. */
+OtrlPrivKeyStoreEntry *otrl_privkey_store_find(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol);
+
+/* Load the key of the given account from the store into the given
+ * OtrlUserState, replacing any key the account had there.  The keys
+ * of other accounts are left alone.  Returns GPG_ERR_NOT_FOUND if the
+ * store has no key for the account. */
+gcry_error_t otrl_privkey_store_load(OtrlUserState us,
+	OtrlPrivKeyStore *store, const char *accountname,
+	const char *protocol);
+
+/* Load the key of every account in the store into the given
+ * OtrlUserState. */
+gcry_error_t otrl_privkey_store_load_all(OtrlUserState us,
+	OtrlPrivKeyStore *store);
+
+/* Append the given key for the given account to the store, replacing
+ * the key it had, and sync it to disk. */
+gcry_error_t otrl_privkey_store_add(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol, gcry_sexp_t privkey);
+
+/* Remove the key of the given account from the store.  Returns
+ * GPG_ERR_NOT_FOUND if it had none. */
+gcry_error_t otrl_privkey_store_remove(OtrlPrivKeyStore *store,
+	const char *accountname, const char *protocol);
+
+/* Add every key in the given OtrlUserState to the store.  Reading an
+ * old private key file with otrl_privkey_read and then calling this
+ * converts it to an indexed store. */
+gcry_error_t otrl_privkey_store_import(OtrlPrivKeyStore *store,
+	OtrlUserState us);
+
+/* Rewrite the store with the newest record of each account only.  The
+ * file is replaced atomically (see persist.h); on failure, the store
+ * is left as it was. */
+gcry_error_t otrl_privkey_store_compact(OtrlPrivKeyStore *store);
+
+#endif
@@ -38,6 +38,8 @@
 #include "version.h"
 #include "tlv.h"
 #include "serial.h"
+#include "stats.h"
+#include "trace.h"
 
 #if OTRL_DEBUGGING
 extern const char *OTRL_DEBUGGING_DEBUGSTR;
@@ -104,37 +106,39 @@ static gcry_error_t reveal_macs(ConnContext *context,
 	sess2->rcvmacused + sess2->sendmacused;
     unsigned int newnumsaved;
     unsigned char *newmacs;
+    ConnContextKeys *keys = context->context_priv->keys;
 
     /* Is there anything to do? */
     if (numnew == 0) return gcry_error(GPG_ERR_NO_ERROR);
 
-    newnumsaved = context->context_priv->numsavedkeys + numnew;
-    newmacs = realloc(context->context_priv->saved_mac_keys,
+    newnumsaved = keys->numsavedkeys + numnew;
+    newmacs = realloc(keys->saved_mac_keys,
 	    newnumsaved * 20);
     if (!newmacs) {
 	return gcry_error(GPG_ERR_ENOMEM);
     }
     if (sess1->rcvmacused) {
-	memmove(newmacs + context->context_priv->numsavedkeys * 20,
+	memmove(newmacs + keys->numsavedkeys * 20,
 		sess1->rcvmackey, 20);
-	context->context_priv->numsavedkeys++;
+	keys->numsavedkeys++;
     }
     if (sess1->sendmacused) {
-	memmove(newmacs + context->context_priv->numsavedkeys * 20,
+	memmove(newmacs + keys->numsavedkeys * 20,
 		sess1->sendmackey, 20);
-	context->context_priv->numsavedkeys++;
+	keys->numsavedkeys++;
     }
     if (sess2->rcvmacused) {
-	memmove(newmacs + context->context_priv->numsavedkeys * 20,
+	memmove(newmacs + keys->numsavedkeys * 20,
 		sess2->rcvmackey, 20);
-	context->context_priv->numsavedkeys++;
+	keys->numsavedkeys++;
     }
     if (sess2->sendmacused) {
-	memmove(newmacs + context->context_priv->numsavedkeys * 20,
+	memmove(newmacs + keys->numsavedkeys * 20,
 		sess2->sendmackey, 20);
-	context->context_priv->numsavedkeys++;
+	keys->numsavedkeys++;
     }
-    context->context_priv->saved_mac_keys = newmacs;
+    keys->saved_mac_keys = newmacs;
+    otrl_stats_add(context->context_priv->us, OTRL_STATS_MACS_SAVED, numnew);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -144,46 +148,47 @@ static gcry_error_t reveal_macs(ConnContext *context,
 static gcry_error_t rotate_dh_keys(ConnContext *context)
 {
     gcry_error_t err;
+    ConnContextKeys *keys = context->context_priv->keys;
 
     /* Rotate the keypair */
-    otrl_dh_keypair_free(&(context->context_priv->our_old_dh_key));
-    memmove(&(context->context_priv->our_old_dh_key),
-	    &(context->context_priv->our_dh_key),
+    otrl_dh_keypair_free(&(keys->our_old_dh_key));
+    memmove(&(keys->our_old_dh_key),
+	    &(keys->our_dh_key),
 	    sizeof(DH_keypair));
 
     /* Rotate the session keys */
-    err = reveal_macs(context, &(context->context_priv->sesskeys[1][0]),
-	    &(context->context_priv->sesskeys[1][1]));
+    err = reveal_macs(context, &(keys->sesskeys[1][0]),
+	    &(keys->sesskeys[1][1]));
     if (err) return err;
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][0]));
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][1]));
-    memmove(&(context->context_priv->sesskeys[1][0]),
-	    &(context->context_priv->sesskeys[0][0]),
+    otrl_dh_session_free(&(keys->sesskeys[1][0]));
+    otrl_dh_session_free(&(keys->sesskeys[1][1]));
+    memmove(&(keys->sesskeys[1][0]),
+	    &(keys->sesskeys[0][0]),
 	    sizeof(DH_sesskeys));
-    memmove(&(context->context_priv->sesskeys[1][1]),
-	    &(context->context_priv->sesskeys[0][1]),
+    memmove(&(keys->sesskeys[1][1]),
+	    &(keys->sesskeys[0][1]),
 	    sizeof(DH_sesskeys));
 
     /* Create a new DH key */
-    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(context->context_priv->our_dh_key));
-    context->context_priv->our_keyid++;
+    otrl_dh_gen_keypair(DH1536_GROUP_ID, &(keys->our_dh_key));
+    keys->our_keyid++;
 
     /* Make the session keys */
-    if (context->context_priv->their_y) {
-	err = otrl_dh_session(&(context->context_priv->sesskeys[0][0]),
-		&(context->context_priv->our_dh_key),
-		context->context_priv->their_y);
+    if (keys->their_y) {
+	err = otrl_dh_session(&(keys->sesskeys[0][0]),
+		&(keys->our_dh_key),
+		keys->their_y);
 	if (err) return err;
     } else {
-	otrl_dh_session_blank(&(context->context_priv->sesskeys[0][0]));
+	otrl_dh_session_blank(&(keys->sesskeys[0][0]));
     }
-    if (context->context_priv->their_old_y) {
-	err = otrl_dh_session(&(context->context_priv->sesskeys[0][1]),
-		&(context->context_priv->our_dh_key),
-		context->context_priv->their_old_y);
+    if (keys->their_old_y) {
+	err = otrl_dh_session(&(keys->sesskeys[0][1]),
+		&(keys->our_dh_key),
+		keys->their_old_y);
 	if (err) return err;
     } else {
-	otrl_dh_session_blank(&(context->context_priv->sesskeys[0][1]));
+	otrl_dh_session_blank(&(keys->sesskeys[0][1]));
     }
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -193,36 +198,37 @@ static gcry_error_t rotate_dh_keys(ConnContext *context)
 static gcry_error_t rotate_y_keys(ConnContext *context, gcry_mpi_t new_y)
 {
     gcry_error_t err;
+    ConnContextKeys *keys = context->context_priv->keys;
 
     /* Rotate the public key */
-    gcry_mpi_release(context->context_priv->their_old_y);
-    context->context_priv->their_old_y = context->context_priv->their_y;
+    gcry_mpi_release(keys->their_old_y);
+    keys->their_old_y = keys->their_y;
 
     /* Rotate the session keys */
-    err = reveal_macs(context, &(context->context_priv->sesskeys[0][1]),
-	    &(context->context_priv->sesskeys[1][1]));
+    err = reveal_macs(context, &(keys->sesskeys[0][1]),
+	    &(keys->sesskeys[1][1]));
     if (err) return err;
-    otrl_dh_session_free(&(context->context_priv->sesskeys[0][1]));
-    otrl_dh_session_free(&(context->context_priv->sesskeys[1][1]));
-    memmove(&(context->context_priv->sesskeys[0][1]),
-	    &(context->context_priv->sesskeys[0][0]),
+    otrl_dh_session_free(&(keys->sesskeys[0][1]));
+    otrl_dh_session_free(&(keys->sesskeys[1][1]));
+    memmove(&(keys->sesskeys[0][1]),
+	    &(keys->sesskeys[0][0]),
 	    sizeof(DH_sesskeys));
-    memmove(&(context->context_priv->sesskeys[1][1]),
-	    &(context->context_priv->sesskeys[1][0]),
+    memmove(&(keys->sesskeys[1][1]),
+	    &(keys->sesskeys[1][0]),
 	    sizeof(DH_sesskeys));
 
     /* Copy in the new public key */
-    context->context_priv->their_y = gcry_mpi_copy(new_y);
-    context->context_priv->their_keyid++;
+    keys->their_y = gcry_mpi_copy(new_y);
+    keys->their_keyid++;
 
     /* Make the session keys */
-    err = otrl_dh_session(&(context->context_priv->sesskeys[0][0]),
-	    &(context->context_priv->our_dh_key),
-	    context->context_priv->their_y);
+    err = otrl_dh_session(&(keys->sesskeys[0][0]),
+	    &(keys->our_dh_key),
+	    keys->their_y);
     if (err) return err;
-    err = otrl_dh_session(&(context->context_priv->sesskeys[1][0]),
-	    &(context->context_priv->our_old_dh_key),
-	    context->context_priv->their_y);
+    err = otrl_dh_session(&(keys->sesskeys[1][0]),
+	    &(keys->our_old_dh_key),
+	    keys->their_y);
     if (err) return err;
 
     return gcry_error(GPG_ERR_NO_ERROR);
@@ -472,11 +478,8 @@ invval:
     return err;
 }
 
-/* Create an OTR Data message.  Pass the plaintext as msg, and an
- * optional chain of TLVs.  A newly-allocated string will be returned in
- * *encmessagep. Put the current extra symmetric key into extrakey
- * (if non-NULL). */
-gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
+/* The work of otrl_proto_create_data */
+static gcry_error_t create_data(char **encmessagep, ConnContext *context,
 	const char *msg, const OtrlTLV *tlvs, unsigned char flags,
 	unsigned char *extrakey)
 {
@@ -487,9 +490,10 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     unsigned char *buf = NULL;
     unsigned char *bufp;
     size_t lenp;
-    DH_sesskeys *sess = &(context->context_priv->sesskeys[1][0]);
+    ConnContextKeys *keys;
+    DH_sesskeys *sess;
     gcry_error_t err;
-    size_t reveallen = 20 * context->context_priv->numsavedkeys;
+    size_t reveallen;
     char *base64buf = NULL;
     unsigned char *msgbuf = NULL;
     enum gcry_mpi_format format = GCRYMPI_FMT_USG;
@@ -499,10 +503,20 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     *encmessagep = NULL;
 
     /* Make sure we're actually supposed to be able to encrypt */
-    if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED ||
-	    context->context_priv->their_keyid == 0) {
+    if (context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
+	return gcry_error(GPG_ERR_CONFLICT);
+    }
+
+    /* Wake the keys up if they went to sleep while idle */
+    err = otrl_context_priv_wake(context->context_priv);
+    if (err) return err;
+
+    keys = context->context_priv->keys;
+    if (keys->their_keyid == 0) {
 	return gcry_error(GPG_ERR_CONFLICT);
     }
+    sess = &(keys->sesskeys[1][0]);
+    reveallen = 20 * keys->numsavedkeys;
 
     /* We need to copy the incoming msg, since it might be an alias for
      * context->lastmessage, which we'll be freeing soon. */
@@ -518,7 +532,7 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 	+ (version == 2 || version == 3 ? 1 : 0) + 4 + 4
 	+ 8 + 4 + msglen + 4 + reveallen + 20;
     gcry_mpi_print(format, NULL, 0, &pubkeylen,
-	    context->context_priv->our_dh_key.pub);
+	    keys->our_dh_key.pub);
     buflen += pubkeylen + 4;
     buf = malloc(buflen);
     msgbuf = gcry_malloc_secure(msglen);
@@ -557,12 +571,12 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
 	bufp += 1; lenp -= 1;
     }
 
-    write_int(context->context_priv->our_keyid-1); /* sender keyid */
+    write_int(keys->our_keyid-1); /* sender keyid */
     debug_int("Sender keyid", bufp-4);
-    write_int(context->context_priv->their_keyid); /* recipient keyid */
+    write_int(keys->their_keyid); /* recipient keyid */
     debug_int("Recipient keyid", bufp-4);
 
-    write_mpi(context->context_priv->our_dh_key.pub, pubkeylen, "Y");  /* Y */
+    write_mpi(keys->our_dh_key.pub, pubkeylen, "Y");  /* Y */
 
     otrl_dh_incctr(sess->sendctr);
     memmove(bufp, sess->sendctr, 8);      /* Counter (top 8 bytes only) */
@@ -593,12 +607,14 @@ gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
     debug_int("Revealed MAC length", bufp-4);
 
     if (reveallen > 0) {
-	memmove(bufp, context->context_priv->saved_mac_keys, reveallen);
+	memmove(bufp, keys->saved_mac_keys, reveallen);
 	debug_data("Revealed MAC data", bufp, reveallen);
 	bufp += reveallen; lenp -= reveallen;
-	free(context->context_priv->saved_mac_keys);
-	context->context_priv->saved_mac_keys = NULL;
-	context->context_priv->numsavedkeys = 0;
+	free(keys->saved_mac_keys);
+	keys->saved_mac_keys = NULL;
+	otrl_stats_add(context->context_priv->us, OTRL_STATS_MACS_REVEALED,
+		keys->numsavedkeys);
+	keys->numsavedkeys = 0;
     }
 
     assert(lenp == 0);
@@ -638,6 +654,26 @@ err:
     return err;
 }
 
+/* Create an OTR Data message.  Pass the plaintext as msg, and an
+ * optional chain of TLVs.  A newly-allocated string will be returned in
+ * *encmessagep. Put the current extra symmetric key into extrakey
+ * (if non-NULL). */
+gcry_error_t otrl_proto_create_data(char **encmessagep, ConnContext *context,
+	const char *msg, const OtrlTLV *tlvs, unsigned char flags,
+	unsigned char *extrakey)
+{
+    OtrlUserState us = context->context_priv->us;
+    unsigned long long start = otrl_stats_start(us);
+    gcry_error_t err;
+
+    OTRL_TRACE3(proto_create_data_entry, context, msg,
+	    context->protocol_version);
+    err = create_data(encmessagep, context, msg, tlvs, flags, extrakey);
+    otrl_stats_end(us, OTRL_STATS_DATA_ENCRYPT, start, err);
+    OTRL_TRACE2(proto_create_data_return, context, err);
+    return err;
+}
+
 /* Extract the flags from an otherwise unreadable Data Message. */
 gcry_error_t otrl_proto_data_read_flags(const char *datamsg,
 	unsigned char *flagsp)
@@ -698,11 +734,8 @@ invval:
     return gcry_error(GPG_ERR_INV_VALUE);
 }
 
-/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
- * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
- * received flags into *flagsp (if non-NULL).  Put the current extra
- * symmetric key into extrakey (if non-NULL). */
-gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
+/* The work of otrl_proto_accept_data */
+static gcry_error_t accept_data(char **plaintextp, OtrlTLV **tlvsp,
 	ConnContext *context, const char *datamsg, unsigned char *flagsp,
 	unsigned char *extrakey)
 {
@@ -714,6 +747,7 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     unsigned char *bufp;
     unsigned int sender_keyid, recipient_keyid;
     gcry_mpi_t sender_next_y = NULL;
+    OtrlUserState us = context->context_priv->us;
     unsigned char ctr[8];
     size_t datalen, reveallen;
     unsigned char *data = NULL;
@@ -721,6 +755,7 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     unsigned char givenmac[20];
     DH_sesskeys *sess;
     unsigned char version;
+    ConnContextKeys *keys;
 
     *plaintextp = NULL;
     *tlvsp = NULL;
@@ -798,27 +833,32 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
     /* That should be everything */
     if (lenp != 0) goto invval;
 
+    /* Wake the keys up if they went to sleep while idle */
+    err = otrl_context_priv_wake(context->context_priv);
+    if (err) goto err;
+    keys = context->context_priv->keys;
+
     /* We don't take any action on this message (especially rotating
      * keys) until we've verified the MAC on this message.  To that end,
      * we need to know which keys this message is claiming to use. */
-    if (context->context_priv->their_keyid == 0 ||
-	    (sender_keyid != context->context_priv->their_keyid &&
-		sender_keyid != context->context_priv->their_keyid - 1) ||
-	    (recipient_keyid != context->context_priv->our_keyid &&
-	     recipient_keyid != context->context_priv->our_keyid - 1) ||
+    if (keys->their_keyid == 0 ||
+	    (sender_keyid != keys->their_keyid &&
+		sender_keyid != keys->their_keyid - 1) ||
+	    (recipient_keyid != keys->our_keyid &&
+	     recipient_keyid != keys->our_keyid - 1) ||
 	    sender_keyid == 0 || recipient_keyid == 0) {
 	goto conflict;
     }
 
-    if (sender_keyid == context->context_priv->their_keyid - 1 &&
-	    context->context_priv->their_old_y == NULL) {
+    if (sender_keyid == keys->their_keyid - 1 &&
+	    keys->their_old_y == NULL) {
 	goto conflict;
     }
 
     /* These are the session keys this message is claiming to use. */
-    sess = &(context->context_priv->sesskeys
-	    [context->context_priv->our_keyid - recipient_keyid]
-	    [context->context_priv->their_keyid - sender_keyid]);
+    sess = &(keys->sesskeys
+	    [keys->our_keyid - recipient_keyid]
+	    [keys->their_keyid - sender_keyid]);
 
     gcry_md_reset(sess->rcvmac);
     gcry_md_write(sess->rcvmac, macstart, macend-macstart);
@@ -851,15 +891,19 @@ gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
 
     /* See if either set of keys needs rotating */
 
-    if (recipient_keyid == context->context_priv->our_keyid) {
+    if (recipient_keyid == keys->our_keyid) {
 	/* They're using our most recent key, so generate a new one */
+	unsigned long long start = otrl_stats_start(us);
 	err = rotate_dh_keys(context);
+	otrl_stats_end(us, OTRL_STATS_ROTATE_DH, start, err);
 	if (err) goto err;
     }
 
-    if (sender_keyid == context->context_priv->their_keyid) {
+    if (sender_keyid == keys->their_keyid) {
 	/* They've sent us a new public key */
+	unsigned long long start = otrl_stats_start(us);
 	err = rotate_y_keys(context, sender_next_y);
+	otrl_stats_end(us, OTRL_STATS_ROTATE_Y, start, err);
 	if (err) goto err;
     }
 
@@ -889,8 +933,29 @@ err:
     return err;
 }
 
-/* Accumulate a potential fragment into the current context. */
-OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
+/* Accept an OTR Data Message in datamsg.  Decrypt it and put the
+ * plaintext into *plaintextp, and any TLVs into tlvsp.  Put any
+ * received flags into *flagsp (if non-NULL).  Put the current extra
+ * symmetric key into extrakey (if non-NULL). */
+gcry_error_t otrl_proto_accept_data(char **plaintextp, OtrlTLV **tlvsp,
+	ConnContext *context, const char *datamsg, unsigned char *flagsp,
+	unsigned char *extrakey)
+{
+    OtrlUserState us = context->context_priv->us;
+    unsigned long long start = otrl_stats_start(us);
+    gcry_error_t err;
+
+    OTRL_TRACE3(proto_accept_data_entry, context, datamsg,
+	    context->protocol_version);
+    err = accept_data(plaintextp, tlvsp, context, datamsg, flagsp,
+	    extrakey);
+    otrl_stats_end(us, OTRL_STATS_DATA_DECRYPT, start, err);
+    OTRL_TRACE2(proto_accept_data_return, context, err);
+    return err;
+}
+
+/* The work of otrl_proto_fragment_accumulate */
+static OtrlFragmentResult fragment_accumulate(char **unfragmessagep,
 	ConnContext *context, const char *msg)
 {
     OtrlFragmentResult res = OTRL_FRAGMENT_INCOMPLETE;
@@ -984,6 +1049,22 @@ OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
     return res;
 }
 
+/* Accumulate a potential fragment into the current context. */
+OtrlFragmentResult otrl_proto_fragment_accumulate(char **unfragmessagep,
+	ConnContext *context, const char *msg)
+{
+    OtrlUserState us = context->context_priv->us;
+    unsigned long long start = otrl_stats_start(us);
+    OtrlFragmentResult res;
+
+    res = fragment_accumulate(unfragmessagep, context, msg);
+    otrl_stats_end(us, OTRL_STATS_FRAGMENT, start, 0);
+    otrl_stats_add(us,
+	    (OtrlStatsCounter)(OTRL_STATS_FRAGMENT_UNFRAGMENTED + res), 1);
+    OTRL_TRACE3(proto_fragment_accumulate, context, msg, res);
+    return res;
+}
+
 /* Create a fragmented message. */
 gcry_error_t otrl_proto_fragment_create(int mms, int fragment_count,
 	char ***fragments, ConnContext *context, const char *message)
@@ -0,0 +1,172 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdlib.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "mem.h"
+#include "scratch.h"
+
+typedef struct s_Scratch {
+    gcry_mpi_t mpis[OTRL_SCRATCH_MPIS];  /* Created as first needed */
+    unsigned int mpis_used;              /* mpis[0..mpis_used) are taken */
+    unsigned char *buf;                  /* OTRL_SCRATCH_BUFLEN bytes */
+    size_t buf_used;                     /* buf[0..buf_used) is taken */
+} Scratch;
+
+/* Without thread-local storage, there are no workspaces, and every
+ * temporary is allocated. */
+#ifdef __GNUC__
+#define SCRATCH_THREAD_LOCAL __thread
+#endif
+
+#ifdef SCRATCH_THREAD_LOCAL
+static SCRATCH_THREAD_LOCAL Scratch *scratch;
+#endif
+
+/* The calling thread's workspace, set up if need be, or NULL */
+static Scratch *get_scratch(void)
+{
+#ifdef SCRATCH_THREAD_LOCAL
+    if (scratch == NULL) {
+	scratch = calloc(1, sizeof(Scratch));
+    }
+    return scratch;
+#else
+    return NULL;
+#endif
+}
+
+/* Overwrite all of an MPI with zeros, leaving it with value 0.
+ * Setting a bit past the end of an MPI zeroes every limb allocated to
+ * it first, including any left over from a bigger value it once
+ * held. */
+static void wipe_mpi(gcry_mpi_t m)
+{
+    gcry_mpi_set_ui(m, 0);
+    gcry_mpi_set_bit(m, 0);
+    gcry_mpi_set_ui(m, 0);
+}
+
+/* Set *mpis to n temporary MPIs, of value 0. */
+void otrl_scratch_mpis(gcry_mpi_t *mpis, unsigned int n)
+{
+    Scratch *s = get_scratch();
+    unsigned int i;
+
+    if (s && OTRL_SCRATCH_MPIS - s->mpis_used >= n) {
+	for (i = 0; i < n; ++i) {
+	    gcry_mpi_t *slot = &(s->mpis[s->mpis_used + i]);
+	    if (*slot == NULL) {
+		*slot = gcry_mpi_snew(OTRL_SCRATCH_MPI_BITS);
+	    }
+	    mpis[i] = *slot;
+	}
+	s->mpis_used += n;
+	return;
+    }
+
+    for (i = 0; i < n; ++i) {
+	mpis[i] = gcry_mpi_snew(OTRL_SCRATCH_MPI_BITS);
+    }
+}
+
+/* Wipe the n temporary MPIs taken by otrl_scratch_mpis, and give them
+ * back. */
+void otrl_scratch_release_mpis(gcry_mpi_t *mpis, unsigned int n)
+{
+    Scratch *s = get_scratch();
+    unsigned int i;
+
+    if (n == 0) return;
+
+    if (s && s->mpis_used >= n &&
+	    mpis[0] == s->mpis[s->mpis_used - n]) {
+	for (i = 0; i < n; ++i) {
+	    wipe_mpi(mpis[i]);
+	    mpis[i] = NULL;
+	}
+	s->mpis_used -= n;
+	return;
+    }
+
+    for (i = 0; i < n; ++i) {
+	gcry_mpi_release(mpis[i]);
+	mpis[i] = NULL;
+    }
+}
+
+/* Return a temporary buffer of len bytes of secure memory, or NULL if
+ * there is not enough memory. */
+unsigned char *otrl_scratch_buf(size_t len)
+{
+    Scratch *s = get_scratch();
+
+    if (s && s->buf == NULL) {
+	s->buf = gcry_malloc_secure(OTRL_SCRATCH_BUFLEN);
+    }
+    if (s && s->buf && OTRL_SCRATCH_BUFLEN - s->buf_used >= len) {
+	unsigned char *buf = s->buf + s->buf_used;
+	s->buf_used += len;
+	return buf;
+    }
+
+    return gcry_malloc_secure(len);
+}
+
+/* Wipe the temporary buffer of len bytes returned by otrl_scratch_buf,
+ * and give it back. */
+void otrl_scratch_release_buf(unsigned char *buf, size_t len)
+{
+    Scratch *s = get_scratch();
+
+    if (buf == NULL) return;
+
+    if (s && s->buf && buf >= s->buf && buf < s->buf + OTRL_SCRATCH_BUFLEN) {
+	otrl_mem_wipe(buf, len);
+	s->buf_used = buf - s->buf;
+	return;
+    }
+
+    /* Our allocation handlers wipe it */
+    gcry_free(buf);
+}
+
+/* Free the calling thread's workspace. */
+void otrl_scratch_free(void)
+{
+#ifdef SCRATCH_THREAD_LOCAL
+    unsigned int i;
+
+    if (scratch == NULL) return;
+
+    for (i = 0; i < OTRL_SCRATCH_MPIS; ++i) {
+	gcry_mpi_release(scratch->mpis[i]);
+    }
+    gcry_free(scratch->buf);
+    free(scratch);
+    scratch = NULL;
+#endif
+}
@@ -0,0 +1,69 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SCRATCH_H__
+#define __SCRATCH_H__
+
+#include <gcrypt.h>
+
+/* Each thread has a workspace of temporaries for the DH, AKE and SMP
+ * computations, so that they don't create and destroy MPIs and buffers
+ * every time they are called.  Temporaries are taken and given back in
+ * last-in, first-out order, and are wiped when they are given back.
+ * When the workspace has run out (or can't be set up), the temporaries
+ * are simply allocated and freed instead, so taking one never fails
+ * for lack of workspace. */
+
+/* The number of MPIs in a workspace */
+#define OTRL_SCRATCH_MPIS 16
+
+/* The size of the MPIs in a workspace.  They grow as needed, but start
+ * out big enough for the 1536-bit DH and SMP groups. */
+#define OTRL_SCRATCH_MPI_BITS 1536
+
+/* The size of the byte buffer in a workspace: enough for two
+ * serialized 1536-bit MPIs along with a DSA public key */
+#define OTRL_SCRATCH_BUFLEN 2048
+
+/* Set *mpis to n temporary MPIs, of value 0. */
+void otrl_scratch_mpis(gcry_mpi_t *mpis, unsigned int n);
+
+/* Wipe the n temporary MPIs taken by otrl_scratch_mpis, and give them
+ * back.  mpis must be the most recently taken ones that have not been
+ * given back yet. */
+void otrl_scratch_release_mpis(gcry_mpi_t *mpis, unsigned int n);
+
+/* Return a temporary buffer of len bytes of secure memory, or NULL if
+ * there is not enough memory. */
+unsigned char *otrl_scratch_buf(size_t len);
+
+/* Wipe the temporary buffer of len bytes returned by otrl_scratch_buf,
+ * and give it back.  It must be the most recently taken one that has
+ * not been given back yet.  buf may be NULL. */
+void otrl_scratch_release_buf(unsigned char *buf, size_t len);
+
+/* Free the calling thread's workspace.  A thread other than the main
+ * one that has used libotr should call this before it exits; the
+ * workspace will otherwise not be freed.  The thread may go on using
+ * libotr afterwards, in which case it gets a new workspace. */
+void otrl_scratch_free(void);
+
+#endif
@@ -22,6 +22,7 @@
 /* system headers */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/types.h>
 
 /* libgcrypt headers */
@@ -30,6 +31,7 @@
 /* libotr headers */
 #include "sm.h"
 #include "serial.h"
+#include "scratch.h"
 
 #if OTRL_DEBUGGING
 
@@ -82,7 +84,6 @@ static const char* SM_ORDER_S = "0x"
     "B3861AA7255E4C0278BA36046511B993FFFFFFFFFFFFFFFF";
 static const char *SM_GENERATOR_S = "0x02";
 static const int SM_MOD_LEN_BITS = 1536;
-static const int SM_MOD_LEN_BYTES = 192;
 
 static gcry_mpi_t SM_MODULUS = NULL;
 static gcry_mpi_t SM_GENERATOR = NULL;
@@ -257,19 +258,47 @@ void otrl_sm_msg_free(gcry_mpi_t **message, int msglen)
     *message = NULL;
 }
 
-static gcry_mpi_t randomExponent(void)
+/* Set r to a random exponent.  r has to be a secure MPI (as scratch
+ * MPIs are), so that libgcrypt exponentiates with it in constant
+ * time. */
+static void randomizeExponent(gcry_mpi_t r)
 {
-    unsigned char *secbuf = NULL;
-    gcry_mpi_t randexpon = NULL;
+    gcry_mpi_randomize(r, SM_MOD_LEN_BITS, GCRY_STRONG_RANDOM);
+}
 
+static gcry_mpi_t randomExponent(void)
+{
     /* Generate a random exponent */
-    secbuf = gcry_random_bytes_secure(SM_MOD_LEN_BYTES, GCRY_STRONG_RANDOM);
-    gcry_mpi_scan(&randexpon, GCRYMPI_FMT_USG, secbuf, SM_MOD_LEN_BYTES, NULL);
-    gcry_free(secbuf);
+    gcry_mpi_t randexpon = gcry_mpi_snew(SM_MOD_LEN_BITS);
+    randomizeExponent(randexpon);
 
     return randexpon;
 }
 
+/* Set the secret of an SM state to the given (hashed) secret.  The
+ * secret is an exponent too, and so has to stay in secure MPIs all the
+ * way: gcry_mpi_scan only makes a secure MPI out of a buffer in secure
+ * memory, and gcry_mpi_set gives its destination the source's flags. */
+static gcry_error_t setSecret(OtrlSMState *state,
+	const unsigned char *secret, int secretlen)
+{
+    unsigned char *secbuf;
+    gcry_mpi_t secret_mpi = NULL;
+
+    secbuf = gcry_malloc_secure(secretlen);
+    if (secbuf == NULL) return gcry_error(GPG_ERR_ENOMEM);
+    memmove(secbuf, secret, secretlen);
+    gcry_mpi_scan(&secret_mpi, GCRYMPI_FMT_USG, secbuf, secretlen, NULL);
+    gcry_free(secbuf);
+    if (secret_mpi == NULL) return gcry_error(GPG_ERR_ENOMEM);
+
+    gcry_mpi_set_flag(secret_mpi, GCRYMPI_FLAG_SECURE);
+    gcry_mpi_set(state->secret, secret_mpi);
+    gcry_mpi_set_flag(state->secret, GCRYMPI_FLAG_SECURE);
+    gcry_mpi_release(secret_mpi);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
 /*
  * Hash one or two mpis.  To hash only one mpi, b may be set to NULL.
  */
@@ -281,41 +310,36 @@ static gcry_error_t otrl_sm_hash(gcry_mpi_t* hash, int version,
     size_t sizea;
     size_t sizeb;
     size_t totalsize;
-    unsigned char* dataa;
-    unsigned char* datab;
 
-    gcry_mpi_aprint(GCRYMPI_FMT_USG, &dataa, &sizea, a);
+    gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &sizea, a);
     totalsize = 1 + 4 + sizea;
     if (b) {
-	gcry_mpi_aprint(GCRYMPI_FMT_USG, &datab, &sizeb, b);
+	gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &sizeb, b);
 	totalsize += 4 + sizeb;
     } else {
 	sizeb = 0;
     }
 
-    input = malloc(totalsize);
+    /* Serialize the mpis straight into a scratch buffer */
+    input = otrl_scratch_buf(totalsize);
+    if (input == NULL) return gcry_error(GPG_ERR_ENOMEM);
     input[0] = (unsigned char)version;
     input[1] = (unsigned char)((sizea >> 24) & 0xFF);
     input[2] = (unsigned char)((sizea >> 16) & 0xFF);
     input[3] = (unsigned char)((sizea >> 8) & 0xFF);
     input[4] = (unsigned char)(sizea & 0xFF);
-    memmove(input + 5, dataa, sizea);
+    gcry_mpi_print(GCRYMPI_FMT_USG, input + 5, sizea, NULL, a);
     if (b) {
 	input[5 + sizea] = (unsigned char)((sizeb >> 24) & 0xFF);
 	input[6 + sizea] = (unsigned char)((sizeb >> 16) & 0xFF);
 	input[7 + sizea] = (unsigned char)((sizeb >> 8) & 0xFF);
 	input[8 + sizea] = (unsigned char)(sizeb & 0xFF);
-	memmove(input + 9 + sizea, datab, sizeb);
+	gcry_mpi_print(GCRYMPI_FMT_USG, input + 9 + sizea, sizeb, NULL, b);
     }
 
     gcry_md_hash_buffer(SM_HASH_ALGORITHM, output, input, totalsize);
     gcry_mpi_scan(hash, GCRYMPI_FMT_USG, output, SM_DIGEST_SIZE, NULL);
-    free(input);
-    input = NULL;
-
-    /* free memory */
-    gcry_free(dataa);
-    if (b) gcry_free(datab);
+    otrl_scratch_release_buf(input, totalsize);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -431,14 +455,17 @@ static int check_expon(gcry_mpi_t x)
 static gcry_error_t otrl_sm_proof_know_log(gcry_mpi_t *c, gcry_mpi_t *d,
 	const gcry_mpi_t g, const gcry_mpi_t x, int version)
 {
-    gcry_mpi_t r = randomExponent();
-    gcry_mpi_t temp = gcry_mpi_snew(SM_MOD_LEN_BITS);
+    gcry_mpi_t scratch[2], r, temp;
+
+    otrl_scratch_mpis(scratch, 2);
+    r = scratch[0];
+    temp = scratch[1];
+    randomizeExponent(r);
     gcry_mpi_powm(temp, g, r, SM_MODULUS);
     otrl_sm_hash(c, version, temp, NULL);
     gcry_mpi_mulm(temp, x, *c, SM_ORDER);
     gcry_mpi_subm(*d, r, temp, SM_ORDER);
-    gcry_mpi_release(temp);
-    gcry_mpi_release(r);
+    otrl_scratch_release_mpis(scratch, 2);
 
     return gcry_error(GPG_ERR_NO_ERROR);
 }
@@ -452,20 +479,24 @@ static int otrl_sm_check_know_log(const gcry_mpi_t c, const gcry_mpi_t d,
 {
     int comp;
 
-    gcry_mpi_t gd = gcry_mpi_new(SM_MOD_LEN_BITS);  /* g^d */
-    gcry_mpi_t xc = gcry_mpi_new(SM_MOD_LEN_BITS);  /* x^c */
-    gcry_mpi_t gdxc = gcry_mpi_new(SM_MOD_LEN_BITS);   /* (g^d x^c) */
+    gcry_mpi_t scratch[3];
+    gcry_mpi_t gd;      /* g^d */
+    gcry_mpi_t xc;      /* x^c */
+    gcry_mpi_t gdxc;    /* (g^d x^c) */
     gcry_mpi_t hgdxc = NULL;   /* h(g^d x^c) */
 
+    otrl_scratch_mpis(scratch, 3);
+    gd = scratch[0];
+    xc = scratch[1];
+    gdxc = scratch[2];
+
     gcry_mpi_powm(gd, g, d, SM_MODULUS);
     gcry_mpi_powm(xc, x, c, SM_MODULUS);
     gcry_mpi_mulm(gdxc, gd, xc, SM_MODULUS);
     otrl_sm_hash(&hgdxc, version, gdxc, NULL);
 
     comp = gcry_mpi_cmp(hgdxc, c);
-    gcry_mpi_release(gd);
-    gcry_mpi_release(xc);
-    gcry_mpi_release(gdxc);
+    otrl_scratch_release_mpis(scratch, 3);
     gcry_mpi_release(hgdxc);
 
     return comp;
@@ -478,10 +509,15 @@ static gcry_error_t otrl_sm_proof_equal_coords(gcry_mpi_t *c, gcry_mpi_t *d1,
 	gcry_mpi_t *d2, const OtrlSMState *state, const gcry_mpi_t r,
 	int version)
 {
-    gcry_mpi_t r1 = randomExponent();
-    gcry_mpi_t r2 = randomExponent();
-    gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    gcry_mpi_t scratch[4], r1, r2, temp1, temp2;
+
+    otrl_scratch_mpis(scratch, 4);
+    r1 = scratch[0];
+    r2 = scratch[1];
+    temp1 = scratch[2];
+    temp2 = scratch[3];
+    randomizeExponent(r1);
+    randomizeExponent(r2);
 
     /* Compute the value of c, as c = h(g3^r1, g1^r1 g2^r2) */
     gcry_mpi_powm(temp1, state->g1, r1, SM_MODULUS);
@@ -498,10 +534,7 @@ static gcry_error_t otrl_sm_proof_equal_coords(gcry_mpi_t *c, gcry_mpi_t *d1,
     gcry_mpi_subm(*d2, r2, temp1, SM_ORDER);
 
     /* All clear */
-    gcry_mpi_release(r1);
-    gcry_mpi_release(r2);
-    gcry_mpi_release(temp1);
-    gcry_mpi_release(temp2);
+    otrl_scratch_release_mpis(scratch, 4);
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -514,11 +547,14 @@ static gcry_error_t otrl_sm_check_equal_coords(const gcry_mpi_t c,
 {
     int comp;
 
-    gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp3 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    gcry_mpi_t scratch[3], temp1, temp2, temp3;
     gcry_mpi_t cprime = NULL;
 
+    otrl_scratch_mpis(scratch, 3);
+    temp1 = scratch[0];
+    temp2 = scratch[1];
+    temp3 = scratch[2];
+
     /* To verify, we test that hash(g3^d1 * p^c, g1^d1 * g2^d2 * q^c) = c
      * If indeed c = hash(g3^r1, g1^r1 g2^r2), d1 = r1 - r*c,
      * d2 = r2 - secret*c.  And if indeed p = g3^r, q = g1^r * g2^secret
@@ -542,9 +578,7 @@ static gcry_error_t otrl_sm_check_equal_coords(const gcry_mpi_t c,
     otrl_sm_hash(&cprime, version, temp1, temp2);
 
     comp = gcry_mpi_cmp(c, cprime);
-    gcry_mpi_release(temp1);
-    gcry_mpi_release(temp2);
-    gcry_mpi_release(temp3);
+    otrl_scratch_release_mpis(scratch, 3);
     gcry_mpi_release(cprime);
 
     return comp;
@@ -556,9 +590,13 @@ static gcry_error_t otrl_sm_check_equal_coords(const gcry_mpi_t c,
 static gcry_error_t otrl_sm_proof_equal_logs(gcry_mpi_t *c, gcry_mpi_t *d,
 	OtrlSMState *state, int version)
 {
-    gcry_mpi_t r = randomExponent();
-    gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    gcry_mpi_t scratch[3], r, temp1, temp2;
+
+    otrl_scratch_mpis(scratch, 3);
+    r = scratch[0];
+    temp1 = scratch[1];
+    temp2 = scratch[2];
+    randomizeExponent(r);
 
     /* Compute the value of c, as c = h(g1^r, (Qa/Qb)^r) */
     gcry_mpi_powm(temp1, state->g1, r, SM_MODULUS);
@@ -570,9 +608,7 @@ static gcry_error_t otrl_sm_proof_equal_logs(gcry_mpi_t *c, gcry_mpi_t *d,
     gcry_mpi_subm(*d, r, temp1, SM_ORDER);
 
     /* All clear */
-    gcry_mpi_release(r);
-    gcry_mpi_release(temp1);
-    gcry_mpi_release(temp2);
+    otrl_scratch_release_mpis(scratch, 3);
     return gcry_error(GPG_ERR_NO_ERROR);
 }
 
@@ -585,11 +621,14 @@ static gcry_error_t otrl_sm_check_equal_logs(const gcry_mpi_t c,
 {
     int comp;
 
-    gcry_mpi_t temp1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp2 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    gcry_mpi_t temp3 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    gcry_mpi_t scratch[3], temp1, temp2, temp3;
     gcry_mpi_t cprime = NULL;
 
+    otrl_scratch_mpis(scratch, 3);
+    temp1 = scratch[0];
+    temp2 = scratch[1];
+    temp3 = scratch[2];
+
     /* Here, we recall the exponents used to create g3.
      * If we have previously seen g3o = g1^x where x is unknown
      * during the DH exchange to produce g3, then we may proceed with:
@@ -614,9 +653,7 @@ static gcry_error_t otrl_sm_check_equal_logs(const gcry_mpi_t c,
     otrl_sm_hash(&cprime, version, temp1, temp2);
 
     comp = gcry_mpi_cmp(c, cprime);
-    gcry_mpi_release(temp1);
-    gcry_mpi_release(temp2);
-    gcry_mpi_release(temp3);
+    otrl_scratch_release_mpis(scratch, 3);
     gcry_mpi_release(cprime);
 
     return comp;
@@ -634,19 +671,17 @@ gcry_error_t otrl_sm_step1(OtrlSMAliceState *astate,
 	unsigned char** output, int* outputlen)
 {
     /* Initialize the sm state or update the secret */
-    gcry_mpi_t secret_mpi = NULL;
     gcry_mpi_t *msg1;
+    gcry_error_t err;
 
     *output = NULL;
     *outputlen = 0;
 
-    gcry_mpi_scan(&secret_mpi, GCRYMPI_FMT_USG, secret, secretlen, NULL);
-
     if (! astate->g1) {
 	otrl_sm_state_init(astate);
     }
-    gcry_mpi_set(astate->secret, secret_mpi);
-    gcry_mpi_release(secret_mpi);
+    err = setSecret(astate, secret, secretlen);
+    if (err) return err;
     astate->received_question = 0;
 
     otrl_sm_msg1_init(&msg1);
@@ -731,16 +766,15 @@ gcry_error_t otrl_sm_step2b(OtrlSMBobState *bstate, const unsigned char* secret,
 	int secretlen, unsigned char **output, int* outputlen)
 {
     /* Convert the given secret to the proper form and store it */
-    gcry_mpi_t r, qb1, qb2;
+    gcry_mpi_t scratch[3], r, qb1, qb2;
     gcry_mpi_t *msg2;
-    gcry_mpi_t secret_mpi = NULL;
+    gcry_error_t err;
 
     *output = NULL;
     *outputlen = 0;
 
-    gcry_mpi_scan(&secret_mpi, GCRYMPI_FMT_USG, secret, secretlen, NULL);
-    gcry_mpi_set(bstate->secret, secret_mpi);
-    gcry_mpi_release(secret_mpi);
+    err = setSecret(bstate, secret, secretlen);
+    if (err) return err;
 
     otrl_sm_msg2_init(&msg2);
 
@@ -751,9 +785,11 @@ gcry_error_t otrl_sm_step2b(OtrlSMBobState *bstate, const unsigned char* secret,
     otrl_sm_proof_know_log(&(msg2[4]), &(msg2[5]), bstate->g1, bstate->x3, 4);
 
     /* Calculate P and Q values for Bob */
-    r = randomExponent();
-    qb1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    qb2 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    otrl_scratch_mpis(scratch, 3);
+    r = scratch[0];
+    qb1 = scratch[1];
+    qb2 = scratch[2];
+    randomizeExponent(r);
     gcry_mpi_powm(bstate->p, bstate->g3, r, SM_MODULUS);
     gcry_mpi_set(msg2[6], bstate->p);
     gcry_mpi_powm(qb1, bstate->g1, r, SM_MODULUS);
@@ -768,9 +804,7 @@ gcry_error_t otrl_sm_step2b(OtrlSMBobState *bstate, const unsigned char* secret,
     serialize_mpi_array(output, outputlen, SM_MSG2_LEN, msg2);
 
     /* Free up memory for unserialized and intermediate values */
-    gcry_mpi_release(r);
-    gcry_mpi_release(qb1);
-    gcry_mpi_release(qb2);
+    otrl_scratch_release_mpis(scratch, 3);
     otrl_sm_msg_free(&msg2, SM_MSG2_LEN);
 
     return gcry_error(GPG_ERR_NO_ERROR);
@@ -787,7 +821,7 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
 	const int inputlen, unsigned char **output, int* outputlen)
 {
     /* Read from input to find the mpis */
-    gcry_mpi_t r, qa1, qa2, inv;
+    gcry_mpi_t scratch[4], r, qa1, qa2, inv;
     gcry_mpi_t *msg2;
     gcry_mpi_t *msg3;
     gcry_error_t err;
@@ -833,9 +867,12 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     }
 
     /* Calculate P and Q values for Alice */
-    r = randomExponent();
-    qa1 = gcry_mpi_new(SM_MOD_LEN_BITS);
-    qa2 = gcry_mpi_new(SM_MOD_LEN_BITS);
+    otrl_scratch_mpis(scratch, 4);
+    r = scratch[0];
+    qa1 = scratch[1];
+    qa2 = scratch[2];
+    inv = scratch[3];
+    randomizeExponent(r);
     gcry_mpi_powm(astate->p, astate->g3, r, SM_MODULUS);
     gcry_mpi_set(msg3[0], astate->p);
     gcry_mpi_powm(qa1, astate->g1, r, SM_MODULUS);
@@ -847,7 +884,6 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
 	    r, 6);
 
     /* Calculate Ra and proof */
-    inv = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_invm(inv, msg2[6], SM_MODULUS);
     gcry_mpi_mulm(astate->pab, astate->p, inv, SM_MODULUS);
     gcry_mpi_invm(inv, msg2[7], SM_MODULUS);
@@ -859,10 +895,7 @@ gcry_error_t otrl_sm_step3(OtrlSMAliceState *astate, const unsigned char* input,
     otrl_sm_msg_free(&msg2, SM_MSG2_LEN);
     otrl_sm_msg_free(&msg3, SM_MSG3_LEN);
 
-    gcry_mpi_release(r);
-    gcry_mpi_release(qa1);
-    gcry_mpi_release(qa2);
-    gcry_mpi_release(inv);
+    otrl_scratch_release_mpis(scratch, 4);
 
     astate->sm_prog_state = OTRL_SMP_PROG_OK;
     return gcry_error(GPG_ERR_NO_ERROR);
@@ -881,7 +914,7 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
 {
     /* Read from input to find the mpis */
     int comp;
-    gcry_mpi_t inv, rab;
+    gcry_mpi_t scratch[2], inv, rab;
     gcry_mpi_t *msg3;
     gcry_mpi_t *msg4;
     gcry_error_t err;
@@ -912,7 +945,9 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
     }
 
     /* Find Pa/Pb and Qa/Qb */
-    inv = gcry_mpi_new(SM_MOD_LEN_BITS);
+    otrl_scratch_mpis(scratch, 2);
+    inv = scratch[0];
+    rab = scratch[1];
     gcry_mpi_invm(inv, bstate->p, SM_MODULUS);
     gcry_mpi_mulm(bstate->pab, msg3[0], inv, SM_MODULUS);
     gcry_mpi_invm(inv, bstate->q, SM_MODULUS);
@@ -922,7 +957,7 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
     if (otrl_sm_check_equal_logs(msg3[6], msg3[7], msg3[5], bstate, 7)) {
 	otrl_sm_msg_free(&msg3, SM_MSG3_LEN);
 	otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
-	gcry_mpi_release(inv);
+	otrl_scratch_release_mpis(scratch, 2);
 	return gcry_error(GPG_ERR_INV_VALUE);
     }
 
@@ -933,15 +968,13 @@ gcry_error_t otrl_sm_step4(OtrlSMBobState *bstate, const unsigned char* input,
     serialize_mpi_array(output, outputlen, SM_MSG4_LEN, msg4);
 
     /* Calculate Rab and verify that secrets match */
-    rab = gcry_mpi_new(SM_MOD_LEN_BITS);
     gcry_mpi_powm(rab, msg3[5], bstate->x3, SM_MODULUS);
     comp = gcry_mpi_cmp(rab, bstate->pab);
 
     /* Clean up everything allocated in this step */
     otrl_sm_msg_free(&msg3, SM_MSG3_LEN);
     otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
-    gcry_mpi_release(rab);
-    gcry_mpi_release(inv);
+    otrl_scratch_release_mpis(scratch, 2);
 
     bstate->sm_prog_state = comp ? OTRL_SMP_PROG_FAILED :
 	OTRL_SMP_PROG_SUCCEEDED;
@@ -981,11 +1014,11 @@ gcry_error_t otrl_sm_step5(OtrlSMAliceState *astate, const unsigned char* input,
     }
 
     /* Calculate Rab and verify that secrets match */
-    rab = gcry_mpi_new(SM_MOD_LEN_BITS);
+    otrl_scratch_mpis(&rab, 1);
     gcry_mpi_powm(rab, msg4[0], astate->x3, SM_MODULUS);
 
     comp = gcry_mpi_cmp(rab, astate->pab);
-    gcry_mpi_release(rab);
+    otrl_scratch_release_mpis(&rab, 1);
     otrl_sm_msg_free(&msg4, SM_MSG4_LEN);
 
     astate->sm_prog_state = comp ? OTRL_SMP_PROG_FAILED :
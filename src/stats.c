@@ -0,0 +1,303 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "userstate.h"
+#include "stats.h"
+
+/* The counters have a single writer (the thread using the
+ * OtrlUserState), so an update is a relaxed load and a relaxed store,
+ * which compile to plain moves, rather than a locked increment.  The
+ * stores being atomic is what lets other threads take snapshots. */
+#if defined(__GNUC__) && defined(__ATOMIC_RELAXED)
+#define STATS_LOAD(p) __atomic_load_n((p), __ATOMIC_RELAXED)
+#define STATS_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define STATS_LOAD(p) (*(p))
+#define STATS_STORE(p, v) (*(p) = (v))
+#endif
+
+#define STATS_ADD(p, n) STATS_STORE((p), STATS_LOAD(p) + (n))
+
+static const char *op_names[OTRL_STATS_NUM_OPS] = {
+    "ake_commit", "ake_key", "ake_revealsig", "ake_signature",
+    "ake_v1_keyexch", "data_encrypt", "data_decrypt", "fragment",
+    "smp_step1", "smp_step2a", "smp_step2b", "smp_step3", "smp_step4",
+    "smp_step5", "rotate_dh", "rotate_y", "resend"
+};
+
+static const char *counter_names[OTRL_STATS_NUM_COUNTERS] = {
+    "fragment_unfragmented", "fragment_incomplete", "fragment_complete",
+    "macs_saved", "macs_revealed"
+};
+
+static const char *msg_event_names[OTRL_STATS_NUM_MSG_EVENTS] = {
+    "none", "encryption_required", "encryption_error", "connection_ended",
+    "setup_error", "msg_reflected", "msg_resent", "rcvdmsg_not_in_private",
+    "rcvdmsg_unreadable", "rcvdmsg_malformed", "log_heartbeat_rcvd",
+    "log_heartbeat_sent", "rcvdmsg_general_err", "rcvdmsg_unencrypted",
+    "rcvdmsg_unrecognized", "rcvdmsg_for_other_instance"
+};
+
+/* The current time, in nanoseconds.  Never returns 0, so that 0 can
+ * mean "not timing". */
+static unsigned long long now_ns(void)
+{
+    unsigned long long ns;
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ns = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    ns = (unsigned long long)tv.tv_sec * 1000000000ULL +
+	tv.tv_usec * 1000ULL;
+#endif
+    return ns ? ns : 1;
+}
+
+/* Which histogram bucket a duration falls into */
+static unsigned int bucket_of(unsigned long long ns)
+{
+    unsigned int bucket = 0;
+
+    while (ns > 1 && bucket < OTRL_STATS_HIST_BUCKETS - 1) {
+	ns >>= 1;
+	bucket++;
+    }
+    return bucket;
+}
+
+/* Start recording statistics for the given OtrlUserState. */
+gcry_error_t otrl_stats_enable(OtrlUserState us)
+{
+    if (us->stats) return gcry_error(GPG_ERR_NO_ERROR);
+
+    us->stats = calloc(1, sizeof(OtrlStats));
+    if (!us->stats) return gcry_error(GPG_ERR_ENOMEM);
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* Stop recording statistics for the given OtrlUserState, and throw
+ * away the statistics recorded so far. */
+void otrl_stats_disable(OtrlUserState us)
+{
+    otrl_stats_free(us->stats);
+    us->stats = NULL;
+}
+
+/* Zero the statistics recorded so far for the given OtrlUserState. */
+void otrl_stats_reset(OtrlUserState us)
+{
+    OtrlStats *stats = us->stats;
+    unsigned long long *p, *end;
+
+    if (!stats) return;
+
+    /* OtrlStats is nothing but counters */
+    p = (unsigned long long *)stats;
+    end = p + sizeof(OtrlStats) / sizeof(unsigned long long);
+    for (; p < end; ++p) {
+	STATS_STORE(p, 0);
+    }
+}
+
+/* Copy the statistics recorded so far for the given OtrlUserState into
+ * *snapshot. */
+gcry_error_t otrl_stats_snapshot(OtrlUserState us, OtrlStats *snapshot)
+{
+    OtrlStats *stats = us->stats;
+    unsigned long long *p, *q, *end;
+
+    if (!stats) return gcry_error(GPG_ERR_INV_VALUE);
+
+    p = (unsigned long long *)stats;
+    q = (unsigned long long *)snapshot;
+    end = p + sizeof(OtrlStats) / sizeof(unsigned long long);
+    for (; p < end; ++p, ++q) {
+	*q = STATS_LOAD(p);
+    }
+    return gcry_error(GPG_ERR_NO_ERROR);
+}
+
+/* A growing string */
+typedef struct {
+    char *buf;
+    size_t len, size;
+    int failed;
+} JSONBuf;
+
+static void json_append(JSONBuf *j, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__ ((format (printf, 2, 3)))
+#endif
+;
+
+static void json_append(JSONBuf *j, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (j->failed) return;
+
+    va_start(ap, fmt);
+    n = vsnprintf(j->buf + j->len, j->size - j->len, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+	j->failed = 1;
+	return;
+    }
+    if ((size_t)n >= j->size - j->len) {
+	size_t newsize = j->size * 2 + n;
+	char *newbuf = realloc(j->buf, newsize);
+	if (!newbuf) {
+	    j->failed = 1;
+	    return;
+	}
+	j->buf = newbuf;
+	j->size = newsize;
+	va_start(ap, fmt);
+	vsnprintf(j->buf + j->len, j->size - j->len, fmt, ap);
+	va_end(ap);
+    }
+    j->len += n;
+}
+
+/* Return a newly-allocated JSON rendering of the given snapshot. */
+char *otrl_stats_to_json(const OtrlStats *snapshot)
+{
+    JSONBuf j;
+    unsigned int i, b;
+
+    j.size = 4096;
+    j.len = 0;
+    j.failed = 0;
+    j.buf = malloc(j.size);
+    if (!j.buf) return NULL;
+    j.buf[0] = '\0';
+
+    json_append(&j, "{\"ops\":{");
+    for (i = 0; i < OTRL_STATS_NUM_OPS; ++i) {
+	const OtrlStatsHist *hist = &(snapshot->ops[i]);
+
+	json_append(&j, "%s\"%s\":{\"count\":%llu,\"errors\":%llu,"
+		"\"total_ns\":%llu,\"max_ns\":%llu,\"buckets\":[",
+		i ? "," : "", op_names[i], hist->count, hist->errors,
+		hist->total_ns, hist->max_ns);
+	for (b = 0; b < OTRL_STATS_HIST_BUCKETS; ++b) {
+	    json_append(&j, "%s%llu", b ? "," : "", hist->buckets[b]);
+	}
+	json_append(&j, "]}");
+    }
+    json_append(&j, "},\"counters\":{");
+    for (i = 0; i < OTRL_STATS_NUM_COUNTERS; ++i) {
+	json_append(&j, "%s\"%s\":%llu", i ? "," : "", counter_names[i],
+		snapshot->counters[i]);
+    }
+    json_append(&j, "},\"msg_events\":{");
+    for (i = 0; i < OTRL_STATS_NUM_MSG_EVENTS; ++i) {
+	json_append(&j, "%s\"%s\":%llu", i ? "," : "", msg_event_names[i],
+		snapshot->msg_events[i]);
+    }
+    json_append(&j, "}}");
+
+    if (j.failed) {
+	free(j.buf);
+	return NULL;
+    }
+    return j.buf;
+}
+
+/* Return the name of the given operation. */
+const char *otrl_stats_op_name(OtrlStatsOp op)
+{
+    if ((unsigned int)op >= OTRL_STATS_NUM_OPS) return NULL;
+    return op_names[op];
+}
+
+/* Return the current time, in nanoseconds, if statistics are being
+ * recorded for the given OtrlUserState, and 0 otherwise. */
+unsigned long long otrl_stats_start(OtrlUserState us)
+{
+    if (!us || !us->stats) return 0;
+    return now_ns();
+}
+
+/* Record an operation that was started at the time start and failed
+ * with err (or succeeded, if err is 0). */
+void otrl_stats_end(OtrlUserState us, OtrlStatsOp op,
+	unsigned long long start, gcry_error_t err)
+{
+    OtrlStatsHist *hist;
+    unsigned long long ns, end;
+
+    /* Statistics may have been disabled by a callback in the meantime */
+    if (start == 0 || !us || !us->stats) return;
+
+    end = now_ns();
+    ns = end > start ? end - start : 0;
+    hist = &(us->stats->ops[op]);
+    STATS_ADD(&(hist->count), 1);
+    if (err) {
+	STATS_ADD(&(hist->errors), 1);
+    }
+    STATS_ADD(&(hist->total_ns), ns);
+    if (ns > STATS_LOAD(&(hist->max_ns))) {
+	STATS_STORE(&(hist->max_ns), ns);
+    }
+    STATS_ADD(&(hist->buckets[bucket_of(ns)]), 1);
+}
+
+/* Add n to the given counter. */
+void otrl_stats_add(OtrlUserState us, OtrlStatsCounter counter,
+	unsigned int n)
+{
+    if (!us || !us->stats || n == 0) return;
+    STATS_ADD(&(us->stats->counters[counter]), n);
+}
+
+/* Count an OtrlMessageEvent. */
+void otrl_stats_msg_event(OtrlUserState us, OtrlMessageEvent msg_event)
+{
+    if (!us || !us->stats) return;
+    if ((unsigned int)msg_event >= OTRL_STATS_NUM_MSG_EVENTS) return;
+    STATS_ADD(&(us->stats->msg_events[msg_event]), 1);
+}
+
+/* Free the statistics of an OtrlUserState. */
+void otrl_stats_free(OtrlStats *stats)
+{
+    free(stats);
+}
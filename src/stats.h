@@ -0,0 +1,151 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include <gcrypt.h>
+
+#include "userstate.h"
+#include "proto.h"
+#include "message.h"
+
+/* The number of buckets in a latency histogram.  Bucket i counts the
+ * operations that took between 2^i and 2^(i+1)-1 nanoseconds (bucket 0
+ * also counts those that took no measurable time); the last bucket
+ * counts everything slower than that. */
+#define OTRL_STATS_HIST_BUCKETS 40
+
+/* The operations whose latency is recorded. */
+typedef enum {
+    OTRL_STATS_AKE_COMMIT,       /* Handling a D-H Commit Message */
+    OTRL_STATS_AKE_KEY,          /* Handling a D-H Key Message */
+    OTRL_STATS_AKE_REVEALSIG,    /* Handling a Reveal Signature Message */
+    OTRL_STATS_AKE_SIGNATURE,    /* Handling a Signature Message */
+    OTRL_STATS_AKE_V1_KEYEXCH,   /* Handling a v1 Key Exchange Message */
+    OTRL_STATS_DATA_ENCRYPT,     /* otrl_proto_create_data */
+    OTRL_STATS_DATA_DECRYPT,     /* otrl_proto_accept_data */
+    OTRL_STATS_FRAGMENT,         /* otrl_proto_fragment_accumulate */
+    OTRL_STATS_SMP_STEP1,        /* otrl_sm_step1 */
+    OTRL_STATS_SMP_STEP2A,       /* otrl_sm_step2a */
+    OTRL_STATS_SMP_STEP2B,       /* otrl_sm_step2b */
+    OTRL_STATS_SMP_STEP3,        /* otrl_sm_step3 */
+    OTRL_STATS_SMP_STEP4,        /* otrl_sm_step4 */
+    OTRL_STATS_SMP_STEP5,        /* otrl_sm_step5 */
+    OTRL_STATS_ROTATE_DH,        /* Rotating in a new DH key of ours */
+    OTRL_STATS_ROTATE_Y,         /* Rotating in a new DH key of theirs */
+    OTRL_STATS_RESEND,           /* Retransmitting the last message */
+    OTRL_STATS_NUM_OPS
+} OtrlStatsOp;
+
+/* The events that are simply counted. */
+typedef enum {
+    OTRL_STATS_FRAGMENT_UNFRAGMENTED,  /* Results of */
+    OTRL_STATS_FRAGMENT_INCOMPLETE,    /* otrl_proto_fragment_accumulate, */
+    OTRL_STATS_FRAGMENT_COMPLETE,      /* in OtrlFragmentResult order */
+    OTRL_STATS_MACS_SAVED,             /* Old MAC keys saved for revealing */
+    OTRL_STATS_MACS_REVEALED,          /* Old MAC keys sent to our
+					  correspondent */
+    OTRL_STATS_NUM_COUNTERS
+} OtrlStatsCounter;
+
+/* The number of values of OtrlMessageEvent */
+#define OTRL_STATS_NUM_MSG_EVENTS \
+	(OTRL_MSGEVENT_RCVDMSG_FOR_OTHER_INSTANCE + 1)
+
+/* The latency histogram of one operation.  All times are in
+ * nanoseconds. */
+typedef struct s_OtrlStatsHist {
+    unsigned long long count;          /* Operations recorded */
+    unsigned long long errors;         /* How many of them failed */
+    unsigned long long total_ns;       /* Their total duration */
+    unsigned long long max_ns;         /* The slowest of them */
+    unsigned long long buckets[OTRL_STATS_HIST_BUCKETS];
+} OtrlStatsHist;
+
+/* The statistics of an OtrlUserState. */
+typedef struct s_OtrlStats {
+    OtrlStatsHist ops[OTRL_STATS_NUM_OPS];
+    unsigned long long counters[OTRL_STATS_NUM_COUNTERS];
+    unsigned long long msg_events[OTRL_STATS_NUM_MSG_EVENTS];
+					/* Indexed by OtrlMessageEvent */
+} OtrlStats;
+
+/* Start recording statistics for the given OtrlUserState.  Nothing is
+ * recorded (and recording costs nothing more than a NULL check) until
+ * this is called.  Calling it again has no effect.
+ *
+ * The statistics are only ever updated by the thread using the
+ * OtrlUserState, so recording them takes no locks and no atomic
+ * read-modify-write instructions; each thread has its own counters by
+ * virtue of having its own OtrlUserStates.  The updates are plain
+ * stores that other threads are allowed to observe, so
+ * otrl_stats_snapshot may be called from any thread. */
+gcry_error_t otrl_stats_enable(OtrlUserState us);
+
+/* Stop recording statistics for the given OtrlUserState, and throw
+ * away the statistics recorded so far.  This must be called from the
+ * thread using the OtrlUserState. */
+void otrl_stats_disable(OtrlUserState us);
+
+/* Zero the statistics recorded so far for the given OtrlUserState.
+ * This must be called from the thread using the OtrlUserState. */
+void otrl_stats_reset(OtrlUserState us);
+
+/* Copy the statistics recorded so far for the given OtrlUserState into
+ * *snapshot.  Each counter is read atomically, but the snapshot as a
+ * whole is not: an operation recorded while the snapshot is being taken
+ * may show up in some of its counters only.  The application must not
+ * let this race with otrl_stats_disable or otrl_userstate_free.
+ * Returns GPG_ERR_INV_VALUE if statistics are not being recorded. */
+gcry_error_t otrl_stats_snapshot(OtrlUserState us, OtrlStats *snapshot);
+
+/* Return a newly-allocated JSON rendering of the given snapshot, or
+ * NULL if there is not enough memory.  The caller should free() the
+ * result when done with it. */
+char *otrl_stats_to_json(const OtrlStats *snapshot);
+
+/* Return the name of the given operation, as used by
+ * otrl_stats_to_json. */
+const char *otrl_stats_op_name(OtrlStatsOp op);
+
+/* Return the current time, in nanoseconds, if statistics are being
+ * recorded for the given OtrlUserState, and 0 otherwise.  This is used
+ * internally to time an operation. */
+unsigned long long otrl_stats_start(OtrlUserState us);
+
+/* Record an operation that was started at the time start (as returned
+ * by otrl_stats_start) and failed with err (or succeeded, if err is
+ * 0).  Does nothing if start is 0.  This is used internally. */
+void otrl_stats_end(OtrlUserState us, OtrlStatsOp op,
+	unsigned long long start, gcry_error_t err);
+
+/* Add n to the given counter.  This is used internally. */
+void otrl_stats_add(OtrlUserState us, OtrlStatsCounter counter,
+	unsigned int n);
+
+/* Count an OtrlMessageEvent.  This is used internally. */
+void otrl_stats_msg_event(OtrlUserState us, OtrlMessageEvent msg_event);
+
+/* Free the statistics of an OtrlUserState. */
+void otrl_stats_free(OtrlStats *stats);
+
+#endif
@@ -24,6 +24,12 @@
 
 #include "tlv.h"
 
+/* The TLVs currently allocated by otrl_tlv_new */
+static OtrlMemUsage tlv_usage;
+
+/* The memory taken up by a TLV with len bytes of data */
+#define TLV_BYTES(len) ((long)(sizeof(OtrlTLV) + (len) + 1))
+
 /* Make a single TLV, copying the supplied data */
 OtrlTLV *otrl_tlv_new(unsigned short type, unsigned short len,
 	const unsigned char *data)
@@ -37,6 +43,7 @@ OtrlTLV *otrl_tlv_new(unsigned short type, unsigned short len,
     memmove(tlv->data, data, len);
     tlv->data[tlv->len] = '\0';
     tlv->next = NULL;
+    otrl_mem_account(&tlv_usage, 1, TLV_BYTES(len));
     return tlv;
 }
 
@@ -63,6 +70,7 @@ void otrl_tlv_free(OtrlTLV *tlv)
 {
     while (tlv) {
 	OtrlTLV *next = tlv->next;
+	otrl_mem_account(&tlv_usage, -1, -TLV_BYTES(tlv->len));
 	free(tlv->data);
 	free(tlv);
 	tlv = next;
@@ -107,3 +115,10 @@ OtrlTLV *otrl_tlv_find(OtrlTLV *tlvs, unsigned short type)
     }
     return NULL;
 }
+
+/* Put the number and total size of the TLVs currently allocated by
+ * otrl_tlv_new into *usage. */
+void otrl_tlv_usage(OtrlMemUsage *usage)
+{
+    otrl_mem_usage_read(&tlv_usage, usage);
+}
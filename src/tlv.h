@@ -21,6 +21,8 @@
 #ifndef __TLV_H__
 #define __TLV_H__
 
+#include "mem.h"
+
 typedef struct s_OtrlTLV {
     unsigned short type;
     unsigned short len;
@@ -75,4 +77,10 @@ void otrl_tlv_serialize(unsigned char *buf, const OtrlTLV *tlv);
  * needs to be non-const.) */
 OtrlTLV *otrl_tlv_find(OtrlTLV *tlvs, unsigned short type);
 
+/* Put the number and total size of the TLVs currently allocated by
+ * otrl_tlv_new (and so by otrl_tlv_parse) into *usage.  This covers
+ * the whole process.  TLVs the application builds by hand and hands to
+ * otrl_tlv_free will throw the count off. */
+void otrl_tlv_usage(OtrlMemUsage *usage);
+
 #endif
@@ -0,0 +1,78 @@
+/*
+ *  Off-the-Record Messaging library
+ *  Copyright (C) 2004-2026  Ian Goldberg, David Goulet, Rob Smits,
+ *                           Chris Alexander, Willy Lew, Lisa Du,
+ *                           Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This library is free software; you can redistribute it and/or
+ *  modify it under the terms of version 2.1 of the GNU Lesser General
+ *  Public License as published by the Free Software Foundation.
+ *
+ *  This library is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ *  Lesser General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public
+ *  License along with this library; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Static tracepoints.  When libotr is configured with --enable-usdt,
+ * each OTRL_TRACEn(name, ...) below is a USDT probe "name" of the
+ * provider "libotr", which bpftrace, perf or SystemTap can attach to
+ * (for instance, "usdt:/usr/lib/libotr.so:libotr:proto_accept_data_entry"
+ * in bpftrace).  An unattached probe costs a single nop.  Otherwise the
+ * macros compile to nothing at all.
+ *
+ * The probes come in _entry/_return pairs.  Unless noted otherwise,
+ * the first argument is the ConnContext involved (which may be NULL),
+ * and the last argument of a _return probe is the gcry_error_t
+ * returned.  Messages are passed as pointers to their text rather than
+ * as lengths, so that an unattached probe never pays for a strlen; use
+ * str() in bpftrace to get at them.
+ *
+ *   message_sending_entry(us, their_instag, msg)
+ *   message_sending_return(context, protocol_version, err)
+ *   message_receiving_entry(us, msg)
+ *   message_receiving_return(context, protocol_version, ignore_message)
+ *   auth_handle_{commit,key,revealsig,signature,v1_key_exchange}_entry
+ *	(context, msg)
+ *   auth_handle_..._return(context, err)
+ *   dh_gen_keypair_entry(groupid), dh_gen_keypair_return(err)
+ *   dh_session_entry(groupid), dh_session_return(err)
+ *   proto_create_data_entry(context, msg, protocol_version)
+ *   proto_create_data_return(context, err)
+ *   proto_accept_data_entry(context, msg, protocol_version)
+ *   proto_accept_data_return(context, err)
+ *   proto_fragment_accumulate(context, msg, result)
+ *	(result is an OtrlFragmentResult)
+ *   sm_step{1,2a,2b,3,4,5}_entry(context, inputlen)
+ *   sm_step..._return(context, err)
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#ifdef OTRL_ENABLE_USDT
+
+#include <sys/sdt.h>
+
+#define OTRL_TRACE1(name, a) DTRACE_PROBE1(libotr, name, a)
+#define OTRL_TRACE2(name, a, b) DTRACE_PROBE2(libotr, name, a, b)
+#define OTRL_TRACE3(name, a, b, c) DTRACE_PROBE3(libotr, name, a, b, c)
+
+#else
+
+#define OTRL_TRACE1(name, a) do { } while (0)
+#define OTRL_TRACE2(name, a, b) do { } while (0)
+#define OTRL_TRACE3(name, a, b, c) do { } while (0)
+
+#endif
+
+#endif
@@ -20,11 +20,17 @@
 
 /* system headers */
 #include <stdlib.h>
+#include <string.h>
 
 /* libotr headers */
 #include "context.h"
 #include "privkey.h"
 #include "userstate.h"
+#include "event.h"
+#include "hibernate.h"
+#include "persist.h"
+#include "stats.h"
+#include "tlv.h"
 
 /* Create a new OtrlUserState.  Most clients will only need one of
  * these.  A OtrlUserState encapsulates the list of known fingerprints
@@ -42,16 +48,181 @@ OtrlUserState otrl_userstate_create(void)
     us->instag_root = NULL;
     us->pending_root = NULL;
     us->timer_running = 0;
+    us->event_queue = NULL;
+    us->notify_interval = 0;
+    us->notify_dirty = 0;
+    us->last_context_list_notify = 0;
+    us->last_fingerprints_notify = 0;
+    us->context_idle_timeout = 0;
+    us->context_sweep_size = OTRL_CONTEXT_SWEEP_DEFAULT;
+    us->context_sweep_pos = 0;
+    us->hibernation = NULL;
+    us->stats = NULL;
+    otrl_hashtab_init(&(us->fingerprint_index));
+    otrl_hashtab_init(&(us->privkey_index));
+    otrl_hashtab_init(&(us->instag_index));
+    us->privkey_index_root = NULL;
+    us->instag_index_root = NULL;
+    us->privkey_store = NULL;
+    us->privkey_lazy_max = 0;
+    us->privkey_lazy_count = 0;
+    us->privkey_lru_head = NULL;
+    us->privkey_lru_tail = NULL;
+    us->instag_file = NULL;
+    us->instag_file_root = NULL;
+    us->persist_depth = 0;
+    us->persist_pending = NULL;
     return us;
 }
 
 /* Free a OtrlUserState.  If you have a timer running for this userstate,
-stop it before freeing the userstate. */
+stop it before freeing the userstate.  Store files still held back by
+otrl_persist_batch_begin are written out first. */
 void otrl_userstate_free(OtrlUserState us)
 {
+    otrl_persist_flush_all(us);
     otrl_context_forget_all(us);
+    otrl_privkey_close_lazy(us);
     otrl_privkey_forget_all(us);
     otrl_privkey_pending_forget_all(us);
     otrl_instag_forget_all(us);
+    otrl_event_queue_free(us->event_queue);
+    otrl_hibernate_free(us->hibernation);
+    otrl_stats_free(us->stats);
+    otrl_hashtab_free(&(us->fingerprint_index));
+    otrl_hashtab_free(&(us->privkey_index));
+    otrl_hashtab_free(&(us->instag_index));
+    free(us->instag_file);
     free(us);
 }
+
+/* The space taken by a string, or 0 for NULL */
+static size_t str_bytes(const char *s)
+{
+    return s ? strlen(s) + 1 : 0;
+}
+
+/* The space taken by the value of an MPI, or 0 for NULL */
+static size_t mpi_bytes(gcry_mpi_t m)
+{
+    return m ? (gcry_mpi_get_nbits(m) + 7) / 8 : 0;
+}
+
+static void add_usage(OtrlMemStats *stats, OtrlMemCategory category,
+	size_t bytes)
+{
+    stats->categories[category].count++;
+    stats->categories[category].bytes += bytes;
+}
+
+/* Account for the memory of one context */
+static void context_memory_stats(const ConnContext *context,
+	OtrlMemStats *stats)
+{
+    const ConnContextPriv *priv = context->context_priv;
+    const OtrlAuthInfo *auth = &(context->auth);
+    const Fingerprint *fp;
+    size_t bytes;
+
+    bytes = sizeof(ConnContext) + sizeof(ConnContextPriv) +
+	sizeof(OtrlSMState) +
+	str_bytes(context->username) + str_bytes(context->accountname) +
+	str_bytes(context->protocol) + str_bytes(priv->lastmessage) +
+	str_bytes(auth->lastauthmsg) + auth->encgx_len;
+    add_usage(stats, OTRL_MEM_CONTEXTS, bytes);
+
+    /* The AKE in progress isn't an object of its own */
+    stats->categories[OTRL_MEM_KEYS].bytes += mpi_bytes(auth->our_dh.pub) +
+	mpi_bytes(auth->our_dh.priv) + mpi_bytes(auth->their_pub);
+
+    for (fp = context->fingerprint_root.next; fp; fp = fp->next) {
+	add_usage(stats, OTRL_MEM_FINGERPRINTS, sizeof(Fingerprint) +
+		(fp->fingerprint ? 20 : 0) + str_bytes(fp->trust));
+    }
+    stats->categories[OTRL_MEM_FINGERPRINTS].bytes +=
+	otrl_hashtab_bytes(&(priv->fingerprints));
+
+    if (priv->keys) {
+	const ConnContextKeys *keys = priv->keys;
+	add_usage(stats, OTRL_MEM_KEYS, sizeof(ConnContextKeys) +
+		mpi_bytes(keys->their_y) + mpi_bytes(keys->their_old_y) +
+		mpi_bytes(keys->our_dh_key.pub) +
+		mpi_bytes(keys->our_dh_key.priv) +
+		mpi_bytes(keys->our_old_dh_key.pub) +
+		mpi_bytes(keys->our_old_dh_key.priv) +
+		20 * keys->numsavedkeys);
+    }
+    if (priv->hibernated) {
+	const OtrlHibernatedKeys *hibernated = priv->hibernated;
+	add_usage(stats, OTRL_MEM_KEYS, sizeof(OtrlHibernatedKeys) +
+		(hibernated->blob ? hibernated->bloblen : 0) +
+		str_bytes(hibernated->path));
+    }
+    /* Count the SM state as keys only while SMP is in use */
+    if (context->smstate->g1) {
+	const OtrlSMState *sm = context->smstate;
+	add_usage(stats, OTRL_MEM_KEYS, mpi_bytes(sm->secret) +
+		mpi_bytes(sm->x2) + mpi_bytes(sm->x3) + mpi_bytes(sm->g1) +
+		mpi_bytes(sm->g2) + mpi_bytes(sm->g3) + mpi_bytes(sm->g3o) +
+		mpi_bytes(sm->p) + mpi_bytes(sm->q) + mpi_bytes(sm->pab) +
+		mpi_bytes(sm->qab));
+    }
+
+    if (priv->fragment) {
+	add_usage(stats, OTRL_MEM_FRAGMENTS, priv->fragment_len + 1);
+    }
+}
+
+/* Fill in *stats with the memory used by the given OtrlUserState, by
+ * category. */
+void otrl_userstate_memory_stats(OtrlUserState us, OtrlMemStats *stats)
+{
+    const ConnContext *context;
+    const OtrlPrivKey *privkey;
+    const OtrlPendingPrivKey *pending;
+    const OtrlInsTag *instag;
+    unsigned int i;
+
+    memset(stats, 0, sizeof(OtrlMemStats));
+
+    for (context = us->context_root; context; context = context->next) {
+	context_memory_stats(context, stats);
+    }
+    stats->categories[OTRL_MEM_FINGERPRINTS].bytes +=
+	otrl_hashtab_bytes(&(us->fingerprint_index));
+
+    stats->categories[OTRL_MEM_PRIVKEYS].bytes +=
+	otrl_hashtab_bytes(&(us->privkey_index));
+    for (privkey = us->privkey_root; privkey; privkey = privkey->next) {
+	size_t bytes = sizeof(OtrlPrivKey) +
+	    str_bytes(privkey->accountname) +
+	    str_bytes(privkey->protocol) + privkey->pubkey_datalen +
+	    (privkey->fingerprint_of ? privkey->fingerprint_oflen : 0);
+	if (privkey->privkey) {
+	    bytes += gcry_sexp_sprint(privkey->privkey,
+		    GCRYSEXP_FMT_CANON, NULL, 0);
+	}
+	add_usage(stats, OTRL_MEM_PRIVKEYS, bytes);
+    }
+
+    for (pending = us->pending_root; pending; pending = pending->next) {
+	add_usage(stats, OTRL_MEM_PENDING_KEYS, sizeof(OtrlPendingPrivKey) +
+		str_bytes(pending->accountname) +
+		str_bytes(pending->protocol));
+    }
+
+    stats->categories[OTRL_MEM_INSTAGS].bytes +=
+	otrl_hashtab_bytes(&(us->instag_index));
+    for (instag = us->instag_root; instag; instag = instag->next) {
+	add_usage(stats, OTRL_MEM_INSTAGS, sizeof(OtrlInsTag) +
+		str_bytes(instag->accountname) +
+		str_bytes(instag->protocol));
+    }
+
+    for (i = 0; i < OTRL_MEM_TLVS; ++i) {
+	stats->userstate_bytes += stats->categories[i].bytes;
+    }
+
+    otrl_tlv_usage(&(stats->categories[OTRL_MEM_TLVS]));
+    otrl_mem_gcrypt_usage(&(stats->categories[OTRL_MEM_GCRYPT]));
+}
@@ -26,6 +26,8 @@ typedef struct s_OtrlUserState* OtrlUserState;
 #include "instag.h"
 #include "context.h"
 #include "privkey-t.h"
+#include "mem.h"
+#include "hashtab.h"
 
 struct s_OtrlUserState {
     ConnContext *context_root;
@@ -33,6 +35,50 @@ struct s_OtrlUserState {
     OtrlInsTag *instag_root;
     OtrlPendingPrivKey *pending_root;
     int timer_running;
+    struct s_OtrlEventQueue *event_queue;  /* NULL unless the application
+					      has called
+					      otrl_event_queue_enable */
+    unsigned int notify_interval;      /* See
+					  otrl_event_set_notify_interval */
+    unsigned int notify_dirty;         /* OTRL_DIRTY_* notifications
+					  being held back */
+    time_t last_context_list_notify;   /* When update_context_list and */
+    time_t last_fingerprints_notify;   /* write_fingerprints were last
+					  raised */
+    unsigned int context_idle_timeout; /* See
+					  otrl_context_set_idle_timeout */
+    unsigned int context_sweep_size;   /* Contexts examined per poll */
+    unsigned int context_sweep_pos;    /* Where the next sweep starts */
+    struct s_OtrlHibernation *hibernation;  /* NULL unless the
+					       application has called
+					       otrl_hibernate_enable */
+    struct s_OtrlStats *stats;         /* NULL unless the application
+					  has called otrl_stats_enable */
+    OtrlHashTable fingerprint_index;   /* Every known fingerprint, by
+					  its first bytes; see
+					  otrl_context_find_fingerprint_all */
+    OtrlHashTable privkey_index;       /* privkey_root and instag_root, */
+    OtrlHashTable instag_index;        /* by accountname and protocol */
+    OtrlPrivKey *privkey_index_root;   /* The heads of the lists when */
+    OtrlInsTag *instag_index_root;     /* their indexes were last known
+					  to be complete */
+    struct s_OtrlPrivKeyStore *privkey_store;  /* NULL unless the
+						  application has called
+						  otrl_privkey_read_lazy */
+    unsigned int privkey_lazy_max;     /* The most keys loaded on demand
+					  to keep, or 0 for no limit */
+    unsigned int privkey_lazy_count;   /* The keys loaded on demand, */
+    OtrlPrivKey *privkey_lru_head;     /* from the most recently */
+    OtrlPrivKey *privkey_lru_tail;     /* found to the least */
+    char *instag_file;                 /* The instance tag file that */
+    OtrlInsTag *instag_file_root;      /* held exactly our instags when
+					  their list had this head; see
+					  otrl_instag_generate */
+    unsigned int persist_depth;        /* Nesting of
+					  otrl_persist_batch_begin */
+    struct s_OtrlPersistPending *persist_pending;  /* Store files
+						      held back by the
+						      batch */
 };
 
 /* Create a new OtrlUserState.  Most clients will only need one of
@@ -44,8 +90,48 @@ struct s_OtrlUserState {
  * OtrlUserState. */
 OtrlUserState otrl_userstate_create(void);
 
+/* What the memory of an OtrlUserState is used for; see
+ * otrl_userstate_memory_stats. */
+typedef enum {
+    OTRL_MEM_CONTEXTS,       /* ConnContexts, with their names, their
+				AKE state and the last message sent */
+    OTRL_MEM_FINGERPRINTS,   /* Known fingerprints and their trust */
+    OTRL_MEM_KEYS,           /* Conversation keys, hibernated keys and
+				the MPIs of an SMP exchange (one object
+				each), including the MPIs of the AKE in
+				progress */
+    OTRL_MEM_FRAGMENTS,      /* Partly reassembled messages */
+    OTRL_MEM_PRIVKEYS,       /* Our private keys */
+    OTRL_MEM_PENDING_KEYS,   /* Private keys being generated */
+    OTRL_MEM_INSTAGS,        /* Our instance tags */
+    OTRL_MEM_TLVS,           /* TLVs, in the whole process */
+    OTRL_MEM_GCRYPT,         /* Everything libgcrypt has allocated, in
+				the whole process */
+    OTRL_MEM_NUM_CATEGORIES
+} OtrlMemCategory;
+
+/* The memory usage of an OtrlUserState */
+typedef struct s_OtrlMemStats {
+    OtrlMemUsage categories[OTRL_MEM_NUM_CATEGORIES];
+    size_t userstate_bytes;  /* The total of the categories that belong
+				to this OtrlUserState alone (that is,
+				all but OTRL_MEM_TLVS and
+				OTRL_MEM_GCRYPT) */
+} OtrlMemStats;
+
+/* Fill in *stats with the memory used by the given OtrlUserState, by
+ * category.  The OtrlUserState is walked to find its objects, so this
+ * takes time proportional to the number of contexts; it is meant to be
+ * called now and then to watch for leaks, not on every message.  The
+ * byte counts are those of the objects themselves, without the
+ * overhead of the allocator, and gcrypt objects (MPIs, cipher and MAC
+ * handles) only show up in full under OTRL_MEM_GCRYPT; the MPIs are
+ * counted by their size in the categories that hold them as well. */
+void otrl_userstate_memory_stats(OtrlUserState us, OtrlMemStats *stats);
+
 /* Free a OtrlUserState.  If you have a timer running for this userstate,
-stop it before freeing the userstate. */
+stop it before freeing the userstate.  Store files still held back by
+otrl_persist_batch_begin are written out first. */
 void otrl_userstate_free(OtrlUserState us);
 
 #endif
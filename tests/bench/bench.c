@@ -0,0 +1,762 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Microbenchmarks for the libotr primitives.
+ *
+ * Every benchmark runs a fixed number of iterations, repeated a few
+ * times; the fastest repetition is reported, which keeps the numbers
+ * stable from one run to the next.  The results are written to stdout
+ * as a single JSON document:
+ *
+ *   { "libotr": ..., "gcrypt": ..., "repetitions": ...,
+ *     "benchmarks": [ { "name": ..., "param": ..., "iterations": ...,
+ *                       "ns_per_op": ..., "allocs_per_op": ...,
+ *                       "bytes_per_op": ..., "gcrypt_allocs_per_op": ...,
+ *                       "gcrypt_bytes_per_op": ... }, ... ] }
+ *
+ * "param" is the message size, context count, etc. the benchmark was
+ * run with (0 if it takes none).  Allocation counts are gathered by
+ * interposing malloc, which is only done with glibc; elsewhere they
+ * are reported as null.  Most of libgcrypt's blocks (the MPIs, cipher
+ * handles and so on) come from libotr's pool rather than malloc, so
+ * they are counted separately, as "gcrypt_allocs_per_op"; the few big
+ * enough to be passed on to malloc show up in both.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <proto.h>
+#include <context.h>
+#include <b64.h>
+#include <tlv.h>
+#include <sm.h>
+#include <dh.h>
+#include <privkey.h>
+#include <userstate.h>
+#include <mem.h>
+
+#include <utils.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define BENCH_DEFAULT_REPETITIONS 3
+
+/* Allocation counting */
+
+static unsigned long num_allocs, num_alloc_bytes;
+
+/* The numbers of allocations made by malloc and by libgcrypt */
+typedef struct s_AllocCount {
+	unsigned long allocs, bytes;
+	size_t gcrypt_allocs, gcrypt_bytes;
+} AllocCount;
+
+static void alloc_count(AllocCount *count)
+{
+	OtrlMemUsage gcrypt;
+
+	otrl_mem_gcrypt_allocated(&gcrypt);
+	count->allocs = num_allocs;
+	count->bytes = num_alloc_bytes;
+	count->gcrypt_allocs = gcrypt.count;
+	count->gcrypt_bytes = gcrypt.bytes;
+}
+
+/* Add the allocations made between start and end to *total */
+static void alloc_count_add(AllocCount *total, const AllocCount *start,
+		const AllocCount *end)
+{
+	total->allocs += end->allocs - start->allocs;
+	total->bytes += end->bytes - start->bytes;
+	total->gcrypt_allocs += end->gcrypt_allocs - start->gcrypt_allocs;
+	total->gcrypt_bytes += end->gcrypt_bytes - start->gcrypt_bytes;
+}
+
+#ifdef __GLIBC__
+#define BENCH_COUNT_ALLOCS 1
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+void *malloc(size_t size)
+{
+	num_allocs++;
+	num_alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	num_allocs++;
+	num_alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	num_allocs++;
+	num_alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr)
+{
+	__libc_free(ptr);
+}
+#else
+#define BENCH_COUNT_ALLOCS 0
+#endif
+
+/* Benchmark driver */
+
+typedef void (*bench_fn)(void *arg);
+
+static unsigned int repetitions = BENCH_DEFAULT_REPETITIONS;
+static unsigned int scale = 1;
+static const char *filter;
+static int num_results;
+static unsigned long num_failures;   /* Operations that returned an error */
+
+static unsigned long long now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Run fn(arg) iterations times, repetitions times over, and print the
+ * result.  If prepare or cleanup are given, they are run (untimed,
+ * uncounted) before and after each call to fn; each call is then timed
+ * individually.
+ */
+static void run_bench(const char *name, long param, unsigned int iterations,
+		bench_fn prepare, bench_fn fn, bench_fn cleanup, void *arg)
+{
+	unsigned long long best_ns = 0;
+	AllocCount best_allocs = { 0, 0, 0, 0 };
+	unsigned int r, i;
+
+	if (filter && !strstr(name, filter)) return;
+
+	iterations *= scale;
+
+	/* Warm up */
+	if (prepare) prepare(arg);
+	fn(arg);
+	if (cleanup) cleanup(arg);
+
+	for (r = 0; r < repetitions; r++) {
+		unsigned long long elapsed = 0;
+		AllocCount allocs = { 0, 0, 0, 0 }, a, b;
+
+		if (prepare || cleanup) {
+			for (i = 0; i < iterations; i++) {
+				unsigned long long start;
+
+				if (prepare) prepare(arg);
+				alloc_count(&a);
+				start = now_ns();
+				fn(arg);
+				elapsed += now_ns() - start;
+				alloc_count(&b);
+				alloc_count_add(&allocs, &a, &b);
+				if (cleanup) cleanup(arg);
+			}
+		} else {
+			unsigned long long start;
+
+			alloc_count(&a);
+			start = now_ns();
+			for (i = 0; i < iterations; i++) {
+				fn(arg);
+			}
+			elapsed = now_ns() - start;
+			alloc_count(&b);
+			alloc_count_add(&allocs, &a, &b);
+		}
+
+		if (r == 0 || elapsed < best_ns) {
+			best_ns = elapsed;
+			best_allocs = allocs;
+		}
+	}
+
+	printf("%s\n    { \"name\": \"%s\", \"param\": %ld, "
+			"\"iterations\": %u, \"ns_per_op\": %.1f, ",
+			num_results ? "," : "", name, param, iterations,
+			(double) best_ns / iterations);
+	if (BENCH_COUNT_ALLOCS) {
+		printf("\"allocs_per_op\": %.2f, \"bytes_per_op\": %.1f, ",
+				(double) best_allocs.allocs / iterations,
+				(double) best_allocs.bytes / iterations);
+	} else {
+		printf("\"allocs_per_op\": null, \"bytes_per_op\": null, ");
+	}
+	printf("\"gcrypt_allocs_per_op\": %.2f, "
+			"\"gcrypt_bytes_per_op\": %.1f }",
+			(double) best_allocs.gcrypt_allocs / iterations,
+			(double) best_allocs.gcrypt_bytes / iterations);
+	fflush(stdout);
+	num_results++;
+}
+
+/* A deterministic filler, so that every run works on the same data */
+static void fill(unsigned char *buf, size_t len, unsigned int seed)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		seed = seed * 1103515245 + 12345;
+		buf[i] = (seed >> 16) & 0xff;
+	}
+}
+
+/* Diffie-Hellman */
+
+static DH_keypair dh_ours, dh_theirs;
+static DH_sesskeys dh_sess;
+
+static void do_dh_gen_keypair(void *arg)
+{
+	DH_keypair kp;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &kp);
+	otrl_dh_keypair_free(&kp);
+}
+
+static void do_dh_session(void *arg)
+{
+	otrl_dh_session(&dh_sess, &dh_ours, dh_theirs.pub);
+	otrl_dh_session_free(&dh_sess);
+}
+
+static void bench_dh(void)
+{
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &dh_ours);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &dh_theirs);
+
+	run_bench("dh_gen_keypair", 0, 50, NULL, do_dh_gen_keypair, NULL, NULL);
+	run_bench("dh_session", 0, 50, NULL, do_dh_session, NULL, NULL);
+
+	otrl_dh_keypair_free(&dh_ours);
+	otrl_dh_keypair_free(&dh_theirs);
+}
+
+/* Data messages */
+
+static OtrlUserState data_us;
+static ConnContext *alice, *bob;
+static char *data_plaintext, *data_message;
+
+/* Give alice and bob matching keys, as if alice had just completed the
+ * AKE with bob and bob had answered once. */
+static void setup_data_contexts(void)
+{
+	data_us = otrl_userstate_create();
+	alice = utils_encrypted_context(data_us, "alice", "bob", "bench",
+			&bob);
+	alice->our_instance = bob->their_instance = 0x100;
+	alice->their_instance = bob->our_instance = 0x101;
+}
+
+static void set_plaintext(size_t len)
+{
+	size_t i;
+
+	free(data_plaintext);
+	data_plaintext = malloc(len + 1);
+	fill((unsigned char *)data_plaintext, len, len);
+	/* Printable, with no embedded NULs */
+	for (i = 0; i < len; i++) {
+		data_plaintext[i] = 'a' + ((unsigned char)data_plaintext[i] % 26);
+	}
+	data_plaintext[len] = '\0';
+}
+
+static void do_create_data(void *arg)
+{
+	if (otrl_proto_create_data(&data_message, alice, data_plaintext, NULL,
+			0, NULL)) {
+		num_failures++;
+	}
+}
+
+static void free_data_message(void *arg)
+{
+	free(data_message);
+	data_message = NULL;
+}
+
+static void do_accept_data(void *arg)
+{
+	char *plaintext = NULL;
+	OtrlTLV *tlvs = NULL;
+
+	if (otrl_proto_accept_data(&plaintext, &tlvs, bob, data_message,
+			NULL, NULL)) {
+		num_failures++;
+	}
+	free(plaintext);
+	otrl_tlv_free(tlvs);
+}
+
+static void bench_data(void)
+{
+	static const size_t sizes[] = { 16, 256, 4096, 65536 };
+	unsigned int i;
+
+	setup_data_contexts();
+
+	/* The first message rotates bob's keys; get that out of the way */
+	set_plaintext(16);
+	do_create_data(NULL);
+	do_accept_data(NULL);
+	free_data_message(NULL);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		set_plaintext(sizes[i]);
+		run_bench("proto_create_data", sizes[i], 500, NULL,
+				do_create_data, free_data_message, NULL);
+		run_bench("proto_accept_data", sizes[i], 500, do_create_data,
+				do_accept_data, free_data_message, NULL);
+	}
+
+	free(data_plaintext);
+	data_plaintext = NULL;
+	otrl_userstate_free(data_us);
+}
+
+/* Fragmentation */
+
+static int frag_mms, frag_count;
+static char **frag_fragments;
+
+static void do_fragment_create(void *arg)
+{
+	if (otrl_proto_fragment_create(frag_mms, frag_count, &frag_fragments,
+			alice, data_message)) {
+		num_failures++;
+	}
+}
+
+static void free_fragments(void *arg)
+{
+	otrl_proto_fragment_free(&frag_fragments, frag_count);
+}
+
+static void do_fragment_accumulate(void *arg)
+{
+	char *unfrag = NULL;
+	int i;
+
+	for (i = 0; i < frag_count; i++) {
+		otrl_proto_fragment_accumulate(&unfrag, bob, frag_fragments[i]);
+	}
+	if (unfrag == NULL) {
+		num_failures++;
+	}
+	free(unfrag);
+}
+
+static void bench_fragment(void)
+{
+	static const size_t sizes[] = { 1024, 16384 };
+	unsigned int i;
+
+	setup_data_contexts();
+	frag_mms = 400;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		int msglen;
+
+		set_plaintext(sizes[i]);
+		do_create_data(NULL);
+		msglen = strlen(data_message);
+		/* As in fragment_and_send */
+		frag_count = ((msglen - 1) / (frag_mms - 37)) + 1;
+
+		run_bench("proto_fragment_create", sizes[i], 2000, NULL,
+				do_fragment_create, free_fragments, NULL);
+		do_fragment_create(NULL);
+		run_bench("proto_fragment_accumulate", sizes[i], 2000, NULL,
+				do_fragment_accumulate, NULL, NULL);
+		free_fragments(NULL);
+		free_data_message(NULL);
+	}
+
+	free(data_plaintext);
+	data_plaintext = NULL;
+	otrl_userstate_free(data_us);
+}
+
+/* Base64 */
+
+static unsigned char *b64_data;
+static size_t b64_len;
+static char *b64_encoded;
+
+static void do_base64_encode(void *arg)
+{
+	free(otrl_base64_otr_encode(b64_data, b64_len));
+}
+
+static void do_base64_decode(void *arg)
+{
+	unsigned char *buf = NULL;
+	size_t len;
+
+	otrl_base64_otr_decode(b64_encoded, &buf, &len);
+	free(buf);
+}
+
+static void bench_base64(void)
+{
+	static const size_t sizes[] = { 64, 1024, 16384 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		b64_len = sizes[i];
+		b64_data = malloc(b64_len);
+		fill(b64_data, b64_len, i);
+		b64_encoded = otrl_base64_otr_encode(b64_data, b64_len);
+
+		run_bench("base64_otr_encode", b64_len, 20000, NULL,
+				do_base64_encode, NULL, NULL);
+		run_bench("base64_otr_decode", b64_len, 20000, NULL,
+				do_base64_decode, NULL, NULL);
+
+		free(b64_encoded);
+		free(b64_data);
+	}
+}
+
+/* TLVs */
+
+static unsigned char *tlv_serialized;
+static size_t tlv_seriallen;
+
+static void do_tlv_parse(void *arg)
+{
+	/* Freeing the result is part of the cost of parsing */
+	otrl_tlv_free(otrl_tlv_parse(tlv_serialized, tlv_seriallen));
+}
+
+static void bench_tlv(void)
+{
+	static const int counts[] = { 1, 8, 64 };
+	unsigned int i;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		OtrlTLV *chain = NULL;
+		unsigned char data[32];
+		int j;
+
+		fill(data, sizeof(data), i);
+		for (j = 0; j < counts[i]; j++) {
+			OtrlTLV *tlv = otrl_tlv_new(OTRL_TLV_SMP1, sizeof(data),
+					data);
+			tlv->next = chain;
+			chain = tlv;
+		}
+		tlv_seriallen = otrl_tlv_seriallen(chain);
+		tlv_serialized = malloc(tlv_seriallen);
+		otrl_tlv_serialize(tlv_serialized, chain);
+		otrl_tlv_free(chain);
+
+		run_bench("tlv_parse", counts[i], 20000, NULL, do_tlv_parse,
+				NULL, NULL);
+
+		free(tlv_serialized);
+	}
+}
+
+/* Context lookup */
+
+static OtrlUserState find_us;
+static char **find_names;
+static unsigned int find_count, find_next;
+
+static void do_context_find(void *arg)
+{
+	otrl_context_find(find_us, find_names[find_next], "account", "bench",
+			OTRL_INSTAG_MASTER, 0, NULL, NULL, NULL);
+	find_next = (find_next + 7919) % find_count;
+}
+
+static void bench_context_find(void)
+{
+	static const unsigned int counts[] = { 10, 100, 1000, 10000 };
+	unsigned int i, j;
+
+	for (i = 0; i < sizeof(counts) / sizeof(counts[0]); i++) {
+		find_count = counts[i];
+		find_next = 0;
+		find_us = otrl_userstate_create();
+		find_names = malloc(find_count * sizeof(char *));
+		for (j = 0; j < find_count; j++) {
+			find_names[j] = malloc(32);
+			snprintf(find_names[j], 32, "buddy%u@example.com", j);
+			otrl_context_find(find_us, find_names[j], "account",
+					"bench", OTRL_INSTAG_MASTER, 1, NULL, NULL,
+					NULL);
+		}
+
+		run_bench("context_find", find_count, 20000, NULL,
+				do_context_find, NULL, NULL);
+
+		for (j = 0; j < find_count; j++) {
+			free(find_names[j]);
+		}
+		free(find_names);
+		otrl_userstate_free(find_us);
+	}
+}
+
+/* Socialist Millionaires' Protocol */
+
+static OtrlSMState sm_alice, sm_bob;
+static unsigned char sm_secret[SM_DIGEST_SIZE];
+static unsigned char *sm_msg1, *sm_msg2, *sm_msg3, *sm_msg4;
+static int sm_msg1len, sm_msg2len, sm_msg3len, sm_msg4len;
+static int sm_upto;
+
+/* Run the exchange up to (but not including) step number sm_upto:
+ * 1: step1, 2: step2a, 3: step2b, 4: step3, 5: step4, 6: step5 */
+static void sm_run(int from, int to)
+{
+	int s;
+
+	for (s = from; s < to; s++) {
+		switch (s) {
+		case 1:
+			otrl_sm_step1(&sm_alice, sm_secret, sizeof(sm_secret),
+					&sm_msg1, &sm_msg1len);
+			break;
+		case 2:
+			otrl_sm_step2a(&sm_bob, sm_msg1, sm_msg1len, 0);
+			break;
+		case 3:
+			otrl_sm_step2b(&sm_bob, sm_secret, sizeof(sm_secret),
+					&sm_msg2, &sm_msg2len);
+			break;
+		case 4:
+			otrl_sm_step3(&sm_alice, sm_msg2, sm_msg2len, &sm_msg3,
+					&sm_msg3len);
+			break;
+		case 5:
+			otrl_sm_step4(&sm_bob, sm_msg3, sm_msg3len, &sm_msg4,
+					&sm_msg4len);
+			break;
+		case 6:
+			otrl_sm_step5(&sm_alice, sm_msg4, sm_msg4len);
+			break;
+		}
+	}
+}
+
+static void sm_prepare(void *arg)
+{
+	otrl_sm_state_new(&sm_alice);
+	otrl_sm_state_init(&sm_alice);
+	otrl_sm_state_new(&sm_bob);
+	otrl_sm_state_init(&sm_bob);
+	sm_run(1, sm_upto);
+}
+
+static void sm_step(void *arg)
+{
+	sm_run(sm_upto, sm_upto + 1);
+}
+
+static void sm_cleanup(void *arg)
+{
+	sm_run(sm_upto + 1, 7);
+	free(sm_msg1);
+	free(sm_msg2);
+	free(sm_msg3);
+	free(sm_msg4);
+	sm_msg1 = sm_msg2 = sm_msg3 = sm_msg4 = NULL;
+	otrl_sm_state_free(&sm_alice);
+	otrl_sm_state_free(&sm_bob);
+}
+
+static void bench_sm(void)
+{
+	static const char *names[] = { NULL, "sm_step1", "sm_step2a",
+		"sm_step2b", "sm_step3", "sm_step4", "sm_step5" };
+
+	gcry_md_hash_buffer(SM_HASH_ALGORITHM, sm_secret, "secret", 6);
+
+	for (sm_upto = 1; sm_upto <= 6; sm_upto++) {
+		run_bench(names[sm_upto], 0, 20, sm_prepare, sm_step,
+				sm_cleanup, NULL);
+	}
+}
+
+/* DSA signatures */
+
+static OtrlPrivKey *sig_privkey;
+static gcry_sexp_t sig_pubs;
+static unsigned char sig_hash[20];
+static unsigned char *sig_buf;
+static size_t sig_len;
+
+static void do_privkey_sign(void *arg)
+{
+	unsigned char *sig = NULL;
+	size_t siglen;
+
+	otrl_privkey_sign(&sig, &siglen, sig_privkey, sig_hash,
+			sizeof(sig_hash));
+	free(sig);
+}
+
+static void do_privkey_verify(void *arg)
+{
+	if (otrl_privkey_verify(sig_buf, sig_len, sig_privkey->pubkey_type,
+			sig_pubs, sig_hash, sizeof(sig_hash))) {
+		num_failures++;
+	}
+}
+
+/* Build the public key S-expression corresponding to a private key */
+static gcry_sexp_t make_pubs(gcry_sexp_t privkey)
+{
+	static const char *names[] = { "p", "q", "g", "y" };
+	gcry_mpi_t mpis[4];
+	gcry_sexp_t pubs = NULL;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		gcry_sexp_t token = gcry_sexp_find_token(privkey, names[i], 0);
+		mpis[i] = gcry_sexp_nth_mpi(token, 1, GCRYMPI_FMT_USG);
+		gcry_sexp_release(token);
+	}
+	gcry_sexp_build(&pubs, NULL,
+			"(public-key (dsa (p %m)(q %m)(g %m)(y %m)))",
+			mpis[0], mpis[1], mpis[2], mpis[3]);
+	for (i = 0; i < 4; i++) {
+		gcry_mpi_release(mpis[i]);
+	}
+	return pubs;
+}
+
+static int bench_privkey(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	FILE *privf = tmpfile();
+
+	if (privf == NULL ||
+			otrl_privkey_generate_FILEp(us, privf, "alice", "bench")) {
+		fprintf(stderr, "Could not generate a private key\n");
+		if (privf) fclose(privf);
+		otrl_userstate_free(us);
+		return -1;
+	}
+	fclose(privf);
+	sig_privkey = otrl_privkey_find(us, "alice", "bench");
+	sig_pubs = make_pubs(sig_privkey->privkey);
+	fill(sig_hash, sizeof(sig_hash), 20);
+	otrl_privkey_sign(&sig_buf, &sig_len, sig_privkey, sig_hash,
+			sizeof(sig_hash));
+
+	run_bench("privkey_sign", 0, 200, NULL, do_privkey_sign, NULL, NULL);
+	run_bench("privkey_verify", 0, 200, NULL, do_privkey_verify, NULL,
+			NULL);
+
+	free(sig_buf);
+	gcry_sexp_release(sig_pubs);
+	otrl_userstate_free(us);
+	return 0;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s [-r repetitions] [-s scale] [filter]\n"
+			"Run the libotr microbenchmarks whose names contain "
+			"filter (all of them\nby default), and write the "
+			"results to stdout as JSON.  Each benchmark is\n"
+			"repeated the given number of times (default %d), "
+			"with its iteration\ncount multiplied by scale "
+			"(default 1).\n", progname, BENCH_DEFAULT_REPETITIONS);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int c, err = 0;
+
+	while ((c = getopt(argc, argv, "r:s:h")) != -1) {
+		switch (c) {
+		case 'r':
+			repetitions = atoi(optarg);
+			break;
+		case 's':
+			scale = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (repetitions < 1 || scale < 1 || argc - optind > 1) {
+		usage(argv[0]);
+	}
+	if (optind < argc) {
+		filter = argv[optind];
+	}
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+	/* Key generation should not wait for entropy */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+	printf("{\n  \"libotr\": \"%s\",\n  \"gcrypt\": \"%s\",\n"
+			"  \"repetitions\": %u,\n  \"scale\": %u,\n"
+			"  \"benchmarks\": [", otrl_version(),
+			gcry_check_version(NULL), repetitions, scale);
+
+	bench_dh();
+	bench_data();
+	bench_fragment();
+	bench_base64();
+	bench_tlv();
+	bench_context_find();
+	bench_sm();
+	if (!filter || strstr("privkey_sign privkey_verify", filter)) {
+		err = bench_privkey();
+	}
+
+	printf("\n  ]\n}\n");
+
+	if (num_failures) {
+		fprintf(stderr, "%lu benchmarked operations failed\n",
+				num_failures);
+		err = -1;
+	}
+	return err ? 1 : 0;
+}
@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <syscall.h>
 #include <sys/epoll.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
@@ -666,7 +667,7 @@ static void *alice_thread(void *data)
 		 */
 		timeout = (rand() % (timeout_max - 1));
 
-		ret = epoll_wait(epfd, ev, sizeof(ev), timeout);
+		ret = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
 		if (ret < 0) {
 			perror("epoll_wait Alice");
 			goto end;
@@ -812,7 +813,7 @@ static void *bob_thread(void *data)
 		 */
 		timeout = (rand() % (timeout_max - 1));
 
-		ret = epoll_wait(epfd, ev, sizeof(ev), timeout);
+		ret = epoll_wait(epfd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
 		if (ret < 0) {
 			perror("epoll_wait Bob");
 			goto end;
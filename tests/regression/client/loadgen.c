@@ -0,0 +1,1101 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Multi-session load generator.
+ *
+ * This works like the regression client: two threads, each running an
+ * epoll loop, pass OTR messages to each other over a Unix socket.  Here,
+ * though, the first thread holds N accounts ("a0", "a1", ...) and the
+ * second holds M buddies for each of them ("b0.0", "b0.1", ...), so that
+ * N * M conversations run at once.  Each thread has its own
+ * OtrlUserState, as a real client would.
+ *
+ * The first thread starts AKEs at the requested rate: first to bring
+ * every conversation up, then to restart random established ones.  Both
+ * threads send data messages at the requested rate over random
+ * established conversations, with sizes drawn from the requested
+ * distribution.  Some of the conversations run SMP right after the AKE.
+ *
+ * At the end, throughput, latency percentiles for each operation and
+ * the peak RSS of the process are printed.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <gcrypt.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <context.h>
+#include <instag.h>
+#include <privkey.h>
+#include <proto.h>
+#include <message.h>
+#include <tlv.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+/* Getopt options. */
+static struct option long_opts[] = {
+	{ "load-key",    1, NULL, 'k' },
+	{ "accounts",    1, NULL, 'n' },
+	{ "buddies",     1, NULL, 'm' },
+	{ "duration",    1, NULL, 'd' },
+	{ "ake-rate",    1, NULL, 'A' },
+	{ "msg-rate",    1, NULL, 'r' },
+	{ "size",        1, NULL, 's' },
+	{ "mms",         1, NULL, 'F' },
+	{ "smp",         1, NULL, 'S' },
+	{ "seed",        1, NULL, 'x' },
+	{ "help",        0, NULL, 'h' },
+
+	/* Closure. */
+	{ NULL, 0, NULL, 0 }
+};
+
+static char *opt_key_path;
+static unsigned int opt_accounts = 4;
+static unsigned int opt_buddies = 4;
+static double opt_duration = 10.0;
+static double opt_ake_rate = 100.0;
+static double opt_msg_rate = 200.0;
+static int opt_mms;
+static double opt_smp_freq;
+static unsigned int opt_seed = 42;
+
+/* Message size distribution */
+enum size_dist { SIZE_FIXED, SIZE_UNIFORM, SIZE_EXP };
+static enum size_dist opt_size_dist = SIZE_UNIFORM;
+static unsigned int opt_size_min = 1, opt_size_max = 600;
+
+#define MAX_MSG_SIZE 65536
+
+static const char *protocol = "otr-load";
+static const char *smp_secret = "No Sugar Added";
+
+/* Set by the signal handler to stop early. */
+static volatile sig_atomic_t stop;
+
+/* Operations we report latencies for. */
+enum {
+	OP_SEND,        /* otrl_message_sending of a data message */
+	OP_RECV,        /* otrl_message_receiving of anything */
+	OP_DELIVER,     /* From sending to delivery of the plaintext */
+	OP_AKE,         /* From the query message to gone_secure */
+	OP_SMP,         /* From initiating SMP to its success */
+	NUM_OPS
+};
+
+static const char *op_names[NUM_OPS] = {
+	"send", "receive", "deliver", "ake", "smp"
+};
+
+/* Latency samples, in microseconds. */
+struct latency {
+	double *samples;
+	size_t num;
+	size_t alloc;
+};
+
+/* One conversation, as seen by one side. */
+struct session {
+	int secure;
+	int ake_pending;
+	int smp_pending;
+	uint64_t ake_start;
+	uint64_t smp_start;
+};
+
+/*
+ * An OTR message in flight between the two threads.  Only the pointer goes
+ * through the socket, as in the regression client.
+ */
+struct wire_msg {
+	struct wire_msg *next;
+	char *from;
+	char *to;
+	char *text;
+	uint64_t sent_ns;
+};
+
+/* Everything one thread owns. */
+struct side {
+	const char *name;
+	int initiator;
+	OtrlUserState us;
+	int sock;
+	unsigned int rand_seed;
+
+	struct session *sessions;
+	unsigned int *smp_wanted;
+	unsigned int num_smp_wanted;
+	unsigned int next_ake;
+
+	/* Messages injected by libotr, waiting to be written to the socket. */
+	struct wire_msg *outbox;
+	struct wire_msg **outbox_tail;
+	/* Stamped on the messages injected while sending a data message. */
+	uint64_t cur_sent_ns;
+
+	unsigned int poll_interval;
+	uint64_t next_poll;
+
+	struct latency lat[NUM_OPS];
+	unsigned long sent;
+	unsigned long skipped;
+	unsigned long delivered;
+	unsigned long long bytes_delivered;
+	unsigned long injected;
+	unsigned long akes_started;
+	unsigned long akes_done;
+	unsigned long smps_done;
+	unsigned long errors;
+};
+
+static struct side alice, bob;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void record(struct side *side, int op, uint64_t start, uint64_t end)
+{
+	struct latency *lat = &side->lat[op];
+
+	if (lat->num == lat->alloc) {
+		size_t newalloc = lat->alloc ? 2 * lat->alloc : 1024;
+		double *newsamples = realloc(lat->samples,
+				newalloc * sizeof(double));
+		if (!newsamples) {
+			return;
+		}
+		lat->samples = newsamples;
+		lat->alloc = newalloc;
+	}
+	lat->samples[lat->num++] = (end - start) / 1000.0;
+}
+
+/* Seconds until the next event of a Poisson process of the given rate. */
+static double next_gap(struct side *side, double rate)
+{
+	double u = (rand_r(&side->rand_seed) + 1.0) / (RAND_MAX + 2.0);
+
+	return -log(u) / rate;
+}
+
+static size_t random_size(struct side *side)
+{
+	size_t len;
+
+	switch (opt_size_dist) {
+	case SIZE_FIXED:
+		return opt_size_min;
+	case SIZE_EXP:
+		len = (size_t) (-log((rand_r(&side->rand_seed) + 1.0) /
+					(RAND_MAX + 2.0)) * opt_size_min) + 1;
+		return len > MAX_MSG_SIZE ? MAX_MSG_SIZE : len;
+	case SIZE_UNIFORM:
+	default:
+		return opt_size_min + rand_r(&side->rand_seed) %
+			(opt_size_max - opt_size_min + 1);
+	}
+}
+
+/*
+ * Names: account i of the first thread is "a<i>", and its buddy j is
+ * "b<i>.<j>", which is an account of the second thread.
+ */
+static void session_names(struct side *side, unsigned int idx,
+		char *account, char *user, size_t len)
+{
+	char a[32], b[32];
+
+	snprintf(a, sizeof(a), "a%u", idx / opt_buddies);
+	snprintf(b, sizeof(b), "b%u.%u", idx / opt_buddies, idx % opt_buddies);
+	snprintf(account, len, "%s", side->initiator ? a : b);
+	snprintf(user, len, "%s", side->initiator ? b : a);
+}
+
+static struct session *find_session(struct side *side,
+		const char *accountname, const char *username, unsigned int *idxp)
+{
+	const char *bname = side->initiator ? username : accountname;
+	unsigned int i, j;
+
+	if (sscanf(bname, "b%u.%u", &i, &j) != 2 || i >= opt_accounts ||
+			j >= opt_buddies) {
+		return NULL;
+	}
+	if (idxp) {
+		*idxp = i * opt_buddies + j;
+	}
+	return &side->sessions[i * opt_buddies + j];
+}
+
+static OtrlPolicy ops_policy(void *opdata, ConnContext *context)
+{
+	return OTRL_POLICY_DEFAULT;
+}
+
+static void ops_create_privkey(void *opdata, const char *accountname,
+		const char *protocol)
+{
+	/* Every account got its key at startup. */
+	return;
+}
+
+static int ops_is_logged_in(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient)
+{
+	return 1;
+}
+
+static void ops_inject_msg(void *opdata, const char *accountname,
+		const char *protocol, const char *recipient, const char *message)
+{
+	struct side *side = opdata;
+	struct wire_msg *msg;
+
+	msg = calloc(1, sizeof(*msg));
+	if (!msg) {
+		perror("calloc inject");
+		return;
+	}
+	msg->from = strdup(accountname);
+	msg->to = strdup(recipient);
+	msg->text = strdup(message);
+	msg->sent_ns = side->cur_sent_ns ? side->cur_sent_ns : now_ns();
+
+	*side->outbox_tail = msg;
+	side->outbox_tail = &msg->next;
+	side->injected++;
+}
+
+static void ops_update_context_list(void *opdata)
+{
+	return;
+}
+
+static void ops_new_fingerprint(void *opdata, OtrlUserState us,
+		const char *accountname, const char *protocol,
+		const char *username, unsigned char fingerprint[20])
+{
+	return;
+}
+
+static void ops_write_fingerprints(void *opdata)
+{
+	return;
+}
+
+static void ops_gone_secure(void *opdata, ConnContext *context)
+{
+	struct side *side = opdata;
+	unsigned int idx;
+	struct session *sess = find_session(side, context->accountname,
+			context->username, &idx);
+
+	if (!sess) {
+		return;
+	}
+	sess->secure = 1;
+	if (sess->ake_pending) {
+		record(side, OP_AKE, sess->ake_start, now_ns());
+		sess->ake_pending = 0;
+		side->akes_done++;
+	}
+
+	/*
+	 * SMP can't be started from inside this callback; leave it to the
+	 * main loop.
+	 */
+	if (side->initiator && !sess->smp_pending && opt_smp_freq > 0 &&
+			rand_r(&side->rand_seed) <
+			opt_smp_freq * ((double) RAND_MAX + 1.0)) {
+		sess->smp_pending = 1;
+		side->smp_wanted[side->num_smp_wanted++] = idx;
+	}
+}
+
+static void ops_gone_insecure(void *opdata, ConnContext *context)
+{
+	struct side *side = opdata;
+	struct session *sess = find_session(side, context->accountname,
+			context->username, NULL);
+
+	if (sess) {
+		sess->secure = 0;
+	}
+}
+
+static void ops_still_secure(void *opdata, ConnContext *context,
+		int is_reply)
+{
+	ops_gone_secure(opdata, context);
+}
+
+static int ops_max_message_size(void *opdata, ConnContext *context)
+{
+	return opt_mms;
+}
+
+static const char *ops_otr_error_message(void *opdata, ConnContext *context,
+		OtrlErrorCode code)
+{
+	return strdup("load generator error");
+}
+
+static void ops_otr_error_message_free(void *opdata, const char *err_msg)
+{
+	free((char *) err_msg);
+}
+
+static void ops_handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
+		ConnContext *context, const char *message, gcry_error_t err)
+{
+	struct side *side = opdata;
+
+	switch (msg_event) {
+	case OTRL_MSGEVENT_ENCRYPTION_ERROR:
+	case OTRL_MSGEVENT_SETUP_ERROR:
+	case OTRL_MSGEVENT_RCVDMSG_UNREADABLE:
+	case OTRL_MSGEVENT_RCVDMSG_MALFORMED:
+	case OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR:
+		side->errors++;
+		break;
+	default:
+		break;
+	}
+}
+
+static void ops_create_instag(void *opdata, const char *accountname,
+		const char *protocol)
+{
+	struct side *side = opdata;
+
+	otrl_instag_generate(side->us, "/dev/null", accountname, protocol);
+}
+
+static void ops_handle_smp_event(void *opdata, OtrlSMPEvent smp_event,
+		ConnContext *context, unsigned short progress_percent,
+		char *question);
+
+static void ops_timer_control(void *opdata, unsigned int interval)
+{
+	struct side *side = opdata;
+
+	side->poll_interval = interval;
+	side->next_poll = now_ns() + interval * 1000000000ULL;
+}
+
+/* OTR message operations. */
+static OtrlMessageAppOps ops = {
+	ops_policy,
+	ops_create_privkey,
+	ops_is_logged_in,
+	ops_inject_msg,
+	ops_update_context_list,
+	ops_new_fingerprint,
+	ops_write_fingerprints,
+	ops_gone_secure,
+	ops_gone_insecure,
+	ops_still_secure,
+	ops_max_message_size,
+	NULL, /* account_name - NOT USED */
+	NULL, /* account_name_free - NOT USED */
+	NULL, /* received_symkey */
+	ops_otr_error_message,
+	ops_otr_error_message_free,
+	NULL, /* resent_msg_prefix */
+	NULL, /* resent_msg_prefix_free */
+	ops_handle_smp_event,
+	ops_handle_msg_event,
+	ops_create_instag,
+	NULL, /* convert_msg */
+	NULL, /* convert_free */
+	ops_timer_control,
+};
+
+static void ops_handle_smp_event(void *opdata, OtrlSMPEvent smp_event,
+		ConnContext *context, unsigned short progress_percent,
+		char *question)
+{
+	struct side *side = opdata;
+	struct session *sess = find_session(side, context->accountname,
+			context->username, NULL);
+
+	switch (smp_event) {
+	case OTRL_SMPEVENT_ASK_FOR_SECRET:
+	case OTRL_SMPEVENT_ASK_FOR_ANSWER:
+		otrl_message_respond_smp(side->us, &ops, side, context,
+				(const unsigned char *) smp_secret,
+				strlen(smp_secret));
+		break;
+	case OTRL_SMPEVENT_IN_PROGRESS:
+		break;
+	case OTRL_SMPEVENT_SUCCESS:
+		if (sess && sess->smp_pending) {
+			record(side, OP_SMP, sess->smp_start, now_ns());
+			sess->smp_pending = 0;
+			side->smps_done++;
+		}
+		break;
+	case OTRL_SMPEVENT_ABORT:
+	case OTRL_SMPEVENT_FAILURE:
+	case OTRL_SMPEVENT_CHEATED:
+	case OTRL_SMPEVENT_ERROR:
+	default:
+		if (sess) {
+			sess->smp_pending = 0;
+		}
+		side->errors++;
+		break;
+	}
+}
+
+/*
+ * Start an AKE.  Conversations are brought up in order first; after that,
+ * a random established one is torn down and started again.
+ */
+static void start_ake(struct side *side, unsigned int num_sessions)
+{
+	char account[32], user[32];
+	struct session *sess;
+	unsigned int idx;
+	char *query;
+
+	if (side->next_ake < num_sessions) {
+		idx = side->next_ake++;
+	} else {
+		idx = rand_r(&side->rand_seed) % num_sessions;
+	}
+	sess = &side->sessions[idx];
+	if (sess->ake_pending || sess->smp_pending) {
+		return;
+	}
+	session_names(side, idx, account, user, sizeof(account));
+
+	if (sess->secure) {
+		otrl_message_disconnect(side->us, &ops, side, account, protocol,
+				user, OTRL_INSTAG_BEST);
+		sess->secure = 0;
+	}
+
+	query = otrl_proto_default_query_msg(account, OTRL_POLICY_DEFAULT);
+	if (!query) {
+		return;
+	}
+	sess->ake_pending = 1;
+	sess->ake_start = now_ns();
+	side->cur_sent_ns = 0;
+	ops_inject_msg(side, account, protocol, user, query);
+	free(query);
+	side->akes_started++;
+}
+
+static void start_smp(struct side *side)
+{
+	while (side->num_smp_wanted > 0) {
+		unsigned int idx = side->smp_wanted[--side->num_smp_wanted];
+		struct session *sess = &side->sessions[idx];
+		char account[32], user[32];
+		ConnContext *context;
+
+		session_names(side, idx, account, user, sizeof(account));
+		context = otrl_context_find(side->us, user, account, protocol,
+				OTRL_INSTAG_BEST, 0, NULL, NULL, NULL);
+		if (!sess->secure || !context ||
+				context->msgstate != OTRL_MSGSTATE_ENCRYPTED) {
+			sess->smp_pending = 0;
+			continue;
+		}
+		sess->smp_start = now_ns();
+		otrl_message_initiate_smp(side->us, &ops, side, context,
+				(const unsigned char *) smp_secret,
+				strlen(smp_secret));
+	}
+}
+
+/* Send a data message over a random established conversation. */
+static void send_data(struct side *side, unsigned int num_sessions)
+{
+	char account[32], user[32];
+	char *text, *new_msg = NULL;
+	unsigned int idx = 0, tries;
+	uint64_t start;
+	gcry_error_t err;
+	size_t i, len;
+
+	for (tries = 0; tries < 8; tries++) {
+		idx = rand_r(&side->rand_seed) % num_sessions;
+		if (side->sessions[idx].secure) {
+			break;
+		}
+	}
+	if (tries == 8) {
+		side->skipped++;
+		return;
+	}
+	session_names(side, idx, account, user, sizeof(account));
+
+	len = random_size(side);
+	text = malloc(len + 1);
+	if (!text) {
+		return;
+	}
+	for (i = 0; i < len; i++) {
+		text[i] = 'a' + rand_r(&side->rand_seed) % 26;
+	}
+	text[len] = '\0';
+
+	start = now_ns();
+	side->cur_sent_ns = start;
+	err = otrl_message_sending(side->us, &ops, side, account, protocol,
+			user, OTRL_INSTAG_BEST, text, NULL, &new_msg,
+			OTRL_FRAGMENT_SEND_ALL, NULL, NULL, NULL);
+	record(side, OP_SEND, start, now_ns());
+	side->cur_sent_ns = 0;
+	if (err) {
+		side->errors++;
+	} else {
+		side->sent++;
+	}
+
+	otrl_message_free(new_msg);
+	free(text);
+}
+
+static void free_wire_msg(struct wire_msg *msg)
+{
+	free(msg->from);
+	free(msg->to);
+	free(msg->text);
+	free(msg);
+}
+
+static void recv_msg(struct side *side, struct wire_msg *msg)
+{
+	char *new_msg = NULL;
+	OtrlTLV *tlvs = NULL;
+	uint64_t start, end;
+	int ignore;
+
+	start = now_ns();
+	ignore = otrl_message_receiving(side->us, &ops, side, msg->to,
+			protocol, msg->from, msg->text, &new_msg, &tlvs, NULL,
+			NULL, NULL);
+	end = now_ns();
+	record(side, OP_RECV, start, end);
+
+	if (!ignore && new_msg) {
+		record(side, OP_DELIVER, msg->sent_ns, end);
+		side->delivered++;
+		side->bytes_delivered += strlen(new_msg);
+	}
+
+	otrl_tlv_free(tlvs);
+	otrl_message_free(new_msg);
+	free_wire_msg(msg);
+}
+
+/* Write as much of the outbox as the socket will take. */
+static void flush_outbox(struct side *side)
+{
+	while (side->outbox) {
+		struct wire_msg *msg = side->outbox;
+		ssize_t ret;
+
+		/* Unlink it first: once sent, it belongs to the other thread. */
+		side->outbox = msg->next;
+		ret = send(side->sock, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("send wire msg");
+			}
+			side->outbox = msg;
+			return;
+		}
+		if (!side->outbox) {
+			side->outbox_tail = &side->outbox;
+		}
+	}
+}
+
+/* Read and handle everything waiting on the socket. */
+static int drain_socket(struct side *side)
+{
+	while (1) {
+		struct wire_msg *msg;
+		ssize_t ret;
+
+		ret = recv(side->sock, &msg, sizeof(msg), MSG_DONTWAIT);
+		if (ret < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 0;
+			}
+			perror("recv wire msg");
+			return -1;
+		} else if (ret == 0) {
+			/* Peer is gone. */
+			return -1;
+		} else if (ret != sizeof(msg)) {
+			fprintf(stderr, "Short read on socket\n");
+			return -1;
+		}
+		msg->next = NULL;
+		recv_msg(side, msg);
+		flush_outbox(side);
+	}
+}
+
+static void *side_thread(void *data)
+{
+	struct side *side = data;
+	unsigned int num_sessions = opt_accounts * opt_buddies;
+	uint64_t start = now_ns(), end, next_msg, next_ake;
+	struct epoll_event ev;
+	int epfd, ret;
+
+	end = start + (uint64_t) (opt_duration * 1e9);
+	next_msg = start + (uint64_t) (next_gap(side, opt_msg_rate) * 1e9);
+	next_ake = side->initiator && opt_ake_rate > 0 ? start : UINT64_MAX;
+
+	/* Poll size is ignored since 2.6.8 */
+	epfd = epoll_create(42);
+	if (epfd < 0) {
+		perror("epoll_create");
+		return NULL;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.fd = side->sock;
+	ret = epoll_ctl(epfd, EPOLL_CTL_ADD, side->sock, &ev);
+	if (ret < 0) {
+		perror("epoll_ctl add");
+		goto end;
+	}
+
+	while (!stop) {
+		uint64_t now = now_ns(), next;
+		int burst, timeout;
+
+		if (now >= end) {
+			break;
+		}
+
+		/* If we fell far behind, don't try to catch up all at once. */
+		if (next_msg + 1000000000ULL < now) {
+			next_msg = now;
+		}
+		for (burst = 0; burst < 64 && now >= next_msg; burst++) {
+			send_data(side, num_sessions);
+			next_msg += (uint64_t) (next_gap(side, opt_msg_rate) * 1e9);
+		}
+		for (burst = 0; burst < 64 && now >= next_ake; burst++) {
+			start_ake(side, num_sessions);
+			next_ake += (uint64_t) (1e9 / opt_ake_rate);
+		}
+		start_smp(side);
+		if (side->poll_interval && now >= side->next_poll) {
+			side->next_poll = now +
+				side->poll_interval * 1000000000ULL;
+			otrl_message_poll(side->us, &ops, side);
+		}
+		flush_outbox(side);
+
+		next = end;
+		if (next_msg < next) next = next_msg;
+		if (next_ake < next) next = next_ake;
+		if (side->poll_interval && side->next_poll < next) {
+			next = side->next_poll;
+		}
+		now = now_ns();
+		timeout = next > now ? (int) ((next - now) / 1000000) : 0;
+		if (timeout > 100) {
+			timeout = 100;
+		}
+		if (side->outbox && timeout > 1) {
+			/* Come back soon to write the rest. */
+			timeout = 1;
+		}
+
+		ret = epoll_wait(epfd, &ev, 1, timeout);
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			break;
+		}
+		if (ret > 0) {
+			if (ev.events & EPOLLIN) {
+				if (drain_socket(side) < 0) {
+					break;
+				}
+			} else if (ev.events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP)) {
+				break;
+			}
+		}
+	}
+
+end:
+	/* Let the peer know we're done. */
+	shutdown(side->sock, SHUT_WR);
+	close(epfd);
+	while (side->outbox) {
+		struct wire_msg *msg = side->outbox;
+		side->outbox = msg->next;
+		free_wire_msg(msg);
+	}
+	return NULL;
+}
+
+/*
+ * Load the private key in opt_key_path, and give a copy of it to each of
+ * the given accounts of us.
+ */
+static int load_key(OtrlUserState us, int initiator)
+{
+	gcry_sexp_t allkeys = NULL, privkey = NULL;
+	char *filebuf = NULL, *keybuf = NULL;
+	unsigned int i, j;
+	size_t filelen, keylen;
+	FILE *f;
+	int ret = -1;
+
+	f = fopen(opt_key_path, "r");
+	if (!f) {
+		perror("open key file");
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	filelen = ftell(f);
+	rewind(f);
+	filebuf = malloc(filelen + 1);
+	if (!filebuf || fread(filebuf, 1, filelen, f) != filelen) {
+		fclose(f);
+		goto end;
+	}
+	fclose(f);
+
+	if (gcry_sexp_new(&allkeys, filebuf, filelen, 0)) {
+		fprintf(stderr, "Could not parse key file\n");
+		goto end;
+	}
+	privkey = gcry_sexp_find_token(allkeys, "private-key", 0);
+	if (!privkey) {
+		fprintf(stderr, "No private key in key file\n");
+		goto end;
+	}
+	keylen = gcry_sexp_sprint(privkey, GCRYSEXP_FMT_ADVANCED, NULL, 0);
+	keybuf = malloc(keylen);
+	if (!keybuf) {
+		goto end;
+	}
+	gcry_sexp_sprint(privkey, GCRYSEXP_FMT_ADVANCED, keybuf, keylen);
+
+	f = tmpfile();
+	if (!f) {
+		perror("tmpfile");
+		goto end;
+	}
+	fprintf(f, "(privkeys\n");
+	for (i = 0; i < opt_accounts; i++) {
+		for (j = 0; j < (initiator ? 1 : opt_buddies); j++) {
+			fprintf(f, " (account\n  (name \"");
+			if (initiator) {
+				fprintf(f, "a%u", i);
+			} else {
+				fprintf(f, "b%u.%u", i, j);
+			}
+			fprintf(f, "\")\n  (protocol %s)\n%s )\n", protocol, keybuf);
+		}
+	}
+	fprintf(f, ")\n");
+	rewind(f);
+	ret = otrl_privkey_read_FILEp(us, f) ? -1 : 0;
+	fclose(f);
+
+end:
+	gcry_sexp_release(privkey);
+	gcry_sexp_release(allkeys);
+	free(keybuf);
+	free(filebuf);
+	return ret;
+}
+
+static int init_side(struct side *side, const char *name, int initiator,
+		int sock)
+{
+	unsigned int num_sessions = opt_accounts * opt_buddies;
+
+	memset(side, 0, sizeof(*side));
+	side->name = name;
+	side->initiator = initiator;
+	side->sock = sock;
+	side->rand_seed = opt_seed + initiator;
+	side->outbox_tail = &side->outbox;
+	side->sessions = calloc(num_sessions, sizeof(struct session));
+	side->smp_wanted = calloc(num_sessions, sizeof(unsigned int));
+	side->us = otrl_userstate_create();
+	if (!side->sessions || !side->smp_wanted || !side->us) {
+		fprintf(stderr, "Out of memory\n");
+		return -1;
+	}
+	if (load_key(side->us, initiator) < 0) {
+		fprintf(stderr, "Could not load keys for %s\n", name);
+		return -1;
+	}
+	return 0;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the percentiles of the samples of both sides for op. */
+static void report_op(int op)
+{
+	struct latency *la = &alice.lat[op], *lb = &bob.lat[op];
+	size_t num = la->num + lb->num;
+	double *all, sum = 0;
+	size_t i;
+
+	if (num == 0) {
+		printf("%-8s %10u %10s %10s %10s %10s %10s\n", op_names[op], 0,
+				"-", "-", "-", "-", "-");
+		return;
+	}
+	all = malloc(num * sizeof(double));
+	if (!all) {
+		return;
+	}
+	memcpy(all, la->samples, la->num * sizeof(double));
+	memcpy(all + la->num, lb->samples, lb->num * sizeof(double));
+	qsort(all, num, sizeof(double), cmp_double);
+	for (i = 0; i < num; i++) {
+		sum += all[i];
+	}
+
+	printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", op_names[op],
+			num, sum / num, all[(size_t) (num * 0.5)],
+			all[(size_t) (num * 0.99)], all[(size_t) (num * 0.999)],
+			all[num - 1]);
+	free(all);
+}
+
+static void report(double elapsed)
+{
+	struct rusage ru;
+	unsigned long delivered = alice.delivered + bob.delivered;
+	int op;
+
+	printf("sessions           %u (%u accounts x %u buddies)\n",
+			opt_accounts * opt_buddies, opt_accounts, opt_buddies);
+	printf("elapsed_s          %.2f\n", elapsed);
+	printf("messages_sent      %lu\n", alice.sent + bob.sent);
+	printf("messages_skipped   %lu\n", alice.skipped + bob.skipped);
+	printf("messages_delivered %lu (%.1f/s, %.1f KiB/s)\n", delivered,
+			delivered / elapsed, (alice.bytes_delivered +
+				bob.bytes_delivered) / 1024.0 / elapsed);
+	printf("otr_messages       %lu (%.1f/s)\n",
+			alice.injected + bob.injected,
+			(alice.injected + bob.injected) / elapsed);
+	printf("akes               %lu started, %lu done (%.1f/s)\n",
+			alice.akes_started, alice.akes_done,
+			alice.akes_done / elapsed);
+	printf("smps               %lu done\n", alice.smps_done + bob.smps_done);
+	printf("errors             %lu\n", alice.errors + bob.errors);
+
+	printf("\n%-8s %10s %10s %10s %10s %10s %10s\n", "op(us)", "count",
+			"mean", "p50", "p99", "p999", "max");
+	for (op = 0; op < NUM_OPS; op++) {
+		report_op(op);
+	}
+
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		printf("\npeak_rss_kib       %ld\n", ru.ru_maxrss);
+	}
+}
+
+static void sighandler(int sig)
+{
+	stop = 1;
+}
+
+static void usage(const char *progname)
+{
+	fprintf(stderr, "Usage: %s --load-key FILE [OPTIONS]\n"
+		"  -k, --load-key FILE  DSA key to give every account\n"
+		"  -n, --accounts N     Accounts on the first side (default 4)\n"
+		"  -m, --buddies M      Buddies of each account (default 4)\n"
+		"  -d, --duration SECS  How long to run (default 10)\n"
+		"  -A, --ake-rate R     AKEs started per second (default 100)\n"
+		"  -r, --msg-rate R     Data messages per second per side "
+			"(default 200)\n"
+		"  -s, --size DIST      Message sizes: fixed:N, uniform:MIN:MAX "
+			"or exp:MEAN\n"
+		"                       (default uniform:1:600)\n"
+		"  -F, --mms N          Fragment OTR messages longer than N "
+			"(default 0, never)\n"
+		"  -S, --smp P          Run SMP after an AKE with probability P "
+			"(default 0)\n"
+		"  -x, --seed S         Random seed (default 42)\n",
+		progname);
+}
+
+static int parse_size(const char *arg)
+{
+	unsigned int a, b;
+
+	if (sscanf(arg, "fixed:%u", &a) == 1 && a > 0 && a <= MAX_MSG_SIZE) {
+		opt_size_dist = SIZE_FIXED;
+		opt_size_min = opt_size_max = a;
+	} else if (sscanf(arg, "uniform:%u:%u", &a, &b) == 2 && a > 0 &&
+			a <= b && b <= MAX_MSG_SIZE) {
+		opt_size_dist = SIZE_UNIFORM;
+		opt_size_min = a;
+		opt_size_max = b;
+	} else if (sscanf(arg, "exp:%u", &a) == 1 && a > 0 &&
+			a <= MAX_MSG_SIZE) {
+		opt_size_dist = SIZE_EXP;
+		opt_size_min = a;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * main entry point.
+ */
+int main(int argc, char **argv)
+{
+	int opt, socks[2];
+	pthread_t alice_th, bob_th;
+	struct sigaction sa;
+	uint64_t start;
+
+	while ((opt = getopt_long(argc, argv, "k:n:m:d:A:r:s:F:S:x:h",
+					long_opts, NULL)) != -1) {
+		switch (opt) {
+		case 'k':
+			opt_key_path = strdup(optarg);
+			break;
+		case 'n':
+			opt_accounts = atoi(optarg);
+			break;
+		case 'm':
+			opt_buddies = atoi(optarg);
+			break;
+		case 'd':
+			opt_duration = atof(optarg);
+			break;
+		case 'A':
+			opt_ake_rate = atof(optarg);
+			break;
+		case 'r':
+			opt_msg_rate = atof(optarg);
+			break;
+		case 's':
+			if (parse_size(optarg) < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'F':
+			opt_mms = atoi(optarg);
+			break;
+		case 'S':
+			opt_smp_freq = atof(optarg);
+			break;
+		case 'x':
+			opt_seed = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if (!opt_key_path || opt_accounts == 0 || opt_buddies == 0 ||
+			opt_duration <= 0 || opt_ake_rate < 0 ||
+			opt_msg_rate <= 0 || opt_mms < 0 || opt_smp_freq < 0 ||
+			opt_smp_freq > 1) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sighandler;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	/* Init libgcrypt threading system. */
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+
+	/* Init OTR library. */
+	OTRL_INIT;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, socks) < 0) {
+		perror("socketpair");
+		return 1;
+	}
+	if (init_side(&alice, "alice", 1, socks[0]) < 0 ||
+			init_side(&bob, "bob", 0, socks[1]) < 0) {
+		return 1;
+	}
+
+	start = now_ns();
+	if (pthread_create(&alice_th, NULL, side_thread, &alice) ||
+			pthread_create(&bob_th, NULL, side_thread, &bob)) {
+		perror("pthread_create");
+		return 1;
+	}
+	pthread_join(alice_th, NULL);
+	pthread_join(bob_th, NULL);
+
+	report((now_ns() - start) / 1e9);
+
+	close(socks[0]);
+	close(socks[1]);
+	otrl_userstate_free(alice.us);
+	otrl_userstate_free(bob.us);
+
+	return 0;
+}
@@ -17,12 +17,19 @@
 
 #include <limits.h>
 #include <pthread.h>
+#include <string.h>
+
+#include <gcrypt.h>
 
 #include <context.h>
+#include <proto.h>
+#include <message.h>
 
 #include <tap/tap.h>
 
-#define NUM_TESTS 22
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 42
 
 static void test_otrl_context_find_fingerprint(void)
 {
@@ -199,16 +206,263 @@ static void test_otrl_context_set_trust(void)
 	ok(strcmp(fprint.trust, trust) == 0, "Fingerprint set with success");
 }
 
+static ConnContext *find_context(OtrlUserState us, const char *user,
+		otrl_instag_t instag)
+{
+	return otrl_context_find(us, user, "alice", "proto", instag, 0, NULL,
+			NULL, NULL);
+}
+
+static void test_otrl_context_expire_idle(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *bob, *bob_child, *carol, *dave, *context;
+	unsigned char fingerprint[20] = {1};
+	time_t now = time(NULL);
+
+	bob = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	bob_child = otrl_context_find(us, "bob", "alice", "proto",
+			0x1000, 1, NULL, NULL, NULL);
+	carol = otrl_context_find(us, "carol", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_find_fingerprint(carol, fingerprint, 1, NULL);
+	dave = otrl_context_find(us, "dave", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_update_recent_child(bob_child, 0);
+
+	ok(otrl_context_expire_idle(us, now) == 0,
+			"Nothing expired while expiry is off");
+
+	otrl_context_set_idle_timeout(us, 60, 0);
+	ok(otrl_context_expire_idle(us, now) == 0,
+			"Recently created contexts are kept");
+
+	/* Everyone but dave has been idle for two minutes */
+	bob->context_priv->created -= 120;
+	bob_child->context_priv->created -= 120;
+	carol->context_priv->created -= 120;
+	dave->context_priv->lastrecv = now;
+
+	ok(otrl_context_expire_idle(us, now) == 1 &&
+			find_context(us, "bob", 0x1000) == NULL &&
+			bob->recent_child == bob && bob->recent_rcvd_child == bob,
+			"Idle child forgotten, master no longer refers to it");
+	ok(otrl_context_expire_idle(us, now) == 1 &&
+			find_context(us, "bob", OTRL_INSTAG_MASTER) == NULL,
+			"Idle master forgotten once it has no children");
+
+	context = find_context(us, "carol", OTRL_INSTAG_MASTER);
+	ok(context == carol && find_context(us, "dave", OTRL_INSTAG_MASTER)
+			== dave,
+			"Masters with fingerprints or recent activity are kept");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_expire_idle_incremental(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	const char *users[] = { "u1", "u2", "u3", "u4", "u5" };
+	ConnContext *context;
+	unsigned int i, remaining = 0;
+
+	for (i = 0; i < 5; i++) {
+		context = otrl_context_find(us, users[i], "alice", "proto",
+				OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+		context->context_priv->created -= 120;
+	}
+
+	otrl_context_set_idle_timeout(us, 60, 2);
+	ok(otrl_context_expire_idle(us, time(NULL)) == 2,
+			"Sweep examines at most sweep_size contexts");
+	otrl_context_expire_idle(us, time(NULL));
+	for (context = us->context_root; context; context = context->next) {
+		remaining++;
+	}
+	ok(remaining == 1, "Successive sweeps go on down the list");
+
+	/* Polling without any app ops still sweeps */
+	otrl_message_poll(us, NULL, NULL);
+	ok(us->context_root == NULL, "Polling with no ops reclaims contexts");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_message_contextp(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	ConnContext *received = context, *sent = context;
+	char *newmsg = NULL;
+
+	otrl_message_receiving(us, NULL, NULL, "alice", "proto", "bob", NULL,
+			&newmsg, NULL, &received, NULL, NULL);
+	otrl_message_sending(us, NULL, NULL, "alice", "proto", NULL,
+			OTRL_INSTAG_BEST, "hi", NULL, &newmsg,
+			OTRL_FRAGMENT_SEND_SKIP, &sent, NULL, NULL);
+	ok(received == context && sent == NULL,
+			"Bad arguments leave *contextp as they always have");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_release_sesskeys(void)
+{
+	ConnContextPriv *priv = otrl_context_priv_new();
+	ConnContextKeys *keys;
+	DH_keypair theirs;
+	DH_sesskeys orig;
+
+	otrl_context_priv_alloc_keys(priv);
+	keys = priv->keys;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &keys->our_dh_key);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &keys->our_old_dh_key);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &theirs);
+	keys->their_y = gcry_mpi_copy(theirs.pub);
+	otrl_dh_session(&keys->sesskeys[0][0], &keys->our_dh_key,
+			keys->their_y);
+	otrl_dh_session(&keys->sesskeys[1][0], &keys->our_old_dh_key,
+			keys->their_y);
+	otrl_dh_incctr(keys->sesskeys[1][0].sendctr);
+	keys->sesskeys[1][0].rcvmacused = 1;
+	memmove(&orig, &keys->sesskeys[1][0], sizeof(orig));
+
+	otrl_context_priv_release_sesskeys(priv);
+	ok(keys->sesskeys[0][0].sendenc == NULL &&
+			keys->sesskeys[1][0].rcvmac == NULL &&
+			keys->released_sesskeys == 0x05,
+			"Session key handles released");
+
+	ok(otrl_context_priv_restore_sesskeys(priv) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			keys->released_sesskeys == 0 &&
+			keys->sesskeys[0][0].sendenc != NULL &&
+			keys->sesskeys[1][0].rcvmac != NULL &&
+			keys->sesskeys[0][1].sendenc == NULL,
+			"Session key handles rebuilt");
+	ok(!memcmp(orig.sendctr, keys->sesskeys[1][0].sendctr, 16) &&
+			keys->sesskeys[1][0].rcvmacused == 1 &&
+			!memcmp(orig.sendmackey, keys->sesskeys[1][0].sendmackey,
+				20) &&
+			!memcmp(orig.extrakey, keys->sesskeys[1][0].extrakey,
+				OTRL_EXTRAKEY_BYTES),
+			"Counters and keys survive a release");
+
+	otrl_dh_keypair_free(&theirs);
+	otrl_context_priv_force_finished(priv);
+	ok(priv->keys == NULL, "Keys freed when the context is finished");
+	free(priv);
+}
+
+static void test_otrl_context_lazy_state(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	ok(context->smstate != NULL &&
+			context->smstate->nextExpected == OTRL_SMP_EXPECT1,
+			"New contexts have an SM state");
+	ok(context->smstate->secret == NULL && context->smstate->g1 == NULL &&
+			context->context_priv->keys == NULL,
+			"New contexts have no SM MPIs or keys");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_context_fingerprint_index(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *bob = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	ConnContext *carol = otrl_context_find(us, "carol", "alice2", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	unsigned char fingerprint[20];
+	Fingerprint *f, *fprints[300], *bobs, *carols;
+	int i, added, all_found = 1, all_added = 1, forgotten = 1;
+
+	/* Only ten different first bytes, so that many fingerprints have
+	 * the same hash */
+	memset(fingerprint, 0, sizeof(fingerprint));
+	for (i = 0; i < 300; ++i) {
+		fingerprint[0] = i % 10;
+		fingerprint[19] = i & 0xff;
+		fingerprint[18] = i >> 8;
+		fprints[i] = otrl_context_find_fingerprint(bob, fingerprint, 1,
+				&added);
+		if (!added) all_added = 0;
+	}
+	for (i = 0; i < 300; ++i) {
+		fingerprint[0] = i % 10;
+		fingerprint[19] = i & 0xff;
+		fingerprint[18] = i >> 8;
+		f = otrl_context_find_fingerprint(bob, fingerprint, 1, &added);
+		if (f != fprints[i] || added) all_found = 0;
+	}
+	ok(all_added && all_found &&
+			bob->context_priv->fingerprints.count == 300,
+			"Fingerprints found through the index");
+
+	for (i = 0; i < 300; i += 2) {
+		otrl_context_forget_fingerprint(fprints[i], 0);
+	}
+	for (i = 0; i < 300; ++i) {
+		fingerprint[0] = i % 10;
+		fingerprint[19] = i & 0xff;
+		fingerprint[18] = i >> 8;
+		f = otrl_context_find_fingerprint(bob, fingerprint, 0, NULL);
+		if (f != ((i % 2) ? fprints[i] : NULL)) forgotten = 0;
+	}
+	ok(forgotten && bob->context_priv->fingerprints.count == 150 &&
+			us->fingerprint_index.count == 150,
+			"Forgotten fingerprints leave the indexes");
+
+	memset(fingerprint, 0xab, sizeof(fingerprint));
+	bobs = otrl_context_find_fingerprint(bob, fingerprint, 1, NULL);
+	carols = otrl_context_find_fingerprint(carol, fingerprint, 1, NULL);
+	f = otrl_context_find_fingerprint_all(us, fingerprint, NULL);
+	ok((f == bobs || f == carols) &&
+			otrl_context_find_fingerprint_all(us, fingerprint, f) ==
+			(f == bobs ? carols : bobs) &&
+			otrl_context_find_fingerprint_all(us, fingerprint,
+				f == bobs ? carols : bobs) == NULL,
+			"Fingerprint found across accounts");
+
+	otrl_context_set_trust(carols, "verified");
+	ok(otrl_context_find_trusted_fingerprint(us, fingerprint) == carols,
+			"Trusted fingerprint found across accounts");
+
+	otrl_context_forget(carol);
+	ok(otrl_context_find_fingerprint_all(us, fingerprint, NULL) == bobs &&
+			otrl_context_find_trusted_fingerprint(us, fingerprint)
+			== NULL,
+			"Forgotten context leaves the userstate's index");
+
+	otrl_userstate_free(us);
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
 
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
 	test_otrl_context_set_trust();
 	test_otrl_context_find_recent_instance();
 	test_otrl_context_find_fingerprint();
 	test_otrl_context_find_recent_secure_instance();
 	test_otrl_context_is_fingerprint_trusted();
 	test_otrl_context_update_recent_child();
+	test_otrl_context_expire_idle();
+	test_otrl_context_expire_idle_incremental();
+	test_otrl_message_contextp();
+	test_otrl_context_release_sesskeys();
+	test_otrl_context_lazy_state();
+	test_otrl_context_fingerprint_index();
 
 	return 0;
 }
@@ -0,0 +1,238 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <proto.h>
+#include <context.h>
+#include <event.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 13
+
+static int num_msg_events, num_update_context_list, num_write_fingerprints;
+static OtrlMessageEvent last_msg_event;
+static ConnContext *last_context;
+static char last_message[64];
+
+static void cb_handle_msg_event(void *opdata, OtrlMessageEvent msg_event,
+		ConnContext *context, const char *message, gcry_error_t err)
+{
+	num_msg_events++;
+	last_msg_event = msg_event;
+	last_context = context;
+	strncpy(last_message, message ? message : "", sizeof(last_message) - 1);
+}
+
+static void cb_update_context_list(void *opdata)
+{
+	num_update_context_list++;
+}
+
+static void cb_write_fingerprints(void *opdata)
+{
+	num_write_fingerprints++;
+}
+
+static int timer_interval = -1;
+
+static void cb_timer_control(void *opdata, unsigned int interval)
+{
+	timer_interval = interval;
+}
+
+static OtrlMessageAppOps ops;
+
+static void reset_counters(void)
+{
+	num_msg_events = 0;
+	num_update_context_list = 0;
+	num_write_fingerprints = 0;
+	last_msg_event = OTRL_MSGEVENT_NONE;
+	last_context = NULL;
+	last_message[0] = '\0';
+}
+
+static void test_otrl_event_synchronous(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	reset_counters();
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_RESENT, context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	ok(num_msg_events == 1 && last_context == context &&
+			otrl_event_queue_pending(us) == 0,
+			"Events are delivered synchronously by default");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_event_queue(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	char message[] = "some error";
+
+	reset_counters();
+	ok(otrl_event_queue_enable(us, 8) == gcry_error(GPG_ERR_NO_ERROR),
+			"Event queue enabled");
+
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR,
+			context, message, gcry_error(GPG_ERR_NO_ERROR));
+	/* The caller's buffer must not be referenced by the queue */
+	memset(message, 'x', sizeof(message) - 1);
+	otrl_event_update_context_list(us, &ops, NULL);
+	otrl_event_write_fingerprints(us, &ops, NULL);
+	otrl_event_update_context_list(us, &ops, NULL);
+	otrl_event_write_fingerprints(us, &ops, NULL);
+	otrl_event_update_context_list(us, &ops, NULL);
+
+	ok(num_msg_events == 0 && num_update_context_list == 0 &&
+			num_write_fingerprints == 0,
+			"Queued events are not delivered before the drain");
+	ok(otrl_event_queue_pending(us) == 3,
+			"Duplicate notifications are merged");
+
+	ok(otrl_event_queue_drain(us, &ops, NULL) == 3 &&
+			num_msg_events == 1 &&
+			last_msg_event == OTRL_MSGEVENT_RCVDMSG_GENERAL_ERR &&
+			last_context == context &&
+			!strcmp(last_message, "some error") &&
+			num_update_context_list == 1 &&
+			num_write_fingerprints == 1,
+			"Drain delivers queued events");
+
+	otrl_event_update_context_list(us, &ops, NULL);
+	ok(otrl_event_queue_pending(us) == 1,
+			"Notifications are queued again after a drain");
+	otrl_event_queue_drain(us, &ops, NULL);
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_event_queue_forgotten_context(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	reset_counters();
+	otrl_event_queue_enable(us, 0);
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_RESENT, context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_context_forget(context);
+
+	ok(otrl_event_queue_drain(us, &ops, NULL) == 0 &&
+			num_msg_events == 0 && us->event_queue->dropped == 1,
+			"Events for forgotten contexts are dropped");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_event_queue_overflow(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+
+	reset_counters();
+	otrl_event_queue_enable(us, 2);
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_RESENT, context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_RESENT, context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_REFLECTED, context,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+
+	ok(num_msg_events == 1 &&
+			last_msg_event == OTRL_MSGEVENT_MSG_REFLECTED &&
+			us->event_queue->overflows == 1,
+			"Events are delivered synchronously when the queue is full");
+
+	otrl_event_queue_disable(us, &ops, NULL);
+	ok(num_msg_events == 3 && us->event_queue == NULL,
+			"Disabling the queue delivers pending events");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_event_notify_interval(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+
+	reset_counters();
+	otrl_event_set_notify_interval(us, 30);
+
+	otrl_event_write_fingerprints(us, &ops, NULL);
+	otrl_event_write_fingerprints(us, &ops, NULL);
+	otrl_event_write_fingerprints(us, &ops, NULL);
+	otrl_event_update_context_list(us, &ops, NULL);
+	otrl_event_update_context_list(us, &ops, NULL);
+	ok(num_write_fingerprints == 1 && num_update_context_list == 1 &&
+			us->notify_dirty ==
+			(OTRL_DIRTY_FINGERPRINTS | OTRL_DIRTY_CONTEXT_LIST),
+			"Notifications within the interval are held back");
+	ok(timer_interval == 30 &&
+			otrl_message_poll_get_default_interval(us) == 30,
+			"Timer started for held-back notifications");
+
+	/* Pretend the interval has elapsed */
+	us->last_fingerprints_notify -= 30;
+	otrl_message_poll(us, &ops, NULL);
+	ok(num_write_fingerprints == 2 && num_update_context_list == 1 &&
+			us->notify_dirty == OTRL_DIRTY_CONTEXT_LIST &&
+			timer_interval == 30,
+			"Poll raises notifications that are due");
+
+	otrl_event_flush(us, &ops, NULL);
+	otrl_message_poll(us, &ops, NULL);
+	ok(num_write_fingerprints == 2 && num_update_context_list == 2 &&
+			us->notify_dirty == 0 && timer_interval == 0,
+			"Flush raises held-back notifications");
+
+	otrl_userstate_free(us);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	memset(&ops, 0, sizeof(ops));
+	ops.handle_msg_event = cb_handle_msg_event;
+	ops.update_context_list = cb_update_context_list;
+	ops.write_fingerprints = cb_write_fingerprints;
+	ops.timer_control = cb_timer_control;
+
+	test_otrl_event_synchronous();
+	test_otrl_event_queue();
+	test_otrl_event_queue_forgotten_context();
+	test_otrl_event_queue_overflow();
+	test_otrl_event_notify_interval();
+
+	return 0;
+}
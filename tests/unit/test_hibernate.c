@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <proto.h>
+#include <context.h>
+#include <hibernate.h>
+
+#include <tap/tap.h>
+#include <utils.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 12
+
+/* Make an ENCRYPTED context with a full set of keys */
+static ConnContext *make_encrypted_context(OtrlUserState us,
+		const char *username)
+{
+	ConnContext *context = utils_encrypted_context(us, "alice", username,
+			"proto", NULL);
+	ConnContextKeys *keys = context->context_priv->keys;
+
+	/* Use more than one session, and some of their state */
+	otrl_dh_session(&keys->sesskeys[0][0], &keys->our_dh_key,
+			keys->their_y);
+	otrl_dh_incctr(keys->sesskeys[0][0].sendctr);
+	otrl_dh_incctr(keys->sesskeys[0][0].sendctr);
+	keys->sesskeys[1][0].rcvmacused = 1;
+
+	keys->numsavedkeys = 2;
+	keys->saved_mac_keys = malloc(40);
+	memset(keys->saved_mac_keys, 0xab, 40);
+
+	return context;
+}
+
+static int count_files(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *ent;
+	int n = 0;
+
+	if (d == NULL) return -1;
+	while ((ent = readdir(d)) != NULL) {
+		if (ent->d_name[0] != '.') n++;
+	}
+	closedir(d);
+	return n;
+}
+
+static void test_otrl_hibernate_roundtrip(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = make_encrypted_context(us, "bob");
+	ConnContextPriv *priv = context->context_priv;
+	ConnContextKeys *keys = priv->keys;
+	DH_sesskeys orig00, orig10;
+	gcry_mpi_t their_y = gcry_mpi_copy(keys->their_y);
+	gcry_mpi_t our_priv = gcry_mpi_copy(keys->our_old_dh_key.priv);
+
+	memmove(&orig00, &keys->sesskeys[0][0], sizeof(orig00));
+	memmove(&orig10, &keys->sesskeys[1][0], sizeof(orig10));
+
+	ok(otrl_hibernate_context(us, context) == gcry_error(GPG_ERR_INV_VALUE),
+			"Hibernation must be enabled first");
+	ok(otrl_hibernate_enable(us, NULL) == gcry_error(GPG_ERR_NO_ERROR),
+			"Hibernation enabled");
+	ok(otrl_hibernate_context(us, context) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			priv->keys == NULL && priv->hibernated != NULL &&
+			priv->hibernated->blob != NULL &&
+			us->hibernation->num_hibernated == 1,
+			"Keys hibernated in memory");
+
+	ok(otrl_context_priv_wake(priv) == gcry_error(GPG_ERR_NO_ERROR) &&
+			priv->keys != NULL && priv->hibernated == NULL &&
+			us->hibernation->num_hibernated == 0,
+			"Keys woken up");
+	keys = priv->keys;
+	ok(keys->their_keyid == 1 && keys->our_keyid == 2 &&
+			!gcry_mpi_cmp(keys->their_y, their_y) &&
+			!gcry_mpi_cmp(keys->our_old_dh_key.priv, our_priv) &&
+			keys->our_dh_key.groupid == DH1536_GROUP_ID &&
+			keys->numsavedkeys == 2 &&
+			keys->saved_mac_keys[39] == 0xab,
+			"DH keys and saved MAC keys survive hibernation");
+	ok(keys->sesskeys[0][0].sendenc != NULL &&
+			keys->sesskeys[1][0].rcvmac != NULL &&
+			keys->sesskeys[0][1].sendenc == NULL &&
+			!memcmp(orig00.sendctr, keys->sesskeys[0][0].sendctr, 16) &&
+			!memcmp(orig00.rcvmackey, keys->sesskeys[0][0].rcvmackey,
+				20) &&
+			keys->sesskeys[1][0].rcvmacused == 1 &&
+			!memcmp(orig10.extrakey, keys->sesskeys[1][0].extrakey,
+				OTRL_EXTRAKEY_BYTES),
+			"Session keys and counters survive hibernation");
+
+	gcry_mpi_release(their_y);
+	gcry_mpi_release(our_priv);
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_hibernate_spill(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = make_encrypted_context(us, "bob");
+	ConnContextPriv *priv = context->context_priv;
+	char dir[] = "/tmp/otr-test-hibernate-XXXXXX";
+
+	if (mkdtemp(dir) == NULL) {
+		fail("Could not create a spill directory");
+		otrl_userstate_free(us);
+		return;
+	}
+
+	otrl_hibernate_enable(us, dir);
+	ok(otrl_hibernate_context(us, context) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			priv->hibernated->blob == NULL &&
+			priv->hibernated->path != NULL &&
+			count_files(dir) == 1,
+			"Keys spilled to disk");
+	ok(otrl_context_priv_wake(priv) == gcry_error(GPG_ERR_NO_ERROR) &&
+			priv->keys != NULL && priv->keys->their_keyid == 1 &&
+			count_files(dir) == 0,
+			"Spilled keys woken up and their file removed");
+
+	otrl_userstate_free(us);
+	rmdir(dir);
+}
+
+static void test_otrl_hibernate_tampered(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context = make_encrypted_context(us, "bob");
+	ConnContextPriv *priv = context->context_priv;
+	OtrlHibernatedKeys *hibernated;
+
+	otrl_hibernate_enable(us, NULL);
+	otrl_hibernate_context(us, context);
+	hibernated = priv->hibernated;
+	hibernated->blob[hibernated->bloblen / 2] ^= 0x01;
+
+	ok(otrl_context_priv_wake(priv) != gcry_error(GPG_ERR_NO_ERROR) &&
+			priv->keys == NULL && priv->hibernated == NULL &&
+			us->hibernation->num_hibernated == 0,
+			"Tampered keys are rejected and discarded");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_hibernate_disable(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *bob = make_encrypted_context(us, "bob");
+	ConnContext *carol = make_encrypted_context(us, "carol");
+
+	otrl_hibernate_enable(us, NULL);
+	otrl_hibernate_context(us, bob);
+	otrl_hibernate_context(us, carol);
+	ok(us->hibernation->num_hibernated == 2,
+			"Two contexts hibernating");
+
+	otrl_hibernate_disable(us);
+	ok(us->hibernation == NULL &&
+			bob->context_priv->keys != NULL &&
+			bob->context_priv->hibernated == NULL &&
+			carol->context_priv->keys != NULL &&
+			carol->context_priv->hibernated == NULL,
+			"Disabling hibernation wakes every context");
+
+	/* Leaving the ENCRYPTED state drops hibernated keys too */
+	otrl_hibernate_enable(us, NULL);
+	otrl_hibernate_context(us, bob);
+	otrl_context_force_plaintext(bob);
+	ok(bob->context_priv->hibernated == NULL &&
+			us->hibernation->num_hibernated == 0,
+			"Ending a hibernating session discards its keys");
+
+	otrl_userstate_free(us);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_hibernate_roundtrip();
+	test_otrl_hibernate_spill();
+	test_otrl_hibernate_tampered();
+	test_otrl_hibernate_disable();
+
+	return 0;
+}
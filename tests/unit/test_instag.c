@@ -15,21 +15,25 @@
  * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <dirent.h>
 #include <gcrypt.h>
 #include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <proto.h>
 #include <auth.h>
 #include <context.h>
+#include <persist.h>
+#include <privkey.h>
 
 #include <tap/tap.h>
 #include <utils.h>
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 13
+#define NUM_TESTS 30
 
 /* Current directory of this executable. */
 static char curdir[PATH_MAX];
@@ -164,6 +168,272 @@ static void test_otrl_instag_read_FILEp(void)
 			"Instag succesfully read");
 }
 
+static void test_otrl_instag_index(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	FILE *instf = tmpfile();
+	OtrlInsTag *p, *old, *new;
+	char accountname[32];
+	unsigned int i;
+	int all_found = 1;
+
+	for (i = 0; i < 500; ++i) {
+		fprintf(instf, "acct%u\tproto\t%08x\n", i, 0x1000 + i);
+	}
+	rewind(instf);
+	otrl_instag_read_FILEp(us, instf);
+	fclose(instf);
+	for (i = 0; i < 500; ++i) {
+		snprintf(accountname, sizeof(accountname), "acct%u", i);
+		p = otrl_instag_find(us, accountname, "proto");
+		if (!p || p->instag != 0x1000 + i) all_found = 0;
+	}
+	ok(all_found && us->instag_index.count == 500 &&
+			otrl_instag_find(us, "acct500", "proto") == NULL,
+			"Instags found through the index");
+
+	old = otrl_instag_find(us, "acct7", "proto");
+	instf = tmpfile();
+	otrl_instag_generate_FILEp(us, instf, "acct7", "proto");
+	fclose(instf);
+	new = otrl_instag_find(us, "acct7", "proto");
+	ok(new != old && new == us->instag_root,
+			"Newest instag of an account found");
+
+	otrl_instag_forget(new);
+	p = otrl_instag_find(us, "acct7", "proto");
+	otrl_instag_forget(old);
+	ok(p == old && otrl_instag_find(us, "acct7", "proto") == NULL &&
+			us->instag_index.count == 499,
+			"Forgotten instags leave the index");
+
+	p = calloc(1, sizeof(OtrlInsTag));
+	p->accountname = strdup("acct7");
+	p->protocol = strdup("proto");
+	p->instag = otrl_instag_get_new();
+	p->next = us->instag_root;
+	p->next->tous = &(p->next);
+	p->tous = &(us->instag_root);
+	us->instag_root = p;
+	ok(otrl_instag_find(us, "acct7", "proto") == p &&
+			otrl_instag_find(us, "acct8", "proto") != NULL,
+			"Instag linked by hand found");
+
+	otrl_userstate_free(us);
+}
+
+/* The number of files in the given directory */
+static int count_files(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	int count = 0;
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] != '.') count++;
+	}
+	closedir(d);
+	return count;
+}
+
+/* Remove the files in the given directory, and the directory */
+static void remove_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	struct dirent *de;
+	char path[PATH_MAX];
+
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_name[0] == '.') continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+static void test_otrl_instag_write(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	char dir[] = "/tmp/libotr-testing-XXXXXX";
+	char path[PATH_MAX], link[PATH_MAX], dangling[PATH_MAX];
+	OtrlInsTag *p;
+	struct stat st, lst, dst;
+	int made, linked;
+
+	made = mkdtemp(dir) != NULL;
+	snprintf(path, sizeof(path), "%s/instags", dir);
+	otrl_instag_read(us, instag_filepath);
+	ok(made && otrl_instag_write(us, path) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			count_files(dir) == 1 && stat(path, &st) == 0 &&
+			(st.st_mode & 0600) == 0600,
+			"Instags written without leaving a temporary file");
+
+	otrl_instag_read(us2, path);
+	p = otrl_instag_find(us2, "alice_irc", "IRC");
+	ok(p && p->instag == 0x9abcdef0 &&
+			otrl_instag_write(us2, "/non_existent_dir/instags") ==
+			gcry_error_from_errno(ENOENT),
+			"Instags read back");
+
+	/* Writing through symlinks, one of which points nowhere yet */
+	snprintf(link, sizeof(link), "%s/link", dir);
+	snprintf(dangling, sizeof(dangling), "%s/dangling", dir);
+	snprintf(path, sizeof(path), "%s/target", dir);
+	linked = symlink("instags", link) == 0 &&
+			symlink("target", dangling) == 0;
+	ok(linked && otrl_instag_write(us2, link) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_instag_write(us2, dangling) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			lstat(link, &lst) == 0 && S_ISLNK(lst.st_mode) &&
+			lstat(dangling, &dst) == 0 && S_ISLNK(dst.st_mode) &&
+			stat(path, &st) == 0 && count_files(dir) == 4,
+			"Instags written through symlinks, which are kept");
+
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+	remove_dir(dir);
+}
+
+static void test_otrl_persist_batch(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	char dir[] = "/tmp/libotr-testing-XXXXXX";
+	char instpath[PATH_MAX], fppath[PATH_MAX];
+	struct stat st;
+	int made, pending_files;
+
+	made = mkdtemp(dir) != NULL;
+	snprintf(instpath, sizeof(instpath), "%s/instags", dir);
+	snprintf(fppath, sizeof(fppath), "%s/fingerprints", dir);
+	otrl_instag_read(us, instag_filepath);
+
+	otrl_persist_batch_begin(us);
+	otrl_persist_batch_begin(us);
+	otrl_instag_write(us, instpath);
+	otrl_instag_generate(us, instpath, "alice_new", "XMPP");
+	otrl_privkey_write_fingerprints(us, fppath);
+	pending_files = count_files(dir);
+	ok(made && otrl_persist_batch_end(us) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			pending_files == 2 && count_files(dir) == 2 &&
+			stat(instpath, &st) != 0,
+			"Writes held back until the outermost batch ends");
+
+	ok(otrl_persist_batch_end(us) == gcry_error(GPG_ERR_NO_ERROR) &&
+			count_files(dir) == 2 && stat(instpath, &st) == 0 &&
+			stat(fppath, &st) == 0 &&
+			otrl_persist_batch_end(us) ==
+			gcry_error(GPG_ERR_INV_VALUE),
+			"Batch committed");
+
+	otrl_instag_read(us2, instpath);
+	ok(otrl_instag_find(us2, "alice_new", "XMPP") != NULL &&
+			otrl_instag_find(us2, "alice_irc", "IRC") != NULL,
+			"Last write of a store in a batch kept");
+
+	otrl_instag_forget_all(us2);
+	unlink(instpath);
+	otrl_persist_batch_begin(us);
+	otrl_instag_write(us, instpath);
+	otrl_userstate_free(us);
+	otrl_instag_read(us2, instpath);
+	ok(otrl_instag_find(us2, "alice_new", "XMPP") != NULL &&
+			count_files(dir) == 2,
+			"Pending writes committed when the userstate is freed");
+
+	otrl_userstate_free(us2);
+	remove_dir(dir);
+}
+
+/* The size of the given file */
+static long file_size(const char *filename)
+{
+	struct stat st;
+
+	return stat(filename, &st) == 0 ? (long)st.st_size : -1;
+}
+
+static void test_otrl_instag_append(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlUserState us3 = otrl_userstate_create();
+	OtrlUserState us4 = otrl_userstate_create();
+	OtrlUserState us5 = otrl_userstate_create();
+	char dir[] = "/tmp/libotr-testing-XXXXXX";
+	char path[PATH_MAX];
+	FILE *instf;
+	const size_t linelen = strlen("acct0\tproto\t01234567\n");
+	OtrlInsTag *p;
+	long size;
+	int made, acct1_lines = 0;
+
+	made = mkdtemp(dir) != NULL;
+	snprintf(path, sizeof(path), "%s/instags", dir);
+	otrl_instag_read(us, instag_filepath);
+	ok(made && otrl_instag_generate(us, path, "acct0", "proto") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			us->instag_file && !strcmp(us->instag_file, path),
+			"New instag file written whole");
+
+	size = file_size(path);
+	otrl_instag_generate(us, path, "acct1", "proto");
+	otrl_instag_generate(us, path, "acct2", "proto");
+	ok(file_size(path) == size + 2 * (long)linelen &&
+			count_files(dir) == 1,
+			"New instags appended");
+
+	/* A second instag for acct1 */
+	otrl_instag_generate(us, path, "acct1", "proto");
+	otrl_instag_read(us2, path);
+	for (p = us2->instag_root; p; p = p->next) {
+		if (!strcmp(p->accountname, "acct1")) acct1_lines++;
+	}
+	p = otrl_instag_find(us2, "acct1", "proto");
+	ok(p && p->instag ==
+			otrl_instag_find(us, "acct1", "proto")->instag &&
+			acct1_lines == 1,
+			"Last line of an account read");
+
+	size = file_size(path);
+	ok(otrl_instag_compact(path) == gcry_error(GPG_ERR_NO_ERROR) &&
+			file_size(path) == size - (long)linelen,
+			"Instag file compacted");
+
+	otrl_instag_forget(otrl_instag_find(us, "acct0", "proto"));
+	otrl_instag_generate(us, path, "acct3", "proto");
+	otrl_instag_read(us3, path);
+	ok(otrl_instag_find(us3, "acct0", "proto") == NULL &&
+			otrl_instag_find(us3, "acct3", "proto") != NULL &&
+			otrl_instag_find(us3, "acct1", "proto") != NULL,
+			"Instag file rewritten after an instag is forgotten");
+
+	/* A crash in the middle of an append left a torn line */
+	instf = fopen(path, "ab");
+	fputs("acct9\tproto\t1234", instf);
+	fclose(instf);
+	otrl_instag_read(us4, path);
+	otrl_instag_generate(us4, path, "acct2", "proto");
+	otrl_instag_read(us5, path);
+	p = otrl_instag_find(us5, "acct2", "proto");
+	ok(us4->instag_file && p && p->instag ==
+			otrl_instag_find(us4, "acct2", "proto")->instag &&
+			otrl_instag_find(us5, "acct3", "proto") != NULL,
+			"Instag generated after a torn line not lost");
+
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+	otrl_userstate_free(us3);
+	otrl_userstate_free(us4);
+	otrl_userstate_free(us5);
+	remove_dir(dir);
+}
+
 static void test_otrl_instag_get_new(void)
 {
 	ok(otrl_instag_get_new() != 0, "New instag generated");
@@ -216,6 +486,10 @@ int main(int argc, char **argv)
 	test_otrl_instag_find();
 	test_otrl_instag_read();
 	test_otrl_instag_read_FILEp();
+	test_otrl_instag_index();
+	test_otrl_instag_write();
+	test_otrl_persist_batch();
+	test_otrl_instag_append();
 	test_otrl_instag_get_new();
 
 	return 0;
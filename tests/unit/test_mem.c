@@ -17,6 +17,7 @@
 
 #include <gcrypt.h>
 #include <pthread.h>
+#include <string.h>
 
 #include <mem.h>
 #include <proto.h>
@@ -25,7 +26,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 5
+#define NUM_TESTS 23
 
 static void test_otrl_mem_differ(void)
 {
@@ -45,6 +46,139 @@ static void test_otrl_mem_differ(void)
 			"NULL and NULL are identical");
 }
 
+static void test_otrl_mem_wipe(void)
+{
+	unsigned char buf[32];
+
+	memset(buf, 0xa5, sizeof(buf));
+	otrl_mem_wipe(buf + 1, 30);
+	ok(buf[0] == 0xa5 && buf[1] == 0 && buf[30] == 0 && buf[31] == 0xa5,
+			"Wipe zeroes exactly the given bytes");
+}
+
+static void test_otrl_mem_pool(void)
+{
+	OtrlMemUsage before, usage, slabs, allocated, allocated_after;
+	unsigned char *p, *q;
+	size_t i;
+	int zeroed = 1;
+
+	otrl_mem_gcrypt_usage(&before);
+	otrl_mem_gcrypt_allocated(&allocated);
+
+	p = gcry_malloc_secure(100);
+	memset(p, 0x5a, 100);
+	otrl_mem_gcrypt_usage(&usage);
+	ok(usage.count == before.count + 1 && usage.bytes > before.bytes + 100,
+			"Pooled allocation accounted for");
+	otrl_mem_pool_usage(&slabs, NULL);
+	ok(slabs.count >= 1 && slabs.bytes >= 65536, "Pool has slabs");
+
+	gcry_free(p);
+	/* The chunk stays in the pool, so we can look at what's left of it
+	 * (past the free list pointer) */
+	for (i = 16; i < 100; ++i) {
+		if (p[i] != 0) zeroed = 0;
+	}
+	ok(zeroed, "Freed chunk is wiped");
+	otrl_mem_gcrypt_usage(&usage);
+	ok(usage.count == before.count && usage.bytes == before.bytes,
+			"Freed chunk no longer accounted for");
+
+	q = gcry_malloc_secure(100);
+	ok(q == p, "Freed chunk is reused");
+
+	memset(q, 0x77, 100);
+	q = gcry_realloc(q, 3000);
+	ok(q != NULL && q[0] == 0x77 && q[99] == 0x77,
+			"Realloc into a bigger size class keeps the data");
+	q = gcry_realloc(q, 20000);
+	ok(q != NULL && q[0] == 0x77 && q[99] == 0x77,
+			"Realloc out of the pool keeps the data");
+	gcry_free(q);
+
+	otrl_mem_gcrypt_usage(&usage);
+	ok(usage.count == before.count && usage.bytes == before.bytes,
+			"Everything given back");
+	otrl_mem_gcrypt_allocated(&allocated_after);
+	ok(allocated_after.count == allocated.count + 4 &&
+			allocated_after.bytes > allocated.bytes + 23200,
+			"Every allocation counted, even those since freed");
+}
+
+static void test_otrl_mem_is_secure(void)
+{
+	unsigned char buf[16];
+	unsigned char *plain, *secure, *big;
+	gcry_mpi_t mpi;
+
+	plain = gcry_malloc(100);
+	secure = gcry_malloc_secure(100);
+	big = gcry_malloc_secure(20000);
+	ok(!gcry_is_secure(plain) && gcry_is_secure(secure) &&
+			gcry_is_secure(big) && gcry_is_secure(big + 19999),
+			"Blocks asked to be secure, and only those, are secure");
+	big = gcry_realloc(big, 40000);
+	ok(big && gcry_is_secure(big) && gcry_is_secure(big + 39999) &&
+			!gcry_is_secure(buf),
+			"Reallocated secure blocks stay secure, others aren't");
+
+	memset(secure, 0x42, 16);
+	gcry_mpi_scan(&mpi, GCRYMPI_FMT_USG, secure, 16, NULL);
+	ok(gcry_mpi_get_flag(mpi, GCRYMPI_FLAG_SECURE),
+			"MPIs scanned from secure blocks are secure");
+	gcry_mpi_release(mpi);
+
+	gcry_free(plain);
+	gcry_free(secure);
+	gcry_free(big);
+}
+
+static void test_otrl_mem_secure_heap(void)
+{
+	OtrlMemUsage usage;
+	size_t fallbacks;
+	unsigned char *chunks[32], *plain[8];
+	int i, secure = 0, plain_secure = 0, from_heap = 0;
+	gcry_error_t err;
+
+	ok(otrl_mem_secure_heap(0) == gcry_error(GPG_ERR_INV_VALUE),
+			"Empty secure heap refused");
+
+	/* Rounded up to a single slab */
+	err = otrl_mem_secure_heap(1);
+	skip_start(err != 0, 4, "Cannot lock memory here") {
+		otrl_mem_secure_heap_usage(&usage, &fallbacks);
+		ok(usage.count == 1 && usage.bytes == 65536 && fallbacks == 0,
+				"Secure heap set up");
+
+		/* Half a slab of insecure 4 KiB chunks */
+		for (i = 0; i < 8; ++i) {
+			plain[i] = gcry_malloc(4000);
+			if (gcry_is_secure(plain[i])) plain_secure++;
+		}
+		ok(plain_secure == 0, "Insecure blocks are not secure");
+
+		/* More secure 4 KiB chunks than fit in the slab */
+		for (i = 0; i < 32; ++i) {
+			chunks[i] = gcry_malloc_secure(4000);
+			if (gcry_is_secure(chunks[i])) secure++;
+			otrl_mem_secure_heap_usage(&usage, &fallbacks);
+			if (fallbacks == 0) from_heap++;
+		}
+		ok(secure == 32 && from_heap >= 16,
+				"Secure blocks get the whole secure heap");
+		ok(fallbacks > 0,
+				"Used-up secure heap falls back to other memory");
+		for (i = 0; i < 32; ++i) {
+			gcry_free(chunks[i]);
+		}
+		for (i = 0; i < 8; ++i) {
+			gcry_free(plain[i]);
+		}
+	} skip_end();
+}
+
 int main(int argc, char **argv)
 {
 	plan_tests(NUM_TESTS);
@@ -53,6 +187,10 @@ int main(int argc, char **argv)
 	OTRL_INIT;
 
 	test_otrl_mem_differ();
+	test_otrl_mem_wipe();
+	test_otrl_mem_pool();
+	test_otrl_mem_is_secure();
+	test_otrl_mem_secure_heap();
 
 	return 0;
 }
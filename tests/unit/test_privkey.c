@@ -16,8 +16,10 @@
  */
 
 #include <gcrypt.h>
+#include <limits.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 #include <privkey.h>
 #include <proto.h>
@@ -26,7 +28,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 13
+#define NUM_TESTS 17
 
 static OtrlUserState us = NULL;
 static char filename[] = "/tmp/libotr-testing-XXXXXX";
@@ -94,6 +96,31 @@ static void test_otrl_privkey_generate_FILEp(void)
 		"key generated");
 }
 
+static void test_otrl_privkey_generate(void)
+{
+	OtrlUserState us2 = otrl_userstate_create();
+	char dir[] = "/tmp/libotr-testing-XXXXXX";
+	char path[PATH_MAX];
+	struct stat st;
+	gcry_error_t err;
+	int made;
+
+	made = mkdtemp(dir) != NULL;
+	snprintf(path, sizeof(path), "%s/privkeys", dir);
+	err = otrl_privkey_generate(us2, path, "bob", "xmpp");
+	otrl_privkey_forget_all(us2);
+	otrl_privkey_read(us2, path);
+	/* The directory is only empty once the store is gone if no
+	 * temporary file was left behind */
+	ok(made && err == gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_find(us2, "bob", "xmpp") != NULL &&
+			stat(path, &st) == 0 && (st.st_mode & 0777) == 0600 &&
+			unlink(path) == 0 && rmdir(dir) == 0,
+			"Key store written to a private file");
+
+	otrl_userstate_free(us2);
+}
+
 static void test_otrl_privkey_hash_to_human(void)
 {
 	int i;
@@ -140,6 +167,33 @@ static void test_otrl_privkey_fingerprint_raw(void)
 		"Raw privkey fingerprint ok");
 }
 
+static void test_otrl_privkey_fingerprint_memo(void)
+{
+	char fingerprint[OTRL_PRIVKEY_FPRINT_HUMAN_LEN] = {0};
+	char expected[OTRL_PRIVKEY_FPRINT_HUMAN_LEN];
+	unsigned char hash[20] = {0}, expected_hash[20] = {0};
+	OtrlPrivKey *p = otrl_privkey_find(us, "alice", "irc");
+
+	otrl_privkey_fingerprint_raw(us, hash, "alice", "irc");
+	ok(p->fingerprint_of && p->fingerprint_of != p->pubkey_data &&
+			p->fingerprint_oflen == p->pubkey_datalen &&
+			!memcmp(p->fingerprint_of, p->pubkey_data,
+				p->pubkey_datalen),
+			"Privkey fingerprints memoized");
+
+	/* Changing the key in place is noticed */
+	p->pubkey_data[0] ^= 0xff;
+	gcry_md_hash_buffer(GCRY_MD_SHA1, expected_hash, p->pubkey_data,
+			p->pubkey_datalen);
+	otrl_privkey_hash_to_human(expected, expected_hash);
+	otrl_privkey_fingerprint_raw(us, hash, "alice", "irc");
+	otrl_privkey_fingerprint(us, fingerprint, "alice", "irc");
+	p->pubkey_data[0] ^= 0xff;
+	ok(memcmp(hash, expected_hash, 20) == 0 &&
+			strcmp(fingerprint, expected) == 0,
+			"Privkey fingerprints follow changes to the key");
+}
+
 static void test_otrl_privkey_find(void)
 {
 	OtrlPrivKey *p = NULL;
@@ -159,6 +213,16 @@ static void test_otrl_privkey_find(void)
 		"Privkey found");
 }
 
+static void test_otrl_privkey_forget(void)
+{
+	OtrlPrivKey *p = otrl_privkey_find(us, "alice", "irc");
+
+	otrl_privkey_forget(p);
+	ok(otrl_privkey_find(us, "alice", "irc") == NULL &&
+			us->privkey_index.count == 0,
+			"Forgotten privkey leaves the index");
+}
+
 static void test_otrl_privkey_sign(void)
 {
 	unsigned char *sig = NULL;
@@ -250,12 +314,15 @@ int main(int argc, char **argv)
 	p = otrl_privkey_find(us, "alice", "irc");
 	make_pubkey(&(p->pubkey_data), &(p->pubkey_datalen), p->privkey);
 
+	test_otrl_privkey_generate();
 	test_otrl_privkey_hash_to_human();
 	test_otrl_privkey_fingerprint();
 	test_otrl_privkey_fingerprint_raw();
+	test_otrl_privkey_fingerprint_memo();
 	test_otrl_privkey_sign();
 	test_otrl_privkey_verify();
 	test_otrl_privkey_find();
+	test_otrl_privkey_forget();
 
 	fclose(f);
 	otrl_userstate_free(us);
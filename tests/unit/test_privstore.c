@@ -0,0 +1,276 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gcrypt.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <privkey.h>
+#include <privstore.h>
+#include <proto.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 16
+
+static char dir[] = "/tmp/libotr-testing-XXXXXX";
+static char path[PATH_MAX], legacypath[PATH_MAX];
+
+/* The size of the given file */
+static long file_size(const char *filename)
+{
+	struct stat st;
+
+	return stat(filename, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/* Do the two keys have the same public part? */
+static int same_key(const OtrlPrivKey *a, const OtrlPrivKey *b)
+{
+	return a && b && a->pubkey_datalen == b->pubkey_datalen &&
+		!memcmp(a->pubkey_data, b->pubkey_data, a->pubkey_datalen);
+}
+
+static void test_otrl_privkey_store_add(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlPrivKeyStore *store = NULL;
+	OtrlPrivKey *alice;
+	void *newkey;
+	gcry_error_t err;
+	int made = mkdtemp(dir) != NULL;
+
+	snprintf(path, sizeof(path), "%s/privkeys", dir);
+	ok(made && otrl_privkey_store_open(&store, path) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			store->entry_root == NULL && file_size(path) > 0,
+			"New store created");
+
+	otrl_privkey_generate_start(us, "alice", "xmpp", &newkey);
+	otrl_privkey_generate_calculate(newkey);
+	err = otrl_privkey_generate_finish_store(us, newkey, store);
+	alice = otrl_privkey_find(us, "alice", "xmpp");
+	ok(err == gcry_error(GPG_ERR_NO_ERROR) && alice != NULL &&
+			otrl_privkey_store_find(store, "alice", "xmpp") &&
+			store->numrecords == 1,
+			"Generated key appended to the store");
+
+	otrl_privkey_store_add(store, "bob", "irc", alice->privkey);
+	otrl_privkey_store_add(store, "carol", "irc", alice->privkey);
+	otrl_privkey_store_close(store);
+
+	otrl_privkey_store_open(&store, path);
+	ok(store->numrecords == 3 &&
+			otrl_privkey_store_load(us2, store, "bob", "irc") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			same_key(otrl_privkey_find(us2, "bob", "irc"), alice) &&
+			us2->privkey_root->next == NULL,
+			"Store reopened, one key loaded alone");
+
+	ok(otrl_privkey_store_remove(store, "carol", "irc") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_store_remove(store, "carol", "irc") ==
+			gcry_error(GPG_ERR_NOT_FOUND) &&
+			otrl_privkey_store_load(us2, store, "carol", "irc") ==
+			gcry_error(GPG_ERR_NOT_FOUND) &&
+			otrl_privkey_store_add(store, "dave\t", "irc",
+				alice->privkey) ==
+			gcry_error(GPG_ERR_INV_VALUE),
+			"Key removed from the store");
+
+	/* Replace bob's key with the one us2 has for him, and load it
+	 * over the old one */
+	otrl_privkey_store_add(store, "bob", "irc",
+			otrl_privkey_find(us2, "bob", "irc")->privkey);
+	ok(otrl_privkey_store_load(us2, store, "bob", "irc") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			us2->privkey_root->next == NULL &&
+			store->numrecords == 5,
+			"Key replaced");
+
+	otrl_privkey_store_close(store);
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+}
+
+static void test_otrl_privkey_store_recover(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlPrivKeyStore *store = NULL;
+	long size = file_size(path);
+	int refused;
+	FILE *f;
+
+	/* A record cut short by a crash */
+	f = fopen(path, "ab");
+	fputs("erin\tirc\t0000000900\n (account\n", f);
+	fclose(f);
+	ok(otrl_privkey_store_open(&store, path) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			file_size(path) == size &&
+			otrl_privkey_store_find(store, "erin", "irc") == NULL &&
+			otrl_privkey_store_find(store, "bob", "irc") != NULL,
+			"Torn record dropped");
+	otrl_privkey_store_close(store);
+
+	/* A damaged record that is not the last one */
+	f = fopen(path, "ab");
+	fputs("erin\tirc\n", f);
+	fputs("frank\tirc\t0000000000\n", f);
+	fclose(f);
+	refused = otrl_privkey_store_open(&store, path) ==
+			gcry_error(GPG_ERR_UNUSABLE_SECKEY) &&
+			store == NULL && file_size(path) > size;
+	ok(refused && truncate(path, size) == 0, "Damaged store refused");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_privkey_store_compact(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlPrivKeyStore *store = NULL;
+	long size = file_size(path);
+
+	otrl_privkey_store_open(&store, path);
+	ok(otrl_privkey_store_compact(store) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			store->numrecords == 2 && file_size(path) < size,
+			"Store compacted");
+
+	ok(otrl_privkey_store_load_all(us, store) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			same_key(otrl_privkey_find(us, "alice", "xmpp"),
+				otrl_privkey_find(us, "bob", "irc")),
+			"Keys loaded after compaction");
+
+	otrl_privkey_store_close(store);
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_privkey_read_lazy(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlPrivKey *alice, *bob;
+	void *newkey = NULL;
+
+	ok(otrl_privkey_read_lazy(us, path, 1) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			us->privkey_root == NULL &&
+			otrl_privkey_find_loaded(us, "alice", "xmpp") == NULL,
+			"Store opened without loading any key");
+
+	alice = otrl_privkey_find(us, "alice", "xmpp");
+	ok(alice && alice->on_demand &&
+			otrl_privkey_find(us, "alice", "xmpp") == alice &&
+			otrl_privkey_find(us, "nobody", "xmpp") == NULL &&
+			us->privkey_lazy_count == 1,
+			"Key loaded when first found");
+
+	bob = otrl_privkey_find(us, "bob", "irc");
+	ok(bob && us->privkey_root == bob && bob->next == NULL &&
+			us->privkey_lazy_count == 1 &&
+			otrl_privkey_find_loaded(us, "alice", "xmpp") == NULL &&
+			otrl_privkey_find(us, "alice", "xmpp") != NULL,
+			"Least recently found key dropped");
+
+	/* Keys generated now go into the store, rather than over it */
+	ok(otrl_privkey_generate(us, path, "heidi", "xmpp") ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_generate_start(us, "ivan", "irc",
+				&newkey) == gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_generate_calculate(newkey) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_generate_finish(us, newkey, path) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_find_loaded(us, "ivan", "irc") != NULL,
+			"Keys generated into the store");
+
+	ok(otrl_privkey_read_lazy(us2, path, 0) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_find(us2, "alice", "xmpp") != NULL &&
+			otrl_privkey_find(us2, "bob", "irc") != NULL &&
+			same_key(otrl_privkey_find(us2, "heidi", "xmpp"),
+				otrl_privkey_find(us, "heidi", "xmpp")) &&
+			same_key(otrl_privkey_find(us2, "ivan", "irc"),
+				otrl_privkey_find(us, "ivan", "irc")),
+			"Generating keys keeps the ones not loaded");
+
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+}
+
+static void test_otrl_privkey_store_import(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlUserState us2 = otrl_userstate_create();
+	OtrlPrivKeyStore *store = NULL;
+	char newpath[PATH_MAX];
+
+	snprintf(legacypath, sizeof(legacypath), "%s/legacy", dir);
+	snprintf(newpath, sizeof(newpath), "%s/imported", dir);
+	otrl_privkey_generate(us, legacypath, "grace", "irc");
+
+	ok(otrl_privkey_store_open(&store, legacypath) ==
+			gcry_error(GPG_ERR_UNUSABLE_SECKEY),
+			"Old private key file is not a store");
+
+	otrl_privkey_store_open(&store, newpath);
+	ok(otrl_privkey_store_import(store, us) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_privkey_store_load_all(us2, store) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			same_key(otrl_privkey_find(us, "grace", "irc"),
+				otrl_privkey_find(us2, "grace", "irc")),
+			"Old private key file imported");
+
+	otrl_privkey_store_close(store);
+	otrl_userstate_free(us);
+	otrl_userstate_free(us2);
+	unlink(newpath);
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	/* Set to quick random so we don't wait on /dev/random. */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM, 0);
+
+	test_otrl_privkey_store_add();
+	test_otrl_privkey_store_recover();
+	test_otrl_privkey_store_compact();
+	test_otrl_privkey_read_lazy();
+	test_otrl_privkey_store_import();
+
+	unlink(path);
+	unlink(legacypath);
+	rmdir(dir);
+
+	return 0;
+}
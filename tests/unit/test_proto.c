@@ -344,7 +344,8 @@ static void test_otrl_proto_create_data(void)
 			"Conflict detected for msgstate plaintext");
 
 	context->msgstate = OTRL_MSGSTATE_ENCRYPTED;
-	context->context_priv->their_keyid = 0;
+	otrl_context_priv_alloc_keys(context->context_priv);
+	context->context_priv->keys->their_keyid = 0;
 	ok(otrl_proto_create_data(&encmessagep, context, msg, tlvs, flags,
 			extrakey) == gcry_error(GPG_ERR_CONFLICT),
 			"Conflict detected for msgstate encrypted");
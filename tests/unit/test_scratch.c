@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <proto.h>
+#include <scratch.h>
+
+#include <tap/tap.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 7
+
+static void test_otrl_scratch_mpis(void)
+{
+	gcry_mpi_t a[2], b[2], many[OTRL_SCRATCH_MPIS + 1];
+	gcry_mpi_t first;
+
+	otrl_scratch_mpis(a, 2);
+	first = a[0];
+	ok(a[0] && a[1] && gcry_mpi_cmp_ui(a[0], 0) == 0,
+			"Temporaries taken");
+	gcry_mpi_set_ui(a[0], 12345);
+	gcry_mpi_randomize(a[1], 1536, GCRY_WEAK_RANDOM);
+	otrl_scratch_release_mpis(a, 2);
+
+	otrl_scratch_mpis(b, 2);
+	ok(b[0] == first && gcry_mpi_cmp_ui(b[0], 0) == 0 &&
+			gcry_mpi_cmp_ui(b[1], 0) == 0,
+			"Temporaries reused, wiped");
+	otrl_scratch_release_mpis(b, 2);
+
+	/* More than the workspace holds */
+	otrl_scratch_mpis(many, OTRL_SCRATCH_MPIS);
+	otrl_scratch_mpis(&many[OTRL_SCRATCH_MPIS], 1);
+	gcry_mpi_set_ui(many[OTRL_SCRATCH_MPIS], 7);
+	ok(many[OTRL_SCRATCH_MPIS] != NULL &&
+			gcry_mpi_cmp_ui(many[OTRL_SCRATCH_MPIS], 7) == 0,
+			"Temporaries allocated once the workspace runs out");
+	otrl_scratch_release_mpis(&many[OTRL_SCRATCH_MPIS], 1);
+	otrl_scratch_release_mpis(many, OTRL_SCRATCH_MPIS);
+
+	otrl_scratch_mpis(a, 1);
+	ok(a[0] == first, "Workspace intact afterwards");
+	otrl_scratch_release_mpis(a, 1);
+}
+
+static void test_otrl_scratch_buf(void)
+{
+	unsigned char *buf1, *buf2, *big;
+	size_t i;
+	int zeroed = 1;
+
+	buf1 = otrl_scratch_buf(100);
+	buf2 = otrl_scratch_buf(20);
+	ok(buf1 && buf2 && buf2 == buf1 + 100, "Buffers taken in turn");
+	memset(buf1, 0xaa, 100);
+	memset(buf2, 0xbb, 20);
+	otrl_scratch_release_buf(buf2, 20);
+	otrl_scratch_release_buf(buf1, 100);
+	for (i = 0; i < 120; ++i) {
+		if (buf1[i] != 0) zeroed = 0;
+	}
+	ok(zeroed && otrl_scratch_buf(10) == buf1, "Buffers wiped, reused");
+	otrl_scratch_release_buf(buf1, 10);
+
+	big = otrl_scratch_buf(OTRL_SCRATCH_BUFLEN + 1);
+	ok(big != NULL && big != buf1, "Big buffer allocated");
+	memset(big, 0xcc, OTRL_SCRATCH_BUFLEN + 1);
+	otrl_scratch_release_buf(big, OTRL_SCRATCH_BUFLEN + 1);
+
+	otrl_scratch_free();
+}
+
+int main(int argc, char **argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_scratch_mpis();
+	test_otrl_scratch_buf();
+
+	return 0;
+}
@@ -26,7 +26,7 @@
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 23
+#define NUM_TESTS 25
 
 /* Copied from sm.c */
 static const int SM_MOD_LEN_BITS = 1536;
@@ -213,6 +213,8 @@ static void test_sm_step1(void)
 			astate->sm_prog_state == OTRL_SMP_PROG_OK &&
 			alice_output && alice_output_len > 0,
 			"SMP step 1 validated");
+	ok(gcry_mpi_get_flag(astate->secret, GCRYMPI_FLAG_SECURE),
+			"SMP step 1 secret is a secure MPI");
 	gcry_mpi_release(secret_mpi);
 }
 
@@ -256,6 +258,8 @@ static void test_sm_step2b(void)
 			bstate->p &&
 			bstate->q,
 			"SMP step2b validate");
+	ok(gcry_mpi_get_flag(bstate->secret, GCRYMPI_FLAG_SECURE),
+			"SMP step2b secret is a secure MPI");
 	gcry_mpi_release(secret_mpi);
 }
 
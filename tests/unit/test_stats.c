@@ -0,0 +1,176 @@
+/*
+ * Copyright (C) 2026 - OTR Development Team <otr@cypherpunks.ca>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License, version 2 only, as
+ * published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, write to the Free Software Foundation, Inc., 51
+ * Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#include <gcrypt.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <proto.h>
+#include <context.h>
+#include <event.h>
+#include <stats.h>
+
+#include <tap/tap.h>
+#include <utils.h>
+
+GCRY_THREAD_OPTION_PTHREAD_IMPL;
+
+#define NUM_TESTS 11
+
+static void test_otrl_stats_disabled(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlStats snapshot;
+
+	ok(otrl_stats_snapshot(us, &snapshot) ==
+			gcry_error(GPG_ERR_INV_VALUE) &&
+			otrl_stats_start(us) == 0,
+			"Nothing is recorded until statistics are enabled");
+	ok(otrl_stats_enable(us) == gcry_error(GPG_ERR_NO_ERROR) &&
+			otrl_stats_snapshot(us, &snapshot) ==
+			gcry_error(GPG_ERR_NO_ERROR) &&
+			snapshot.ops[OTRL_STATS_DATA_ENCRYPT].count == 0,
+			"Statistics enabled");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_stats_proto(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	ConnContext *context;
+	OtrlStats snapshot;
+	OtrlStatsHist *hist;
+	char *msg = NULL, *unfrag = NULL;
+	unsigned long long buckets = 0;
+	unsigned int i;
+
+	otrl_stats_enable(us);
+	context = otrl_context_find(us, "carol", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_proto_create_data(&msg, context, "hi", NULL, 0, NULL);
+
+	context = utils_encrypted_context(us, "alice", "bob", "proto", NULL);
+	context->context_priv->keys->numsavedkeys = 2;
+	context->context_priv->keys->saved_mac_keys = calloc(2, 20);
+	otrl_proto_create_data(&msg, context, "hi", NULL, 0, NULL);
+	free(msg);
+
+	otrl_stats_snapshot(us, &snapshot);
+	hist = &snapshot.ops[OTRL_STATS_DATA_ENCRYPT];
+	for (i = 0; i < OTRL_STATS_HIST_BUCKETS; ++i) {
+		buckets += hist->buckets[i];
+	}
+	ok(hist->count == 2 && hist->errors == 1 && buckets == 2 &&
+			hist->max_ns > 0 && hist->total_ns >= hist->max_ns,
+			"Data Message creation timed, failures counted");
+	ok(snapshot.counters[OTRL_STATS_MACS_REVEALED] == 2,
+			"Revealed MAC keys counted");
+
+	otrl_proto_fragment_accumulate(&unfrag, context, "plain");
+	otrl_proto_fragment_accumulate(&unfrag, context, "?OTR,1,2,ab,");
+	otrl_proto_fragment_accumulate(&unfrag, context, "?OTR,2,2,cd,");
+	otrl_stats_snapshot(us, &snapshot);
+	ok(snapshot.ops[OTRL_STATS_FRAGMENT].count == 3 &&
+			snapshot.counters[OTRL_STATS_FRAGMENT_UNFRAGMENTED]
+			== 1 &&
+			snapshot.counters[OTRL_STATS_FRAGMENT_INCOMPLETE] == 1 &&
+			snapshot.counters[OTRL_STATS_FRAGMENT_COMPLETE] == 1 &&
+			unfrag && !strcmp(unfrag, "abcd"),
+			"Fragment results counted");
+	free(unfrag);
+
+	otrl_stats_reset(us);
+	otrl_stats_snapshot(us, &snapshot);
+	ok(snapshot.ops[OTRL_STATS_DATA_ENCRYPT].count == 0 &&
+			snapshot.counters[OTRL_STATS_FRAGMENT_COMPLETE] == 0,
+			"Statistics reset");
+
+	otrl_stats_disable(us);
+	ok(us->stats == NULL &&
+			otrl_stats_snapshot(us, &snapshot) ==
+			gcry_error(GPG_ERR_INV_VALUE),
+			"Statistics disabled");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_stats_msg_events(void)
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMessageAppOps ops;
+	OtrlStats snapshot;
+
+	memset(&ops, 0, sizeof(ops));
+	otrl_stats_enable(us);
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_RCVDMSG_UNREADABLE, NULL,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_RCVDMSG_UNREADABLE, NULL,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_event_msg(us, &ops, NULL, OTRL_MSGEVENT_MSG_RESENT, NULL,
+			NULL, gcry_error(GPG_ERR_NO_ERROR));
+	otrl_stats_snapshot(us, &snapshot);
+	ok(snapshot.msg_events[OTRL_MSGEVENT_RCVDMSG_UNREADABLE] == 2 &&
+			snapshot.msg_events[OTRL_MSGEVENT_MSG_RESENT] == 1 &&
+			snapshot.msg_events[OTRL_MSGEVENT_NONE] == 0,
+			"Message events counted");
+
+	otrl_userstate_free(us);
+}
+
+static void test_otrl_stats_json(void)
+{
+	OtrlStats snapshot;
+	char *json;
+
+	memset(&snapshot, 0, sizeof(snapshot));
+	snapshot.ops[OTRL_STATS_SMP_STEP3].count = 5;
+	snapshot.ops[OTRL_STATS_SMP_STEP3].buckets[
+		OTRL_STATS_HIST_BUCKETS - 1] = 7;
+	snapshot.counters[OTRL_STATS_MACS_SAVED] = 12;
+	snapshot.msg_events[OTRL_MSGEVENT_ENCRYPTION_ERROR] = 3;
+
+	json = otrl_stats_to_json(&snapshot);
+	ok(json != NULL && json[0] == '{' &&
+			json[strlen(json) - 1] == '}',
+			"Snapshot rendered as JSON");
+	ok(json && strstr(json, "\"smp_step3\":{\"count\":5,") &&
+			strstr(json, ",7]}") &&
+			strstr(json, "\"macs_saved\":12") &&
+			strstr(json, "\"encryption_error\":3"),
+			"JSON holds the snapshot");
+	ok(!strcmp(otrl_stats_op_name(OTRL_STATS_ROTATE_Y), "rotate_y") &&
+			otrl_stats_op_name(OTRL_STATS_NUM_OPS) == NULL,
+			"Operation names");
+	free(json);
+}
+
+int main(int argc, char** argv)
+{
+	plan_tests(NUM_TESTS);
+
+	gcry_control(GCRYCTL_SET_THREAD_CBS, &gcry_threads_pthread);
+	OTRL_INIT;
+
+	test_otrl_stats_disabled();
+	test_otrl_stats_proto();
+	test_otrl_stats_msg_events();
+	test_otrl_stats_json();
+
+	return 0;
+}
@@ -17,15 +17,18 @@
 
 #include <gcrypt.h>
 #include <pthread.h>
+#include <string.h>
 
 #include <userstate.h>
 #include <proto.h>
+#include <context.h>
+#include <tlv.h>
 
 #include <tap/tap.h>
 
 GCRY_THREAD_OPTION_PTHREAD_IMPL;
 
-#define NUM_TESTS 1
+#define NUM_TESTS 7
 
 static void test_otrl_userstate_create()
 {
@@ -39,6 +42,77 @@ static void test_otrl_userstate_create()
 	otrl_userstate_free(us);
 }
 
+static void test_otrl_userstate_memory_stats()
+{
+	OtrlUserState us = otrl_userstate_create();
+	OtrlMemStats stats, before;
+	ConnContext *context;
+	OtrlTLV *tlv;
+
+	otrl_userstate_memory_stats(us, &stats);
+	ok(stats.categories[OTRL_MEM_CONTEXTS].count == 0 &&
+			stats.categories[OTRL_MEM_FINGERPRINTS].count == 0 &&
+			stats.userstate_bytes == 0,
+			"An empty userstate uses no memory");
+
+	context = otrl_context_find(us, "bob", "alice", "proto",
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	otrl_context_find_fingerprint(context,
+			(unsigned char *)"01234567890123456789", 1, NULL);
+	otrl_context_find_fingerprint(context,
+			(unsigned char *)"98765432109876543210", 1, NULL);
+	context->context_priv->fragment = strdup("?OTR,1,3,frag");
+	context->context_priv->fragment_len = 13;
+	otrl_context_priv_alloc_keys(context->context_priv);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID,
+			&context->context_priv->keys->our_dh_key);
+
+	otrl_userstate_memory_stats(us, &stats);
+	ok(stats.categories[OTRL_MEM_CONTEXTS].count == 1 &&
+			stats.categories[OTRL_MEM_CONTEXTS].bytes >
+			sizeof(ConnContext) &&
+			stats.categories[OTRL_MEM_FINGERPRINTS].count == 2 &&
+			stats.categories[OTRL_MEM_FRAGMENTS].count == 1 &&
+			stats.categories[OTRL_MEM_FRAGMENTS].bytes == 14,
+			"Contexts, fingerprints and fragments accounted for");
+	ok(stats.categories[OTRL_MEM_KEYS].count == 1 &&
+			stats.categories[OTRL_MEM_KEYS].bytes >=
+			sizeof(ConnContextKeys) + 192 + 40 - 1,
+			"Conversation keys accounted for");
+	ok(stats.userstate_bytes ==
+			stats.categories[OTRL_MEM_CONTEXTS].bytes +
+			stats.categories[OTRL_MEM_FINGERPRINTS].bytes +
+			stats.categories[OTRL_MEM_KEYS].bytes +
+			stats.categories[OTRL_MEM_FRAGMENTS].bytes,
+			"Userstate total adds up");
+
+	before = stats;
+	tlv = otrl_tlv_new(OTRL_TLV_PADDING, 100, (unsigned char *)
+			"0123456789012345678901234567890123456789"
+			"0123456789012345678901234567890123456789"
+			"01234567890123456789");
+	otrl_userstate_memory_stats(us, &stats);
+	ok(stats.categories[OTRL_MEM_TLVS].count ==
+			before.categories[OTRL_MEM_TLVS].count + 1 &&
+			stats.categories[OTRL_MEM_TLVS].bytes ==
+			before.categories[OTRL_MEM_TLVS].bytes +
+			sizeof(OtrlTLV) + 101,
+			"TLVs accounted for");
+	otrl_tlv_free(tlv);
+
+	otrl_context_force_plaintext(context);
+	otrl_context_priv_free_keys(context->context_priv);
+	otrl_userstate_memory_stats(us, &stats);
+	ok(stats.categories[OTRL_MEM_KEYS].count == 0 &&
+			stats.categories[OTRL_MEM_TLVS].count ==
+			before.categories[OTRL_MEM_TLVS].count &&
+			stats.categories[OTRL_MEM_GCRYPT].bytes <
+			before.categories[OTRL_MEM_GCRYPT].bytes,
+			"Freed memory is no longer accounted for");
+
+	otrl_userstate_free(us);
+}
+
 int main(int argc, char** argv)
 {
 	plan_tests(NUM_TESTS);
@@ -47,6 +121,7 @@ int main(int argc, char** argv)
 	OTRL_INIT;
 
 	test_otrl_userstate_create();
+	test_otrl_userstate_memory_stats();
 
 	return 0;
 }
@@ -18,6 +18,12 @@
 #ifndef TESTS_UTILS_H
 #define TESTS_UTILS_H
 
+#include <string.h>
+
+#include <gcrypt.h>
+
+#include <context.h>
+
 /*
  * Return 1 if the given buffer is zeroed or 0 if not.
  */
@@ -26,4 +32,61 @@ static inline int utils_is_zeroed(const unsigned char *buf, size_t size)
 	return buf[0] == 0 && !memcmp(buf, buf + 1, size - 1);
 }
 
+/*
+ * Put accountname's context for username in us into the ENCRYPTED
+ * state, as if the AKE had just completed and username had answered
+ * once, and return it.  If theirp is not NULL, username's context for
+ * accountname gets the other half of the same keys and is stored
+ * there, so that Data Messages made by one can be read by the other.
+ */
+static inline ConnContext *utils_encrypted_context(OtrlUserState us,
+		const char *accountname, const char *username,
+		const char *protocol, ConnContext **theirp)
+{
+	ConnContext *ours;
+	ConnContextKeys *keys;
+	DH_keypair a0, a1, b1;
+
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a0);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &a1);
+	otrl_dh_gen_keypair(DH1536_GROUP_ID, &b1);
+
+	ours = otrl_context_find(us, username, accountname, protocol,
+			OTRL_INSTAG_MASTER, 1, NULL, NULL, NULL);
+	ours->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+	ours->protocol_version = 3;
+	otrl_context_priv_alloc_keys(ours->context_priv);
+	keys = ours->context_priv->keys;
+	otrl_dh_keypair_copy(&keys->our_old_dh_key, &a0);
+	otrl_dh_keypair_copy(&keys->our_dh_key, &a1);
+	keys->our_keyid = 2;
+	keys->their_y = gcry_mpi_copy(b1.pub);
+	keys->their_keyid = 1;
+	otrl_dh_session(&keys->sesskeys[1][0], &keys->our_old_dh_key,
+			keys->their_y);
+
+	if (theirp) {
+		ConnContext *theirs = otrl_context_find(us, accountname,
+				username, protocol, OTRL_INSTAG_MASTER, 1,
+				NULL, NULL, NULL);
+
+		theirs->msgstate = OTRL_MSGSTATE_ENCRYPTED;
+		theirs->protocol_version = 3;
+		otrl_context_priv_alloc_keys(theirs->context_priv);
+		keys = theirs->context_priv->keys;
+		otrl_dh_keypair_copy(&keys->our_dh_key, &b1);
+		keys->our_keyid = 1;
+		keys->their_y = gcry_mpi_copy(a0.pub);
+		keys->their_keyid = 1;
+		otrl_dh_session(&keys->sesskeys[0][0], &keys->our_dh_key,
+				keys->their_y);
+		*theirp = theirs;
+	}
+
+	otrl_dh_keypair_free(&a0);
+	otrl_dh_keypair_free(&a1);
+	otrl_dh_keypair_free(&b1);
+	return ours;
+}
+
 #endif /* TESTS_UTILS_H */
@@ -0,0 +1,250 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "hashtab.h"
+
+/* toolkit headers */
+#include "parse.h"
+#include "sesskeys.h"
+#include "batch.h"
+
+static void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+}
+
+/* Start reading records from the given stream. */
+void batch_reader_init(BatchReader *reader, FILE *stream)
+{
+    reader->stream = stream;
+    reader->line = NULL;
+    reader->size = 0;
+    reader->lineno = 0;
+}
+
+/* Read a whole line into reader->line, without its line break.
+ * Returns 0 at the end of the input. */
+static int read_line(BatchReader *reader)
+{
+    size_t len = 0;
+
+    if (reader->size == 0) {
+	reader->size = 4096;
+	reader->line = malloc(reader->size);
+	if (!reader->line) out_of_memory();
+    }
+
+    while (fgets(reader->line + len, reader->size - len, reader->stream)) {
+	len += strlen(reader->line + len);
+	if (len > 0 && reader->line[len-1] == '\n') break;
+	if (len + 1 < reader->size) break;   /* The last line */
+
+	reader->size *= 2;
+	reader->line = realloc(reader->line, reader->size);
+	if (!reader->line) out_of_memory();
+    }
+    if (len == 0) return 0;
+
+    while (len > 0 && (reader->line[len-1] == '\n' ||
+		reader->line[len-1] == '\r')) {
+	reader->line[--len] = '\0';
+    }
+    reader->lineno++;
+    return 1;
+}
+
+/* Read the next record, and point fields[0], fields[1], ... at its
+ * fields. */
+int batch_read(BatchReader *reader, char *fields[BATCH_MAX_FIELDS])
+{
+    char *p;
+    int n;
+
+    do {
+	if (!read_line(reader)) return -1;
+    } while (reader->line[0] == '\0' || reader->line[0] == '#');
+
+    p = reader->line;
+    for (n = 0; n < BATCH_MAX_FIELDS - 1; ) {
+	char *tab = strchr(p, '\t');
+	fields[n++] = p;
+	if (!tab) return n;
+	*tab = '\0';
+	p = tab + 1;
+    }
+    fields[n++] = p;
+    return n;
+}
+
+/* Free the memory used by a reader. */
+void batch_reader_free(BatchReader *reader)
+{
+    free(reader->line);
+    reader->line = NULL;
+    reader->size = 0;
+}
+
+/* Start an empty key cache. */
+void batch_keys_init(BatchKeyCache *cache)
+{
+    otrl_hashtab_init(&(cache->table));
+    cache->keys = NULL;
+}
+
+/* Turn a string of hex chars into an MPI.  Returns NULL if it isn't
+ * one. */
+static gcry_mpi_t hex_to_mpi(char *hex)
+{
+    unsigned char *buf;
+    size_t buflen;
+    gcry_mpi_t mpi = NULL;
+
+    argv_to_buf(&buf, &buflen, hex);
+    if (!buf) return NULL;
+    gcry_mpi_scan(&mpi, GCRYMPI_FMT_USG, buf, buflen, NULL);
+    free(buf);
+    return mpi;
+}
+
+/* Derive the keys of a dh: key spec, in spec (which gets cut up).
+ * Returns 0 on success, or -1 if the spec is invalid. */
+static int derive_dh(BatchKey *key, char *spec)
+{
+    char *our_hex = spec + 3, *their_hex, *dir;
+    gcry_mpi_t our_x, our_y, their_y;
+    unsigned char sessionid[20], sendenc[16], rcvenc[16];
+    int is_high;
+
+    their_hex = strchr(our_hex, ':');
+    if (!their_hex) return -1;
+    *their_hex++ = '\0';
+    dir = strchr(their_hex, ':');
+    if (!dir) return -1;
+    *dir++ = '\0';
+    if (strcmp(dir, "send") && strcmp(dir, "recv")) return -1;
+
+    our_x = hex_to_mpi(our_hex);
+    their_y = hex_to_mpi(their_hex);
+    if (!our_x || !their_y) {
+	gcry_mpi_release(our_x);
+	gcry_mpi_release(their_y);
+	return -1;
+    }
+
+    sesskeys_gen(sessionid, sendenc, rcvenc, &is_high, &our_y, our_x,
+	    their_y);
+    memmove(key->aes, strcmp(dir, "send") ? rcvenc : sendenc, 16);
+    key->have_aes = 1;
+    sesskeys_make_mac(key->mac, key->aes);
+
+    gcry_mpi_release(our_x);
+    gcry_mpi_release(our_y);
+    gcry_mpi_release(their_y);
+    return 0;
+}
+
+/* Derive the keys of a key spec, in spec (which gets cut up).  Returns
+ * 0 on success, or -1 if the spec is invalid. */
+static int derive(BatchKey *key, char *spec)
+{
+    unsigned char *buf;
+    size_t buflen;
+
+    if (!strncmp(spec, "dh:", 3)) {
+	return derive_dh(key, spec);
+    }
+
+    argv_to_buf(&buf, &buflen, spec);
+    if (!buf) return -1;
+    if (buflen == 16) {
+	memmove(key->aes, buf, 16);
+	key->have_aes = 1;
+	sesskeys_make_mac(key->mac, key->aes);
+    } else if (buflen == 20) {
+	memmove(key->mac, buf, 20);
+	key->have_aes = 0;
+    } else {
+	free(buf);
+	return -1;
+    }
+    free(buf);
+    return 0;
+}
+
+/* Return the keys given by a key spec, deriving them if they are not in
+ * the cache yet. */
+const BatchKey *batch_key(BatchKeyCache *cache, const char *spec)
+{
+    size_t hash = otrl_hashtab_hash_string(OTRL_HASHTAB_SEED, spec);
+    OtrlHashCursor cursor;
+    BatchKey *key;
+    char *scratch;
+
+    if (otrl_hashtab_usable(&(cache->table))) {
+	otrl_hashtab_lookup(&(cache->table), hash, &cursor);
+	while ((key = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!strcmp(key->spec, spec)) return key;
+	}
+    } else {
+	for (key = cache->keys; key; key = key->next) {
+	    if (!strcmp(key->spec, spec)) return key;
+	}
+    }
+
+    key = calloc(1, sizeof(BatchKey));
+    if (key) key->spec = strdup(spec);
+    scratch = strdup(spec);
+    if (!key || !key->spec || !scratch) out_of_memory();
+
+    if (derive(key, scratch)) {
+	fprintf(stderr, "Invalid key ``%s''.\n", spec);
+	free(scratch);
+	free(key->spec);
+	free(key);
+	return NULL;
+    }
+    free(scratch);
+
+    key->next = cache->keys;
+    cache->keys = key;
+    otrl_hashtab_add(&(cache->table), hash, key);
+    return key;
+}
+
+/* Free the keys in the cache. */
+void batch_keys_free(BatchKeyCache *cache)
+{
+    while (cache->keys) {
+	BatchKey *key = cache->keys;
+	cache->keys = key->next;
+	free(key->spec);
+	free(key);
+    }
+    otrl_hashtab_free(&(cache->table));
+}
@@ -0,0 +1,84 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __BATCH_H__
+#define __BATCH_H__
+
+#include <stdio.h>
+
+#include "hashtab.h"
+
+/* The most fields a batch record may have */
+#define BATCH_MAX_FIELDS 16
+
+/* A reader of batch records: lines of tab-separated fields.  Empty
+ * lines, and lines starting with '#', are skipped. */
+typedef struct s_BatchReader {
+    FILE *stream;
+    char *line;
+    size_t size;
+    unsigned long lineno;        /* The line the last record was on */
+} BatchReader;
+
+/* The keys given by a key spec, which is one of
+ *   32 hex chars: an AES key (and the MAC key derived from it)
+ *   40 hex chars: a MAC key
+ *   dh:our_privkey:their_pubkey:send (or :recv): the sending (or
+ *	receiving) AES and MAC keys of the session between the given
+ *	D-H keys, as otr_sesskeys would show them */
+typedef struct s_BatchKey {
+    struct s_BatchKey *next;
+    char *spec;
+    int have_aes;                /* Is aes set, or just mac? */
+    unsigned char aes[16];
+    unsigned char mac[20];
+} BatchKey;
+
+/* The keys derived so far, by key spec, so that a batch reusing a key
+ * only derives it once */
+typedef struct s_BatchKeyCache {
+    OtrlHashTable table;
+    BatchKey *keys;
+} BatchKeyCache;
+
+/* Start reading records from the given stream. */
+void batch_reader_init(BatchReader *reader, FILE *stream);
+
+/* Read the next record, and point fields[0], fields[1], ... at its
+ * fields (which stay valid until the next call).  Returns the number of
+ * fields, or -1 at the end of the input.  A record with more than
+ * BATCH_MAX_FIELDS fields has the rest of them left in its last
+ * field. */
+int batch_read(BatchReader *reader, char *fields[BATCH_MAX_FIELDS]);
+
+/* Free the memory used by a reader (but don't close its stream). */
+void batch_reader_free(BatchReader *reader);
+
+/* Start an empty key cache. */
+void batch_keys_init(BatchKeyCache *cache);
+
+/* Return the keys given by a key spec, deriving them if they are not in
+ * the cache yet.  Returns NULL (after saying why on stderr) if the spec
+ * is invalid. */
+const BatchKey *batch_key(BatchKeyCache *cache, const char *spec);
+
+/* Free the keys in the cache. */
+void batch_keys_free(BatchKeyCache *cache);
+
+#endif
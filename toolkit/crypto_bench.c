@@ -0,0 +1,183 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* Compare the toolkit's implementations of AES-CTR and SHA1-HMAC (see
+ * cryptoimpl.h) on messages of a few sizes.  Each benchmark is repeated
+ * a few times and the fastest repetition is reported.  The results are
+ * written to stdout as JSON, in the form used by tests/bench:
+ *
+ *   { "gcrypt": ..., "repetitions": ...,
+ *     "benchmarks": [ { "name": ..., "param": ..., "iterations": ...,
+ *                       "ns_per_op": ..., "mb_per_s": ... }, ... ] }
+ *
+ * "name" is the operation and implementation (e.g. "aes_ctr_gcrypt"),
+ * and "param" the message size in bytes.  Before timing anything, the
+ * implementations are checked to agree on every size. */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* toolkit headers */
+#include "ctrmode.h"
+#include "sha1hmac.h"
+
+#define BENCH_REPETITIONS 3
+
+/* Each benchmark processes about this many bytes per repetition */
+#define BENCH_BYTES (8 * 1024 * 1024)
+
+static const size_t sizes[] = { 64, 1024, 16384, 1048576 };
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static unsigned char key[20], ctrtop[8];
+static unsigned char *inbuf, *outbuf;
+static int num_results;
+
+typedef void (*bench_fn)(size_t len);
+
+static void do_aes_ctr_portable(size_t len)
+{
+    aes_ctr_crypt_portable(outbuf, inbuf, len, key, ctrtop);
+}
+
+static void do_aes_ctr_gcrypt(size_t len)
+{
+    aes_ctr_crypt_gcrypt(outbuf, inbuf, len, key, ctrtop);
+}
+
+static void do_hmac_portable(size_t len)
+{
+    sha1hmac_portable(outbuf, key, inbuf, len);
+}
+
+static void do_hmac_gcrypt(size_t len)
+{
+    sha1hmac_gcrypt(outbuf, key, inbuf, len);
+}
+
+static unsigned long long now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Time fn on messages of length len, and print the result */
+static void run_bench(const char *name, bench_fn fn, size_t len)
+{
+    unsigned int iterations = BENCH_BYTES / len, i, r;
+    unsigned long long best_ns = 0;
+
+    if (iterations < 4) iterations = 4;
+
+    fn(len);  /* Warm up */
+    for (r = 0; r < BENCH_REPETITIONS; ++r) {
+	unsigned long long start = now_ns(), elapsed;
+
+	for (i = 0; i < iterations; ++i) {
+	    fn(len);
+	}
+	elapsed = now_ns() - start;
+	if (r == 0 || elapsed < best_ns) best_ns = elapsed;
+    }
+
+    printf("%s\n    { \"name\": \"%s\", \"param\": %lu, "
+	    "\"iterations\": %u, \"ns_per_op\": %.1f, "
+	    "\"mb_per_s\": %.1f }", num_results ? "," : "", name,
+	    (unsigned long)len, iterations, (double)best_ns / iterations,
+	    best_ns ? (double)len * iterations * 1000.0 / best_ns : 0.0);
+    fflush(stdout);
+    num_results++;
+}
+
+/* Check that the implementations agree on messages of length len.
+ * Returns 0 if they do. */
+static int check(size_t len)
+{
+    unsigned char *portable = malloc(len), *gcrypt = malloc(len);
+    unsigned char hmac_portable[20], hmac_gcrypt[20];
+    int ret = -1;
+
+    if (portable && gcrypt) {
+	aes_ctr_crypt_portable(portable, inbuf, len, key, ctrtop);
+	sha1hmac_portable(hmac_portable, key, inbuf, len);
+	if (aes_ctr_crypt_gcrypt(gcrypt, inbuf, len, key, ctrtop) == 0 &&
+		sha1hmac_gcrypt(hmac_gcrypt, key, inbuf, len) == 0 &&
+		!memcmp(portable, gcrypt, len) &&
+		!memcmp(hmac_portable, hmac_gcrypt, 20)) {
+	    ret = 0;
+	}
+    }
+    if (ret) {
+	fprintf(stderr, "The implementations disagree on %lu bytes.\n",
+		(unsigned long)len);
+    }
+    free(portable);
+    free(gcrypt);
+    return ret;
+}
+
+int main(int argc, char **argv)
+{
+    size_t maxlen = sizes[NUM_SIZES-1], i;
+
+    gcry_check_version(NULL);
+
+    inbuf = malloc(maxlen);
+    outbuf = malloc(maxlen);
+    if (!inbuf || !outbuf) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    for (i = 0; i < maxlen; ++i) {
+	inbuf[i] = (unsigned char)(i * 131 + 7);
+    }
+    for (i = 0; i < sizeof(key); ++i) {
+	key[i] = (unsigned char)(i + 1);
+    }
+    memmove(ctrtop, "\x00\x00\x00\x00\xff\xff\xff\xfe", 8);
+
+    for (i = 0; i < NUM_SIZES; ++i) {
+	/* Also try an odd length, to exercise the last partial block */
+	if (check(sizes[i]) || check(sizes[i] - 5)) exit(1);
+    }
+
+    printf("{\n  \"gcrypt\": \"%s\",\n  \"repetitions\": %d,\n"
+	    "  \"benchmarks\": [", gcry_check_version(NULL),
+	    BENCH_REPETITIONS);
+    for (i = 0; i < NUM_SIZES; ++i) {
+	run_bench("aes_ctr_portable", do_aes_ctr_portable, sizes[i]);
+	run_bench("aes_ctr_gcrypt", do_aes_ctr_gcrypt, sizes[i]);
+	run_bench("hmac_portable", do_hmac_portable, sizes[i]);
+	run_bench("hmac_gcrypt", do_hmac_gcrypt, sizes[i]);
+    }
+    printf("\n  ]\n}\n");
+
+    free(inbuf);
+    free(outbuf);
+    return 0;
+}
@@ -0,0 +1,60 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* toolkit headers */
+#include "cryptoimpl.h"
+
+static int impl_chosen = 0;
+static CryptoImpl impl = CRYPTO_IMPL_GCRYPT;
+
+/* Return the implementation in use, choosing it if need be. */
+CryptoImpl crypto_impl(void)
+{
+    const char *name;
+
+    if (impl_chosen) return impl;
+
+    name = getenv("OTR_TOOLKIT_CRYPTO");
+    if (name && !strcmp(name, crypto_impl_name(CRYPTO_IMPL_PORTABLE))) {
+	impl = CRYPTO_IMPL_PORTABLE;
+    } else if (name && strcmp(name, crypto_impl_name(CRYPTO_IMPL_GCRYPT))) {
+	fprintf(stderr, "Unknown OTR_TOOLKIT_CRYPTO ``%s''; using %s.\n",
+		name, crypto_impl_name(impl));
+    }
+    impl_chosen = 1;
+    return impl;
+}
+
+/* Use the given implementation from now on. */
+void crypto_set_impl(CryptoImpl newimpl)
+{
+    impl = newimpl;
+    impl_chosen = 1;
+}
+
+/* Return the name of an implementation */
+const char *crypto_impl_name(CryptoImpl which)
+{
+    return which == CRYPTO_IMPL_PORTABLE ? "portable" : "gcrypt";
+}
@@ -0,0 +1,43 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __CRYPTOIMPL_H__
+#define __CRYPTOIMPL_H__
+
+/* The implementations of AES-CTR and SHA1-HMAC the toolkit can use */
+typedef enum {
+    CRYPTO_IMPL_PORTABLE,   /* Our own, in aes.c, ctrmode.c and sha1hmac.c */
+    CRYPTO_IMPL_GCRYPT      /* libgcrypt's, which does many blocks at a
+			       time with AES-NI, SHA-NI, etc. when the CPU
+			       has them */
+} CryptoImpl;
+
+/* Return the implementation in use.  It is chosen the first time this
+ * is called: the one named by the OTR_TOOLKIT_CRYPTO environment
+ * variable ("portable" or "gcrypt"), if it is set, and libgcrypt's
+ * otherwise. */
+CryptoImpl crypto_impl(void);
+
+/* Use the given implementation from now on. */
+void crypto_set_impl(CryptoImpl impl);
+
+/* Return the name of an implementation, as used by OTR_TOOLKIT_CRYPTO */
+const char *crypto_impl_name(CryptoImpl impl);
+
+#endif
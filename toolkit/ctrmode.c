@@ -21,14 +21,19 @@
 #include <stdlib.h>
 #include <string.h>
 
+/* libgcrypt headers */
+#include <gcrypt.h>
+
 /* toolkit headers */
 #include "aes.h"
+#include "ctrmode.h"
+#include "cryptoimpl.h"
 
-/* Encrypt or decrypt data in AES-CTR mode.  (The operations are the
- * same.)  We roll our own here just to double-check that the calls
- * libotr makes to libgcrypt are doing the right thing. */
-void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
-	unsigned char key[16], unsigned char ctrtop[8])
+/* Encrypt or decrypt data in AES-CTR mode with our own AES.  We roll
+ * our own here just to double-check that the calls libotr makes to
+ * libgcrypt are doing the right thing. */
+void aes_ctr_crypt_portable(unsigned char *out, const unsigned char *in,
+	size_t len, unsigned char key[16], unsigned char ctrtop[8])
 {
     unsigned char ctr[16], encctr[16];
     aes_context aesc;
@@ -58,3 +63,38 @@ void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
 	len -= amt;
     }
 }
+
+/* Encrypt or decrypt data in AES-CTR mode with libgcrypt, which works
+ * on many blocks at once.  Returns 0 on success, or -1 if libgcrypt
+ * can't do it. */
+int aes_ctr_crypt_gcrypt(unsigned char *out, const unsigned char *in,
+	size_t len, unsigned char key[16], unsigned char ctrtop[8])
+{
+    unsigned char ctr[16];
+    gcry_cipher_hd_t cipher;
+    gcry_error_t err;
+
+    memmove(ctr, ctrtop, 8);
+    memset(ctr+8, 0, 8);
+
+    err = gcry_cipher_open(&cipher, GCRY_CIPHER_AES, GCRY_CIPHER_MODE_CTR,
+	    GCRY_CIPHER_SECURE);
+    if (err) return -1;
+    err = gcry_cipher_setkey(cipher, key, 16);
+    if (!err) err = gcry_cipher_setctr(cipher, ctr, 16);
+    if (!err) err = gcry_cipher_encrypt(cipher, out, len, in, len);
+    gcry_cipher_close(cipher);
+    return err ? -1 : 0;
+}
+
+/* Encrypt or decrypt data in AES-CTR mode.  (The operations are the
+ * same.) */
+void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
+	unsigned char key[16], unsigned char ctrtop[8])
+{
+    if (crypto_impl() == CRYPTO_IMPL_GCRYPT &&
+	    aes_ctr_crypt_gcrypt(out, in, len, key, ctrtop) == 0) {
+	return;
+    }
+    aes_ctr_crypt_portable(out, in, len, key, ctrtop);
+}
@@ -21,9 +21,20 @@
 #define __CTRMODE_H__
 
 /* Encrypt or decrypt data in AES-CTR mode.  (The operations are the
- * same.)  We roll our own here just to double-check that the calls
- * libotr makes to libgcrypt are doing the right thing. */
+ * same.)  This uses the implementation given by crypto_impl(), falling
+ * back to our own if libgcrypt can't do it. */
 void aes_ctr_crypt(unsigned char *out, const unsigned char *in, size_t len,
 	unsigned char key[16], unsigned char ctrtop[8]);
 
+/* Encrypt or decrypt data in AES-CTR mode with our own AES.  We roll
+ * our own here just to double-check that the calls libotr makes to
+ * libgcrypt are doing the right thing. */
+void aes_ctr_crypt_portable(unsigned char *out, const unsigned char *in,
+	size_t len, unsigned char key[16], unsigned char ctrtop[8]);
+
+/* Encrypt or decrypt data in AES-CTR mode with libgcrypt.  Returns 0
+ * on success, or -1 if libgcrypt can't do it. */
+int aes_ctr_crypt_gcrypt(unsigned char *out, const unsigned char *in,
+	size_t len, unsigned char key[16], unsigned char ctrtop[8]);
+
 #endif
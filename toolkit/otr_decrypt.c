@@ -0,0 +1,838 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* libgcrypt headers */
+#include <gcrypt.h>
+
+/* libotr headers */
+#include "proto.h"
+#include "hashtab.h"
+
+/* toolkit headers */
+#include "scanotr.h"
+#include "parse.h"
+#include "sesskeys.h"
+#include "sha1hmac.h"
+#include "ctrmode.h"
+#include "batch.h"
+#include "output.h"
+
+/* How many sets of session keys are kept, by default */
+#define DEFAULT_CACHE_SIZE 256
+
+/* A D-H public key seen in the transcript: the one with the given
+ * keyid of the party with the given instance tag (or NULL if it has
+ * been forgotten) */
+typedef struct s_PubKey {
+    struct s_PubKey *next;
+    size_t hash;
+    unsigned int instance;
+    unsigned int keyid;
+    gcry_mpi_t y;
+    char *yhex;
+} PubKey;
+
+/* One of the D-H private keys we were given, and its public key */
+typedef struct s_PrivKey {
+    struct s_PrivKey *next;
+    gcry_mpi_t x, y;
+    char *yhex;
+} PrivKey;
+
+/* The session keys between one of our private keys and a public key.
+ * They are kept in least-recently-used order, most recent first. */
+typedef struct s_SessKeys {
+    struct s_SessKeys *prev, *next;
+    size_t hash;
+    const PrivKey *priv;
+    char *their_yhex;
+    unsigned char sendenc[16], rcvenc[16];
+    unsigned char sendmac[20], rcvmac[20];
+} SessKeys;
+
+/* Something waiting for more messages from the given sender: a message
+ * being put together from its fragments (the last of which was piece k
+ * of n), or the encrypted D-H public key of a D-H Commit message, to be
+ * decrypted with the key its Reveal Signature message reveals */
+typedef struct s_Pending {
+    struct s_Pending *next;
+    unsigned int sender, receiver;
+    unsigned short k, n;
+    unsigned long long offset;   /* Where the first fragment was */
+    unsigned char *data;
+    size_t len, size;
+} Pending;
+
+/* What became of a Data message */
+typedef enum {
+    STATUS_DECRYPTED,
+    STATUS_BAD_MAC,              /* We had keys, but none verified */
+    STATUS_NO_KEYS,              /* We don't know the keys in use */
+    STATUS_INVALID,              /* It could not be parsed */
+    STATUS_UNSUPPORTED           /* Not protocol version 3 */
+} Status;
+
+static const char *const status_names[] = {
+    "decrypted", "bad_mac", "no_keys", "invalid", "unsupported_version"
+};
+
+enum {
+    F_OFFSET, F_SENDER_INSTANCE, F_RECEIVER_INSTANCE, F_SENDER_KEYID,
+    F_RCPT_KEYID, F_COUNTER, F_STATUS, F_TEXT,
+    NUM_FIELDS
+};
+
+static const char *const field_names[NUM_FIELDS] = {
+    "offset", "sender_instance", "receiver_instance", "sender_keyid",
+    "rcpt_keyid", "counter", "status", "text"
+};
+
+static PubKey *pubkeys = NULL;
+static OtrlHashTable pubkey_index;
+static PrivKey *privkeys = NULL;
+static OtrlHashTable privkey_index;
+
+static SessKeys *lru_head = NULL, *lru_tail = NULL;
+static OtrlHashTable sesskeys_index;
+static unsigned int num_sesskeys = 0, cache_size = DEFAULT_CACHE_SIZE;
+
+static Pending *fragments = NULL, *commits = NULL;
+
+static OutputFormat format = OUTPUT_TEXT;
+static OutputRecord rec;
+
+static unsigned long long num_datamsgs = 0;
+static unsigned long long num_status[STATUS_UNSUPPORTED + 1];
+static unsigned long long num_derived = 0;
+
+static void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+}
+
+/* Return a newly-allocated hex rendering of an MPI, which identifies a
+ * public key */
+static char *mpi_hex(gcry_mpi_t y)
+{
+    unsigned char *buf;
+    char *hex;
+
+    if (gcry_mpi_aprint(GCRYMPI_FMT_HEX, &buf, NULL, y)) out_of_memory();
+    hex = strdup((char *)buf);
+    gcry_free(buf);
+    if (!hex) out_of_memory();
+    return hex;
+}
+
+/* The hash of a (instance tag, keyid) pair */
+static size_t pubkey_hash(unsigned int instance, unsigned int keyid)
+{
+    char key[24];
+
+    sprintf(key, "%x/%u", instance, keyid);
+    return otrl_hashtab_hash_string(OTRL_HASHTAB_SEED, key);
+}
+
+/* Find the public key with the given keyid of the given party */
+static PubKey *pubkey_find(unsigned int instance, unsigned int keyid)
+{
+    size_t hash = pubkey_hash(instance, keyid);
+    OtrlHashCursor cursor;
+    PubKey *pub;
+
+    if (otrl_hashtab_usable(&pubkey_index)) {
+	otrl_hashtab_lookup(&pubkey_index, hash, &cursor);
+	while ((pub = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (pub->instance == instance && pub->keyid == keyid) break;
+	}
+    } else {
+	for (pub = pubkeys; pub; pub = pub->next) {
+	    if (pub->instance == instance && pub->keyid == keyid) break;
+	}
+    }
+    return pub;
+}
+
+/* Find the public key with the given keyid of the given party, if we
+ * know it */
+static PubKey *pubkey_get(unsigned int instance, unsigned int keyid)
+{
+    PubKey *pub = pubkey_find(instance, keyid);
+
+    return (pub && pub->y) ? pub : NULL;
+}
+
+/* Forget the public key with the given keyid of the given party */
+static void pubkey_forget(unsigned int instance, unsigned int keyid)
+{
+    PubKey *pub = pubkey_find(instance, keyid);
+
+    if (pub && pub->y) {
+	gcry_mpi_release(pub->y);
+	free(pub->yhex);
+	pub->y = NULL;
+	pub->yhex = NULL;
+    }
+}
+
+/* Record that the given party uses y as its public key with the given
+ * keyid (replacing what we had, as happens when a new AKE starts the
+ * keyids over) */
+static void pubkey_set(unsigned int instance, unsigned int keyid,
+	gcry_mpi_t y)
+{
+    PubKey *pub = pubkey_find(instance, keyid);
+
+    if (pub) {
+	if (pub->y && !gcry_mpi_cmp(pub->y, y)) return;
+	gcry_mpi_release(pub->y);
+	free(pub->yhex);
+    } else {
+	pub = calloc(1, sizeof(PubKey));
+	if (!pub) out_of_memory();
+	pub->hash = pubkey_hash(instance, keyid);
+	pub->instance = instance;
+	pub->keyid = keyid;
+	pub->next = pubkeys;
+	pubkeys = pub;
+	otrl_hashtab_add(&pubkey_index, pub->hash, pub);
+    }
+    pub->y = gcry_mpi_copy(y);
+    pub->yhex = mpi_hex(y);
+}
+
+/* Find our private key for the given public key */
+static const PrivKey *privkey_find(const char *yhex)
+{
+    size_t hash = otrl_hashtab_hash_string(OTRL_HASHTAB_SEED, yhex);
+    OtrlHashCursor cursor;
+    PrivKey *priv;
+
+    if (otrl_hashtab_usable(&privkey_index)) {
+	otrl_hashtab_lookup(&privkey_index, hash, &cursor);
+	while ((priv = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (!strcmp(priv->yhex, yhex)) return priv;
+	}
+	return NULL;
+    }
+    for (priv = privkeys; priv; priv = priv->next) {
+	if (!strcmp(priv->yhex, yhex)) return priv;
+    }
+    return NULL;
+}
+
+/* Read the D-H private keys, one per line in hex, from the given file.
+ * Returns the number of keys read, or -1 on error. */
+static int read_privkeys(const char *filename)
+{
+    FILE *keyf = fopen(filename, "r");
+    BatchReader reader;
+    char *fields[BATCH_MAX_FIELDS];
+    int n, num = 0;
+
+    if (!keyf) {
+	fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+	return -1;
+    }
+
+    batch_reader_init(&reader, keyf);
+    while ((n = batch_read(&reader, fields)) >= 0) {
+	unsigned char *buf;
+	size_t buflen;
+	PrivKey *priv;
+
+	argv_to_buf(&buf, &buflen, fields[0]);
+	if (!buf || buflen == 0) {
+	    fprintf(stderr, "%s: line %lu: not a private key in hex.\n",
+		    filename, reader.lineno);
+	    free(buf);
+	    num = -1;
+	    break;
+	}
+	priv = calloc(1, sizeof(PrivKey));
+	if (!priv) out_of_memory();
+	gcry_mpi_scan(&priv->x, GCRYMPI_FMT_USG, buf, buflen, NULL);
+	free(buf);
+	sesskeys_pubkey(&priv->y, priv->x);
+	priv->yhex = mpi_hex(priv->y);
+
+	if (privkey_find(priv->yhex)) {
+	    /* A duplicate */
+	    gcry_mpi_release(priv->x);
+	    gcry_mpi_release(priv->y);
+	    free(priv->yhex);
+	    free(priv);
+	    continue;
+	}
+	priv->next = privkeys;
+	privkeys = priv;
+	otrl_hashtab_add(&privkey_index,
+		otrl_hashtab_hash_string(OTRL_HASHTAB_SEED, priv->yhex), priv);
+	num++;
+    }
+    batch_reader_free(&reader);
+    fclose(keyf);
+    return num;
+}
+
+/* Take a set of session keys out of the LRU list */
+static void lru_unlink(SessKeys *sk)
+{
+    if (sk->prev) sk->prev->next = sk->next; else lru_head = sk->next;
+    if (sk->next) sk->next->prev = sk->prev; else lru_tail = sk->prev;
+    sk->prev = sk->next = NULL;
+}
+
+/* Put a set of session keys at the front of the LRU list */
+static void lru_push(SessKeys *sk)
+{
+    sk->prev = NULL;
+    sk->next = lru_head;
+    if (lru_head) lru_head->prev = sk; else lru_tail = sk;
+    lru_head = sk;
+}
+
+/* Return the session keys between our private key priv and their
+ * public key, deriving them if they are not in the cache (and making
+ * room for them by forgetting the least recently used keys). */
+static const SessKeys *sesskeys_get(const PrivKey *priv,
+	const PubKey *their)
+{
+    size_t hash = otrl_hashtab_hash_string(
+	    otrl_hashtab_hash_string(OTRL_HASHTAB_SEED, priv->yhex),
+	    their->yhex);
+    OtrlHashCursor cursor;
+    SessKeys *sk = NULL;
+    unsigned char sessionid[20];
+    int is_high;
+
+    if (otrl_hashtab_usable(&sesskeys_index)) {
+	otrl_hashtab_lookup(&sesskeys_index, hash, &cursor);
+	while ((sk = otrl_hashtab_next(&cursor)) != NULL) {
+	    if (sk->priv == priv && !strcmp(sk->their_yhex, their->yhex)) {
+		break;
+	    }
+	}
+    } else {
+	for (sk = lru_head; sk; sk = sk->next) {
+	    if (sk->priv == priv && !strcmp(sk->their_yhex, their->yhex)) {
+		break;
+	    }
+	}
+    }
+    if (sk) {
+	lru_unlink(sk);
+	lru_push(sk);
+	return sk;
+    }
+
+    if (num_sesskeys >= cache_size) {
+	/* Reuse the least recently used entry */
+	sk = lru_tail;
+	lru_unlink(sk);
+	otrl_hashtab_remove(&sesskeys_index, sk->hash, sk);
+	free(sk->their_yhex);
+    } else {
+	sk = calloc(1, sizeof(SessKeys));
+	if (!sk) out_of_memory();
+	num_sesskeys++;
+    }
+
+    sesskeys_derive(sessionid, sk->sendenc, sk->rcvenc, &is_high, priv->y,
+	    priv->x, their->y);
+    sesskeys_make_mac(sk->sendmac, sk->sendenc);
+    sesskeys_make_mac(sk->rcvmac, sk->rcvenc);
+    num_derived++;
+
+    sk->hash = hash;
+    sk->priv = priv;
+    sk->their_yhex = strdup(their->yhex);
+    if (!sk->their_yhex) out_of_memory();
+    lru_push(sk);
+    otrl_hashtab_add(&sesskeys_index, hash, sk);
+    return sk;
+}
+
+/* Does the MAC of the Data message verify with the given key? */
+static int mac_verifies(DataMsg datamsg, const unsigned char mackey[20])
+{
+    unsigned char macval[20];
+
+    sha1hmac(macval, (unsigned char *)mackey, datamsg->macstart,
+	    datamsg->macend - datamsg->macstart);
+    return !memcmp(macval, datamsg->mac, 20);
+}
+
+/* Find the AES key of a Data message, and put it in aeskey.  Returns
+ * STATUS_DECRYPTED if the key was found (and the MAC verifies with
+ * it), or why not otherwise. */
+static Status find_aeskey(DataMsg datamsg, unsigned char aeskey[16])
+{
+    unsigned int sender = datamsg->sender_instance;
+    unsigned int receiver = datamsg->receiver_instance;
+    PubKey *ys = pubkey_get(sender, datamsg->sender_keyid);
+    PubKey *yr = pubkey_get(receiver, datamsg->rcpt_keyid);
+    const PrivKey *priv;
+    const SessKeys *sk;
+    Status status = STATUS_NO_KEYS;
+
+    if (ys && yr) {
+	/* We know both public keys; do we have either private key? */
+	if ((priv = privkey_find(ys->yhex)) != NULL) {
+	    sk = sesskeys_get(priv, yr);
+	    if (mac_verifies(datamsg, sk->sendmac)) {
+		memmove(aeskey, sk->sendenc, 16);
+		return STATUS_DECRYPTED;
+	    }
+	    status = STATUS_BAD_MAC;
+	}
+	if ((priv = privkey_find(yr->yhex)) != NULL) {
+	    sk = sesskeys_get(priv, ys);
+	    if (mac_verifies(datamsg, sk->rcvmac)) {
+		memmove(aeskey, sk->rcvenc, 16);
+		return STATUS_DECRYPTED;
+	    }
+	    status = STATUS_BAD_MAC;
+	}
+    }
+
+    /* We don't know (or have the wrong idea of) one of the public keys,
+     * as when we missed a D-H Commit message: see if one of our
+     * private keys is the other side of one we know, and remember the
+     * one that works. */
+    for (priv = privkeys; priv; priv = priv->next) {
+	if (ys && strcmp(priv->yhex, ys->yhex)) {
+	    sk = sesskeys_get(priv, ys);
+	    if (mac_verifies(datamsg, sk->rcvmac)) {
+		memmove(aeskey, sk->rcvenc, 16);
+		pubkey_set(receiver, datamsg->rcpt_keyid, priv->y);
+		return STATUS_DECRYPTED;
+	    }
+	}
+	if (yr && strcmp(priv->yhex, yr->yhex)) {
+	    sk = sesskeys_get(priv, yr);
+	    if (mac_verifies(datamsg, sk->sendmac)) {
+		memmove(aeskey, sk->sendenc, 16);
+		pubkey_set(sender, datamsg->sender_keyid, priv->y);
+		return STATUS_DECRYPTED;
+	    }
+	}
+    }
+    return status;
+}
+
+/* Print what became of a Data message */
+static void report(unsigned long long offset, DataMsg datamsg,
+	Status status, const char *text)
+{
+    num_status[status]++;
+
+    if (format == OUTPUT_TEXT) {
+	if (datamsg) {
+	    printf("%llu: %08x -> %08x (keyids %u/%u): ", offset,
+		    datamsg->sender_instance, datamsg->receiver_instance,
+		    datamsg->sender_keyid, datamsg->rcpt_keyid);
+	} else {
+	    printf("%llu: ", offset);
+	}
+	if (text) {
+	    printf("``%s''\n", text);
+	} else {
+	    printf("[%s]\n", status_names[status]);
+	}
+	return;
+    }
+
+    record_ullong(&rec, F_OFFSET, offset);
+    if (datamsg) {
+	record_int(&rec, F_SENDER_INSTANCE, datamsg->sender_instance);
+	record_int(&rec, F_RECEIVER_INSTANCE, datamsg->receiver_instance);
+	record_int(&rec, F_SENDER_KEYID, datamsg->sender_keyid);
+	record_int(&rec, F_RCPT_KEYID, datamsg->rcpt_keyid);
+	record_hex(&rec, F_COUNTER, datamsg->ctr, 8);
+    }
+    record_str(&rec, F_STATUS, status_names[status]);
+    if (text) record_str(&rec, F_TEXT, text);
+    record_write(&rec, stdout);
+}
+
+/* Decrypt a Data message, and note the next public key of its sender */
+static void handle_datamsg(const char *msg, unsigned long long offset)
+{
+    DataMsg datamsg = parse_datamsg(msg);
+    unsigned char aeskey[16];
+    unsigned char *plaintext;
+    Status status;
+
+    num_datamsgs++;
+    if (datamsg == NULL) {
+	report(offset, NULL, STATUS_INVALID, NULL);
+	return;
+    }
+    if (datamsg->version != 3) {
+	report(offset, datamsg, STATUS_UNSUPPORTED, NULL);
+	free_datamsg(datamsg);
+	return;
+    }
+
+    status = find_aeskey(datamsg, aeskey);
+    if (status == STATUS_DECRYPTED) {
+	plaintext = malloc(datamsg->encmsglen + 1);
+	if (!plaintext) out_of_memory();
+	aes_ctr_crypt(plaintext, datamsg->encmsg, datamsg->encmsglen,
+		aeskey, datamsg->ctr);
+	/* The message ends at a NUL, and any TLVs follow */
+	plaintext[datamsg->encmsglen] = '\0';
+	report(offset, datamsg, status, (char *)plaintext);
+	free(plaintext);
+    } else {
+	report(offset, datamsg, status, NULL);
+    }
+
+    /* The sender will use the public key it sent with the next keyid */
+    pubkey_set(datamsg->sender_instance, datamsg->sender_keyid + 1,
+	    datamsg->y);
+    free_datamsg(datamsg);
+}
+
+/* Find what is pending from the given sender (and, if receiver is not
+ * NULL, to the given receiver) on a list, making a new entry if there
+ * is none */
+static Pending *pending_find(Pending **listp, unsigned int sender,
+	const unsigned int *receiver)
+{
+    Pending *p;
+
+    for (p = *listp; p; p = p->next) {
+	if (p->sender == sender && (!receiver || p->receiver == *receiver)) {
+	    return p;
+	}
+    }
+    p = calloc(1, sizeof(Pending));
+    if (!p) out_of_memory();
+    p->sender = sender;
+    if (receiver) p->receiver = *receiver;
+    p->next = *listp;
+    *listp = p;
+    return p;
+}
+
+/* Replace the data of a pending entry with (or, if append is set, add
+ * to it) len bytes of data, leaving room for a NUL */
+static void pending_put(Pending *p, const void *data, size_t len,
+	int append)
+{
+    if (!append) p->len = 0;
+    if (p->len + len + 1 > p->size) {
+	size_t newsize = p->size ? p->size * 2 : 1024;
+	unsigned char *newdata;
+
+	if (newsize < p->len + len + 1) newsize = p->len + len + 1;
+	newdata = realloc(p->data, newsize);
+	if (!newdata) out_of_memory();
+	p->data = newdata;
+	p->size = newsize;
+    }
+    memmove(p->data + p->len, data, len);
+    p->len += len;
+    p->data[p->len] = '\0';
+}
+
+/* Note the encrypted public key of a D-H Commit message */
+static void handle_commit(const char *msg)
+{
+    CommitMsg cmsg = parse_commit(msg);
+    Pending *p;
+
+    if (cmsg == NULL) return;
+    /* The receiver instance may not be known yet, so go by the sender */
+    p = pending_find(&commits, cmsg->sender_instance, NULL);
+    pending_put(p, cmsg->enckey, cmsg->enckeylen, 0);
+    free_commit(cmsg);
+}
+
+/* Note the public key of a D-H Key message */
+static void handle_key(const char *msg)
+{
+    KeyMsg kmsg = parse_key(msg);
+
+    if (kmsg == NULL) return;
+    /* A new AKE starts the keyids over, and the receiver's first key
+     * will be revealed by its Reveal Signature message */
+    pubkey_forget(kmsg->receiver_instance, 1);
+    pubkey_set(kmsg->sender_instance, 1, kmsg->y);
+    free_key(kmsg);
+}
+
+/* Decrypt the public key of the D-H Commit message this Reveal
+ * Signature message goes with */
+static void handle_revealsig(const char *msg)
+{
+    RevealSigMsg rmsg = parse_revealsig(msg);
+    Pending *p;
+    unsigned char ctr[8], *gxbuf;
+    size_t gxlen;
+    gcry_mpi_t gx;
+
+    if (rmsg == NULL) return;
+    p = pending_find(&commits, rmsg->sender_instance, NULL);
+    if (rmsg->keylen != 16 || p->len < 4) {
+	free_revealsig(rmsg);
+	return;
+    }
+
+    /* The key was used with a counter of 0 */
+    memset(ctr, 0, 8);
+    gxbuf = malloc(p->len);
+    if (!gxbuf) out_of_memory();
+    aes_ctr_crypt(gxbuf, p->data, p->len, rmsg->key, ctr);
+
+    /* It's an MPI: a four-byte length, and that many bytes */
+    gxlen = ((size_t)gxbuf[0] << 24) | (gxbuf[1] << 16) |
+	(gxbuf[2] << 8) | gxbuf[3];
+    if (gxlen == p->len - 4 &&
+	    !gcry_mpi_scan(&gx, GCRYMPI_FMT_USG, gxbuf + 4, gxlen, NULL)) {
+	pubkey_set(rmsg->sender_instance, 1, gx);
+	gcry_mpi_release(gx);
+    }
+    p->len = 0;
+    free(gxbuf);
+    free_revealsig(rmsg);
+}
+
+static void handle_message(const char *msg, unsigned long long offset);
+
+/* Add a fragment to the message being put together from its sender,
+ * and handle the message once it is complete.  Out-of-order and
+ * missing fragments throw away the message, as libotr does. */
+static void handle_fragment(const char *frag, unsigned long long offset)
+{
+    unsigned int sender = 0, receiver = 0;
+    unsigned short k, n;
+    int start = -1;
+    size_t fraglen = strlen(frag);
+    Pending *p;
+
+    if (frag[4] == '|') {
+	sscanf(frag, "?OTR|%x|%x,%hu,%hu,%n", &sender, &receiver, &k, &n,
+		&start);
+    } else {
+	sscanf(frag, "?OTR,%hu,%hu,%n", &k, &n, &start);
+    }
+    if (start < 0 || k == 0 || n == 0 || k > n ||
+	    (size_t)start >= fraglen || frag[fraglen-1] != ',') {
+	return;
+    }
+
+    p = pending_find(&fragments, sender, &receiver);
+    if (k == 1) {
+	p->offset = offset;
+	pending_put(p, frag + start, fraglen - start - 1, 0);
+    } else if (p->n == n && p->k + 1 == k) {
+	pending_put(p, frag + start, fraglen - start - 1, 1);
+    } else {
+	p->len = 0;
+	p->k = p->n = 0;
+	return;
+    }
+    p->k = k;
+    p->n = n;
+
+    if (k == n) {
+	char *msg = strdup((char *)p->data);
+
+	if (!msg) out_of_memory();
+	p->len = 0;
+	p->k = p->n = 0;
+	handle_message(msg, p->offset);
+	free(msg);
+    }
+}
+
+/* Handle one message (or fragment) found at the given offset */
+static void handle_message(const char *msg, unsigned long long offset)
+{
+    if (msg[4] == '|' || msg[4] == ',') {
+	handle_fragment(msg, offset);
+	return;
+    }
+
+    switch(otrl_proto_message_type(msg)) {
+	case OTRL_MSGTYPE_DH_COMMIT:
+	    handle_commit(msg);
+	    break;
+	case OTRL_MSGTYPE_DH_KEY:
+	    handle_key(msg);
+	    break;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    handle_revealsig(msg);
+	    break;
+	case OTRL_MSGTYPE_DATA:
+	    handle_datamsg(msg, offset);
+	    break;
+	default:
+	    break;
+    }
+}
+
+/* Decrypt the Data messages of one input.  Returns 0 on success, or -1
+ * on a read error. */
+static int decrypt_input(int fd, const char *name)
+{
+    ScanOtr scan;
+    const char *msg;
+    unsigned long long offset;
+
+    scanotr_init(&scan, fd);
+    scan.fragments = 1;
+    while ((msg = scanotr_next(&scan, NULL, &offset)) != NULL) {
+	handle_message(msg, offset);
+    }
+    scanotr_free(&scan);
+    if (scan.error) {
+	fprintf(stderr, "%s: %s\n", name, strerror(scan.error));
+	return -1;
+    }
+    return 0;
+}
+
+/* Free a list of pending entries */
+static void pending_free(Pending *p)
+{
+    while (p) {
+	Pending *next = p->next;
+	free(p->data);
+	free(p);
+	p = next;
+    }
+}
+
+/* Free everything we learned */
+static void free_all(void)
+{
+    while (pubkeys) {
+	PubKey *pub = pubkeys;
+	pubkeys = pub->next;
+	gcry_mpi_release(pub->y);
+	free(pub->yhex);
+	free(pub);
+    }
+    while (privkeys) {
+	PrivKey *priv = privkeys;
+	privkeys = priv->next;
+	gcry_mpi_release(priv->x);
+	gcry_mpi_release(priv->y);
+	free(priv->yhex);
+	free(priv);
+    }
+    while (lru_head) {
+	SessKeys *sk = lru_head;
+	lru_head = sk->next;
+	free(sk->their_yhex);
+	free(sk);
+    }
+    otrl_hashtab_free(&pubkey_index);
+    otrl_hashtab_free(&privkey_index);
+    otrl_hashtab_free(&sesskeys_index);
+    pending_free(fragments);
+    pending_free(commits);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-f text|json|csv] [-c cache_size] keyfile "
+	    "[file ...]\n"
+"Decrypt the Off-the-Record (OTR) Data messages in the given files (or\n"
+"stdin), in a single pass, given D-H private keys of either side of\n"
+"the conversation, one per line in hex, in keyfile.  Public keys are\n"
+"learned from the AKE and Data messages as they go by, so as to follow\n"
+"the rotation of keys, and fragmented messages are put back together.\n"
+"The session keys of the cache_size (default %d) most recently used\n"
+"key pairs are kept.  Only protocol version 3 is supported.\n",
+	    progname, DEFAULT_CACHE_SIZE);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    int c, i, ret = 0;
+    long size;
+
+    while ((c = getopt(argc, argv, "f:c:")) != -1) {
+	switch(c) {
+	    case 'f':
+		if (output_format_parse(optarg, &format)) usage(argv[0]);
+		break;
+	    case 'c':
+		size = strtol(optarg, NULL, 10);
+		if (size < 1) usage(argv[0]);
+		cache_size = size;
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (optind >= argc) {
+	usage(argv[0]);
+    }
+
+    otrl_hashtab_init(&pubkey_index);
+    otrl_hashtab_init(&privkey_index);
+    otrl_hashtab_init(&sesskeys_index);
+
+    if (read_privkeys(argv[optind]) < 0) exit(1);
+
+    record_init(&rec, format, field_names, NUM_FIELDS);
+    record_header(&rec, stdout);
+
+    if (optind + 1 == argc) {
+	if (decrypt_input(0, "-")) ret = 1;
+    }
+    for (i = optind + 1; i < argc; ++i) {
+	int fd = strcmp(argv[i], "-") ? open(argv[i], O_RDONLY) : 0;
+
+	if (fd < 0) {
+	    fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+	    ret = 1;
+	    continue;
+	}
+	if (decrypt_input(fd, argv[i])) ret = 1;
+	if (fd != 0) close(fd);
+    }
+    fflush(stdout);
+
+    fprintf(stderr, "Decrypted %llu of %llu Data messages (%llu with "
+	    "unknown keys, %llu failing their MAC); derived %llu sets of "
+	    "session keys.\n", num_status[STATUS_DECRYPTED], num_datamsgs,
+	    num_status[STATUS_NO_KEYS], num_status[STATUS_BAD_MAC],
+	    num_derived);
+
+    record_free(&rec);
+    free_all();
+    return ret;
+}
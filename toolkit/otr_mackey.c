@@ -20,14 +20,23 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* toolkit headers */
 #include "parse.h"
 #include "sesskeys.h"
+#include "output.h"
+
+/* The fields of the structured output */
+enum { F_AES_KEY, F_MAC_KEY, NUM_FIELDS };
+
+static const char *const field_names[NUM_FIELDS] = {
+    "aes_key", "mac_key"
+};
 
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s aeskey\n"
+    fprintf(stderr, "Usage: %s [-f text|json|csv] aeskey\n"
 "Calculate and display the MAC key derived from a given AES key.\n",
 	progname);
     exit(1);
@@ -38,12 +47,20 @@ int main(int argc, char **argv)
     unsigned char *argbuf;
     size_t argbuflen;
     unsigned char mackey[20];
+    OutputFormat format = OUTPUT_TEXT;
+    OutputRecord rec;
+    int c;
 
-    if (argc != 2) {
+    while ((c = getopt(argc, argv, "f:")) != -1) {
+	if (c != 'f' || output_format_parse(optarg, &format)) {
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 1) {
 	usage(argv[0]);
     }
 
-    argv_to_buf(&argbuf, &argbuflen, argv[1]);
+    argv_to_buf(&argbuf, &argbuflen, argv[optind]);
     /* AES keys are 128 bits long, so check for that */
     if (!argbuf) {
 	usage(argv[0]);
@@ -56,8 +73,17 @@ int main(int argc, char **argv)
 
     sesskeys_make_mac(mackey, argbuf);
 
-    dump_data(stdout, "AES key", argbuf, 16);
-    dump_data(stdout, "MAC key", mackey, 20);
+    if (format == OUTPUT_TEXT) {
+	dump_data(stdout, "AES key", argbuf, 16);
+	dump_data(stdout, "MAC key", mackey, 20);
+    } else {
+	record_init(&rec, format, field_names, NUM_FIELDS);
+	record_header(&rec, stdout);
+	record_hex(&rec, F_AES_KEY, argbuf, 16);
+	record_hex(&rec, F_MAC_KEY, mackey, 20);
+	record_write(&rec, stdout);
+	record_free(&rec);
+    }
 
     free(argbuf);
     fflush(stdout);
@@ -20,6 +20,7 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libotr headers */
 #include "proto.h"
@@ -28,32 +29,133 @@
 #include "readotr.h"
 #include "parse.h"
 #include "sha1hmac.h"
+#include "batch.h"
 
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s mackey old_text new_text offset\n"
+"       %s -b\n"
 "Read an OTR Data Message from stdin.  Even if we can't read the\n"
 "data because we don't know either the AES key or the DH privkey,\n"
 "but we can make a good guess that the substring \"old_text\"\n"
 "appears at the given offset in the message, replace the old_text\n"
 "with the new_text (which must be of the same length), recalculate\n"
-"the MAC with the given mackey, and output the resulting Data message.\n",
-    progname);
+"the MAC with the given mackey, and output the resulting Data message.\n"
+"With -b, read records of mackey, old_text, new_text, offset and the\n"
+"Data message, separated by tabs, from stdin, one per line, and output\n"
+"one Data message per line.  In a record, mackey may be any key spec\n"
+"(see otr_toolkit(1)).\n",
+    progname, progname);
     exit(1);
 }
 
+/* Replace the textlen bytes of old_text at the given offset of the
+ * Data message otrmsg with new_text, and MAC it again with mackey.
+ * Returns a newly-allocated message, or NULL (after saying why) if
+ * otrmsg isn't a Data message that verifies with mackey. */
+static char *modify(const unsigned char mackey[20],
+	const unsigned char *old_text, const unsigned char *new_text,
+	size_t textlen, unsigned int offset, const char *otrmsg)
+{
+    unsigned char macval[20];
+    DataMsg datamsg;
+    char *newdatamsg;
+    size_t i;
+
+    if (otrl_proto_message_type(otrmsg) != OTRL_MSGTYPE_DATA) {
+	fprintf(stderr, "OTR Non-Data Message found on stdin.\n");
+	return NULL;
+    }
+
+    datamsg = parse_datamsg(otrmsg);
+    if (datamsg == NULL) {
+	fprintf(stderr, "Invalid OTR Data Message found on stdin.\n");
+	return NULL;
+    }
+
+    /* Check the MAC */
+    sha1hmac(macval, (unsigned char *)mackey, datamsg->macstart,
+	    datamsg->macend - datamsg->macstart);
+    if (memcmp(macval, datamsg->mac, 20)) {
+	fprintf(stderr, "MAC does not verify: wrong MAC key?\n");
+	free_datamsg(datamsg);
+	return NULL;
+    }
+
+    /* Modify the ciphertext */
+    for(i=0; i<textlen && offset+i < datamsg->encmsglen; ++i) {
+	datamsg->encmsg[offset+i] ^= (old_text[i] ^ new_text[i]);
+    }
+
+    /* Recalculate the MAC */
+    newdatamsg = remac_datamsg(datamsg, (unsigned char *)mackey);
+
+    free_datamsg(datamsg);
+    return newdatamsg;
+}
+
+/* Read records from stdin, and output the modified Data message of
+ * each.  Returns the number of records that failed. */
+static unsigned long modify_batch(void)
+{
+    BatchReader reader;
+    BatchKeyCache keys;
+    char *fields[BATCH_MAX_FIELDS];
+    unsigned long failed = 0;
+    int n;
+
+    batch_reader_init(&reader, stdin);
+    batch_keys_init(&keys);
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+
+    while ((n = batch_read(&reader, fields)) >= 0) {
+	const BatchKey *key = NULL;
+	char *newdatamsg = NULL;
+	unsigned int offset;
+
+	if (n != 5) {
+	    fprintf(stderr, "Line %lu: expected 5 fields, found %d.\n",
+		    reader.lineno, n);
+	} else if (strlen(fields[1]) != strlen(fields[2])) {
+	    fprintf(stderr, "The old_text and new_text must be of the "
+		    "same length.\n");
+	} else if (sscanf(fields[3], "%u", &offset) != 1) {
+	    fprintf(stderr, "Unparseable offset given.\n");
+	} else if ((key = batch_key(&keys, fields[0])) != NULL) {
+	    newdatamsg = modify(key->mac, (unsigned char *)fields[1],
+		    (unsigned char *)fields[2], strlen(fields[1]), offset,
+		    fields[4]);
+	}
+	if (!newdatamsg) {
+	    fprintf(stderr, "Line %lu: no Data message made.\n",
+		    reader.lineno);
+	    failed++;
+	}
+
+	/* Keep one line of output per record */
+	printf("%s\n", newdatamsg ? newdatamsg : "");
+	free(newdatamsg);
+    }
+
+    batch_keys_free(&keys);
+    batch_reader_free(&reader);
+    fflush(stdout);
+    return failed;
+}
+
 int main(int argc, char **argv)
 {
     unsigned char *mackey;
     size_t mackeylen;
-    unsigned char macval[20];
     char *otrmsg = NULL;
-    DataMsg datamsg;
     size_t textlen;
     unsigned int offset;
     const unsigned char *old_text, *new_text;
     char *newdatamsg;
-    size_t i;
+
+    if (argc == 2 && !strcmp(argv[1], "-b")) {
+	return modify_batch() ? 1 : 0;
+    }
 
     if (argc != 5) {
 	usage(argv[0]);
@@ -89,37 +191,15 @@ int main(int argc, char **argv)
 	exit(1);
     }
 
-    if (otrl_proto_message_type(otrmsg) != OTRL_MSGTYPE_DATA) {
-	fprintf(stderr, "OTR Non-Data Message found on stdin.\n");
-	exit(1);
-    }
-
-    datamsg = parse_datamsg(otrmsg);
+    newdatamsg = modify(mackey, old_text, new_text, textlen, offset,
+	    otrmsg);
     free(otrmsg);
-    if (datamsg == NULL) {
-	fprintf(stderr, "Invalid OTR Data Message found on stdin.\n");
-	exit(1);
-    }
-
-    /* Check the MAC */
-    sha1hmac(macval, mackey, datamsg->macstart,
-	    datamsg->macend - datamsg->macstart);
-    if (memcmp(macval, datamsg->mac, 20)) {
-	fprintf(stderr, "MAC does not verify: wrong MAC key?\n");
+    if (!newdatamsg) {
 	exit(1);
     }
-
-    /* Modify the ciphertext */
-    for(i=0; i<textlen && offset+i < datamsg->encmsglen; ++i) {
-	datamsg->encmsg[offset+i] ^= (old_text[i] ^ new_text[i]);
-    }
-
-    /* Recalculate the MAC */
-    newdatamsg = remac_datamsg(datamsg, mackey);
     printf("%s\n", newdatamsg);
     free(newdatamsg);
 
-    free_datamsg(datamsg);
     free(mackey);
     fflush(stdout);
     return 0;
@@ -21,13 +21,169 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* libotr headers */
 #include "proto.h"
 
 /* toolkit headers */
-#include "readotr.h"
+#include "scanotr.h"
 #include "parse.h"
+#include "output.h"
+
+/* The fields of a message in structured output */
+enum {
+    F_TYPE, F_VALID, F_VERSION, F_SENDER_INSTANCE, F_RECEIVER_INSTANCE,
+    F_FLAGS, F_SENDER_KEYID, F_RCPT_KEYID, F_DH_Y, F_COUNTER,
+    F_ENCRYPTED_MESSAGE, F_MAC, F_REVEALED_MAC_KEYS, F_ENCRYPTED_KEY,
+    F_HASHED_KEY, F_KEY, F_ENCRYPTED_SIGNATURE, F_REPLY, F_DSA_P,
+    F_DSA_Q, F_DSA_G, F_DSA_E, F_KEYID, F_SIG_R, F_SIG_S, F_TEXT,
+    NUM_FIELDS
+};
+
+static const char *const field_names[NUM_FIELDS] = {
+    "type", "valid", "version", "sender_instance", "receiver_instance",
+    "flags", "sender_keyid", "rcpt_keyid", "dh_y", "counter",
+    "encrypted_message", "mac", "revealed_mac_keys", "encrypted_key",
+    "hashed_key", "key", "encrypted_signature", "reply", "dsa_p",
+    "dsa_q", "dsa_g", "dsa_e", "keyid", "sig_r", "sig_s", "text"
+};
+
+/* Put the fields of a message into a record, and print it */
+static void parse_record(OutputRecord *rec, const char *msg)
+{
+    OtrlMessageType mtype = otrl_proto_message_type(msg);
+    CommitMsg cmsg;
+    KeyMsg kmsg;
+    RevealSigMsg rmsg;
+    SignatureMsg smsg;
+    KeyExchMsg keyexch;
+    DataMsg datamsg;
+    int valid = 1;
+
+    record_str(rec, F_TYPE, output_msgtype_name(mtype));
+
+    switch(mtype) {
+	case OTRL_MSGTYPE_DH_COMMIT:
+	    cmsg = parse_commit(msg);
+	    if (!cmsg) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, cmsg->version);
+	    if (cmsg->version == 3) {
+		record_int(rec, F_SENDER_INSTANCE, cmsg->sender_instance);
+		record_int(rec, F_RECEIVER_INSTANCE,
+			cmsg->receiver_instance);
+	    }
+	    record_hex(rec, F_ENCRYPTED_KEY, cmsg->enckey, cmsg->enckeylen);
+	    record_hex(rec, F_HASHED_KEY, cmsg->hashkey, cmsg->hashkeylen);
+	    free_commit(cmsg);
+	    break;
+	case OTRL_MSGTYPE_DH_KEY:
+	    kmsg = parse_key(msg);
+	    if (!kmsg) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, kmsg->version);
+	    if (kmsg->version == 3) {
+		record_int(rec, F_SENDER_INSTANCE, kmsg->sender_instance);
+		record_int(rec, F_RECEIVER_INSTANCE,
+			kmsg->receiver_instance);
+	    }
+	    record_mpi(rec, F_DH_Y, kmsg->y);
+	    free_key(kmsg);
+	    break;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    rmsg = parse_revealsig(msg);
+	    if (!rmsg) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, rmsg->version);
+	    if (rmsg->version == 3) {
+		record_int(rec, F_SENDER_INSTANCE, rmsg->sender_instance);
+		record_int(rec, F_RECEIVER_INSTANCE,
+			rmsg->receiver_instance);
+	    }
+	    record_hex(rec, F_KEY, rmsg->key, rmsg->keylen);
+	    record_hex(rec, F_ENCRYPTED_SIGNATURE, rmsg->encsig,
+		    rmsg->encsiglen);
+	    record_hex(rec, F_MAC, rmsg->mac, 20);
+	    free_revealsig(rmsg);
+	    break;
+	case OTRL_MSGTYPE_SIGNATURE:
+	    smsg = parse_signature(msg);
+	    if (!smsg) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, smsg->version);
+	    if (smsg->version == 3) {
+		record_int(rec, F_SENDER_INSTANCE, smsg->sender_instance);
+		record_int(rec, F_RECEIVER_INSTANCE,
+			smsg->receiver_instance);
+	    }
+	    record_hex(rec, F_ENCRYPTED_SIGNATURE, smsg->encsig,
+		    smsg->encsiglen);
+	    record_hex(rec, F_MAC, smsg->mac, 20);
+	    free_signature(smsg);
+	    break;
+	case OTRL_MSGTYPE_V1_KEYEXCH:
+	    keyexch = parse_keyexch(msg);
+	    if (!keyexch) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, 1);
+	    record_int(rec, F_REPLY, keyexch->reply);
+	    record_mpi(rec, F_DSA_P, keyexch->p);
+	    record_mpi(rec, F_DSA_Q, keyexch->q);
+	    record_mpi(rec, F_DSA_G, keyexch->g);
+	    record_mpi(rec, F_DSA_E, keyexch->e);
+	    record_int(rec, F_KEYID, keyexch->keyid);
+	    record_mpi(rec, F_DH_Y, keyexch->y);
+	    record_mpi(rec, F_SIG_R, keyexch->r);
+	    record_mpi(rec, F_SIG_S, keyexch->s);
+	    free_keyexch(keyexch);
+	    break;
+	case OTRL_MSGTYPE_DATA:
+	    datamsg = parse_datamsg(msg);
+	    if (!datamsg) {
+		valid = 0;
+		break;
+	    }
+	    record_int(rec, F_VERSION, datamsg->version);
+	    if (datamsg->flags >= 0) {
+		record_int(rec, F_FLAGS, datamsg->flags);
+	    }
+	    if (datamsg->version == 3) {
+		record_int(rec, F_SENDER_INSTANCE,
+			datamsg->sender_instance);
+		record_int(rec, F_RECEIVER_INSTANCE,
+			datamsg->receiver_instance);
+	    }
+	    record_int(rec, F_SENDER_KEYID, datamsg->sender_keyid);
+	    record_int(rec, F_RCPT_KEYID, datamsg->rcpt_keyid);
+	    record_mpi(rec, F_DH_Y, datamsg->y);
+	    record_hex(rec, F_COUNTER, datamsg->ctr, 8);
+	    record_hex(rec, F_ENCRYPTED_MESSAGE, datamsg->encmsg,
+		    datamsg->encmsglen);
+	    record_hex(rec, F_MAC, datamsg->mac, 20);
+	    /* The revealed keys are 20 bytes each, run together */
+	    record_hex(rec, F_REVEALED_MAC_KEYS, datamsg->mackeys,
+		    datamsg->mackeyslen - datamsg->mackeyslen % 20);
+	    free_datamsg(datamsg);
+	    break;
+	default:
+	    record_str(rec, F_TEXT, msg);
+	    break;
+    }
+
+    record_int(rec, F_VALID, valid);
+    record_write(rec, stdout);
+}
 
 static void parse(const char *msg)
 {
@@ -201,24 +357,51 @@ static void parse(const char *msg)
 
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s\n"
+    fprintf(stderr, "Usage: %s [-f text|json|csv]\n"
 "Read Off-the-Record (OTR) Key Exchange and/or Data messages from stdin\n"
-"and display their contents in a more readable format.\n", progname);
+"and display their contents in a more readable format, or with -f json\n"
+"or -f csv, as one line of JSON or CSV per message.\n", progname);
     exit(1);
 }
 
 int main(int argc, char **argv)
 {
-    char *otrmsg = NULL;
+    const char *otrmsg;
+    ScanOtr scan;
+    OutputFormat format = OUTPUT_TEXT;
+    OutputRecord rec;
+    int c;
 
-    if (argc != 1) {
+    while ((c = getopt(argc, argv, "f:")) != -1) {
+	if (c != 'f' || output_format_parse(optarg, &format)) {
+	    usage(argv[0]);
+	}
+    }
+    if (optind != argc) {
 	usage(argv[0]);
     }
 
-    while ((otrmsg = readotr(stdin)) != NULL) {
-	parse(otrmsg);
-	free(otrmsg);
+    scanotr_init(&scan, 0);
+
+    if (format == OUTPUT_TEXT) {
+	while ((otrmsg = scanotr_next(&scan, NULL, NULL)) != NULL) {
+	    parse(otrmsg);
+	}
+	scanotr_free(&scan);
+	return 0;
     }
 
+    /* Structured output is for machines, so it isn't flushed after
+     * each message */
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+    record_init(&rec, format, field_names, NUM_FIELDS);
+    record_header(&rec, stdout);
+    while ((otrmsg = scanotr_next(&scan, NULL, NULL)) != NULL) {
+	parse_record(&rec, otrmsg);
+    }
+    record_free(&rec);
+    scanotr_free(&scan);
+    fflush(stdout);
+
     return 0;
 }
@@ -20,6 +20,7 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libotr headers */
 #include "proto.h"
@@ -30,26 +31,176 @@
 #include "sesskeys.h"
 #include "sha1hmac.h"
 #include "ctrmode.h"
+#include "batch.h"
 
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s aeskey [new_message]\n"
+"       %s -b\n"
 "Read an OTR Data Message from stdin.  Use the given AES key to\n"
 "verify its MAC and decrypt the message to stdout.  If new_message\n"
 "is given, output a new OTR Data Message with the same fields as the\n"
-"original, but with the message replaced by new_message\n", progname);
+"original, but with the message replaced by new_message\n"
+"With -b, read records of aeskey, the Data message and optionally\n"
+"new_message, separated by tabs, from stdin, one per line.  For each,\n"
+"output one line: the new Data message if new_message is given, or else\n"
+"the decrypted message, with backslashes, tabs and line breaks escaped\n"
+"as in C.  In a record, aeskey may be any key spec with an AES key\n"
+"(see otr_toolkit(1)).\n", progname, progname);
     exit(1);
 }
 
+/* Parse the Data message otrmsg, and check its MAC with mackey,
+ * setting *verifiedp to whether it verifies.  Returns the DataMsg, or
+ * NULL (after saying why) if otrmsg is not a Data message. */
+static DataMsg read_datamsg(const char *otrmsg,
+	const unsigned char mackey[20], int *verifiedp)
+{
+    unsigned char macval[20];
+    DataMsg datamsg;
+
+    if (otrl_proto_message_type(otrmsg) != OTRL_MSGTYPE_DATA) {
+	fprintf(stderr, "OTR Non-Data Message found on stdin.\n");
+	return NULL;
+    }
+
+    datamsg = parse_datamsg(otrmsg);
+    if (datamsg == NULL) {
+	fprintf(stderr, "Invalid OTR Data Message found on stdin.\n");
+	return NULL;
+    }
+
+    /* Check the MAC */
+    sha1hmac(macval, (unsigned char *)mackey, datamsg->macstart,
+	    datamsg->macend - datamsg->macstart);
+    *verifiedp = !memcmp(macval, datamsg->mac, 20);
+    if (!*verifiedp) {
+	fprintf(stderr, "MAC does not verify: wrong AES key?\n");
+    }
+    return datamsg;
+}
+
+/* Decrypt the message of a Data message into a newly-allocated,
+ * NUL-terminated buffer */
+static unsigned char *decrypt(DataMsg datamsg, const unsigned char aeskey[16])
+{
+    unsigned char *plaintext = malloc(datamsg->encmsglen+1);
+
+    if (!plaintext) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    aes_ctr_crypt(plaintext, datamsg->encmsg, datamsg->encmsglen,
+	    (unsigned char *)aeskey, datamsg->ctr);
+    plaintext[datamsg->encmsglen] = '\0';
+    return plaintext;
+}
+
+/* Replace the message of a Data message with newmsg, and return the
+ * newly-allocated result */
+static char *forge(DataMsg datamsg, const unsigned char aeskey[16],
+	const unsigned char mackey[20], const char *newmsg)
+{
+    unsigned char *ciphertext;
+    size_t newlen = strlen(newmsg);
+
+    ciphertext = malloc(newlen);
+    if (!ciphertext && newlen > 0) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    aes_ctr_crypt(ciphertext, (const unsigned char *)newmsg, newlen,
+	    (unsigned char *)aeskey, datamsg->ctr);
+    free(datamsg->encmsg);
+    datamsg->encmsg = ciphertext;
+    datamsg->encmsglen = newlen;
+
+    return remac_datamsg(datamsg, (unsigned char *)mackey);
+}
+
+/* Output a decrypted message on one line */
+static void put_escaped(const unsigned char *s)
+{
+    for (; *s; ++s) {
+	switch(*s) {
+	    case '\\': fputs("\\\\", stdout); break;
+	    case '\t': fputs("\\t", stdout); break;
+	    case '\n': fputs("\\n", stdout); break;
+	    case '\r': fputs("\\r", stdout); break;
+	    default: putchar(*s);
+	}
+    }
+    putchar('\n');
+}
+
+/* Read records from stdin, and output the forged Data message, or the
+ * decrypted message, of each.  Returns the number of records that
+ * failed. */
+static unsigned long readforge_batch(void)
+{
+    BatchReader reader;
+    BatchKeyCache keys;
+    char *fields[BATCH_MAX_FIELDS];
+    unsigned long failed = 0;
+    int n;
+
+    batch_reader_init(&reader, stdin);
+    batch_keys_init(&keys);
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+
+    while ((n = batch_read(&reader, fields)) >= 0) {
+	const BatchKey *key = NULL;
+	DataMsg datamsg = NULL;
+	int verified = 0;
+
+	if (n != 2 && n != 3) {
+	    fprintf(stderr, "Line %lu: expected 2 or 3 fields, found %d.\n",
+		    reader.lineno, n);
+	} else if ((key = batch_key(&keys, fields[0])) != NULL &&
+		!key->have_aes) {
+	    fprintf(stderr, "An AES key is needed, not just a MAC key.\n");
+	} else if (key) {
+	    datamsg = read_datamsg(fields[1], key->mac, &verified);
+	}
+
+	if (datamsg && n == 3) {
+	    char *newdatamsg = forge(datamsg, key->aes, key->mac,
+		    fields[2]);
+	    printf("%s\n", newdatamsg);
+	    free(newdatamsg);
+	} else if (datamsg && verified) {
+	    unsigned char *plaintext = decrypt(datamsg, key->aes);
+	    put_escaped(plaintext);
+	    free(plaintext);
+	} else {
+	    /* Keep one line of output per record */
+	    fprintf(stderr, "Line %lu: nothing to output.\n",
+		    reader.lineno);
+	    putchar('\n');
+	    failed++;
+	}
+	free_datamsg(datamsg);
+    }
+
+    batch_keys_free(&keys);
+    batch_reader_free(&reader);
+    fflush(stdout);
+    return failed;
+}
+
 int main(int argc, char **argv)
 {
     unsigned char *aeskey;
     unsigned char mackey[20];
-    unsigned char macval[20];
     size_t aeskeylen;
-    unsigned char *plaintext, *ciphertext;
+    unsigned char *plaintext;
     char *otrmsg = NULL;
     DataMsg datamsg;
+    int verified;
+
+    if (argc == 2 && !strcmp(argv[1], "-b")) {
+	return readforge_batch() ? 1 : 0;
+    }
 
     if (argc != 2 && argc != 3) {
 	usage(argv[0]);
@@ -71,56 +222,25 @@ int main(int argc, char **argv)
 	exit(1);
     }
 
-    if (otrl_proto_message_type(otrmsg) != OTRL_MSGTYPE_DATA) {
-	fprintf(stderr, "OTR Non-Data Message found on stdin.\n");
-	exit(1);
-    }
+    /* Create the MAC key */
+    sesskeys_make_mac(mackey, aeskey);
 
-    datamsg = parse_datamsg(otrmsg);
+    datamsg = read_datamsg(otrmsg, mackey, &verified);
     free(otrmsg);
     if (datamsg == NULL) {
-	fprintf(stderr, "Invalid OTR Data Message found on stdin.\n");
 	exit(1);
     }
 
-    /* Create the MAC key */
-    sesskeys_make_mac(mackey, aeskey);
-
-    /* Check the MAC */
-    sha1hmac(macval, mackey, datamsg->macstart,
-	    datamsg->macend - datamsg->macstart);
-    if (memcmp(macval, datamsg->mac, 20)) {
-	fprintf(stderr, "MAC does not verify: wrong AES key?\n");
-    } else {
+    if (verified) {
 	/* Decrypt the message */
-	plaintext = malloc(datamsg->encmsglen+1);
-	if (!plaintext) {
-	    fprintf(stderr, "Out of memory!\n");
-	    exit(1);
-	}
-	aes_ctr_crypt(plaintext, datamsg->encmsg, datamsg->encmsglen,
-		aeskey, datamsg->ctr);
-	plaintext[datamsg->encmsglen] = '\0';
+	plaintext = decrypt(datamsg, aeskey);
 	printf("Plaintext: ``%s''\n", plaintext);
 	free(plaintext);
     }
 
     /* Do we want to forge a message? */
     if (argv[2] != NULL) {
-	char *newdatamsg;
-	size_t newlen = strlen(argv[2]);
-	ciphertext = malloc(newlen);
-	if (!ciphertext && newlen > 0) {
-	    fprintf(stderr, "Out of memory!\n");
-	    exit(1);
-	}
-	aes_ctr_crypt(ciphertext, (const unsigned char *)argv[2], newlen,
-		aeskey, datamsg->ctr);
-	free(datamsg->encmsg);
-	datamsg->encmsg = ciphertext;
-	datamsg->encmsglen = newlen;
-
-	newdatamsg = remac_datamsg(datamsg, mackey);
+	char *newdatamsg = forge(datamsg, aeskey, mackey, argv[2]);
 
 	printf("%s\n", newdatamsg);
 	free(newdatamsg);
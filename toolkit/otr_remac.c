@@ -21,6 +21,7 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
@@ -28,23 +29,29 @@
 /* toolkit headers */
 #include "parse.h"
 #include "sha1hmac.h"
+#include "batch.h"
 
 static void usage(const char *progname)
 {
     fprintf(stderr, "Usage: %s mackey sender_instance receiver_instance "
 	"flags snd_keyid rcp_keyid pubkey counter encdata revealed_mackeys\n"
+"       %s -b\n"
 "Make a new Data message, with the given pieces (note that the\n"
 "data part is already encrypted).  MAC it with the given mackey.\n"
 "mackey, pubkey, counter, encdata, and revealed_mackeys are given\n"
-"as strings of hex chars.  snd_keyid and rcp_keyid are decimal integers.\n",
-	progname);
+"as strings of hex chars.  snd_keyid and rcp_keyid are decimal integers.\n"
+"With -b, read records of the same arguments, separated by tabs, from\n"
+"stdin, one per line, and output one Data message per line.  In a\n"
+"record, mackey may be any key spec (see otr_toolkit(1)).\n",
+	progname, progname);
     exit(1);
 }
 
-int main(int argc, char **argv)
+/* Make a new Data message out of the arguments that follow the mackey,
+ * and MAC it with the given mackey.  Returns a newly-allocated
+ * message, or NULL (after saying why) if an argument is invalid. */
+static char *remac(const unsigned char mackey[20], char **args)
 {
-    unsigned char *mackey;
-    size_t mackeylen;
     unsigned int snd_keyid, rcp_keyid;
     int flags;
     unsigned char version = 3;
@@ -61,83 +68,150 @@ int main(int argc, char **argv)
     size_t mackeyslen;
     char *newdatamsg;
 
-    if (argc != 11) {
-	usage(argv[0]);
-    }
-
-    argv_to_buf(&mackey, &mackeylen, argv[1]);
-    if (!mackey) {
-	usage(argv[0]);
-    }
-
-    if (mackeylen != 20) {
-	fprintf(stderr, "The MAC key must be 40 hex chars long.\n");
-	usage(argv[0]);
-    }
-
-    if (sscanf(argv[2], "%u", &sender_instance) != 1) {
+    if (sscanf(args[0], "%u", &sender_instance) != 1) {
 	fprintf(stderr, "Unparseable sender_instance given.\n");
-	usage(argv[0]);
+	return NULL;
     }
 
-    if (sscanf(argv[3], "%u", &receiver_instance) != 1) {
+    if (sscanf(args[1], "%u", &receiver_instance) != 1) {
 	fprintf(stderr, "Unparseable receiver_instance given.\n");
-	usage(argv[0]);
+	return NULL;
     }
 
-    if (sscanf(argv[4], "%d", &flags) != 1) {
+    if (sscanf(args[2], "%d", &flags) != 1) {
 	fprintf(stderr, "Unparseable flags given.\n");
-	usage(argv[0]);
+	return NULL;
     }
 
-    if (sscanf(argv[5], "%u", &snd_keyid) != 1) {
+    if (sscanf(args[3], "%u", &snd_keyid) != 1) {
 	fprintf(stderr, "Unparseable snd_keyid given.\n");
-	usage(argv[0]);
+	return NULL;
     }
 
-    if (sscanf(argv[6], "%u", &rcp_keyid) != 1) {
+    if (sscanf(args[4], "%u", &rcp_keyid) != 1) {
 	fprintf(stderr, "Unparseable rcp_keyid given.\n");
-	usage(argv[0]);
+	return NULL;
     }
 
-    argv_to_buf(&pubkey, &pubkeylen, argv[7]);
+    argv_to_buf(&pubkey, &pubkeylen, args[5]);
     if (!pubkey) {
-	usage(argv[0]);
+	return NULL;
     }
     gcry_mpi_scan(&pubv, GCRYMPI_FMT_USG, pubkey, pubkeylen, NULL);
     free(pubkey);
 
-    argv_to_buf(&ctr, &ctrlen, argv[8]);
+    argv_to_buf(&ctr, &ctrlen, args[6]);
     if (!ctr) {
-	usage(argv[0]);
+	gcry_mpi_release(pubv);
+	return NULL;
     }
 
     if (ctrlen != 8) {
 	fprintf(stderr, "The counter must be 16 hex chars long.\n");
+	gcry_mpi_release(pubv);
+	free(ctr);
+	return NULL;
+    }
+
+    argv_to_buf(&encdata, &encdatalen, args[7]);
+    if (!encdata && strlen(args[7]) > 0) {
+	gcry_mpi_release(pubv);
+	free(ctr);
+	return NULL;
+    }
+
+    argv_to_buf(&mackeys, &mackeyslen, args[8]);
+    if (!mackeys && strlen(args[8]) > 0) {
+	gcry_mpi_release(pubv);
+	free(ctr);
+	free(encdata);
+	return NULL;
+    }
+
+    newdatamsg = assemble_datamsg((unsigned char *)mackey, version,
+	    sender_instance, receiver_instance, flags, snd_keyid, rcp_keyid,
+	    pubv, ctr, encdata, encdatalen, mackeys, mackeyslen);
+
+    gcry_mpi_release(pubv);
+    free(ctr);
+    free(encdata);
+    free(mackeys);
+    return newdatamsg;
+}
+
+/* Read records from stdin, and output a Data message for each.  Returns
+ * the number of records that failed. */
+static unsigned long remac_batch(void)
+{
+    BatchReader reader;
+    BatchKeyCache keys;
+    char *fields[BATCH_MAX_FIELDS];
+    unsigned long failed = 0;
+    int n;
+
+    batch_reader_init(&reader, stdin);
+    batch_keys_init(&keys);
+    setvbuf(stdout, NULL, _IOFBF, 65536);
+
+    while ((n = batch_read(&reader, fields)) >= 0) {
+	const BatchKey *key = NULL;
+	char *newdatamsg = NULL;
+
+	if (n != 10) {
+	    fprintf(stderr, "Line %lu: expected 10 fields, found %d.\n",
+		    reader.lineno, n);
+	} else if ((key = batch_key(&keys, fields[0])) != NULL) {
+	    newdatamsg = remac(key->mac, fields + 1);
+	}
+	if (!newdatamsg) {
+	    fprintf(stderr, "Line %lu: no Data message made.\n",
+		    reader.lineno);
+	    failed++;
+	}
+
+	/* Keep one line of output per record */
+	printf("%s\n", newdatamsg ? newdatamsg : "");
+	free(newdatamsg);
+    }
+
+    batch_keys_free(&keys);
+    batch_reader_free(&reader);
+    fflush(stdout);
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    unsigned char *mackey;
+    size_t mackeylen;
+    char *newdatamsg;
+
+    if (argc == 2 && !strcmp(argv[1], "-b")) {
+	return remac_batch() ? 1 : 0;
+    }
+
+    if (argc != 11) {
 	usage(argv[0]);
     }
 
-    argv_to_buf(&encdata, &encdatalen, argv[9]);
-    if (!encdata) {
+    argv_to_buf(&mackey, &mackeylen, argv[1]);
+    if (!mackey) {
 	usage(argv[0]);
     }
 
-    argv_to_buf(&mackeys, &mackeyslen, argv[10]);
-    if (!mackeys) {
+    if (mackeylen != 20) {
+	fprintf(stderr, "The MAC key must be 40 hex chars long.\n");
 	usage(argv[0]);
     }
 
-    newdatamsg = assemble_datamsg(mackey, version, sender_instance,
-	    receiver_instance, flags, snd_keyid, rcp_keyid, pubv, ctr, encdata,
-	    encdatalen, mackeys, mackeyslen);
+    newdatamsg = remac(mackey, argv + 2);
+    if (!newdatamsg) {
+	usage(argv[0]);
+    }
     printf("%s\n", newdatamsg);
     free(newdatamsg);
 
     free(mackey);
-    gcry_mpi_release(pubv);
-    free(ctr);
-    free(encdata);
-    free(mackeys);
     fflush(stdout);
     return 0;
 }
@@ -0,0 +1,441 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* libotr headers */
+#include "proto.h"
+
+/* toolkit headers */
+#include "scanotr.h"
+#include "parse.h"
+#include "output.h"
+
+/* How many messages, or bytes of messages, a thread is handed at once */
+#define BATCH_MSGS 4096
+#define BATCH_BYTES (1024 * 1024)
+
+/* The most threads we will start */
+#define MAX_THREADS 64
+
+/* The highest protocol version counted on its own */
+#define MAX_VERSION 3
+
+/* The counts of one kind of message */
+typedef struct {
+    unsigned long long count;
+    unsigned long long invalid;
+    unsigned long long bytes;
+} Tally;
+
+/* The counts of every kind of message, by type and protocol version
+ * (version 0 for messages that could not be parsed) */
+typedef struct {
+    Tally tally[OTRL_MSGTYPE_UNKNOWN + 1][MAX_VERSION + 1];
+} Stats;
+
+/* A run of consecutive messages from one input */
+typedef struct {
+    enum { BATCH_FREE, BATCH_FILLED, BATCH_DONE } state;
+    const char *name;            /* The input they came from */
+    char *text;                  /* The messages, each NUL-terminated */
+    size_t textlen, textsize;
+    size_t msgs[BATCH_MSGS];     /* Where each one starts in text */
+    unsigned long long offsets[BATCH_MSGS];  /* and in the input */
+    size_t nmsgs;
+    Stats stats;                 /* Filled in by the thread */
+    char *out;                   /* The lines printed with -v */
+    size_t outlen, outsize;
+} Batch;
+
+/* The batches are parsed by a pool of threads, and collected in order
+ * by the main thread, from a ring of twice as many batches as there
+ * are threads. */
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    Batch *ring;
+    unsigned int nslots;
+    unsigned long long filled;   /* Batches handed to the threads */
+    unsigned long long taken;    /* Batches the threads started on */
+    unsigned long long written;  /* Batches collected */
+    int finished;                /* Are there no more batches to come? */
+    int verbose;
+} Pool;
+
+static Pool pool;
+
+static void out_append(Batch *batch, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__ ((format (printf, 2, 3)))
+#endif
+;
+
+/* Add a line to the output of a batch */
+static void out_append(Batch *batch, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    while (1) {
+	va_start(ap, fmt);
+	n = vsnprintf(batch->out + batch->outlen,
+		batch->outsize - batch->outlen, fmt, ap);
+	va_end(ap);
+	if (n < 0) return;
+	if ((size_t)n < batch->outsize - batch->outlen) break;
+
+	batch->outsize = batch->outsize * 2 + n + 1;
+	batch->out = realloc(batch->out, batch->outsize);
+	if (!batch->out) {
+	    fprintf(stderr, "Out of memory!\n");
+	    exit(1);
+	}
+    }
+    batch->outlen += n;
+}
+
+/* Parse one message.  Return 1 if it is valid (and then put its
+ * protocol version in *versionp), or 0 if not. */
+static int check(const char *msg, OtrlMessageType mtype,
+	unsigned int *versionp)
+{
+    CommitMsg cmsg;
+    KeyMsg kmsg;
+    RevealSigMsg rmsg;
+    SignatureMsg smsg;
+    KeyExchMsg keyexch;
+    DataMsg datamsg;
+
+    switch(mtype) {
+	case OTRL_MSGTYPE_DH_COMMIT:
+	    if (!(cmsg = parse_commit(msg))) return 0;
+	    *versionp = cmsg->version;
+	    free_commit(cmsg);
+	    return 1;
+	case OTRL_MSGTYPE_DH_KEY:
+	    if (!(kmsg = parse_key(msg))) return 0;
+	    *versionp = kmsg->version;
+	    free_key(kmsg);
+	    return 1;
+	case OTRL_MSGTYPE_REVEALSIG:
+	    if (!(rmsg = parse_revealsig(msg))) return 0;
+	    *versionp = rmsg->version;
+	    free_revealsig(rmsg);
+	    return 1;
+	case OTRL_MSGTYPE_SIGNATURE:
+	    if (!(smsg = parse_signature(msg))) return 0;
+	    *versionp = smsg->version;
+	    free_signature(smsg);
+	    return 1;
+	case OTRL_MSGTYPE_V1_KEYEXCH:
+	    if (!(keyexch = parse_keyexch(msg))) return 0;
+	    *versionp = 1;
+	    free_keyexch(keyexch);
+	    return 1;
+	case OTRL_MSGTYPE_DATA:
+	    if (!(datamsg = parse_datamsg(msg))) return 0;
+	    *versionp = datamsg->version;
+	    free_datamsg(datamsg);
+	    return 1;
+	default:
+	    return 0;
+    }
+}
+
+/* Parse the messages of a batch */
+static void parse_batch(Batch *batch, int verbose)
+{
+    size_t i;
+
+    memset(&(batch->stats), 0, sizeof(Stats));
+    batch->outlen = 0;
+
+    for (i = 0; i < batch->nmsgs; ++i) {
+	const char *msg = batch->text + batch->msgs[i];
+	size_t msgend = i + 1 < batch->nmsgs ? batch->msgs[i+1] :
+	    batch->textlen;
+	OtrlMessageType mtype = otrl_proto_message_type(msg);
+	unsigned int version = 0;
+	int valid = check(msg, mtype, &version);
+	Tally *tally;
+
+	if (version > MAX_VERSION) version = 0;
+	tally = &(batch->stats.tally[mtype][version]);
+	tally->count++;
+	tally->invalid += !valid;
+	tally->bytes += msgend - batch->msgs[i] - 1;
+
+	if (verbose) {
+	    out_append(batch, "%s\t%llu\t%s\t%u\t%s\n", batch->name,
+		    batch->offsets[i], output_msgtype_name(mtype), version,
+		    valid ? "ok" : "invalid");
+	}
+    }
+}
+
+/* The threads parsing batches */
+static void *worker(void *arg)
+{
+    while (1) {
+	Batch *batch;
+
+	pthread_mutex_lock(&pool.lock);
+	while (pool.taken == pool.filled && !pool.finished) {
+	    pthread_cond_wait(&pool.cond, &pool.lock);
+	}
+	if (pool.taken == pool.filled) {
+	    pthread_mutex_unlock(&pool.lock);
+	    return NULL;
+	}
+	batch = &(pool.ring[pool.taken++ % pool.nslots]);
+	pthread_mutex_unlock(&pool.lock);
+
+	parse_batch(batch, pool.verbose);
+
+	pthread_mutex_lock(&pool.lock);
+	batch->state = BATCH_DONE;
+	pthread_cond_broadcast(&pool.cond);
+	pthread_mutex_unlock(&pool.lock);
+    }
+}
+
+/* Wait for the oldest batch to be parsed, print its output and add its
+ * counts to *stats. */
+static void collect(Stats *stats)
+{
+    Batch *batch = &(pool.ring[pool.written % pool.nslots]);
+    unsigned int t, v;
+
+    pthread_mutex_lock(&pool.lock);
+    while (batch->state != BATCH_DONE) {
+	pthread_cond_wait(&pool.cond, &pool.lock);
+    }
+    pthread_mutex_unlock(&pool.lock);
+
+    if (batch->outlen > 0) {
+	fwrite(batch->out, 1, batch->outlen, stdout);
+    }
+    for (t = 0; t <= OTRL_MSGTYPE_UNKNOWN; ++t) {
+	for (v = 0; v <= MAX_VERSION; ++v) {
+	    Tally *from = &(batch->stats.tally[t][v]);
+	    Tally *to = &(stats->tally[t][v]);
+	    to->count += from->count;
+	    to->invalid += from->invalid;
+	    to->bytes += from->bytes;
+	}
+    }
+
+    batch->state = BATCH_FREE;
+    pool.written++;
+}
+
+/* Return the batch to fill next, collecting the one that was in its
+ * slot if need be. */
+static Batch *next_batch(Stats *stats, const char *name)
+{
+    Batch *batch;
+
+    while (pool.written + pool.nslots <= pool.filled) {
+	collect(stats);
+    }
+    batch = &(pool.ring[pool.filled % pool.nslots]);
+    batch->name = name;
+    batch->textlen = 0;
+    batch->nmsgs = 0;
+    return batch;
+}
+
+/* Hand a filled batch to the threads */
+static void submit(Batch *batch)
+{
+    pthread_mutex_lock(&pool.lock);
+    batch->state = BATCH_FILLED;
+    pool.filled++;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+}
+
+/* Add a message to a batch.  Returns 1 if the batch is now full. */
+static int add_message(Batch *batch, const char *msg, size_t len,
+	unsigned long long offset)
+{
+    if (batch->textlen + len + 1 > batch->textsize) {
+	batch->textsize = (batch->textlen + len + 1) * 2;
+	batch->text = realloc(batch->text, batch->textsize);
+	if (!batch->text) {
+	    fprintf(stderr, "Out of memory!\n");
+	    exit(1);
+	}
+    }
+    memmove(batch->text + batch->textlen, msg, len + 1);
+    batch->msgs[batch->nmsgs] = batch->textlen;
+    batch->offsets[batch->nmsgs] = offset;
+    batch->nmsgs++;
+    batch->textlen += len + 1;
+
+    return batch->nmsgs == BATCH_MSGS || batch->textlen >= BATCH_BYTES;
+}
+
+/* Scan one input, handing its messages to the threads.  Returns 0 on
+ * success, or -1 on a read error. */
+static int scan_input(int fd, const char *name, Stats *stats)
+{
+    ScanOtr scan;
+    const char *msg;
+    size_t len;
+    unsigned long long offset;
+    Batch *batch = NULL;
+    int ret = 0;
+
+    scanotr_init(&scan, fd);
+    while ((msg = scanotr_next(&scan, &len, &offset)) != NULL) {
+	if (!batch) batch = next_batch(stats, name);
+	if (add_message(batch, msg, len, offset)) {
+	    submit(batch);
+	    batch = NULL;
+	}
+    }
+    if (batch) submit(batch);
+
+    if (scan.error) {
+	fprintf(stderr, "%s: %s\n", name, strerror(scan.error));
+	ret = -1;
+    }
+    scanotr_free(&scan);
+    return ret;
+}
+
+/* Print the counts by message type and protocol version */
+static void print_stats(const Stats *stats)
+{
+    unsigned int t, v;
+    Tally total;
+
+    memset(&total, 0, sizeof(total));
+    printf("%-18s %7s %14s %14s %16s\n", "Type", "Version", "Messages",
+	    "Invalid", "Bytes");
+    for (t = 0; t <= OTRL_MSGTYPE_UNKNOWN; ++t) {
+	for (v = 0; v <= MAX_VERSION; ++v) {
+	    const Tally *tally = &(stats->tally[t][v]);
+	    char version[4] = "-";
+
+	    if (tally->count == 0) continue;
+	    if (v > 0) sprintf(version, "%u", v);
+	    printf("%-18s %7s %14llu %14llu %16llu\n", output_msgtype_name(t),
+		    version, tally->count, tally->invalid, tally->bytes);
+	    total.count += tally->count;
+	    total.invalid += tally->invalid;
+	    total.bytes += tally->bytes;
+	}
+    }
+    printf("%-18s %7s %14llu %14llu %16llu\n", "total", "", total.count,
+	    total.invalid, total.bytes);
+}
+
+static void usage(const char *progname)
+{
+    fprintf(stderr, "Usage: %s [-v] [-j threads] [file ...]\n"
+"Read Off-the-Record (OTR) Key Exchange and/or Data messages from the\n"
+"given files (or stdin), and count them by message type and protocol\n"
+"version, parsing them in several threads.  With -v, also show the\n"
+"input, offset, type, version and validity of each message, in input\n"
+"order.\n", progname);
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    Stats stats;
+    pthread_t threads[MAX_THREADS];
+    long nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    int c, i, ret = 0;
+
+    while ((c = getopt(argc, argv, "vj:")) != -1) {
+	switch(c) {
+	    case 'v':
+		pool.verbose = 1;
+		break;
+	    case 'j':
+		nthreads = strtol(optarg, NULL, 10);
+		break;
+	    default:
+		usage(argv[0]);
+	}
+    }
+    if (nthreads < 1) nthreads = 1;
+    if (nthreads > MAX_THREADS) nthreads = MAX_THREADS;
+
+    /* Initialize libgcrypt before the threads race to do it */
+    gcry_check_version(NULL);
+
+    memset(&stats, 0, sizeof(stats));
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.cond, NULL);
+    pool.nslots = 2 * nthreads;
+    pool.ring = calloc(pool.nslots, sizeof(Batch));
+    if (!pool.ring) {
+	fprintf(stderr, "Out of memory!\n");
+	exit(1);
+    }
+    for (i = 0; i < nthreads; ++i) {
+	if (pthread_create(&threads[i], NULL, worker, NULL)) {
+	    perror("pthread_create");
+	    exit(1);
+	}
+    }
+
+    if (optind == argc) {
+	if (scan_input(0, "-", &stats)) ret = 1;
+    }
+    for (i = optind; i < argc; ++i) {
+	int fd = strcmp(argv[i], "-") ? open(argv[i], O_RDONLY) : 0;
+
+	if (fd < 0) {
+	    fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+	    ret = 1;
+	    continue;
+	}
+	if (scan_input(fd, argv[i], &stats)) ret = 1;
+	if (fd != 0) close(fd);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    pool.finished = 1;
+    pthread_cond_broadcast(&pool.cond);
+    pthread_mutex_unlock(&pool.lock);
+    while (pool.written < pool.filled) {
+	collect(&stats);
+    }
+    for (i = 0; i < nthreads; ++i) {
+	pthread_join(threads[i], NULL);
+    }
+
+    print_stats(&stats);
+
+    return ret;
+}
@@ -20,14 +20,28 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
 /* toolkit headers */
 #include "parse.h"
 #include "sesskeys.h"
+#include "output.h"
+
+/* The fields of the structured output */
+enum {
+    F_END, F_OUR_PUBLIC_KEY, F_SESSION_ID, F_SENDING_AES_KEY,
+    F_SENDING_MAC_KEY, F_RECEIVING_AES_KEY, F_RECEIVING_MAC_KEY,
+    NUM_FIELDS
+};
+
+static const char *const field_names[NUM_FIELDS] = {
+    "end", "our_public_key", "session_id", "sending_aes_key",
+    "sending_mac_key", "receiving_aes_key", "receiving_mac_key"
+};
 
 static void usage(const char *progname)
 {
-    fprintf(stderr, "Usage: %s our_privkey their_pubkey\n"
+    fprintf(stderr, "Usage: %s [-f text|json|csv] our_privkey their_pubkey\n"
 "Calculate and display our public key, the session id, two AES keys,\n"
 "and two MAC keys generated by the given DH private key and public key.\n",
 	progname);
@@ -44,18 +58,26 @@ int main(int argc, char **argv)
     unsigned char sessionid[20], sendenc[16], rcvenc[16];
     unsigned char sendmac[20], rcvmac[20];
     int is_high;
+    OutputFormat format = OUTPUT_TEXT;
+    OutputRecord rec;
+    int c;
 
-    if (argc != 3) {
+    while ((c = getopt(argc, argv, "f:")) != -1) {
+	if (c != 'f' || output_format_parse(optarg, &format)) {
+	    usage(argv[0]);
+	}
+    }
+    if (argc - optind != 2) {
 	usage(argv[0]);
     }
 
-    argv_to_buf(&argbuf, &argbuflen, argv[1]);
+    argv_to_buf(&argbuf, &argbuflen, argv[optind]);
     /* Private keys are only 320 bits long, so check for that to make
      * sure they didn't get the args the wrong way around */
     if (!argbuf || argbuflen > 40) usage(argv[0]);
     gcry_mpi_scan(&our_x, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
     free(argbuf);
-    argv_to_buf(&argbuf, &argbuflen, argv[2]);
+    argv_to_buf(&argbuf, &argbuflen, argv[optind+1]);
     if (!argbuf) usage(argv[0]);
     gcry_mpi_scan(&their_y, GCRYMPI_FMT_USG, argbuf, argbuflen, NULL);
     free(argbuf);
@@ -73,6 +95,22 @@ int main(int argc, char **argv)
     }
     gcry_mpi_print(GCRYMPI_FMT_USG, pubbuf, publen, NULL, our_y);
 
+    if (format != OUTPUT_TEXT) {
+	record_init(&rec, format, field_names, NUM_FIELDS);
+	record_header(&rec, stdout);
+	record_str(&rec, F_END, is_high ? "high" : "low");
+	record_hex(&rec, F_OUR_PUBLIC_KEY, pubbuf, publen);
+	record_hex(&rec, F_SESSION_ID, sessionid, 20);
+	record_hex(&rec, F_SENDING_AES_KEY, sendenc, 16);
+	record_hex(&rec, F_SENDING_MAC_KEY, sendmac, 20);
+	record_hex(&rec, F_RECEIVING_AES_KEY, rcvenc, 16);
+	record_hex(&rec, F_RECEIVING_MAC_KEY, rcvmac, 20);
+	record_write(&rec, stdout);
+	record_free(&rec);
+	fflush(stdout);
+	return 0;
+    }
+
     puts("");
     printf("We are the %s end of this key exchange.\n",
 	    is_high ? "high" : "low");
@@ -0,0 +1,332 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* toolkit headers */
+#include "output.h"
+
+/* The hex encoding of every byte value */
+static const char hexpairs[513] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+static const char *msgtype_names[OTRL_MSGTYPE_UNKNOWN + 1] = {
+    "not_otr", "tagged_plaintext", "query", "dh_commit", "dh_key",
+    "revealsig", "signature", "v1_keyexch", "data", "error", "unknown"
+};
+
+/* Parse the name of an output format into *formatp. */
+int output_format_parse(const char *name, OutputFormat *formatp)
+{
+    if (!strcmp(name, "text")) {
+	*formatp = OUTPUT_TEXT;
+    } else if (!strcmp(name, "json")) {
+	*formatp = OUTPUT_JSON;
+    } else if (!strcmp(name, "csv")) {
+	*formatp = OUTPUT_CSV;
+    } else {
+	return -1;
+    }
+    return 0;
+}
+
+/* Return the name of a message type */
+const char *output_msgtype_name(OtrlMessageType mtype)
+{
+    if ((unsigned int)mtype > OTRL_MSGTYPE_UNKNOWN) return "unknown";
+    return msgtype_names[mtype];
+}
+
+/* Write the hex encoding of data to out.  This is a table lookup per
+ * byte, four bytes to a round, which is about as fast as it gets
+ * without resorting to SIMD intrinsics. */
+void hex_encode(char *out, const unsigned char *data, size_t len)
+{
+    size_t i = 0;
+
+    for (; i + 4 <= len; i += 4) {
+	memmove(out, hexpairs + 2 * data[i], 2);
+	memmove(out + 2, hexpairs + 2 * data[i+1], 2);
+	memmove(out + 4, hexpairs + 2 * data[i+2], 2);
+	memmove(out + 6, hexpairs + 2 * data[i+3], 2);
+	out += 8;
+    }
+    for (; i < len; ++i) {
+	memmove(out, hexpairs + 2 * data[i], 2);
+	out += 2;
+    }
+    *out = '\0';
+}
+
+static void out_of_memory(void)
+{
+    fprintf(stderr, "Out of memory!\n");
+    exit(1);
+}
+
+/* Set up a record with the given fields */
+void record_init(OutputRecord *rec, OutputFormat format,
+	const char *const *names, unsigned int nfields)
+{
+    rec->format = format;
+    rec->names = names;
+    rec->nfields = nfields;
+    rec->starts = calloc(nfields, sizeof(size_t));
+    rec->lens = calloc(nfields, sizeof(size_t));
+    rec->isset = calloc(nfields, 1);
+    if (!rec->starts || !rec->lens || !rec->isset) out_of_memory();
+    rec->values = NULL;
+    rec->valueslen = 0;
+    rec->valuessize = 0;
+    rec->line = NULL;
+    rec->linesize = 0;
+}
+
+/* Print the line naming the columns, if the format has one */
+void record_header(OutputRecord *rec, FILE *stream)
+{
+    unsigned int i;
+
+    if (rec->format != OUTPUT_CSV) return;
+
+    for (i = 0; i < rec->nfields; ++i) {
+	fprintf(stream, "%s%s", i ? "," : "", rec->names[i]);
+    }
+    fputc('\n', stream);
+}
+
+/* Unset every field */
+void record_clear(OutputRecord *rec)
+{
+    memset(rec->isset, 0, rec->nfields);
+    rec->valueslen = 0;
+}
+
+/* Make room for len more chars of values, and return where they go */
+static char *values_reserve(OutputRecord *rec, size_t len)
+{
+    if (rec->valueslen + len > rec->valuessize) {
+	rec->valuessize = (rec->valueslen + len) * 2;
+	rec->values = realloc(rec->values, rec->valuessize);
+	if (!rec->values) out_of_memory();
+    }
+    return rec->values + rec->valueslen;
+}
+
+/* Note that the chars just put at the end of values, up to end, are the
+ * value of the given field */
+static void values_set(OutputRecord *rec, unsigned int field,
+	const char *end)
+{
+    size_t len = end - (rec->values + rec->valueslen);
+
+    rec->starts[field] = rec->valueslen;
+    rec->lens[field] = len;
+    rec->isset[field] = 1;
+    rec->valueslen += len;
+}
+
+/* Set a field to a number */
+void record_int(OutputRecord *rec, unsigned int field, unsigned int val)
+{
+    char *p = values_reserve(rec, 11);
+
+    values_set(rec, field, p + sprintf(p, "%u", val));
+}
+
+/* Set a field to a larger number */
+void record_ullong(OutputRecord *rec, unsigned int field,
+	unsigned long long val)
+{
+    char *p = values_reserve(rec, 21);
+
+    values_set(rec, field, p + sprintf(p, "%llu", val));
+}
+
+/* Set a field to the hex encoding of some data.  Hex needs no escaping
+ * in either format; JSON just needs it quoted. */
+void record_hex(OutputRecord *rec, unsigned int field,
+	const unsigned char *data, size_t datalen)
+{
+    int json = (rec->format == OUTPUT_JSON);
+    char *p = values_reserve(rec, 2 * datalen + 3);
+    char *q = p;
+
+    if (json) *q++ = '"';
+    hex_encode(q, data, datalen);
+    q += 2 * datalen;
+    if (json) *q++ = '"';
+    values_set(rec, field, q);
+}
+
+/* Set a field to the hex encoding of an MPI */
+void record_mpi(OutputRecord *rec, unsigned int field, gcry_mpi_t val)
+{
+    size_t plen;
+    unsigned char *d;
+
+    gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &plen, val);
+    d = malloc(plen);
+    if (!d && plen > 0) out_of_memory();
+    gcry_mpi_print(GCRYMPI_FMT_USG, d, plen, NULL, val);
+    record_hex(rec, field, d, plen);
+    free(d);
+}
+
+/* Return the length of the well-formed UTF-8 sequence at s, which
+ * starts with a byte of 0x80 or more, or 0 if there isn't one there.
+ * Overlong forms, surrogates and code points past U+10FFFF are not
+ * well-formed. */
+static size_t utf8_seqlen(const unsigned char *s)
+{
+    unsigned char lo = 0x80, hi = 0xbf;
+    size_t len, i;
+
+    if (s[0] >= 0xc2 && s[0] <= 0xdf) {
+	len = 2;
+    } else if (s[0] >= 0xe0 && s[0] <= 0xef) {
+	len = 3;
+	if (s[0] == 0xe0) lo = 0xa0;
+	if (s[0] == 0xed) hi = 0x9f;
+    } else if (s[0] >= 0xf0 && s[0] <= 0xf4) {
+	len = 4;
+	if (s[0] == 0xf0) lo = 0x90;
+	if (s[0] == 0xf4) hi = 0x8f;
+    } else {
+	return 0;
+    }
+
+    /* The NUL at the end of the string stops this too */
+    if (s[1] < lo || s[1] > hi) return 0;
+    for (i = 2; i < len; ++i) {
+	if (s[i] < 0x80 || s[i] > 0xbf) return 0;
+    }
+    return len;
+}
+
+/* Set a field to a string, quoted and escaped as JSON or CSV need.
+ * JSON must be UTF-8, so there any byte that isn't part of a
+ * well-formed UTF-8 sequence is replaced with U+FFFD. */
+void record_str(OutputRecord *rec, unsigned int field, const char *s)
+{
+    size_t len = strlen(s);
+    char *q;
+
+    if (rec->format == OUTPUT_JSON) {
+	/* At worst, every char becomes \u00XX or \ufffd */
+	q = values_reserve(rec, 6 * len + 2);
+	*q++ = '"';
+	while (*s) {
+	    unsigned char c = *s;
+	    size_t seqlen;
+	    if (c == '"' || c == '\\') {
+		*q++ = '\\';
+		*q++ = c;
+	    } else if (c < 0x20) {
+		q += sprintf(q, "\\u%04x", c);
+	    } else if (c < 0x80) {
+		*q++ = c;
+	    } else if ((seqlen = utf8_seqlen((const unsigned char *)s)) > 0) {
+		memmove(q, s, seqlen);
+		q += seqlen;
+		s += seqlen;
+		continue;
+	    } else {
+		q += sprintf(q, "\\ufffd");
+	    }
+	    ++s;
+	}
+	*q++ = '"';
+    } else {
+	/* Quote the value if it holds a comma, a quote or a line break,
+	 * doubling any quotes */
+	q = values_reserve(rec, 2 * len + 3);
+	if (strpbrk(s, ",\"\r\n") == NULL) {
+	    memmove(q, s, len);
+	    q += len;
+	} else {
+	    *q++ = '"';
+	    for (; *s; ++s) {
+		if (*s == '"') *q++ = '"';
+		*q++ = *s;
+	    }
+	    *q++ = '"';
+	}
+    }
+    values_set(rec, field, q);
+}
+
+/* Print the record as one line, and unset its fields.  The line is put
+ * together first, so that it takes a single write. */
+void record_write(OutputRecord *rec, FILE *stream)
+{
+    size_t need = rec->valueslen + 3, len = 0;
+    unsigned int i;
+    int first = 1;
+
+    for (i = 0; i < rec->nfields; ++i) {
+	need += strlen(rec->names[i]) + 4;
+    }
+    if (need > rec->linesize) {
+	rec->linesize = need * 2;
+	rec->line = realloc(rec->line, rec->linesize);
+	if (!rec->line) out_of_memory();
+    }
+
+    if (rec->format == OUTPUT_JSON) rec->line[len++] = '{';
+    for (i = 0; i < rec->nfields; ++i) {
+	if (rec->format == OUTPUT_JSON) {
+	    if (!rec->isset[i]) continue;
+	    len += sprintf(rec->line + len, "%s\"%s\":", first ? "" : ",",
+		    rec->names[i]);
+	} else if (!first) {
+	    rec->line[len++] = ',';
+	}
+	first = 0;
+	if (!rec->isset[i]) continue;
+	memmove(rec->line + len, rec->values + rec->starts[i],
+		rec->lens[i]);
+	len += rec->lens[i];
+    }
+    if (rec->format == OUTPUT_JSON) rec->line[len++] = '}';
+    rec->line[len++] = '\n';
+    fwrite(rec->line, 1, len, stream);
+
+    record_clear(rec);
+}
+
+/* Free the memory used by a record */
+void record_free(OutputRecord *rec)
+{
+    free(rec->starts);
+    free(rec->lens);
+    free(rec->isset);
+    free(rec->values);
+    free(rec->line);
+}
@@ -0,0 +1,99 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __OUTPUT_H__
+#define __OUTPUT_H__
+
+#include <stdio.h>
+#include <gcrypt.h>
+
+#include "proto.h"
+
+/* The ways the toolkit can print what it finds */
+typedef enum {
+    OUTPUT_TEXT,                 /* For people to read */
+    OUTPUT_JSON,                 /* One JSON object per line */
+    OUTPUT_CSV                   /* One line of comma-separated values
+				    per record, after a header line */
+} OutputFormat;
+
+/* A record with a fixed list of fields, printed as a line of JSON or
+ * CSV.  In JSON, fields that were not set are left out; in CSV they are
+ * empty. */
+typedef struct s_OutputRecord {
+    OutputFormat format;
+    const char *const *names;    /* The names of the fields, in column
+				    order */
+    unsigned int nfields;
+    size_t *starts, *lens;       /* Where the value of each field is in
+				    values */
+    unsigned char *isset;        /* Which fields have a value */
+    char *values;                /* The values, already quoted and
+				    escaped as the format requires */
+    size_t valueslen, valuessize;
+    char *line;                  /* The line being printed */
+    size_t linesize;
+} OutputRecord;
+
+/* Parse the name of an output format ("text", "json" or "csv") into
+ * *formatp.  Returns 0 on success, or -1 if the name is unknown. */
+int output_format_parse(const char *name, OutputFormat *formatp);
+
+/* Return the name of a message type, as used in structured output */
+const char *output_msgtype_name(OtrlMessageType mtype);
+
+/* Write the lowercase hex encoding of len bytes of data to out, which
+ * must have room for 2*len+1 chars, and NUL-terminate it. */
+void hex_encode(char *out, const unsigned char *data, size_t len);
+
+/* Set up a record with the given fields (which must outlive it) */
+void record_init(OutputRecord *rec, OutputFormat format,
+	const char *const *names, unsigned int nfields);
+
+/* Print the line naming the columns, if the format has one */
+void record_header(OutputRecord *rec, FILE *stream);
+
+/* Unset every field */
+void record_clear(OutputRecord *rec);
+
+/* Set a field to a number */
+void record_int(OutputRecord *rec, unsigned int field, unsigned int val);
+
+/* Set a field to a larger number */
+void record_ullong(OutputRecord *rec, unsigned int field,
+	unsigned long long val);
+
+/* Set a field to the hex encoding of some data */
+void record_hex(OutputRecord *rec, unsigned int field,
+	const unsigned char *data, size_t datalen);
+
+/* Set a field to the hex encoding of an MPI */
+void record_mpi(OutputRecord *rec, unsigned int field, gcry_mpi_t val);
+
+/* Set a field to a string.  In JSON, bytes that aren't part of
+ * well-formed UTF-8 are replaced with U+FFFD. */
+void record_str(OutputRecord *rec, unsigned int field, const char *s);
+
+/* Print the record as one line, and unset its fields */
+void record_write(OutputRecord *rec, FILE *stream);
+
+/* Free the memory used by a record */
+void record_free(OutputRecord *rec);
+
+#endif
@@ -28,6 +28,7 @@
 /* toolkit headers */
 #include "sha1hmac.h"
 #include "parse.h"
+#include "output.h"
 
 /* Dump an unsigned int to a FILE * */
 void dump_int(FILE *stream, const char *title, unsigned int val)
@@ -52,12 +53,17 @@ void dump_mpi(FILE *stream, const char *title, gcry_mpi_t val)
 void dump_data(FILE *stream, const char *title, const unsigned char *data,
 	size_t datalen)
 {
-    size_t i;
+    char hex[1025];
+
     fprintf(stream, "%s: ", title);
-    for(i=0;i<datalen;++i) {
-	fprintf(stream, "%02x", data[i]);
+    while (datalen > 0) {
+	size_t chunk = datalen < 512 ? datalen : 512;
+	hex_encode(hex, data, chunk);
+	fwrite(hex, 1, 2 * chunk, stream);
+	data += chunk;
+	datalen -= chunk;
     }
-    fprintf(stream, "\n");
+    fputc('\n', stream);
 }
 
 /* base64 decode the message, and put the resulting size into *lenp */
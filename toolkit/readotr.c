@@ -37,14 +37,18 @@ static void buf_new(Buffer *bufp)
 
 static void buf_put(Buffer *bufp, const char *str, size_t len)
 {
-    while (bufp->len + len + 1 > bufp->alloclen) {
-	char *newdata = realloc(bufp->data, bufp->alloclen + 1024);
+    if (bufp->len + len + 1 > bufp->alloclen) {
+	size_t newlen = bufp->alloclen ? bufp->alloclen * 2 : 1024;
+	char *newdata;
+
+	if (newlen < bufp->len + len + 1) newlen = bufp->len + len + 1;
+	newdata = realloc(bufp->data, newlen);
 	if (!newdata) {
 	    fprintf(stderr, "Out of memory!\n");
 	    exit(1);
 	}
 	bufp->data = newdata;
-	bufp->alloclen += 1024;
+	bufp->alloclen = newlen;
     }
     memmove(bufp->data + bufp->len, str, len);
     bufp->len += len;
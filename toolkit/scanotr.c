@@ -0,0 +1,193 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/* system headers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* toolkit headers */
+#include "scanotr.h"
+
+/* How much to read at a time */
+#define SCANOTR_BLOCK (1024 * 1024)
+
+static const char header[] = "?OTR";   /* There are no '?' chars other
+					  than the leading one */
+#define HEADERLEN (sizeof(header) - 1)
+
+/* A fragment ends at the ',' after its piece, the fourth one in both
+ * "?OTR|sender|receiver,k,n,piece," and "?OTR,k,n,piece," */
+#define FRAGMENT_COMMAS 4
+
+/* Start scanning the open file descriptor fd. */
+void scanotr_init(ScanOtr *scan, int fd)
+{
+    scan->fd = fd;
+    scan->buf = NULL;
+    scan->size = 0;
+    scan->start = 0;
+    scan->end = 0;
+    scan->eof = 0;
+    scan->error = 0;
+    scan->offset = 0;
+    scan->saved_at = NULL;
+    scan->saved = '\0';
+    scan->fragments = 0;
+}
+
+/* Read another block after the unscanned data, first moving that data
+ * to the front of the buffer, and growing the buffer if it is still
+ * short of room.  Returns 0 at the end of the input. */
+static int fill(ScanOtr *scan)
+{
+    ssize_t n;
+
+    if (scan->eof) return 0;
+
+    if (scan->start > 0) {
+	memmove(scan->buf, scan->buf + scan->start,
+		scan->end - scan->start);
+	scan->offset += scan->start;
+	scan->end -= scan->start;
+	scan->start = 0;
+    }
+
+    /* Keep a byte free for the NUL after a message */
+    if (scan->size - scan->end < SCANOTR_BLOCK + 1) {
+	size_t newsize = scan->size ? scan->size * 2 : 2 * SCANOTR_BLOCK;
+	char *newbuf;
+
+	if (newsize < scan->end + SCANOTR_BLOCK + 1) {
+	    newsize = scan->end + SCANOTR_BLOCK + 1;
+	}
+	newbuf = realloc(scan->buf, newsize);
+	if (!newbuf) {
+	    fprintf(stderr, "Out of memory!\n");
+	    exit(1);
+	}
+	scan->buf = newbuf;
+	scan->size = newsize;
+    }
+
+    do {
+	n = read(scan->fd, scan->buf + scan->end,
+		scan->size - scan->end - 1);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+	if (n < 0) scan->error = errno;
+	scan->eof = 1;
+	return 0;
+    }
+    scan->end += n;
+    return 1;
+}
+
+/* Find the next OTR Key Exchange or Data message (or fragment, if
+ * scan->fragments is set).  Return a pointer to it, NUL-terminated,
+ * which stays valid until the next call. */
+const char *scanotr_next(ScanOtr *scan, size_t *lenp,
+	unsigned long long *offsetp)
+{
+    char *h, *end;
+    char endchar;
+    size_t scanned, msgend;
+    int left;
+
+    /* Put back what the NUL ending the last message overwrote */
+    if (scan->saved_at) {
+	*(scan->saved_at) = scan->saved;
+	scan->saved_at = NULL;
+    }
+
+    /* Look for the header, a block at a time */
+    while (1) {
+	h = NULL;
+	if (scan->end > scan->start) {
+	    h = memchr(scan->buf + scan->start, header[0],
+		    scan->end - scan->start);
+	}
+	if (h && (size_t)(scan->buf + scan->end - h) > HEADERLEN) {
+	    scan->start = h - scan->buf;
+	    if (!memcmp(h, header, HEADERLEN)) {
+		if (h[HEADERLEN] == ':') {
+		    endchar = '.';
+		    left = 1;
+		    break;
+		}
+		if (scan->fragments &&
+			(h[HEADERLEN] == '|' || h[HEADERLEN] == ',')) {
+		    endchar = ',';
+		    left = FRAGMENT_COMMAS;
+		    break;
+		}
+	    }
+	    scan->start++;
+	    continue;
+	}
+
+	/* Keep a header that may be cut off by the end of the block */
+	scan->start = h ? (size_t)(h - scan->buf) : scan->end;
+	if (!fill(scan)) return NULL;
+    }
+
+    /* Look for the trailing '.' (or ','), which may be a few blocks
+     * away */
+    scanned = HEADERLEN + 1;
+    while (1) {
+	end = memchr(scan->buf + scan->start + scanned, endchar,
+		scan->end - scan->start - scanned);
+	if (end && --left == 0) {
+	    msgend = end - scan->buf + 1;
+	    break;
+	}
+	if (end) {
+	    scanned = end - (scan->buf + scan->start) + 1;
+	    continue;
+	}
+	scanned = scan->end - scan->start;
+	if (!fill(scan)) {
+	    msgend = scan->end;
+	    break;
+	}
+    }
+
+    scan->saved_at = scan->buf + msgend;
+    scan->saved = *(scan->saved_at);
+    *(scan->saved_at) = '\0';
+
+    if (lenp) *lenp = msgend - scan->start;
+    if (offsetp) *offsetp = scan->offset + scan->start;
+    h = scan->buf + scan->start;
+    scan->start = msgend;
+    return h;
+}
+
+/* Free the memory used by the scanner. */
+void scanotr_free(ScanOtr *scan)
+{
+    free(scan->buf);
+    scan->buf = NULL;
+    scan->size = 0;
+    scan->start = 0;
+    scan->end = 0;
+    scan->saved_at = NULL;
+}
@@ -0,0 +1,59 @@
+/*
+ *  Off-the-Record Messaging Toolkit
+ *  Copyright (C) 2004-2026  Ian Goldberg, Chris Alexander, Nikita Borisov
+ *                           <otr@cypherpunks.ca>
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of version 2 of the GNU General Public License as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef __SCANOTR_H__
+#define __SCANOTR_H__
+
+/* A reader of OTR Key Exchange and Data messages out of a large
+ * transcript.  Unlike readotr, it reads the input in large blocks and
+ * hands out messages in place, without copying them. */
+typedef struct s_ScanOtr {
+    int fd;
+    char *buf;
+    size_t size;                 /* The allocated size of buf */
+    size_t start, end;           /* The unscanned data is buf[start,end) */
+    int eof;                     /* Has read() returned 0 (or failed)? */
+    int error;                   /* The errno of a failed read(), or 0 */
+    unsigned long long offset;   /* The offset in the input of buf[0] */
+    char *saved_at;              /* Where the NUL ending the last message */
+    char saved;                  /*   was written, and what was there */
+    int fragments;               /* Hand out fragments too? */
+} ScanOtr;
+
+/* Start scanning the open file descriptor fd.  Set scan->fragments
+ * afterwards to have fragments of messages handed out as well. */
+void scanotr_init(ScanOtr *scan, int fd);
+
+/* Find the next OTR Key Exchange or Data message, that is, the next
+ * "?OTR:" and everything up to and including the next '.' (or up to
+ * the end of the input, if there is none).  If scan->fragments is set,
+ * also find fragments: "?OTR|" or "?OTR," and everything up to and
+ * including the fourth ','.  Return a pointer to it,
+ * NUL-terminated, which stays valid until the next call; if lenp or
+ * offsetp are not NULL, store its length and its offset in the input
+ * there.  Returns NULL at the end of the input, or on a read error
+ * (in which case scan->error is set). */
+const char *scanotr_next(ScanOtr *scan, size_t *lenp,
+	unsigned long long *offsetp);
+
+/* Free the memory used by the scanner (but don't close its file
+ * descriptor). */
+void scanotr_free(ScanOtr *scan);
+
+#endif
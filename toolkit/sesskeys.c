@@ -36,15 +36,28 @@ static const char* DH1536_MODULUS_S = "0x"
 static const int DH1536_MOD_LEN_BITS = 1536;
 static const char *DH1536_GENERATOR_S = "0x02";
 
-/* Generate the session id and the two encryption keys from our private
- * DH key and their public DH key.  Also indicate in *high_endp if we
- * are the "high" end of the key exchange (set to 1) or the "low" end
- * (set to 0) */
-void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
-	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t *our_yp,
+/* Calculate our public DH key from our private DH key */
+void sesskeys_pubkey(gcry_mpi_t *our_yp, gcry_mpi_t our_x)
+{
+    gcry_mpi_t modulus, generator;
+
+    gcry_mpi_scan(&modulus, GCRYMPI_FMT_HEX,
+	(const unsigned char *)DH1536_MODULUS_S, 0, NULL);
+    gcry_mpi_scan(&generator, GCRYMPI_FMT_HEX,
+	(const unsigned char *)DH1536_GENERATOR_S, 0, NULL);
+    *our_yp = gcry_mpi_new(DH1536_MOD_LEN_BITS);
+    gcry_mpi_powm(*our_yp, generator, our_x, modulus);
+    gcry_mpi_release(generator);
+    gcry_mpi_release(modulus);
+}
+
+/* Generate the session id and the two encryption keys, as sesskeys_gen
+ * does, when we already know our public DH key */
+void sesskeys_derive(unsigned char sessionid[20], unsigned char sendenc[16],
+	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t our_y,
 	gcry_mpi_t our_x, gcry_mpi_t their_y)
 {
-    gcry_mpi_t modulus, generator, secretv;
+    gcry_mpi_t modulus, secretv;
     unsigned char *secret;
     size_t secretlen;
     unsigned char hash[20];
@@ -52,13 +65,8 @@ void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
 
     gcry_mpi_scan(&modulus, GCRYMPI_FMT_HEX,
 	(const unsigned char *)DH1536_MODULUS_S, 0, NULL);
-    gcry_mpi_scan(&generator, GCRYMPI_FMT_HEX,
-	(const unsigned char *)DH1536_GENERATOR_S, 0, NULL);
-    *our_yp = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
-    gcry_mpi_powm(*our_yp, generator, our_x, modulus);
     secretv = gcry_mpi_snew(DH1536_MOD_LEN_BITS);
     gcry_mpi_powm(secretv, their_y, our_x, modulus);
-    gcry_mpi_release(generator);
     gcry_mpi_release(modulus);
     gcry_mpi_print(GCRYMPI_FMT_USG, NULL, 0, &secretlen, secretv);
     secret = malloc(secretlen + 5);
@@ -70,7 +78,7 @@ void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
     gcry_mpi_print(GCRYMPI_FMT_USG, secret+5, secretlen, NULL, secretv);
     gcry_mpi_release(secretv);
 
-    is_high = (gcry_mpi_cmp(*our_yp, their_y) > 0);
+    is_high = (gcry_mpi_cmp(our_y, their_y) > 0);
 
     /* Calculate the session id */
     secret[0] = 0x00;
@@ -91,6 +99,19 @@ void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
     free(secret);
 }
 
+/* Generate the session id and the two encryption keys from our private
+ * DH key and their public DH key.  Also indicate in *high_endp if we
+ * are the "high" end of the key exchange (set to 1) or the "low" end
+ * (set to 0) */
+void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
+	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t *our_yp,
+	gcry_mpi_t our_x, gcry_mpi_t their_y)
+{
+    sesskeys_pubkey(our_yp, our_x);
+    sesskeys_derive(sessionid, sendenc, rcvenc, high_endp, *our_yp, our_x,
+	    their_y);
+}
+
 /* Generate a MAC key from the corresponding encryption key */
 void sesskeys_make_mac(unsigned char mackey[20], unsigned char enckey[16])
 {
@@ -28,6 +28,15 @@ void sesskeys_gen(unsigned char sessionid[20], unsigned char sendenc[16],
 	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t *our_yp,
 	gcry_mpi_t our_x, gcry_mpi_t their_y);
 
+/* Calculate our public DH key from our private DH key */
+void sesskeys_pubkey(gcry_mpi_t *our_yp, gcry_mpi_t our_x);
+
+/* Generate the session id and the two encryption keys, as sesskeys_gen
+ * does, when we already know our public DH key */
+void sesskeys_derive(unsigned char sessionid[20], unsigned char sendenc[16],
+	unsigned char rcvenc[16], int *high_endp, gcry_mpi_t our_y,
+	gcry_mpi_t our_x, gcry_mpi_t their_y);
+
 /* Generate a MAC key from the corresponding encryption key */
 void sesskeys_make_mac(unsigned char mackey[20], unsigned char enckey[16]);
 
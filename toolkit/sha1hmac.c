@@ -20,14 +20,19 @@
 /* system headers */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 /* libgcrypt headers */
 #include <gcrypt.h>
 
+/* toolkit headers */
+#include "sha1hmac.h"
+#include "cryptoimpl.h"
+
 /* Implementation of SHA1-HMAC.  We're rolling our own just to
  * double-check that the calls libotr makes to libgcrypt are in fact
  * doing the right thing. */
-void sha1hmac(unsigned char digest[20], unsigned char key[20],
+void sha1hmac_portable(unsigned char digest[20], unsigned char key[20],
 	unsigned char *data, size_t datalen)
 {
     unsigned char ipad[64], opad[64];
@@ -59,3 +64,49 @@ void sha1hmac(unsigned char digest[20], unsigned char key[20],
     memmove(digest, gcry_md_read(sha1, 0), 20);
     gcry_md_close(sha1);
 }
+
+/* SHA1-HMAC with libgcrypt doing all the hashing: each of the two
+ * hashes is a single call over the pad and the data, with no handle to
+ * allocate.  Returns 0 on success, or -1 if libgcrypt can't do it. */
+int sha1hmac_gcrypt(unsigned char digest[20], unsigned char key[20],
+	unsigned char *data, size_t datalen)
+{
+#if GCRYPT_VERSION_NUMBER >= 0x010600
+    unsigned char ipad[64], opad[64], hash[20];
+    gcry_buffer_t iov[2];
+    size_t i;
+
+    memset(ipad, 0x36, 64);
+    memset(opad, 0x5c, 64);
+    for(i=0;i<20;++i) {
+	ipad[i] ^= key[i];
+	opad[i] ^= key[i];
+    }
+
+    memset(iov, 0, sizeof(iov));
+    iov[0].data = ipad;
+    iov[0].size = iov[0].len = 64;
+    iov[1].data = data;
+    iov[1].size = iov[1].len = datalen;
+    if (gcry_md_hash_buffers(GCRY_MD_SHA1, 0, hash, iov, 2)) return -1;
+
+    iov[0].data = opad;
+    iov[1].data = hash;
+    iov[1].size = iov[1].len = 20;
+    if (gcry_md_hash_buffers(GCRY_MD_SHA1, 0, digest, iov, 2)) return -1;
+    return 0;
+#else
+    return -1;
+#endif
+}
+
+/* SHA1-HMAC with the implementation given by crypto_impl() */
+void sha1hmac(unsigned char digest[20], unsigned char key[20],
+	unsigned char *data, size_t datalen)
+{
+    if (crypto_impl() == CRYPTO_IMPL_GCRYPT &&
+	    sha1hmac_gcrypt(digest, key, data, datalen) == 0) {
+	return;
+    }
+    sha1hmac_portable(digest, key, data, datalen);
+}
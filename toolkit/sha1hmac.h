@@ -20,10 +20,21 @@
 #ifndef __SHA1HMAC_H__
 #define __SHA1HMAC_H__
 
+/* SHA1-HMAC, with the implementation given by crypto_impl(), falling
+ * back to our own if libgcrypt can't do it. */
+void sha1hmac(unsigned char digest[20], unsigned char key[20],
+	unsigned char *data, size_t datalen);
+
 /* Implementation of SHA1-HMAC.  We're rolling our own just to
  * double-check that the calls libotr makes to libgcrypt are in fact
  * doing the right thing. */
-void sha1hmac(unsigned char digest[20], unsigned char key[20],
+void sha1hmac_portable(unsigned char digest[20], unsigned char key[20],
+	unsigned char *data, size_t datalen);
+
+/* SHA1-HMAC with libgcrypt doing all the hashing, with no handle to
+ * allocate.  Returns 0 on success, or -1 if libgcrypt can't do it (it
+ * needs libgcrypt 1.6 or later). */
+int sha1hmac_gcrypt(unsigned char digest[20], unsigned char key[20],
 	unsigned char *data, size_t datalen);
 
 #endif